@@ -549,6 +549,14 @@ static __constant__ uint32_t AES_STATE_HASH[16] = {
 	0xe18b449a, 0xdc5d97cc, 0x49593c57, 0xbb30a58a,
 };
 
+// Kernels compiled at run time with NVRTC (RandomX_CUDA.exe --mine --specialize) get the batch size as a literal,
+// so index math and bounds checks which depend on it are folded. It's a no-op in normal builds
+#ifdef NVRTC_BATCH_SIZE
+#define SPECIALIZE_BATCH_SIZE(batch_size) batch_size = NVRTC_BATCH_SIZE
+#else
+#define SPECIALIZE_BATCH_SIZE(batch_size) (void)(batch_size)
+#endif
+
 __device__ uint32_t get_byte(uint32_t a, uint32_t start_bit)
 {
 	uint32_t result;
@@ -556,12 +564,337 @@ __device__ uint32_t get_byte(uint32_t a, uint32_t start_bit)
 	return result;
 }
 
-template<uint64_t outputSize, bool strided>
+// AES round implementations for fillAes1Rx4, hashAes1Rx4 and finalize_hashes, every kernel takes one as a template parameter
+// RandomX_CUDA.exe --test checks and benchmarks all of them, RandomX_CUDA.exe --mine runs the fastest one on this GPU (see --aes-engine)
+constexpr uint32_t AES_ENGINE_TTABLE = 0;		// 4 T-tables per direction in shared memory (8 KB), lookups of a warp often hit the same bank
+constexpr uint32_t AES_ENGINE_REPLICATED = 1;	// 1 T-table with a copy in every bank (32 KB), each lane only reads its own bank, the other 3 tables are rotations
+constexpr uint32_t AES_ENGINE_SBOX = 2;			// S-box bytes with a copy in every bank (8 KB), MixColumns is computed with shifts and XORs
+constexpr uint32_t AES_ENGINE_BITSLICED = 3;	// No tables, SubBytes inverts bit slices of the state in GF(2^8)
+constexpr uint32_t AES_ENGINE_COUNT = 4;
+
+// All 4 lanes of one hash run in the same warp, even lanes run one direction and odd lanes the other:
+// encrypt_odd tells which lanes do aesenc, engines with one table per lane fill each lane's copy for its direction
+
+template<uint32_t ENGINE> struct AESEngine;
+
+template<>
+struct AESEngine<AES_ENGINE_TTABLE>
+{
+	static constexpr uint32_t TABLE_SIZE = 2048;
+
+	__device__ static void load_table(uint32_t* T, bool)
+	{
+		for (int i = threadIdx.x; i < 2048; i += blockDim.x)
+			T[i] = AES_TABLE[i];
+	}
+
+	__device__ AESEngine(const uint32_t* T, bool encrypt) :
+		s1(encrypt ? 8 : 24),
+		s3(encrypt ? 24 : 8),
+		t0(encrypt ? T : (T + 1024)),
+		t1(encrypt ? (T + 256) : (T + 1792)),
+		t2(encrypt ? (T + 512) : (T + 1536)),
+		t3(encrypt ? (T + 768) : (T + 1280))
+	{}
+
+	__device__ void round(const uint32_t (&x)[4], uint32_t (&y)[4], const uint32_t (&k)[4]) const
+	{
+		y[0] = t0[get_byte(x[0], 0)] ^ t1[get_byte(x[1], s1)] ^ t2[get_byte(x[2], 16)] ^ t3[get_byte(x[3], s3)] ^ k[0];
+		y[1] = t0[get_byte(x[1], 0)] ^ t1[get_byte(x[2], s1)] ^ t2[get_byte(x[3], 16)] ^ t3[get_byte(x[0], s3)] ^ k[1];
+		y[2] = t0[get_byte(x[2], 0)] ^ t1[get_byte(x[3], s1)] ^ t2[get_byte(x[0], 16)] ^ t3[get_byte(x[1], s3)] ^ k[2];
+		y[3] = t0[get_byte(x[3], 0)] ^ t1[get_byte(x[0], s1)] ^ t2[get_byte(x[1], 16)] ^ t3[get_byte(x[2], s3)] ^ k[3];
+	}
+
+	const uint32_t s1, s3;
+	const uint32_t* const t0;
+	const uint32_t* const t1;
+	const uint32_t* const t2;
+	const uint32_t* const t3;
+};
+
+// Entry i of lane j's table is T[i * 32 + j], so lanes of a warp never read the same bank
+// Table n (n = 1, 2, 3) is table 0 rotated left by 8 * n bits, and the byte looked up in it is at bit 8 * n, so both use the same shift
+template<>
+struct AESEngine<AES_ENGINE_REPLICATED>
+{
+	static constexpr uint32_t TABLE_SIZE = 256 * 32;
+
+	__device__ static void load_table(uint32_t* T, bool encrypt_odd)
+	{
+		for (int i = threadIdx.x; i < 256 * 32; i += blockDim.x)
+			T[i] = AES_TABLE[((((i & 1) != 0) == encrypt_odd) ? 0 : 1024) + i / 32];
+	}
+
+	__device__ AESEngine(const uint32_t* T, bool encrypt) :
+		s1(encrypt ? 8 : 24),
+		s3(encrypt ? 24 : 8),
+		t(T + (threadIdx.x % 32))
+	{}
+
+	__device__ uint32_t lookup(uint32_t x, uint32_t shift) const
+	{
+		const uint32_t a = t[get_byte(x, shift) * 32];
+		return __funnelshift_l(a, a, shift);
+	}
+
+	__device__ void round(const uint32_t (&x)[4], uint32_t (&y)[4], const uint32_t (&k)[4]) const
+	{
+		y[0] = t[get_byte(x[0], 0) * 32] ^ lookup(x[1], s1) ^ lookup(x[2], 16) ^ lookup(x[3], s3) ^ k[0];
+		y[1] = t[get_byte(x[1], 0) * 32] ^ lookup(x[2], s1) ^ lookup(x[3], 16) ^ lookup(x[0], s3) ^ k[1];
+		y[2] = t[get_byte(x[2], 0) * 32] ^ lookup(x[3], s1) ^ lookup(x[0], 16) ^ lookup(x[1], s3) ^ k[2];
+		y[3] = t[get_byte(x[3], 0) * 32] ^ lookup(x[0], s1) ^ lookup(x[1], 16) ^ lookup(x[2], s3) ^ k[3];
+	}
+
+	const uint32_t s1, s3;
+	const uint32_t* const t;
+};
+
+// Multiplies 4 bytes by 2 in GF(2^8)
+__device__ uint32_t aes_xtime(uint32_t a)
+{
+	return ((a & 0x7F7F7F7FU) << 1) ^ (((a >> 7) & 0x01010101U) * 0x1B);
+}
+
+// MixColumns of one column (after SubBytes and ShiftRows), or InvMixColumns if dec_mask is all ones
+// InvMixColumns(a) = MixColumns(a ^ 4 * (a ^ (a rotated by 2 bytes))), so both directions run the same instructions
+__device__ uint32_t aes_mix_column(uint32_t a, uint32_t dec_mask)
+{
+	const uint32_t a2 = __funnelshift_l(a, a, 16);
+	a ^= dec_mask & aes_xtime(aes_xtime(a ^ a2));
+
+	const uint32_t r1 = __funnelshift_r(a, a, 8);
+	const uint32_t r2 = __funnelshift_l(a, a, 16);
+	const uint32_t r3 = __funnelshift_l(a, a, 8);
+	return aes_xtime(a ^ r1) ^ r1 ^ r2 ^ r3;
+}
+
+// S-box of lane j is in bytes of T[i * 32 + j] (4 entries per word), so lanes of a warp never read the same bank
+// Lanes doing aesdec have the inverse S-box there
+template<>
+struct AESEngine<AES_ENGINE_SBOX>
+{
+	static constexpr uint32_t TABLE_SIZE = 64 * 32;
+
+	__device__ static void load_table(uint32_t* T, bool encrypt_odd)
+	{
+		for (int i = threadIdx.x; i < 64 * 32; i += blockDim.x)
+		{
+			const uint32_t* table = AES_TABLE + (((((i & 1) != 0) == encrypt_odd) ? 0 : 1024) + (i / 32) * 4);
+
+			// Bytes of T-table entries are the S-box value multiplied by 2, 1, 1, 3 (or 14, 9, 13, 11 for the inverse S-box), they add up to 1
+			uint32_t result = 0;
+			for (int j = 0; j < 4; ++j)
+			{
+				uint32_t a = table[j];
+				a ^= a >> 16;
+				a ^= a >> 8;
+				result |= (a & 0xFF) << (j * 8);
+			}
+			T[i] = result;
+		}
+	}
+
+	__device__ AESEngine(const uint32_t* T, bool encrypt) :
+		s1(encrypt ? 8 : 24),
+		s3(encrypt ? 24 : 8),
+		dec_mask(encrypt ? 0 : 0xFFFFFFFFU),
+		s((const uint8_t*)(T + (threadIdx.x % 32)))
+	{}
+
+	// S-box value of the byte at bit shift, at the same position
+	__device__ uint32_t sub_byte(uint32_t x, uint32_t shift) const
+	{
+		const uint32_t a = get_byte(x, shift);
+		return static_cast<uint32_t>(s[((a & 0xFC) << 5) | (a & 3)]) << shift;
+	}
+
+	__device__ void round(const uint32_t (&x)[4], uint32_t (&y)[4], const uint32_t (&k)[4]) const
+	{
+		y[0] = aes_mix_column(sub_byte(x[0], 0) | sub_byte(x[1], s1) | sub_byte(x[2], 16) | sub_byte(x[3], s3), dec_mask) ^ k[0];
+		y[1] = aes_mix_column(sub_byte(x[1], 0) | sub_byte(x[2], s1) | sub_byte(x[3], 16) | sub_byte(x[0], s3), dec_mask) ^ k[1];
+		y[2] = aes_mix_column(sub_byte(x[2], 0) | sub_byte(x[3], s1) | sub_byte(x[0], 16) | sub_byte(x[1], s3), dec_mask) ^ k[2];
+		y[3] = aes_mix_column(sub_byte(x[3], 0) | sub_byte(x[0], s1) | sub_byte(x[1], 16) | sub_byte(x[2], s3), dec_mask) ^ k[3];
+	}
+
+	const uint32_t s1, s3;
+	const uint32_t dec_mask;
+	const uint8_t* const s;
+};
+
+// Transposes 8 bytes as an 8x8 bit matrix: bit i of byte j goes to bit j of byte i
+__device__ uint64_t aes_transpose8x8(uint64_t a)
+{
+	uint64_t t;
+	t = (a ^ (a >> 7)) & 0x00AA00AA00AA00AAULL; a ^= t ^ (t << 7);
+	t = (a ^ (a >> 14)) & 0x0000CCCC0000CCCCULL; a ^= t ^ (t << 14);
+	t = (a ^ (a >> 28)) & 0x00000000F0F0F0F0ULL; a ^= t ^ (t << 28);
+	return a;
+}
+
+// c = a * b in GF(2^8) (AES polynomial x^8 + x^4 + x^3 + x + 1), slice i holds bit i of up to 32 bytes
+__device__ void aes_gf_mul(const uint32_t (&a)[8], const uint32_t (&b)[8], uint32_t (&c)[8])
+{
+	uint32_t p[15] = {};
+
+	#pragma unroll
+	for (int i = 0; i < 8; ++i)
+	{
+		#pragma unroll
+		for (int j = 0; j < 8; ++j)
+			p[i + j] ^= a[i] & b[j];
+	}
+
+	#pragma unroll
+	for (int i = 14; i >= 8; --i)
+	{
+		p[i - 4] ^= p[i];
+		p[i - 5] ^= p[i];
+		p[i - 7] ^= p[i];
+		p[i - 8] ^= p[i];
+	}
+
+	#pragma unroll
+	for (int i = 0; i < 8; ++i)
+		c[i] = p[i];
+}
+
+// a = a^(2^n), squaring is linear in GF(2^8), so it's only XORs
+__device__ void aes_gf_square(uint32_t (&a)[8], int n)
+{
+	#pragma unroll
+	for (int k = 0; k < n; ++k)
+	{
+		uint32_t p[15] = {};
+
+		#pragma unroll
+		for (int i = 0; i < 8; ++i)
+			p[i * 2] = a[i];
+
+		#pragma unroll
+		for (int i = 14; i >= 8; --i)
+		{
+			p[i - 4] ^= p[i];
+			p[i - 5] ^= p[i];
+			p[i - 7] ^= p[i];
+			p[i - 8] ^= p[i];
+		}
+
+		#pragma unroll
+		for (int i = 0; i < 8; ++i)
+			a[i] = p[i];
+	}
+}
+
+// SubBytes (or InvSubBytes if dec_mask is all ones) computed on bit slices of the 16 bytes of x, no memory is read
+// S(a) = A(a^254) and S^-1(a) = (A^-1(a))^254, where A is the affine transform (constant 0x63) and A^-1 is its inverse (constant 0x05)
+__device__ void aes_sub_bytes_bitsliced(const uint32_t (&x)[4], uint32_t (&y)[4], uint32_t dec_mask)
+{
+	// Slice i: bit i of bytes 0-7 in bits 0-7, bit i of bytes 8-15 in bits 8-15
+	const uint64_t lo = aes_transpose8x8(x[0] | (static_cast<uint64_t>(x[1]) << 32));
+	const uint64_t hi = aes_transpose8x8(x[2] | (static_cast<uint64_t>(x[3]) << 32));
+
+	uint32_t a[8];
+	{
+		const uint32_t q0 = __byte_perm(static_cast<uint32_t>(lo), static_cast<uint32_t>(hi), 0x5140);
+		const uint32_t q1 = __byte_perm(static_cast<uint32_t>(lo), static_cast<uint32_t>(hi), 0x7362);
+		const uint32_t q2 = __byte_perm(static_cast<uint32_t>(lo >> 32), static_cast<uint32_t>(hi >> 32), 0x5140);
+		const uint32_t q3 = __byte_perm(static_cast<uint32_t>(lo >> 32), static_cast<uint32_t>(hi >> 32), 0x7362);
+		a[0] = q0; a[1] = q0 >> 16;
+		a[2] = q1; a[3] = q1 >> 16;
+		a[4] = q2; a[5] = q2 >> 16;
+		a[6] = q3; a[7] = q3 >> 16;
+	}
+
+	{
+		uint32_t b[8];
+		#pragma unroll
+		for (int i = 0; i < 8; ++i)
+			b[i] = a[(i + 2) % 8] ^ a[(i + 5) % 8] ^ a[(i + 7) % 8] ^ (((0x05 >> i) & 1) ? 0xFFFFFFFFU : 0);
+
+		#pragma unroll
+		for (int i = 0; i < 8; ++i)
+			a[i] ^= dec_mask & (a[i] ^ b[i]);
+	}
+
+	// a^254 = a^240 * a^14 = (a^15)^16 * a^12 * a^2
+	uint32_t a2[8], a3[8], a12[8], a15[8], a14[8];
+	#pragma unroll
+	for (int i = 0; i < 8; ++i)
+		a2[i] = a[i];
+	aes_gf_square(a2, 1);
+	aes_gf_mul(a2, a, a3);
+	#pragma unroll
+	for (int i = 0; i < 8; ++i)
+		a12[i] = a3[i];
+	aes_gf_square(a12, 2);
+	aes_gf_mul(a12, a3, a15);
+	aes_gf_mul(a12, a2, a14);
+	aes_gf_square(a15, 4);
+	aes_gf_mul(a15, a14, a);
+
+	{
+		uint32_t b[8];
+		#pragma unroll
+		for (int i = 0; i < 8; ++i)
+			b[i] = a[i] ^ a[(i + 4) % 8] ^ a[(i + 5) % 8] ^ a[(i + 6) % 8] ^ a[(i + 7) % 8] ^ (((0x63 >> i) & 1) ? 0xFFFFFFFFU : 0);
+
+		#pragma unroll
+		for (int i = 0; i < 8; ++i)
+			a[i] ^= ~dec_mask & (a[i] ^ b[i]);
+	}
+
+	const uint32_t p01 = __byte_perm(a[0], a[1], 0x5140);
+	const uint32_t p23 = __byte_perm(a[2], a[3], 0x5140);
+	const uint32_t p45 = __byte_perm(a[4], a[5], 0x5140);
+	const uint32_t p67 = __byte_perm(a[6], a[7], 0x5140);
+
+	const uint64_t lo2 = aes_transpose8x8(__byte_perm(p01, p23, 0x5410) | (static_cast<uint64_t>(__byte_perm(p45, p67, 0x5410)) << 32));
+	const uint64_t hi2 = aes_transpose8x8(__byte_perm(p01, p23, 0x7632) | (static_cast<uint64_t>(__byte_perm(p45, p67, 0x7632)) << 32));
+
+	y[0] = static_cast<uint32_t>(lo2);
+	y[1] = static_cast<uint32_t>(lo2 >> 32);
+	y[2] = static_cast<uint32_t>(hi2);
+	y[3] = static_cast<uint32_t>(hi2 >> 32);
+}
+
+template<>
+struct AESEngine<AES_ENGINE_BITSLICED>
+{
+	// Shared memory is not used
+	static constexpr uint32_t TABLE_SIZE = 1;
+
+	__device__ static void load_table(uint32_t*, bool) {}
+
+	__device__ AESEngine(const uint32_t*, bool encrypt) :
+		m1(encrypt ? 0x0000FF00U : 0xFF000000U),
+		m3(encrypt ? 0xFF000000U : 0x0000FF00U),
+		dec_mask(encrypt ? 0 : 0xFFFFFFFFU)
+	{}
+
+	__device__ void round(const uint32_t (&x)[4], uint32_t (&y)[4], const uint32_t (&k)[4]) const
+	{
+		uint32_t s[4];
+		aes_sub_bytes_bitsliced(x, s, dec_mask);
+
+		// SubBytes doesn't move bytes, so ShiftRows only selects them from the right columns
+		y[0] = aes_mix_column((s[0] & 0x000000FFU) | (s[1] & m1) | (s[2] & 0x00FF0000U) | (s[3] & m3), dec_mask) ^ k[0];
+		y[1] = aes_mix_column((s[1] & 0x000000FFU) | (s[2] & m1) | (s[3] & 0x00FF0000U) | (s[0] & m3), dec_mask) ^ k[1];
+		y[2] = aes_mix_column((s[2] & 0x000000FFU) | (s[3] & m1) | (s[0] & 0x00FF0000U) | (s[1] & m3), dec_mask) ^ k[2];
+		y[3] = aes_mix_column((s[3] & 0x000000FFU) | (s[0] & m1) | (s[1] & 0x00FF0000U) | (s[2] & m3), dec_mask) ^ k[3];
+	}
+
+	const uint32_t m1, m3;
+	const uint32_t dec_mask;
+};
+
+template<uint64_t outputSize, bool strided, uint32_t ENGINE = AES_ENGINE_TTABLE>
 __global__ void fillAes1Rx4(void* state, void* out, uint32_t batch_size)
 {
+	SPECIALIZE_BATCH_SIZE(batch_size);
+
 	static_assert((outputSize % 128) == 0, "Output size must be a multiple of 128");
 
-	__shared__ uint32_t T[2048];
+	__shared__ uint32_t T[AESEngine<ENGINE>::TABLE_SIZE];
 
 	const uint32_t stride_size = batch_size * 4;
 	const uint32_t global_index = blockIdx.x * blockDim.x + threadIdx.x;
@@ -571,8 +904,7 @@ __global__ void fillAes1Rx4(void* state, void* out, uint32_t batch_size)
 	const uint32_t idx = global_index / 4;
 	const uint32_t sub = global_index % 4;
 
-	for (int i = threadIdx.x; i < 2048; i += blockDim.x)
-		T[i] = AES_TABLE[i];
+	AESEngine<ENGINE>::load_table(T, true);
 
 	__syncthreads();
 
@@ -581,25 +913,16 @@ __global__ void fillAes1Rx4(void* state, void* out, uint32_t batch_size)
 	uint32_t* s = ((uint32_t*)state) + idx * (64 / sizeof(uint32_t)) + sub * (16 / sizeof(uint32_t));
 	uint32_t x[4] = { s[0], s[1], s[2], s[3] };
 
-	const uint32_t s1 = (sub & 1) ? 8 : 24;
-	const uint32_t s3 = (sub & 1) ? 24 : 8;
-
 	uint4* p = strided ? (((uint4*) out) + idx * 4 + sub) : (((uint4*)out) + idx * (outputSize / sizeof(uint4)) + sub);
 
-	const uint32_t* const t0 = (sub & 1) ? T : (T + 1024);
-	const uint32_t* const t1 = (sub & 1) ? (T + 256) : (T + 1792);
-	const uint32_t* const t2 = (sub & 1) ? (T + 512) : (T + 1536);
-	const uint32_t* const t3 = (sub & 1) ? (T + 768) : (T + 1280);
+	const AESEngine<ENGINE> aes(T, (sub & 1) != 0);
 
 	#pragma unroll(((outputSize % 512) == 0) ? 8 : 2)
 	for (uint32_t i = 0; i < outputSize / sizeof(uint4); i += 4, p += strided ? stride_size : 4)
 	{
 		uint32_t y[4];
 
-		y[0] = t0[get_byte(x[0], 0)] ^ t1[get_byte(x[1], s1)] ^ t2[get_byte(x[2], 16)] ^ t3[get_byte(x[3], s3)] ^ k[0];
-		y[1] = t0[get_byte(x[1], 0)] ^ t1[get_byte(x[2], s1)] ^ t2[get_byte(x[3], 16)] ^ t3[get_byte(x[0], s3)] ^ k[1];
-		y[2] = t0[get_byte(x[2], 0)] ^ t1[get_byte(x[3], s1)] ^ t2[get_byte(x[0], 16)] ^ t3[get_byte(x[1], s3)] ^ k[2];
-		y[3] = t0[get_byte(x[3], 0)] ^ t1[get_byte(x[0], s1)] ^ t2[get_byte(x[1], 16)] ^ t3[get_byte(x[2], s3)] ^ k[3];
+		aes.round(x, y, k);
 
 		*p = *(uint4*)(y);
 
@@ -612,46 +935,29 @@ __global__ void fillAes1Rx4(void* state, void* out, uint32_t batch_size)
 	*(uint4*)(s) = *(uint4*)(x);
 }
 
-template<uint64_t inputSize, uint32_t hashOffsetBytes, uint32_t hashStrideBytes>
-__global__ void hashAes1Rx4(const void* input, void* hash, uint32_t batch_size)
+// Hashes one strided scratchpad with 4 lanes, each lane gets 16 bytes of the result in x
+// T must be the table of this AES engine in shared memory, loaded with AESEngine<ENGINE>::load_table(T, false)
+template<uint64_t inputSize, uint32_t ENGINE = AES_ENGINE_TTABLE>
+__device__ void hashAes1Rx4_lanes(const uint32_t* T, const void* input, uint32_t idx, uint32_t sub, uint32_t batch_size, uint32_t (&x)[4])
 {
 	static_assert((inputSize % 512) == 0, "Input size must be a multiple of 512");
 
-	__shared__ uint32_t T[2048];
-
 	const uint32_t stride_size = batch_size * 4;
-	const uint32_t global_index = blockIdx.x * blockDim.x + threadIdx.x;
-	if (global_index >= stride_size)
-		return;
-
-	const uint32_t idx = global_index / 4;
-	const uint32_t sub = global_index % 4;
-
-	for (int i = threadIdx.x; i < 2048; i += blockDim.x)
-		T[i] = AES_TABLE[i];
-
-	__syncthreads();
 
-	uint32_t x[4] = { AES_STATE_HASH[sub * 4], AES_STATE_HASH[sub * 4 + 1], AES_STATE_HASH[sub * 4 + 2], AES_STATE_HASH[sub * 4 + 3] };
-
-	const uint32_t s1 = ((sub & 1) == 0) ? 8 : 24;
-	const uint32_t s3 = ((sub & 1) == 0) ? 24 : 8;
+	x[0] = AES_STATE_HASH[sub * 4];
+	x[1] = AES_STATE_HASH[sub * 4 + 1];
+	x[2] = AES_STATE_HASH[sub * 4 + 2];
+	x[3] = AES_STATE_HASH[sub * 4 + 3];
 
 	const uint4* p = ((uint4*) input) + idx * 4 + sub;
 
-	const uint32_t* const t0 = ((sub & 1) == 0) ? T : (T + 1024);
-	const uint32_t* const t1 = ((sub & 1) == 0) ? (T + 256) : (T + 1792);
-	const uint32_t* const t2 = ((sub & 1) == 0) ? (T + 512) : (T + 1536);
-	const uint32_t* const t3 = ((sub & 1) == 0) ? (T + 768) : (T + 1280);
+	const AESEngine<ENGINE> aes(T, (sub & 1) == 0);
 
 #define ITER(m) \
 	{ \
 		uint32_t k[4], y[4]; \
 		*(uint4*)(k) = p[m * stride_size]; \
-		y[0] = t0[get_byte(x[0], 0)] ^ t1[get_byte(x[1], s1)] ^ t2[get_byte(x[2], 16)] ^ t3[get_byte(x[3], s3)] ^ k[0]; \
-		y[1] = t0[get_byte(x[1], 0)] ^ t1[get_byte(x[2], s1)] ^ t2[get_byte(x[3], 16)] ^ t3[get_byte(x[0], s3)] ^ k[1]; \
-		y[2] = t0[get_byte(x[2], 0)] ^ t1[get_byte(x[3], s1)] ^ t2[get_byte(x[0], 16)] ^ t3[get_byte(x[1], s3)] ^ k[2]; \
-		y[3] = t0[get_byte(x[3], 0)] ^ t1[get_byte(x[0], s1)] ^ t2[get_byte(x[1], 16)] ^ t3[get_byte(x[2], s3)] ^ k[3]; \
+		aes.round(x, y, k); \
 		x[0] = y[0]; \
 		x[1] = y[1]; \
 		x[2] = y[2]; \
@@ -672,17 +978,33 @@ __global__ void hashAes1Rx4(const void* input, void* hash, uint32_t batch_size)
 
 #undef ITER
 
+	const uint32_t k1[4] = { 0x11cbf247, 0x2a5a929c, 0xe4c5593d, 0x83951283 };
+	const uint32_t k2[4] = { 0xce816c95, 0x477bef0b, 0xabbc2523, 0xff215bb2 };
+
 	uint32_t y[4];
+	aes.round(x, y, k1);
+	aes.round(y, x, k2);
+}
+
+template<uint64_t inputSize, uint32_t hashOffsetBytes, uint32_t hashStrideBytes, uint32_t ENGINE = AES_ENGINE_TTABLE>
+__global__ void hashAes1Rx4(const void* input, void* hash, uint32_t batch_size)
+{
+	__shared__ uint32_t T[AESEngine<ENGINE>::TABLE_SIZE];
+
+	const uint32_t stride_size = batch_size * 4;
+	const uint32_t global_index = blockIdx.x * blockDim.x + threadIdx.x;
+	if (global_index >= stride_size)
+		return;
+
+	const uint32_t idx = global_index / 4;
+	const uint32_t sub = global_index % 4;
 
-	y[0] = t0[get_byte(x[0], 0)] ^ t1[get_byte(x[1], s1)] ^ t2[get_byte(x[2], 16)] ^ t3[get_byte(x[3], s3)] ^ 0x11cbf247;
-	y[1] = t0[get_byte(x[1], 0)] ^ t1[get_byte(x[2], s1)] ^ t2[get_byte(x[3], 16)] ^ t3[get_byte(x[0], s3)] ^ 0x2a5a929c;
-	y[2] = t0[get_byte(x[2], 0)] ^ t1[get_byte(x[3], s1)] ^ t2[get_byte(x[0], 16)] ^ t3[get_byte(x[1], s3)] ^ 0xe4c5593d;
-	y[3] = t0[get_byte(x[3], 0)] ^ t1[get_byte(x[0], s1)] ^ t2[get_byte(x[1], 16)] ^ t3[get_byte(x[2], s3)] ^ 0x83951283;
+	AESEngine<ENGINE>::load_table(T, false);
+
+	__syncthreads();
 
-	x[0] = t0[get_byte(y[0], 0)] ^ t1[get_byte(y[1], s1)] ^ t2[get_byte(y[2], 16)] ^ t3[get_byte(y[3], s3)] ^ 0xce816c95;
-	x[1] = t0[get_byte(y[1], 0)] ^ t1[get_byte(y[2], s1)] ^ t2[get_byte(y[3], 16)] ^ t3[get_byte(y[0], s3)] ^ 0x477bef0b;
-	x[2] = t0[get_byte(y[2], 0)] ^ t1[get_byte(y[3], s1)] ^ t2[get_byte(y[0], 16)] ^ t3[get_byte(y[1], s3)] ^ 0xabbc2523;
-	x[3] = t0[get_byte(y[3], 0)] ^ t1[get_byte(y[0], s1)] ^ t2[get_byte(y[1], 16)] ^ t3[get_byte(y[2], s3)] ^ 0xff215bb2;
+	uint32_t x[4];
+	hashAes1Rx4_lanes<inputSize, ENGINE>(T, input, idx, sub, batch_size, x);
 
 	*((uint4*)(hash) + idx * (hashStrideBytes / sizeof(uint4)) + sub + (hashOffsetBytes / sizeof(uint4))) = *(uint4*)(x);
 }
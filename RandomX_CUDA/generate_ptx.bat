@@ -1,3 +1,4 @@
 @echo off
 call "%VS140COMNTOOLS%/../../VC/vcvarsall.bat" amd64
 nvcc --gpu-architecture=compute_35 -ptx -prec-div=true -prec-sqrt=true -o kernel.ptx kernel.cu
+nvcc --gpu-architecture=compute_35 -ptx -prec-div=true -prec-sqrt=true -DEXECUTE_VM_SWITCH_DISPATCH=1 -o kernel_switch_dispatch.ptx kernel.cu
@@ -21,11 +21,21 @@ along with RandomX CUDA.  If not, see<http://www.gnu.org/licenses/>.
 #include "device_launch_parameters.h"
 #include <stdint.h>
 #include <stdio.h>
+#include <string.h>
+#include <stdlib.h>
 #include <chrono>
 #include <vector>
 #include <thread>
 #include <atomic>
 #include <algorithm>
+#include <climits>
+#include <csignal>
+#include <cfenv>
+#include <cmath>
+#include <cctype>
+#include <random>
+#include <type_traits>
+#include <string>
 #include "../RandomX/src/blake2/blake2.h"
 #include "../RandomX/src/aes_hash.hpp"
 #include "../RandomX/src/randomx.h"
@@ -34,25 +44,76 @@ along with RandomX CUDA.  If not, see<http://www.gnu.org/licenses/>.
 
 #include "blake2b_cuda.hpp"
 #include "aes_cuda.hpp"
+#include "soft_fp64_cuda.hpp"
 #include "randomx_cuda.hpp"
 
-bool test_mining(bool validate, int bfactor, int workers_per_hash);
+// Kernels specialized at run time for the batch size and iteration count of a mining run (RandomX_CUDA.exe --mine --specialize),
+// it can be set at build time with -DNVRTC_SPECIALIZATION=1 (CUDA 12.0 or newer, link with -lnvrtc)
+// 0: --specialize is not available, generic kernels are always used
+// 1: kernels are compiled with NVRTC from the headers in NVRTC_INCLUDE_PATH and cached in randomx_cuda_sm*.cubin files
+#ifndef NVRTC_SPECIALIZATION
+#define NVRTC_SPECIALIZATION 0
+#endif
+
+// Directory with RandomX CUDA headers, the RandomX library source must be in ../RandomX relative to it
+#ifndef NVRTC_INCLUDE_PATH
+#define NVRTC_INCLUDE_PATH "."
+#endif
+
+#if NVRTC_SPECIALIZATION
+#include <nvrtc.h>
+#endif
+
+struct VariantKernels;
+static const VariantKernels* find_variant(const char* name);
+
+bool test_mining(const VariantKernels& variant, bool validate, int bfactor, int workers_per_hash, int time_slice, bool resident, bool l1_shared, int hashes_per_block, int carveout, bool adaptive, bool group, bool thread, bool interleaved, bool cost_model, bool specialize, int aes_engine);
 void tests();
+void bank_conflicts(int workers_per_hash);
+void benchmark_engines(const VariantKernels& variant);
+bool load_instruction_costs(int workers_per_hash, bool recalibrate);
 
 int main(int argc, char** argv)
 {
 	if (argc < 3)
 	{
-		printf("Usage: RandomX_CUDA.exe --mine device_id [--validate] [--bfactor N] [--workers N]\n\n");
+		printf("Usage: RandomX_CUDA.exe --mine device_id [--validate] [--bfactor N] [--workers N] [--persistent N] [--resident] [--l1-shared] [--hashes-per-block N] [--carveout N] [--adaptive] [--group-programs] [--thread] [--interleaved] [--cost-model] [--variant name] [--specialize] [--aes-engine N]\n\n");
 		printf("device_id is 0 if you only have 1 GPU\n");
 		printf("bfactor can be 0-10, default is 0. Increase it if you get CUDA errors/driver crashes/screen lags.\n");
-		printf("workers can be 2,4,8, default is 8. Choose the value that gives you the best hashrate (it's usually 4 or 8).\n\n");
+		printf("workers can be 2,4,8, default is 8. Choose the value that gives you the best hashrate (it's usually 4 or 8).\n");
+		printf("persistent enables persistent VM execution with N ms time slices (0 = no time limit), bfactor is not used then. Increase N if hashrate is low, decrease it if you get screen lags.\n");
+		printf("resident keeps VM registers in GPU registers instead of shared memory, it can't be used together with persistent.\n");
+		printf("l1-shared (experimental) keeps L1 part of scratchpads in shared memory, it's for GPUs with 100 KB or more shared memory per SM. It can't be used together with persistent and resident.\n");
+		printf("hashes-per-block can be 2,4,8, default is 2. It's the number of hashes in one execute_vm block, bigger blocks help on GPUs which limit the number of blocks per SM. It's not used with persistent.\n");
+		printf("carveout can be 0-100, it's the preferred percentage of L1 cache used as shared memory. Default is to let the driver choose.\n");
+		printf("adaptive compiles every program for 2, 4 and 8 workers and runs each hash pair with the fastest version, workers is not used then. It can't be used together with persistent.\n");
+		printf("group-programs sorts hashes by program length after every program is compiled, so hashes with similar programs run in the same warp.\n");
+		printf("thread (experimental) runs every hash in a single GPU thread, workers only selects how programs are compiled then. It can't be used together with persistent, resident, l1-shared and adaptive.\n");
+		printf("interleaved (experimental) runs 2 hashes in every group of 8 threads, alternating their instructions to hide memory latency. It's for 2 and 4 workers, it can't be used together with persistent, resident, l1-shared and thread.\n");
+		printf("cost-model uploads instruction costs measured on this GPU model, so programs are compiled with expensive instructions sharing groups. Costs are measured on the first run and cached in a file, --adaptive uses the costs of 2, 4 and 8 workers.\n");
+		printf("variant selects RandomX parameters: default (configuration.h), monero, wownero or arqma. Only the default variant can be validated.\n");
+		printf("specialize compiles kernels for this GPU with the batch size and iteration count as constants (needs a build with NVRTC, CUDA 12.0 or newer). Compiled kernels are cached in a file.\n");
+		printf("aes-engine selects the AES implementation of fillAes1Rx4 and hashAes1Rx4: 0 = T-tables, 1 = replicated T-table, 2 = S-box, 3 = bitsliced. Default is to time all of them at startup and use the fastest one.\n\n");
+		printf("RandomX_CUDA.exe --bank-conflicts device_id [--workers N] compiles programs on the GPU and replays execute_vm shared memory accesses on the CPU to count bank conflicts for different VM state paddings.\n\n");
+		printf("RandomX_CUDA.exe --calibrate device_id [--workers N] measures latency and throughput of every instruction class in execute_vm and updates the cached instruction costs for --cost-model.\n\n");
+		printf("RandomX_CUDA.exe --benchmark-engines device_id [--variant name] compares the hashrate and IPC of execute_vm with 2, 4 and 8 workers per hash, the interleaved and the hash-per-thread engines for different batch sizes.\n\n");
 		printf("Examples:\nRandomX_CUDA.exe --test 0\nRandomX_CUDA.exe --mine 0 --validate --bfactor 3 --workers 4\n");
 		return 0;
 	}
 
 	const int device_id = atoi(argv[2]);
 
+	// CUDA 11.7 and newer can load kernels lazily on their first launch, then the startup time below wouldn't include JIT compilation
+	// Ask for eager loading before the first runtime call unless the user has chosen a mode
+	if (!getenv("CUDA_MODULE_LOADING"))
+	{
+#ifdef _WIN32
+		_putenv_s("CUDA_MODULE_LOADING", "EAGER");
+#else
+		setenv("CUDA_MODULE_LOADING", "EAGER", 0);
+#endif
+	}
+
 	cudaError_t cudaStatus = cudaSetDevice(device_id);
 	if (cudaStatus != cudaSuccess)
 	{
@@ -64,9 +125,41 @@ int main(int argc, char** argv)
 	if (cudaGetDeviceFlags(&flags) == cudaSuccess)
 		cudaSetDeviceFlags(flags | cudaDeviceScheduleBlockingSync);
 
+	// The first runtime call creates the context and loads all kernels (with eager module loading), so it includes JIT compilation if the binary has only PTX for this GPU
+	// Run with CUDA_CACHE_DISABLE=1 to measure it, the driver caches JIT compiled kernels otherwise
+	{
+		const std::chrono::steady_clock::time_point t1 = std::chrono::steady_clock::now();
+
+		cudaStatus = cudaFree(nullptr);
+		if (cudaStatus != cudaSuccess)
+		{
+			fprintf(stderr, "Failed to initialize GPU: %s\n", cudaGetErrorString(cudaStatus));
+			return 1;
+		}
+
+		const double dt = std::chrono::duration<double>(std::chrono::steady_clock::now() - t1).count();
+
+		cudaDeviceProp props;
+		if (cudaGetDeviceProperties(&props, device_id) == cudaSuccess)
+			printf("%s (sm_%d%d) initialized in %.3f seconds\n", props.name, props.major, props.minor, dt);
+	}
+
 	bool validate = false;
 	int bfactor = 0;
 	int workers_per_hash = 8;
+	int time_slice = -1;
+	bool resident = false;
+	bool l1_shared = false;
+	int hashes_per_block = 2;
+	int carveout = -1;
+	bool adaptive = false;
+	bool group = false;
+	bool thread = false;
+	bool interleaved = false;
+	bool cost_model = false;
+	bool specialize = false;
+	int aes_engine = -1;
+	const VariantKernels* variant = find_variant("default");
 	for (int i = 0; i < argc; ++i)
 	{
 		if (strcmp(argv[i], "--validate") == 0)
@@ -95,12 +188,103 @@ int main(int argc, char** argv)
 				workers_per_hash = 4;
 			}
 		}
+
+		if ((strcmp(argv[i], "--persistent") == 0) && (i + 1 < argc))
+		{
+			time_slice = atoi(argv[i + 1]);
+			if (time_slice < 0) time_slice = 0;
+			if (time_slice > 1000) time_slice = 1000;
+		}
+
+		if (strcmp(argv[i], "--resident") == 0)
+		{
+			resident = true;
+		}
+
+		if (strcmp(argv[i], "--l1-shared") == 0)
+		{
+			l1_shared = true;
+		}
+
+		if ((strcmp(argv[i], "--hashes-per-block") == 0) && (i + 1 < argc))
+		{
+			hashes_per_block = atoi(argv[i + 1]);
+			switch (hashes_per_block)
+			{
+			case 2:
+			case 4:
+			case 8:
+				break;
+
+			default:
+				hashes_per_block = 2;
+			}
+		}
+
+		if ((strcmp(argv[i], "--carveout") == 0) && (i + 1 < argc))
+		{
+			carveout = atoi(argv[i + 1]);
+			if (carveout < 0) carveout = 0;
+			if (carveout > 100) carveout = 100;
+		}
+
+		if (strcmp(argv[i], "--adaptive") == 0)
+		{
+			adaptive = true;
+		}
+
+		if (strcmp(argv[i], "--group-programs") == 0)
+		{
+			group = true;
+		}
+
+		if (strcmp(argv[i], "--thread") == 0)
+		{
+			thread = true;
+		}
+
+		if (strcmp(argv[i], "--interleaved") == 0)
+		{
+			interleaved = true;
+		}
+
+		if (strcmp(argv[i], "--cost-model") == 0)
+		{
+			cost_model = true;
+		}
+
+		if ((strcmp(argv[i], "--variant") == 0) && (i + 1 < argc))
+		{
+			variant = find_variant(argv[i + 1]);
+			if (!variant)
+			{
+				fprintf(stderr, "Unknown RandomX variant %s!\n", argv[i + 1]);
+				return 1;
+			}
+		}
+
+		if (strcmp(argv[i], "--specialize") == 0)
+		{
+			specialize = true;
+		}
+
+		if ((strcmp(argv[i], "--aes-engine") == 0) && (i + 1 < argc))
+		{
+			aes_engine = atoi(argv[i + 1]);
+			if ((aes_engine < 0) || (aes_engine >= static_cast<int>(AES_ENGINE_COUNT))) aes_engine = -1;
+		}
 	}
 
 	if (strcmp(argv[1], "--mine") == 0)
-		test_mining(validate, bfactor, workers_per_hash);
+		test_mining(*variant, validate, bfactor, workers_per_hash, time_slice, resident, l1_shared, hashes_per_block, carveout, adaptive, group, thread, interleaved, cost_model, specialize, aes_engine);
 	else if (strcmp(argv[1], "--test") == 0)
 		tests();
+	else if (strcmp(argv[1], "--bank-conflicts") == 0)
+		bank_conflicts(workers_per_hash);
+	else if (strcmp(argv[1], "--benchmark-engines") == 0)
+		benchmark_engines(*variant);
+	else if (strcmp(argv[1], "--calibrate") == 0)
+		load_instruction_costs(workers_per_hash, true);
 
 	cudaStatus = cudaDeviceReset();
 	if (cudaStatus != cudaSuccess) {
@@ -140,346 +324,2139 @@ private:
 	void* p;
 };
 
-bool test_mining(bool validate, int bfactor, int workers_per_hash)
+// CUDA events which are destroyed together, it's not valid if any of them couldn't be created
+struct GPUEvents
 {
-	printf("Testing mining: CPU validation is %s, bfactor is %d, %d workers per hash\n", validate ? "ON" : "OFF", bfactor, workers_per_hash);
-
-	cudaError_t cudaStatus;
-
-	size_t free_mem, total_mem;
+	explicit GPUEvents(size_t count) : events(count, nullptr), ok(true)
 	{
-		GPUPtr tmp(256);
-		cudaStatus = cudaMemGetInfo(&free_mem, &total_mem);
-		if (cudaStatus != cudaSuccess)
+		for (cudaEvent_t& e : events)
 		{
-			fprintf(stderr, "Failed to get free memory info!");
-			return false;
+			if (cudaEventCreate(&e) != cudaSuccess)
+			{
+				e = nullptr;
+				ok = false;
+			}
 		}
 	}
 
-	printf("%zu MB GPU memory free\n", free_mem >> 20);
-	printf("%zu MB GPU memory total\n", total_mem >> 20);
-
-	// There should be enough GPU memory for the 2080 MB dataset, 32 scratchpads and 64 MB for everything else
-	const size_t dataset_size = randomx_dataset_item_count() * RANDOMX_DATASET_ITEM_SIZE;
-	if (free_mem <= dataset_size + (32U * SCRATCHPAD_SIZE) + (64U << 20))
-	{
-		fprintf(stderr, "Not enough free GPU memory!");
-		return false;
-	}
-
-	const uint32_t batch_size = static_cast<uint32_t>((((free_mem - dataset_size - (64U << 20)) / SCRATCHPAD_SIZE) / 32) * 32);
-
-	GPUPtr dataset_gpu(dataset_size);
-	if (!dataset_gpu)
+	~GPUEvents()
 	{
-		fprintf(stderr, "Failed to allocate GPU memory for dataset!");
-		return false;
+		for (cudaEvent_t e : events)
+		{
+			if (e)
+				cudaEventDestroy(e);
+		}
 	}
 
-	printf("Allocated %.0f MB dataset\n", dataset_size / 1048576.0);
-
-	printf("Initializing dataset...");
-
-	randomx_dataset *myDataset;
-	{
-		const char mySeed[] = "RandomX example seed";
+	GPUEvents(const GPUEvents&) = delete;
+	GPUEvents& operator=(const GPUEvents&) = delete;
 
-		randomx_cache *myCache = randomx_alloc_cache((randomx_flags)(RANDOMX_FLAG_JIT));
-		randomx_init_cache(myCache, mySeed, sizeof mySeed);
-		myDataset = randomx_alloc_dataset(RANDOMX_FLAG_LARGE_PAGES);
-		if (!myDataset)
-			myDataset = randomx_alloc_dataset(RANDOMX_FLAG_DEFAULT);
+	bool valid() const { return ok; }
+	size_t size() const { return events.size(); }
+	cudaEvent_t operator[](size_t i) const { return events[i]; }
 
-		time_point<steady_clock> t1 = high_resolution_clock::now();
+private:
+	std::vector<cudaEvent_t> events;
+	bool ok;
+};
 
-		std::vector<std::thread> threads;
-		for (uint32_t i = 0, n = std::thread::hardware_concurrency(); i < n; ++i)
-			threads.emplace_back(randomx_init_dataset, myDataset, myCache, (i * randomx_dataset_item_count()) / n, ((i + 1) * randomx_dataset_item_count()) / n - (i * randomx_dataset_item_count()) / n);
+static volatile uint32_t* stop_flag_current = nullptr;
 
-		for (auto& t : threads)
-			t.join();
+static void stop_flag_signal_handler(int)
+{
+	if (stop_flag_current)
+		*stop_flag_current = 1;
+}
 
-		randomx_release_cache(myCache);
+// Host mapped flag which tells persistent kernels to stop taking new work, it's set on Ctrl+C
+struct StopFlag
+{
+	explicit StopFlag(bool enabled) : p(nullptr), p_gpu(nullptr)
+	{
+		if (!enabled)
+			return;
 
-		cudaStatus = cudaMemcpy(dataset_gpu, randomx_get_dataset_memory(myDataset), dataset_size, cudaMemcpyHostToDevice);
-		if (cudaStatus != cudaSuccess) {
-			fprintf(stderr, "Failed to copy dataset to GPU: %s\n", cudaGetErrorString(cudaStatus));
-			return false;
+		if (cudaHostAlloc((void**) &p, sizeof(uint32_t), cudaHostAllocMapped) != cudaSuccess)
+		{
+			p = nullptr;
+			return;
 		}
 
-		printf("done in %.3f seconds\n", duration_cast<nanoseconds>(high_resolution_clock::now() - t1).count() / 1e9);
-	}
-
-	GPUPtr scratchpads_gpu(batch_size * SCRATCHPAD_SIZE);
-	if (!scratchpads_gpu)
-	{
-		fprintf(stderr, "Failed to allocate GPU memory for scratchpads!");
-		return false;
-	}
+		*p = 0;
 
-	printf("Allocated %u scratchpads\n", batch_size);
+		if (cudaHostGetDevicePointer((void**) &p_gpu, (void*) p, 0) != cudaSuccess)
+		{
+			cudaFreeHost((void*) p);
+			p = nullptr;
+			return;
+		}
 
-	GPUPtr hashes_gpu(batch_size * HASH_SIZE);
-	if (!hashes_gpu)
-	{
-		fprintf(stderr, "Failed to allocate GPU memory for hashes!");
-		return false;
+		stop_flag_current = p;
+		signal(SIGINT, stop_flag_signal_handler);
 	}
 
-	GPUPtr entropy_gpu(batch_size * ENTROPY_SIZE);
-	if (!entropy_gpu)
+	~StopFlag()
 	{
-		fprintf(stderr, "Failed to allocate GPU memory for programs!");
-		return false;
+		if (p)
+		{
+			signal(SIGINT, SIG_DFL);
+			stop_flag_current = nullptr;
+			cudaFreeHost((void*) p);
+		}
 	}
 
-	GPUPtr vm_states_gpu(batch_size * VM_STATE_SIZE);
-	if (!vm_states_gpu)
-	{
-		fprintf(stderr, "Failed to allocate GPU memory for VM states!");
-		return false;
-	}
+	operator bool() const { return p != nullptr; }
+	bool is_set() const { return *p != 0; }
+	const volatile uint32_t* device_ptr() const { return p_gpu; }
 
-	GPUPtr rounding_gpu(batch_size * sizeof(uint32_t));
-	if (!rounding_gpu)
-	{
-		fprintf(stderr, "Failed to allocate GPU memory for VM rounding data!");
-		return false;
-	}
+private:
+	volatile uint32_t* p;
+	const volatile uint32_t* p_gpu;
+};
 
-	GPUPtr num_vm_cycles_gpu(sizeof(uint64_t));
-	if (!num_vm_cycles_gpu)
-	{
-		fprintf(stderr, "Failed to allocate GPU memory for VM num cyles data!");
-		return false;
-	}
+template<typename T> struct KernelArg { typedef T type; };
 
-	cudaMemset(num_vm_cycles_gpu, 0, sizeof(uint64_t));
+// Same as kernel<<<grid, block, shared>>>(args...), but kernel can also be a handle from cudaLibraryGetKernel (see specialize_kernels)
+// <<<>>> on a kernel pointer calls its host stub, which only exists for kernels compiled into this binary
+template<typename... Params>
+static void launch_kernel(void (*kernel)(Params...), uint32_t grid, uint32_t block, size_t shared, typename KernelArg<Params>::type... args)
+{
+	void* arg_ptrs[] = { const_cast<void*>(static_cast<const void*>(&args))..., nullptr };
+	cudaLaunchKernel((const void*) kernel, dim3(grid), dim3(block), arg_ptrs, shared, 0);
+}
 
-	GPUPtr blockTemplate_gpu(sizeof(blockTemplate));
-	if (!blockTemplate_gpu)
-	{
-		fprintf(stderr, "Failed to allocate GPU memory for block template!");
-		return false;
-	}
+typedef void (*execute_vm_persistent_func)(void*, void*, const void*, uint32_t, uint32_t*, const volatile uint32_t*, long long int, const uint32_t*);
 
-	cudaStatus = cudaMemcpy(blockTemplate_gpu, blockTemplate, sizeof(blockTemplate), cudaMemcpyHostToDevice);
+// Runs the current program for all hashes with execute_vm_persistent, relaunching it until all hash pairs are done or the stop flag is set
+static bool run_execute_vm_persistent(execute_vm_persistent_func kernel, uint32_t num_blocks, void* vm_states, void* scratchpads, const void* dataset, uint32_t batch_size, uint32_t* work_items, const StopFlag& stop_flag, long long int time_budget, const uint32_t* hash_list)
+{
+	cudaError_t cudaStatus = cudaMemset(work_items, 0, (batch_size / 2 + 2) * sizeof(uint32_t));
 	if (cudaStatus != cudaSuccess) {
-		fprintf(stderr, "Failed to copy block template to GPU: %s\n", cudaGetErrorString(cudaStatus));
+		fprintf(stderr, "cudaMemset failed!");
 		return false;
 	}
 
-	cudaStatus = cudaMemGetInfo(&free_mem, &total_mem);
-	if (cudaStatus != cudaSuccess)
+	for (;;)
 	{
-		fprintf(stderr, "Failed to get free memory info!");
-		return false;
-	}
-
-	printf("%zu MB free GPU memory left\n", free_mem >> 20);
-
-	const void* init_vm_list[] = { init_vm<2>, init_vm<4>, init_vm<8> };
-	const void* execute_vm_list[] = { execute_vm<2>, execute_vm<4>, execute_vm<8> };
+		launch_kernel(kernel, num_blocks, 2 * 8, 0, vm_states, scratchpads, dataset, batch_size, work_items, stop_flag.device_ptr(), time_budget, hash_list);
+		cudaStatus = cudaGetLastError();
+		if (cudaStatus != cudaSuccess) {
+			fprintf(stderr, "execute_vm_persistent launch failed: %s\n", cudaGetErrorString(cudaStatus));
+			return false;
+		}
 
-	for (int i = 0; i < 3; ++i)
-	{
-		cudaStatus = cudaFuncSetCacheConfig(init_vm_list[i], cudaFuncCachePreferShared);
-		if (cudaStatus != cudaSuccess)
-		{
-			fprintf(stderr, "Failed to set cache config for init_vm<%d>!", 1 << i);
+		uint32_t num_pairs_done = 0;
+		cudaStatus = cudaMemcpy(&num_pairs_done, work_items + 1, sizeof(uint32_t), cudaMemcpyDeviceToHost);
+		if (cudaStatus != cudaSuccess) {
+			fprintf(stderr, "execute_vm_persistent failed: %s\n", cudaGetErrorString(cudaStatus));
 			return false;
 		}
 
-		cudaStatus = cudaFuncSetCacheConfig(execute_vm_list[i], cudaFuncCachePreferShared);
-		if (cudaStatus != cudaSuccess)
-		{
-			fprintf(stderr, "Failed to set cache config for execute_vm<%d>!", 1 << i);
+		if ((num_pairs_done == batch_size / 2) || stop_flag.is_set())
+			return true;
+
+		cudaStatus = cudaMemset(work_items, 0, sizeof(uint32_t));
+		if (cudaStatus != cudaSuccess) {
+			fprintf(stderr, "cudaMemset failed!");
 			return false;
 		}
 	}
+}
 
-	time_point<steady_clock> prev_time;
-
-	std::vector<uint8_t> hashes, hashes_check;
-	hashes.resize(batch_size * 32);
-	hashes_check.resize(batch_size * 32);
+typedef void (*init_vm_func)(void*, void*, void*, bool);
+typedef void (*init_vm_adaptive_func)(void*, void*, void*, bool, uint32_t, uint32_t*, uint64_t*, AdaptiveWorkersCosts);
+typedef void (*execute_vm_func)(void*, void*, const void*, uint32_t, uint32_t, bool, bool, const uint32_t*);
+typedef void (*fill_scratchpads_func)(void*, void*, uint32_t);
+typedef void (*hash_scratchpads_func)(const void*, void*, uint32_t);
+typedef void (*finalize_hashes_func)(const void*, const void*, void*, uint32_t*, uint64_t, uint32_t);
 
-	std::vector<std::thread> threads;
-	std::atomic<uint32_t> nonce_counter;
-	bool cpu_limited = false;
+// Kernel instantiations which can be selected at runtime, indexed by [workers per hash][hashes per block] (2, 4, 8 both)
+struct ExecuteVMInstance
+{
+	const char* name;
+	execute_vm_func func;
 
-	for (uint32_t nonce = 0, k = 0; nonce < 0xFFFFFFFFUL; nonce += batch_size, ++k)
-	{
-		auto validation_thread = [&nonce_counter, myDataset, &hashes_check, batch_size, nonce]() {
-			randomx_vm *myMachine = randomx_create_vm((randomx_flags)(RANDOMX_FLAG_FULL_MEM | RANDOMX_FLAG_JIT | RANDOMX_FLAG_HARD_AES | RANDOMX_FLAG_LARGE_PAGES), nullptr, myDataset);
+	// 0 if the kernel uses only static shared memory
+	size_t dynamic_shared_per_hash;
+};
 
-			uint8_t buf[sizeof(blockTemplate)];
-			memcpy(buf, blockTemplate, sizeof(buf));
+static const char* init_vm_names[3] = { "init_vm_fused<2>", "init_vm_fused<4>", "init_vm_fused<8>" };
+static const char* execute_vm_persistent_names[3] = { "execute_vm_persistent<2>", "execute_vm_persistent<4>", "execute_vm_persistent<8>" };
+static const char* aes_engine_names[AES_ENGINE_COUNT] = { "T-tables", "replicated T-table", "S-box", "bitsliced" };
 
-			for (;;)
-			{
-				const uint32_t i = nonce_counter.fetch_add(1);
-				if (i >= batch_size)
-					break;
+// All kernels of one RandomX variant (see RandomXVariant), init_vm and execute_vm_persistent are indexed by workers per hash (2, 4, 8)
+// fill_scratchpads, hash_scratchpads and finalize_hashes are indexed by AES engine (see AES_ENGINE_TTABLE)
+struct VariantKernels
+{
+	const char* name;
 
-				*(uint32_t*)(buf + 39) = nonce + i;
+	// Type of the variant in randomx_cuda.hpp, kernels compiled at run time are instantiated with it
+	const char* type_name;
 
-				randomx_calculate_hash(myMachine, buf, sizeof(buf), (hashes_check.data() + i * 32));
-			}
-			randomx_destroy_vm(myMachine);
-		};
+	size_t scratchpad_size;
+	size_t dataset_size;
+	uint32_t program_count;
+	uint32_t program_iterations;
 
-		if (validate)
-		{
-			nonce_counter = 0;
+	// Only the variant from configuration.h can be validated against the RandomX library
+	bool has_reference;
 
-			const uint32_t n = std::max(std::thread::hardware_concurrency() / 2, 1U);
+	fill_scratchpads_func fill_scratchpads[AES_ENGINE_COUNT];
 
-			threads.clear();
-			for (uint32_t i = 0; i < n; ++i)
-				threads.emplace_back(validation_thread);
-		}
+	// Only used to time AES engines, finalize_hashes has its own copy of hashAes1Rx4
+	hash_scratchpads_func hash_scratchpads[AES_ENGINE_COUNT];
 
-		time_point<steady_clock> cur_time = high_resolution_clock::now();
-		if (k > 0)
-		{
-			const double dt = duration_cast<nanoseconds>(cur_time - prev_time).count() / 1e9;
-			uint64_t data = uint64_t(-1);
-			cudaMemcpy(&data, num_vm_cycles_gpu, sizeof(uint64_t), cudaMemcpyDeviceToHost);
+	init_vm_func init_vm[3];
+	init_vm_adaptive_func init_vm_adaptive;
+	execute_vm_persistent_func execute_vm_persistent[3];
+	ExecuteVMInstance execute_vm[3][3];
+	ExecuteVMInstance execute_vm_resident[3][3];
+	ExecuteVMInstance execute_vm_l1_shared[3][3];
+	ExecuteVMInstance execute_vm_interleaved[3][3];
 
-			const double num_vm_cycles = static_cast<uint32_t>(data);
-			const double num_slots_used = static_cast<uint32_t>(data >> 32);
-			if (validate)
-				printf("%u hashes validated successfully, IPC %.4f, WPC %.4f, %.0f h/s%s    \r", nonce, nonce * RANDOMX_PROGRAM_SIZE * RANDOMX_PROGRAM_COUNT / num_vm_cycles, num_slots_used / num_vm_cycles, batch_size / dt, cpu_limited ? ", limited by CPU" : "                ");
-			else
-				printf("%.0f h/s\t\r", batch_size / dt);
-		}
-		prev_time = cur_time;
+	// Hash-per-thread engine, it runs programs compiled for any workers count
+	ExecuteVMInstance execute_vm_thread;
 
-		blake2b_initial_hash<sizeof(blockTemplate)><<<batch_size / 32, 32>>>(hashes_gpu, blockTemplate_gpu, nonce);
-		cudaStatus = cudaGetLastError();
-		if (cudaStatus != cudaSuccess) {
-			fprintf(stderr, "blake2b_initial_hash launch failed: %s\n", cudaGetErrorString(cudaStatus));
-			return false;
-		}
+	finalize_hashes_func finalize_hashes[AES_ENGINE_COUNT];
+};
 
-		fillAes1Rx4<SCRATCHPAD_SIZE, true><<<batch_size / 32, 32 * 4>>>(hashes_gpu, scratchpads_gpu, batch_size);
-		cudaStatus = cudaGetLastError();
-		if (cudaStatus != cudaSuccess) {
-			fprintf(stderr, "fillAes1Rx4 launch failed: %s\n", cudaGetErrorString(cudaStatus));
-			return false;
-		}
+template<typename VARIANT>
+static VariantKernels variant_kernels(const char* name, const char* type_name)
+{
+	constexpr size_t L1 = execute_vm_l1_shared_size_per_hash<VARIANT>();
 
-		cudaStatus = cudaMemset(rounding_gpu, 0, batch_size * sizeof(uint32_t));
+	return {
+		name, type_name, VARIANT::SCRATCHPAD_SIZE, VARIANT::DATASET_SIZE, VARIANT::PROGRAM_COUNT, VARIANT::PROGRAM_ITERATIONS,
+		std::is_same<VARIANT, RandomX_Default>::value,
+		{
+			fillAes1Rx4<VARIANT::SCRATCHPAD_SIZE, true, AES_ENGINE_TTABLE>,
+			fillAes1Rx4<VARIANT::SCRATCHPAD_SIZE, true, AES_ENGINE_REPLICATED>,
+			fillAes1Rx4<VARIANT::SCRATCHPAD_SIZE, true, AES_ENGINE_SBOX>,
+			fillAes1Rx4<VARIANT::SCRATCHPAD_SIZE, true, AES_ENGINE_BITSLICED>,
+		},
+		{
+			hashAes1Rx4<VARIANT::SCRATCHPAD_SIZE, 0, 64, AES_ENGINE_TTABLE>,
+			hashAes1Rx4<VARIANT::SCRATCHPAD_SIZE, 0, 64, AES_ENGINE_REPLICATED>,
+			hashAes1Rx4<VARIANT::SCRATCHPAD_SIZE, 0, 64, AES_ENGINE_SBOX>,
+			hashAes1Rx4<VARIANT::SCRATCHPAD_SIZE, 0, 64, AES_ENGINE_BITSLICED>,
+		},
+		{ init_vm_fused<VARIANT, 2>, init_vm_fused<VARIANT, 4>, init_vm_fused<VARIANT, 8> },
+		init_vm_adaptive<VARIANT>,
+		{ execute_vm_persistent<VARIANT, 2>, execute_vm_persistent<VARIANT, 4>, execute_vm_persistent<VARIANT, 8> },
+		{
+			{ { "execute_vm<2, 2>", execute_vm<VARIANT, 2, 2>, 0 }, { "execute_vm<2, 4>", execute_vm<VARIANT, 2, 4>, 0 }, { "execute_vm<2, 8>", execute_vm<VARIANT, 2, 8>, 0 } },
+			{ { "execute_vm<4, 2>", execute_vm<VARIANT, 4, 2>, 0 }, { "execute_vm<4, 4>", execute_vm<VARIANT, 4, 4>, 0 }, { "execute_vm<4, 8>", execute_vm<VARIANT, 4, 8>, 0 } },
+			{ { "execute_vm<8, 2>", execute_vm<VARIANT, 8, 2>, 0 }, { "execute_vm<8, 4>", execute_vm<VARIANT, 8, 4>, 0 }, { "execute_vm<8, 8>", execute_vm<VARIANT, 8, 8>, 0 } },
+		},
+		{
+			{ { "execute_vm_resident<2, 2>", execute_vm_resident<VARIANT, 2, 2>, 0 }, { "execute_vm_resident<2, 4>", execute_vm_resident<VARIANT, 2, 4>, 0 }, { "execute_vm_resident<2, 8>", execute_vm_resident<VARIANT, 2, 8>, 0 } },
+			{ { "execute_vm_resident<4, 2>", execute_vm_resident<VARIANT, 4, 2>, 0 }, { "execute_vm_resident<4, 4>", execute_vm_resident<VARIANT, 4, 4>, 0 }, { "execute_vm_resident<4, 8>", execute_vm_resident<VARIANT, 4, 8>, 0 } },
+			{ { "execute_vm_resident<8, 2>", execute_vm_resident<VARIANT, 8, 2>, 0 }, { "execute_vm_resident<8, 4>", execute_vm_resident<VARIANT, 8, 4>, 0 }, { "execute_vm_resident<8, 8>", execute_vm_resident<VARIANT, 8, 8>, 0 } },
+		},
+		{
+			{ { "execute_vm_l1_shared<2, 2>", execute_vm_l1_shared<VARIANT, 2, 2>, L1 }, { "execute_vm_l1_shared<2, 4>", execute_vm_l1_shared<VARIANT, 2, 4>, L1 }, { "execute_vm_l1_shared<2, 8>", execute_vm_l1_shared<VARIANT, 2, 8>, L1 } },
+			{ { "execute_vm_l1_shared<4, 2>", execute_vm_l1_shared<VARIANT, 4, 2>, L1 }, { "execute_vm_l1_shared<4, 4>", execute_vm_l1_shared<VARIANT, 4, 4>, L1 }, { "execute_vm_l1_shared<4, 8>", execute_vm_l1_shared<VARIANT, 4, 8>, L1 } },
+			{ { "execute_vm_l1_shared<8, 2>", execute_vm_l1_shared<VARIANT, 8, 2>, L1 }, { "execute_vm_l1_shared<8, 4>", execute_vm_l1_shared<VARIANT, 8, 4>, L1 }, { "execute_vm_l1_shared<8, 8>", execute_vm_l1_shared<VARIANT, 8, 8>, L1 } },
+		},
+		{
+			{ { "execute_vm_interleaved<2, 2>", execute_vm_interleaved<VARIANT, 2, 2>, 0 }, { "execute_vm_interleaved<2, 4>", execute_vm_interleaved<VARIANT, 2, 4>, 0 }, { "execute_vm_interleaved<2, 8>", execute_vm_interleaved<VARIANT, 2, 8>, 0 } },
+			{ { "execute_vm_interleaved<4, 2>", execute_vm_interleaved<VARIANT, 4, 2>, 0 }, { "execute_vm_interleaved<4, 4>", execute_vm_interleaved<VARIANT, 4, 4>, 0 }, { "execute_vm_interleaved<4, 8>", execute_vm_interleaved<VARIANT, 4, 8>, 0 } },
+			{ { "execute_vm_interleaved<8, 2>", execute_vm_interleaved<VARIANT, 8, 2>, 0 }, { "execute_vm_interleaved<8, 4>", execute_vm_interleaved<VARIANT, 8, 4>, 0 }, { "execute_vm_interleaved<8, 8>", execute_vm_interleaved<VARIANT, 8, 8>, 0 } },
+		},
+		{ "execute_vm_thread", execute_vm_thread<VARIANT>, 0 },
+		{
+			finalize_hashes<VARIANT, AES_ENGINE_TTABLE>,
+			finalize_hashes<VARIANT, AES_ENGINE_REPLICATED>,
+			finalize_hashes<VARIANT, AES_ENGINE_SBOX>,
+			finalize_hashes<VARIANT, AES_ENGINE_BITSLICED>,
+		},
+	};
+}
+
+// Variants which can be selected with --variant, the first one is used when it's not given
+static const VariantKernels randomx_variants[] = {
+	variant_kernels<RandomX_Default>("default", "RandomX_Default"),
+	variant_kernels<RandomX_Monero>("monero", "RandomX_Monero"),
+	variant_kernels<RandomX_Wownero>("wownero", "RandomX_Wownero"),
+	variant_kernels<RandomX_Arqma>("arqma", "RandomX_Arqma"),
+};
+
+static const VariantKernels* find_variant(const char* name)
+{
+	for (const VariantKernels& v : randomx_variants)
+	{
+		if (strcmp(v.name, name) == 0)
+			return &v;
+	}
+	return nullptr;
+}
+
+#if NVRTC_SPECIALIZATION
+
+#define NVRTC_STR2(x) #x
+#define NVRTC_STR(x) NVRTC_STR2(x)
+
+// Kernel pointer which is replaced with its specialized version, expression is the kernel's name in NVRTC source
+struct SpecializedKernel
+{
+	std::string expression;
+	void** func;
+};
+
+template<typename F>
+static SpecializedKernel specialized_kernel(std::string expression, F& func)
+{
+	return { std::move(expression), reinterpret_cast<void**>(&func) };
+}
+
+// "execute_vm<2, 4>" -> "execute_vm<RandomX_Monero, 2, 4>", "finalize_hashes" -> "finalize_hashes<RandomX_Monero>"
+static std::string kernel_expression(const char* name, const char* type_name)
+{
+	const char* p = strchr(name, '<');
+	if (!p)
+		return std::string(name) + '<' + type_name + '>';
+
+	return std::string(name, p + 1) + type_name + ", " + (p + 1);
+}
+
+// Constants from RandomX's common.hpp which device code uses, common.hpp itself can't be compiled by NVRTC
+template<typename T>
+static std::string nvrtc_constant(const char* name, T value)
+{
+	char buf[128];
+	if (std::is_signed<T>::value)
+		snprintf(buf, sizeof(buf), "constexpr int%zu_t %s = %lld;\n", sizeof(T) * 8, name, static_cast<long long>(value));
+	else
+		snprintf(buf, sizeof(buf), "constexpr uint%zu_t %s = %lluULL;\n", sizeof(T) * 8, name, static_cast<unsigned long long>(value));
+	return buf;
+}
+
+#define NVRTC_CONSTANT(name) nvrtc_constant(#name, randomx::name)
+
+static bool read_file(const std::string& file_name, std::string& data)
+{
+	FILE* f = fopen(file_name.c_str(), "rb");
+	if (!f)
+		return false;
+
+	data.clear();
+	char buf[65536];
+	for (size_t n; (n = fread(buf, 1, sizeof(buf), f)) > 0;)
+		data.append(buf, n);
+
+	fclose(f);
+	return true;
+}
+
+struct NVRTCProgram
+{
+	NVRTCProgram() : p(nullptr) {}
+	~NVRTCProgram() { if (p) nvrtcDestroyProgram(&p); }
+
+	nvrtcProgram p;
+};
+
+// Specialized kernels stay loaded until the end of the mining run
+struct CudaLibrary
+{
+	CudaLibrary() : p(nullptr) {}
+	~CudaLibrary() { if (p) cudaLibraryUnload(p); }
+
+	cudaLibrary_t p;
+};
+
+// Compiles kernels with NVRTC_BATCH_SIZE and NVRTC_NUM_ITERATIONS (see SPECIALIZE_BATCH_SIZE), loads them into library
+// and replaces kernel pointers only if all of them were found. Compiled kernels are cached in a file named after the hash of everything
+// that went into the compilation, so changed headers, build options or NVRTC versions compile them again
+static bool specialize_kernels(const std::vector<SpecializedKernel>& kernels, uint32_t batch_size, uint32_t num_iterations, bool copy_costs, CudaLibrary& library)
+{
+	const time_point<steady_clock> t1 = steady_clock::now();
+
+	int device_id, major, minor;
+	if ((cudaGetDevice(&device_id) != cudaSuccess) ||
+		(cudaDeviceGetAttribute(&major, cudaDevAttrComputeCapabilityMajor, device_id) != cudaSuccess) ||
+		(cudaDeviceGetAttribute(&minor, cudaDevAttrComputeCapabilityMinor, device_id) != cudaSuccess))
+	{
+		fprintf(stderr, "Failed to get GPU attributes!");
+		return false;
+	}
+
+	int nvrtc_major, nvrtc_minor;
+	if (nvrtcVersion(&nvrtc_major, &nvrtc_minor) != NVRTC_SUCCESS)
+	{
+		fprintf(stderr, "NVRTC is not available!\n");
+		return false;
+	}
+
+	// Headers are given to NVRTC by their names in #include directives
+	static const char* header_names[] = { "../RandomX/src/configuration.h", "blake2b_cuda.hpp", "aes_cuda.hpp", "soft_fp64_cuda.hpp", "randomx_cuda.hpp" };
+	constexpr size_t num_headers = sizeof(header_names) / sizeof(header_names[0]);
+
+	std::string headers[num_headers];
+	for (size_t i = 0; i < num_headers; ++i)
+	{
+		const std::string file_name = std::string(NVRTC_INCLUDE_PATH) + '/' + header_names[i];
+		if (!read_file(file_name, headers[i]))
+		{
+			fprintf(stderr, "Failed to read %s\n", file_name.c_str());
+			return false;
+		}
+	}
+
+	// NVRTC has no standard headers, the prelude defines what device code uses from them
+	std::string source =
+		"typedef signed char int8_t;\n"
+		"typedef short int16_t;\n"
+		"typedef int int32_t;\n"
+		"typedef long long int64_t;\n"
+		"typedef unsigned char uint8_t;\n"
+		"typedef unsigned short uint16_t;\n"
+		"typedef unsigned int uint32_t;\n"
+		"typedef unsigned long long uint64_t;\n"
+		"typedef decltype(sizeof(0)) size_t;\n"
+		"#define LLONG_MAX 9223372036854775807LL\n"
+		"#include \"../RandomX/src/configuration.h\"\n"
+		"namespace randomx {\n";
+
+	source += NVRTC_CONSTANT(CacheLineSize);
+	source += NVRTC_CONSTANT(ConditionMask);
+	source += NVRTC_CONSTANT(ConditionOffset);
+	source += NVRTC_CONSTANT(RegisterCountFlt);
+	source += NVRTC_CONSTANT(RegisterNeedsDisplacement);
+	source += NVRTC_CONSTANT(StoreL3Condition);
+	source += NVRTC_CONSTANT(constExponentBits);
+	source += NVRTC_CONSTANT(dynamicExponentBits);
+	source += NVRTC_CONSTANT(dynamicMantissaMask);
+	source += NVRTC_CONSTANT(exponentBias);
+	source += NVRTC_CONSTANT(exponentMask);
+	source += NVRTC_CONSTANT(mantissaMask);
+	source += NVRTC_CONSTANT(mantissaSize);
+	source += NVRTC_CONSTANT(staticExponentBits);
+
+	source +=
+		"}\n"
+		"#include \"blake2b_cuda.hpp\"\n"
+		"#include \"aes_cuda.hpp\"\n"
+		"#include \"soft_fp64_cuda.hpp\"\n"
+		"#include \"randomx_cuda.hpp\"\n";
+
+	// Build options of this binary are passed on, so specialized kernels run the same code as generic ones
+	char buf[64];
+	std::vector<std::string> options = {
+		"-std=c++14",
+		"--prec-div=true",
+		"--prec-sqrt=true",
+		"-DVM_STATE_SHARED_PADDING=" NVRTC_STR(VM_STATE_SHARED_PADDING),
+		"-DEXECUTION_PLAN_PADDING=" NVRTC_STR(EXECUTION_PLAN_PADDING),
+		"-DEXECUTE_VM_SWITCH_DISPATCH=" NVRTC_STR(EXECUTE_VM_SWITCH_DISPATCH),
+		"-DEXECUTE_VM_DATASET_PREFETCH=" NVRTC_STR(EXECUTE_VM_DATASET_PREFETCH),
+		"-DEXECUTE_VM_FPRC_SPECIALIZATION=" NVRTC_STR(EXECUTE_VM_FPRC_SPECIALIZATION),
+		"-DEXECUTE_VM_SOFT_FP64=" NVRTC_STR(EXECUTE_VM_SOFT_FP64),
+		"-DEXECUTE_VM_CONDITIONAL_SYNC=" NVRTC_STR(EXECUTE_VM_CONDITIONAL_SYNC),
+		"-DCOMPILE_PROGRAM_RENAME_SWAPS=" NVRTC_STR(COMPILE_PROGRAM_RENAME_SWAPS),
+		"-DCOMPILE_PROGRAM_COST_WINDOW=" NVRTC_STR(COMPILE_PROGRAM_COST_WINDOW),
+	};
+	snprintf(buf, sizeof(buf), "--gpu-architecture=sm_%d%d", major, minor);
+	options.emplace_back(buf);
+	snprintf(buf, sizeof(buf), "-DNVRTC_BATCH_SIZE=%uU", batch_size);
+	options.emplace_back(buf);
+	snprintf(buf, sizeof(buf), "-DNVRTC_NUM_ITERATIONS=%uU", num_iterations);
+	options.emplace_back(buf);
+
+	std::vector<std::string> expressions;
+	for (const SpecializedKernel& k : kernels)
+		expressions.push_back(k.expression);
+	if (copy_costs)
+		expressions.emplace_back("&instruction_costs");
+
+	char file_name[128];
+	{
+		std::string key = source;
+		for (size_t i = 0; i < num_headers; ++i)
+			key += std::string(1, '\0') + header_names[i] + '\0' + headers[i];
+		for (const std::string& s : options)
+			key += std::string(1, '\0') + s;
+		for (const std::string& s : expressions)
+			key += std::string(1, '\0') + s;
+		snprintf(buf, sizeof(buf), "%d.%d", nvrtc_major, nvrtc_minor);
+		key += std::string(1, '\0') + buf;
+
+		uint8_t hash[32];
+		blake2b(hash, sizeof(hash), key.data(), key.size(), nullptr, 0);
+
+		snprintf(file_name, sizeof(file_name), "randomx_cuda_sm%d%d_%02x%02x%02x%02x%02x%02x%02x%02x.cubin", major, minor, hash[0], hash[1], hash[2], hash[3], hash[4], hash[5], hash[6], hash[7]);
+	}
+
+	// Cache file has a lowered name for every expression on separate lines, followed by the cubin
+	std::vector<std::string> lowered_names;
+	std::string cubin;
+	bool loaded = false;
+	{
+		std::string data;
+		if (read_file(file_name, data))
+		{
+			size_t pos = 0;
+			while ((lowered_names.size() < expressions.size()) && (pos < data.size()))
+			{
+				const size_t end = data.find('\n', pos);
+				if (end == std::string::npos)
+					break;
+				lowered_names.emplace_back(data, pos, end - pos);
+				pos = end + 1;
+			}
+
+			loaded = (lowered_names.size() == expressions.size()) && (pos < data.size());
+			if (loaded)
+				cubin.assign(data, pos, std::string::npos);
+			else
+				printf("%s is not valid, compiling kernels again\n", file_name);
+		}
+	}
+
+	if (!loaded)
+	{
+		printf("Compiling %zu kernels for sm_%d%d with NVRTC %d.%d...", kernels.size(), major, minor, nvrtc_major, nvrtc_minor);
+		fflush(stdout);
+
+		const char* header_data[num_headers];
+		for (size_t i = 0; i < num_headers; ++i)
+			header_data[i] = headers[i].c_str();
+
+		NVRTCProgram prog;
+		if (nvrtcCreateProgram(&prog.p, source.c_str(), "randomx_cuda_specialized.cu", static_cast<int>(num_headers), header_data, header_names) != NVRTC_SUCCESS)
+		{
+			fprintf(stderr, "nvrtcCreateProgram failed!\n");
+			return false;
+		}
+
+		for (const std::string& e : expressions)
+		{
+			if (nvrtcAddNameExpression(prog.p, e.c_str()) != NVRTC_SUCCESS)
+			{
+				fprintf(stderr, "nvrtcAddNameExpression failed for %s\n", e.c_str());
+				return false;
+			}
+		}
+
+		std::vector<const char*> option_ptrs;
+		for (const std::string& s : options)
+			option_ptrs.push_back(s.c_str());
+
+		const nvrtcResult result = nvrtcCompileProgram(prog.p, static_cast<int>(option_ptrs.size()), option_ptrs.data());
+		if (result != NVRTC_SUCCESS)
+		{
+			fprintf(stderr, "failed: %s\n", nvrtcGetErrorString(result));
+
+			size_t log_size = 0;
+			if ((nvrtcGetProgramLogSize(prog.p, &log_size) == NVRTC_SUCCESS) && (log_size > 1))
+			{
+				std::vector<char> log(log_size);
+				if (nvrtcGetProgramLog(prog.p, log.data()) == NVRTC_SUCCESS)
+					fprintf(stderr, "%s\n", log.data());
+			}
+			return false;
+		}
+
+		lowered_names.clear();
+		for (const std::string& e : expressions)
+		{
+			const char* lowered_name;
+			if (nvrtcGetLoweredName(prog.p, e.c_str(), &lowered_name) != NVRTC_SUCCESS)
+			{
+				fprintf(stderr, "nvrtcGetLoweredName failed for %s\n", e.c_str());
+				return false;
+			}
+			lowered_names.emplace_back(lowered_name);
+		}
+
+		size_t cubin_size;
+		if (nvrtcGetCUBINSize(prog.p, &cubin_size) != NVRTC_SUCCESS)
+		{
+			fprintf(stderr, "nvrtcGetCUBINSize failed!\n");
+			return false;
+		}
+
+		cubin.resize(cubin_size);
+		if (nvrtcGetCUBIN(prog.p, &cubin[0]) != NVRTC_SUCCESS)
+		{
+			fprintf(stderr, "nvrtcGetCUBIN failed!\n");
+			return false;
+		}
+
+		printf("done\n");
+
+		FILE* f = fopen(file_name, "wb");
+		if (f)
+		{
+			for (const std::string& s : lowered_names)
+				fprintf(f, "%s\n", s.c_str());
+			fwrite(cubin.data(), 1, cubin.size(), f);
+			fclose(f);
+			printf("Compiled kernels saved to %s\n", file_name);
+		}
+		else
+		{
+			fprintf(stderr, "Failed to save compiled kernels to %s\n", file_name);
+		}
+	}
+
+	cudaError_t cudaStatus = cudaLibraryLoadData(&library.p, cubin.data(), nullptr, nullptr, 0, nullptr, nullptr, 0);
+	if (cudaStatus != cudaSuccess)
+	{
+		library.p = nullptr;
+		fprintf(stderr, "Failed to load %s: %s\n", file_name, cudaGetErrorString(cudaStatus));
+		return false;
+	}
+
+	std::vector<cudaKernel_t> handles(kernels.size());
+	for (size_t i = 0; i < kernels.size(); ++i)
+	{
+		cudaStatus = cudaLibraryGetKernel(&handles[i], library.p, lowered_names[i].c_str());
+		if (cudaStatus != cudaSuccess)
+		{
+			fprintf(stderr, "Kernel %s not found in %s: %s\n", kernels[i].expression.c_str(), file_name, cudaGetErrorString(cudaStatus));
+			return false;
+		}
+	}
+
+	// Instruction costs uploaded by load_instruction_costs are copied from this binary's kernels to the specialized ones
+	if (copy_costs)
+	{
+		uint16_t costs[INSTRUCTION_COST_TABLES][INSTRUCTION_COST_CLASSES];
+		void* costs_gpu;
+		size_t costs_size;
+		if ((cudaMemcpyFromSymbol(costs, instruction_costs, sizeof(costs)) != cudaSuccess) ||
+			(cudaLibraryGetGlobal(&costs_gpu, &costs_size, library.p, lowered_names.back().c_str()) != cudaSuccess) ||
+			(costs_size != sizeof(costs)) ||
+			(cudaMemcpy(costs_gpu, costs, sizeof(costs), cudaMemcpyHostToDevice) != cudaSuccess))
+		{
+			fprintf(stderr, "Failed to upload instruction costs to specialized kernels!\n");
+			return false;
+		}
+	}
+
+	for (size_t i = 0; i < kernels.size(); ++i)
+		*kernels[i].func = (void*) handles[i];
+
+	printf("Specialized %zu kernels for %u hashes, %u iterations per launch in %.3f seconds\n", kernels.size(), batch_size, num_iterations, duration_cast<nanoseconds>(steady_clock::now() - t1).count() / 1e9);
+	return true;
+}
+
+#endif
+
+// Launch configuration of one kernel used in mining
+struct LaunchConfig
+{
+	const char* name;
+	const void* func;
+	uint32_t block_size;
+	size_t dynamic_shared;
+
+	// Filled in by setup_launch_config
+	int blocks_per_sm;
+};
+
+// Applies shared memory settings to the kernel (carveout is in percent, -1 leaves it to the driver),
+// then prints its resource usage and theoretical occupancy
+static bool setup_launch_config(LaunchConfig& config, int carveout, int max_threads_per_sm)
+{
+	cudaError_t cudaStatus = cudaFuncSetCacheConfig(config.func, cudaFuncCachePreferShared);
+	if (cudaStatus != cudaSuccess)
+	{
+		fprintf(stderr, "Failed to set cache config for %s!", config.name);
+		return false;
+	}
+
+	if (config.dynamic_shared > 0)
+	{
+		cudaStatus = cudaFuncSetAttribute(config.func, cudaFuncAttributeMaxDynamicSharedMemorySize, static_cast<int>(config.dynamic_shared));
+		if (cudaStatus != cudaSuccess)
+		{
+			fprintf(stderr, "%s needs %zu bytes of shared memory per block, it's not supported by this GPU: %s\n", config.name, config.dynamic_shared, cudaGetErrorString(cudaStatus));
+			return false;
+		}
+	}
+
+	if (carveout >= 0)
+	{
+		cudaStatus = cudaFuncSetAttribute(config.func, cudaFuncAttributePreferredSharedMemoryCarveout, carveout);
+		if (cudaStatus != cudaSuccess)
+		{
+			fprintf(stderr, "Failed to set shared memory carveout for %s: %s\n", config.name, cudaGetErrorString(cudaStatus));
+			return false;
+		}
+	}
+
+	cudaFuncAttributes attr;
+	cudaStatus = cudaFuncGetAttributes(&attr, config.func);
+	if (cudaStatus != cudaSuccess)
+	{
+		fprintf(stderr, "Failed to get attributes of %s!", config.name);
+		return false;
+	}
+
+	cudaStatus = cudaOccupancyMaxActiveBlocksPerMultiprocessor(&config.blocks_per_sm, config.func, config.block_size, config.dynamic_shared);
+	if (cudaStatus != cudaSuccess)
+	{
+		fprintf(stderr, "Failed to get occupancy for %s!", config.name);
+		return false;
+	}
+
+	// Local memory is used for register spills and arrays which couldn't be put in registers
+	printf("%-28s %3u threads, %3d registers, %4zu bytes local, %6zu bytes shared, %2d blocks/SM, %5.1f%% occupancy\n",
+		config.name, config.block_size, attr.numRegs, attr.localSizeBytes, attr.sharedSizeBytes + config.dynamic_shared,
+		config.blocks_per_sm, (config.blocks_per_sm * config.block_size * 100.0) / max_threads_per_sm);
+
+	if (config.blocks_per_sm == 0)
+	{
+		fprintf(stderr, "%s can't run with %u threads per block on this GPU!\n", config.name, config.block_size);
+		return false;
+	}
+
+	return true;
+}
+
+// Replaces the VM cycle costs used by init_vm_adaptive with the time per VM cycle measured for each workers count in the last batch,
+// then writes the workers mix and the estimated speedup against the best fixed workers count to status
+// The estimate assumes that every hash would run as many VM cycles at the same cost per cycle with a fixed workers count, it's not a measurement
+static bool update_adaptive_costs(AdaptiveWorkersCosts& costs, const GPUEvents& events, const uint64_t* stats_gpu, char* status, size_t status_size)
+{
+	uint64_t stats[9];
+	if (cudaMemcpy(stats, stats_gpu, sizeof(stats), cudaMemcpyDeviceToHost) != cudaSuccess)
+	{
+		fprintf(stderr, "Failed to copy adaptive workers stats!");
+		return false;
+	}
+
+	double time_ms[3] = {};
+	for (size_t i = 0; i < events.size(); i += 4)
+	{
+		for (int k = 0; k < 3; ++k)
+		{
+			float dt;
+			if (cudaEventElapsedTime(&dt, events[i + k], events[i + k + 1]) != cudaSuccess)
+			{
+				fprintf(stderr, "Failed to get elapsed time for adaptive workers!");
+				return false;
+			}
+			time_ms[k] += dt;
+		}
+	}
+
+	const uint64_t num_pairs = stats[0] + stats[1] + stats[2];
+	if (num_pairs == 0)
+		return true;
+
+	// Measured costs replace the old ones, the rest are scaled to the same units
+	double new_costs[3];
+	double measured_sum = 0.0;
+	double old_sum = 0.0;
+	for (int k = 0; k < 3; ++k)
+	{
+		new_costs[k] = 0.0;
+		if ((stats[k] * 100 >= num_pairs) && (stats[3 + k] > 0))
+		{
+			new_costs[k] = time_ms[k] / stats[3 + k];
+			measured_sum += new_costs[k];
+			old_sum += costs.per_cycle[k];
+		}
+	}
+
+	const double scale = (measured_sum > 0.0) ? (measured_sum / old_sum) : 1.0;
+	for (int k = 0; k < 3; ++k)
+	{
+		if (new_costs[k] == 0.0)
+			new_costs[k] = costs.per_cycle[k] * scale * 0.9;
+	}
+
+	// Normalize to the cost of 8 workers to keep the numbers readable
+	for (int k = 0; k < 3; ++k)
+		costs.per_cycle[k] = static_cast<float>(new_costs[k] / new_costs[2]);
+
+	double adaptive_cost = 0.0;
+	double best_fixed_cost = 0.0;
+	int best_fixed = 0;
+	for (int k = 0; k < 3; ++k)
+	{
+		adaptive_cost += stats[3 + k] * new_costs[k];
+		const double fixed_cost = stats[6 + k] * new_costs[k];
+		if ((k == 0) || (fixed_cost < best_fixed_cost))
+		{
+			best_fixed_cost = fixed_cost;
+			best_fixed = k;
+		}
+	}
+
+	snprintf(status, status_size, ", workers 2/4/8: %.0f%%/%.0f%%/%.0f%%, estimated %+.1f%% vs %d workers",
+		stats[0] * 100.0 / num_pairs, stats[1] * 100.0 / num_pairs, stats[2] * 100.0 / num_pairs,
+		(best_fixed_cost / adaptive_cost - 1.0) * 100.0, 2 << best_fixed);
+
+	return true;
+}
+
+// Writes the share of execute_vm loop steps which lanes spend waiting for longer programs in their warp, before and after group_programs
+static bool update_group_status(const uint64_t* stats_gpu, char* status, size_t status_size)
+{
+	uint64_t stats[3];
+	if (cudaMemcpy(stats, stats_gpu, sizeof(stats), cudaMemcpyDeviceToHost) != cudaSuccess)
+	{
+		fprintf(stderr, "Failed to copy program grouping stats!");
+		return false;
+	}
+
+	if ((stats[1] == 0) || (stats[2] == 0))
+		return true;
+
+	snprintf(status, status_size, ", idle lanes %.1f%% -> %.1f%%", 100.0 - stats[0] * 100.0 / stats[1], 100.0 - stats[0] * 100.0 / stats[2]);
+	return true;
+}
+
+// Times fillAes1Rx4 and hashAes1Rx4 of every AES engine on the whole batch and picks the fastest one
+// Contents of scratchpads and hashes are overwritten, the first run of every engine is a warm-up
+static bool select_aes_engine(const VariantKernels& variant, void* scratchpads_gpu, void* hashes_gpu, uint32_t batch_size, int& aes_engine)
+{
+	GPUEvents events(2);
+	if (!events.valid())
+	{
+		fprintf(stderr, "Failed to create CUDA event!");
+		return false;
+	}
+
+	float best_ms = 0.0f;
+	aes_engine = AES_ENGINE_TTABLE;
+
+	printf("AES engines:");
+	for (uint32_t e = 0; e < AES_ENGINE_COUNT; ++e)
+	{
+		float ms = 0.0f;
+		for (int run = 0; run < 2; ++run)
+		{
+			cudaEventRecord(events[0]);
+			variant.fill_scratchpads[e]<<<batch_size / 32, 32 * 4>>>(hashes_gpu, scratchpads_gpu, batch_size);
+			variant.hash_scratchpads[e]<<<batch_size / 32, 32 * 4>>>(scratchpads_gpu, hashes_gpu, batch_size);
+			cudaEventRecord(events[1]);
+
+			const cudaError_t cudaStatus = cudaEventSynchronize(events[1]);
+			if (cudaStatus != cudaSuccess)
+			{
+				fprintf(stderr, "\n%s AES engine failed: %s\n", aes_engine_names[e], cudaGetErrorString(cudaStatus));
+				return false;
+			}
+
+			if (cudaEventElapsedTime(&ms, events[0], events[1]) != cudaSuccess)
+			{
+				fprintf(stderr, "\nFailed to get elapsed time for %s AES engine!\n", aes_engine_names[e]);
+				return false;
+			}
+		}
+
+		printf(" %s %.1f ms%s", aes_engine_names[e], ms, (e + 1 < AES_ENGINE_COUNT) ? "," : "");
+
+		if ((e == 0) || (ms < best_ms))
+		{
+			best_ms = ms;
+			aes_engine = static_cast<int>(e);
+		}
+	}
+	printf("\nUsing %s AES engine\n", aes_engine_names[aes_engine]);
+	return true;
+}
+
+bool test_mining(const VariantKernels& variant, bool validate, int bfactor, int workers_per_hash, int time_slice, bool resident, bool l1_shared, int hashes_per_block, int carveout, bool adaptive, bool group, bool thread, bool interleaved, bool cost_model, bool specialize, int aes_engine)
+{
+	const bool persistent = (time_slice >= 0);
+
+	printf("RandomX variant: %s, %zu KB scratchpad, %u programs, %u iterations\n", variant.name, variant.scratchpad_size >> 10, variant.program_count, variant.program_iterations);
+
+	if (persistent)
+		printf("Testing mining: CPU validation is %s, persistent VM execution with %d ms time slices, %d workers per hash\n", validate ? "ON" : "OFF", time_slice, workers_per_hash);
+	else if (adaptive)
+		printf("Testing mining: CPU validation is %s, bfactor is %d, adaptive workers per hash, %d hashes per block%s%s%s\n", validate ? "ON" : "OFF", bfactor, hashes_per_block, resident ? ", register-resident VM" : "", l1_shared ? ", L1 in shared memory" : "", interleaved ? ", interleaved" : "");
+	else if (thread)
+		printf("Testing mining: CPU validation is %s, bfactor is %d, 1 thread per hash, programs compiled for %d workers\n", validate ? "ON" : "OFF", bfactor, workers_per_hash);
+	else
+		printf("Testing mining: CPU validation is %s, bfactor is %d, %d workers per hash, %d hashes per block%s%s%s\n", validate ? "ON" : "OFF", bfactor, workers_per_hash, hashes_per_block, resident ? ", register-resident VM" : "", l1_shared ? ", L1 in shared memory" : "", interleaved ? ", interleaved" : "");
+
+	if (persistent && resident)
+	{
+		fprintf(stderr, "--resident can't be used together with --persistent!\n");
+		return false;
+	}
+
+	if (l1_shared && (persistent || resident))
+	{
+		fprintf(stderr, "--l1-shared can't be used together with --persistent or --resident!\n");
+		return false;
+	}
+
+	if (adaptive && persistent)
+	{
+		fprintf(stderr, "--adaptive can't be used together with --persistent!\n");
+		return false;
+	}
+
+	if (thread && (persistent || resident || l1_shared || adaptive))
+	{
+		fprintf(stderr, "--thread can't be used together with --persistent, --resident, --l1-shared or --adaptive!\n");
+		return false;
+	}
+
+	if (interleaved && (persistent || resident || l1_shared || thread))
+	{
+		fprintf(stderr, "--interleaved can't be used together with --persistent, --resident, --l1-shared or --thread!\n");
+		return false;
+	}
+
+	if (validate && !variant.has_reference)
+	{
+		fprintf(stderr, "--validate can't be used with variant %s, the RandomX library is built for configuration.h parameters!\n", variant.name);
+		return false;
+	}
+
+	// Scratchpads used for calibration are freed before mining memory is allocated
+	// init_vm_adaptive compiles every program for 2, 4 and 8 workers, so it needs the cost tables of all of them
+	if (cost_model)
+	{
+		for (int w = 2; w <= 8; w *= 2)
+		{
+			if ((adaptive || (w == workers_per_hash)) && !load_instruction_costs(w, false))
+				return false;
+		}
+	}
+
+	cudaError_t cudaStatus;
+
+	size_t free_mem, total_mem;
+	{
+		GPUPtr tmp(256);
+		cudaStatus = cudaMemGetInfo(&free_mem, &total_mem);
+		if (cudaStatus != cudaSuccess)
+		{
+			fprintf(stderr, "Failed to get free memory info!");
+			return false;
+		}
+	}
+
+	printf("%zu MB GPU memory free\n", free_mem >> 20);
+	printf("%zu MB GPU memory total\n", total_mem >> 20);
+
+	// There should be enough GPU memory for the 2080 MB dataset, 32 scratchpads and 64 MB for everything else
+	// Dataset items are generated by the RandomX library, so only variants with the same dataset size can use them
+	const size_t dataset_size = randomx_dataset_item_count() * RANDOMX_DATASET_ITEM_SIZE;
+	if (variant.dataset_size != dataset_size)
+	{
+		fprintf(stderr, "Dataset size of variant %s doesn't match configuration.h!\n", variant.name);
+		return false;
+	}
+
+	if (free_mem <= dataset_size + (32U * variant.scratchpad_size) + (64U << 20))
+	{
+		fprintf(stderr, "Not enough free GPU memory!");
+		return false;
+	}
+
+	const uint32_t batch_size = static_cast<uint32_t>((((free_mem - dataset_size - (64U << 20)) / variant.scratchpad_size) / 32) * 32);
+
+	GPUPtr dataset_gpu(dataset_size);
+	if (!dataset_gpu)
+	{
+		fprintf(stderr, "Failed to allocate GPU memory for dataset!");
+		return false;
+	}
+
+	printf("Allocated %.0f MB dataset\n", dataset_size / 1048576.0);
+
+	printf("Initializing dataset...");
+
+	randomx_dataset *myDataset;
+	{
+		const char mySeed[] = "RandomX example seed";
+
+		randomx_cache *myCache = randomx_alloc_cache((randomx_flags)(RANDOMX_FLAG_JIT));
+		randomx_init_cache(myCache, mySeed, sizeof mySeed);
+		myDataset = randomx_alloc_dataset(RANDOMX_FLAG_LARGE_PAGES);
+		if (!myDataset)
+			myDataset = randomx_alloc_dataset(RANDOMX_FLAG_DEFAULT);
+
+		time_point<steady_clock> t1 = steady_clock::now();
+
+		std::vector<std::thread> threads;
+		for (uint32_t i = 0, n = std::thread::hardware_concurrency(); i < n; ++i)
+			threads.emplace_back(randomx_init_dataset, myDataset, myCache, (i * randomx_dataset_item_count()) / n, ((i + 1) * randomx_dataset_item_count()) / n - (i * randomx_dataset_item_count()) / n);
+
+		for (auto& t : threads)
+			t.join();
+
+		randomx_release_cache(myCache);
+
+		cudaStatus = cudaMemcpy(dataset_gpu, randomx_get_dataset_memory(myDataset), dataset_size, cudaMemcpyHostToDevice);
+		if (cudaStatus != cudaSuccess) {
+			fprintf(stderr, "Failed to copy dataset to GPU: %s\n", cudaGetErrorString(cudaStatus));
+			return false;
+		}
+
+		printf("done in %.3f seconds\n", duration_cast<nanoseconds>(steady_clock::now() - t1).count() / 1e9);
+	}
+
+	GPUPtr scratchpads_gpu(batch_size * variant.scratchpad_size);
+	if (!scratchpads_gpu)
+	{
+		fprintf(stderr, "Failed to allocate GPU memory for scratchpads!");
+		return false;
+	}
+
+	printf("Allocated %u scratchpads\n", batch_size);
+
+	GPUPtr hashes_gpu(batch_size * HASH_SIZE);
+	if (!hashes_gpu)
+	{
+		fprintf(stderr, "Failed to allocate GPU memory for hashes!");
+		return false;
+	}
+
+	GPUPtr vm_states_gpu(batch_size * VM_STATE_SIZE);
+	if (!vm_states_gpu)
+	{
+		fprintf(stderr, "Failed to allocate GPU memory for VM states!");
+		return false;
+	}
+
+	GPUPtr num_vm_cycles_gpu(sizeof(uint64_t));
+	if (!num_vm_cycles_gpu)
+	{
+		fprintf(stderr, "Failed to allocate GPU memory for VM num cyles data!");
+		return false;
+	}
+
+	cudaMemset(num_vm_cycles_gpu, 0, sizeof(uint64_t));
+
+	// results[0] is the number of hashes found, followed by their indices in the batch
+	GPUPtr results_gpu((batch_size + 1) * sizeof(uint32_t));
+	if (!results_gpu)
+	{
+		fprintf(stderr, "Failed to allocate GPU memory for results!");
+		return false;
+	}
+
+	// Hash lists for 2, 4 and 8 workers for --adaptive (see init_vm_adaptive), followed by the lists sorted by group_programs for --group-programs
+	// Without --adaptive, group_programs sorts the whole batch into one list
+	const uint32_t num_selected_lists = adaptive ? 3 : 0;
+	const uint32_t num_grouped_lists = group ? (adaptive ? 3 : 1) : 0;
+	GPUPtr hash_lists_gpu(std::max(hash_list_size(batch_size) * (num_selected_lists + num_grouped_lists), 1U) * sizeof(uint32_t));
+	GPUPtr adaptive_stats_gpu(9 * sizeof(uint64_t));
+	GPUPtr group_stats_gpu(3 * sizeof(uint64_t));
+	if (!hash_lists_gpu || !adaptive_stats_gpu || !group_stats_gpu)
+	{
+		fprintf(stderr, "Failed to allocate GPU memory for hash lists!");
+		return false;
+	}
+
+	uint32_t* selected_lists = (uint32_t*)(void*)(hash_lists_gpu);
+	uint32_t* grouped_lists = selected_lists + hash_list_size(batch_size) * num_selected_lists;
+
+	// Warps of execute_vm run 2 hashes with 16 threads per block and 4 hashes otherwise, execute_vm_interleaved runs twice as many
+	// and warps of execute_vm_thread run 32 hashes
+	const uint32_t hashes_per_warp = thread ? 32 : (((persistent || (hashes_per_block == 2)) ? 2 : 4) * (interleaved ? 2 : 1));
+
+	// All hashes are needed for CPU validation, otherwise only hashes which would pass a test difficulty are written out
+	constexpr uint64_t TEST_DIFFICULTY = 10000;
+	const uint64_t target = validate ? uint64_t(-1) : (uint64_t(-1) / TEST_DIFFICULTY);
+	uint64_t num_results = 0;
+
+	// Work counter, number of finished hash pairs and iterations done for each hash pair for execute_vm_persistent
+	GPUPtr work_items_gpu(persistent ? (batch_size / 2 + 2) * sizeof(uint32_t) : sizeof(uint32_t));
+	if (!work_items_gpu)
+	{
+		fprintf(stderr, "Failed to allocate GPU memory for work items!");
+		return false;
+	}
+
+	StopFlag stop_flag(persistent);
+	if (persistent && !stop_flag)
+	{
+		fprintf(stderr, "Failed to allocate mapped memory for stop flag!");
+		return false;
+	}
+
+	GPUPtr blockTemplate_gpu(sizeof(blockTemplate));
+	if (!blockTemplate_gpu)
+	{
+		fprintf(stderr, "Failed to allocate GPU memory for block template!");
+		return false;
+	}
+
+	cudaStatus = cudaMemcpy(blockTemplate_gpu, blockTemplate, sizeof(blockTemplate), cudaMemcpyHostToDevice);
+	if (cudaStatus != cudaSuccess) {
+		fprintf(stderr, "Failed to copy block template to GPU: %s\n", cudaGetErrorString(cudaStatus));
+		return false;
+	}
+
+	cudaStatus = cudaMemGetInfo(&free_mem, &total_mem);
+	if (cudaStatus != cudaSuccess)
+	{
+		fprintf(stderr, "Failed to get free memory info!");
+		return false;
+	}
+
+	printf("%zu MB free GPU memory left\n", free_mem >> 20);
+
+	int device_id, num_sm, max_threads_per_sm;
+	if ((cudaGetDevice(&device_id) != cudaSuccess) ||
+		(cudaDeviceGetAttribute(&num_sm, cudaDevAttrMultiProcessorCount, device_id) != cudaSuccess) ||
+		(cudaDeviceGetAttribute(&max_threads_per_sm, cudaDevAttrMaxThreadsPerMultiProcessor, device_id) != cudaSuccess))
+	{
+		fprintf(stderr, "Failed to get GPU attributes!");
+		return false;
+	}
+
+	if ((aes_engine < 0) && !select_aes_engine(variant, scratchpads_gpu, hashes_gpu, batch_size, aes_engine))
+		return false;
+
+	const int w = (workers_per_hash == 2) ? 0 : ((workers_per_hash == 4) ? 1 : 2);
+	const int h = (hashes_per_block == 2) ? 0 : ((hashes_per_block == 4) ? 1 : 2);
+
+	// Kernels used in this run, generic or specialized for its batch size and iteration count
+	VariantKernels kernels = variant;
+
+	ExecuteVMInstance (&execute_vm_variant_list)[3][3] = l1_shared ? kernels.execute_vm_l1_shared : (resident ? kernels.execute_vm_resident : (interleaved ? kernels.execute_vm_interleaved : kernels.execute_vm));
+	ExecuteVMInstance& execute_vm_instance = thread ? kernels.execute_vm_thread : execute_vm_variant_list[w][h];
+
+#if NVRTC_SPECIALIZATION
+	CudaLibrary specialized_library;
+	if (specialize)
+	{
+		std::vector<SpecializedKernel> specialized = {
+			specialized_kernel(std::string("fillAes1Rx4<") + variant.type_name + "::SCRATCHPAD_SIZE, true, " + std::to_string(aes_engine) + ">", kernels.fill_scratchpads[aes_engine]),
+			specialized_kernel(std::string("finalize_hashes<") + variant.type_name + ", " + std::to_string(aes_engine) + ">", kernels.finalize_hashes[aes_engine]),
+		};
+
+		if (adaptive)
+		{
+			specialized.push_back(specialized_kernel(kernel_expression("init_vm_adaptive", variant.type_name), kernels.init_vm_adaptive));
+			for (int i = 0; i < 3; ++i)
+				specialized.push_back(specialized_kernel(kernel_expression(execute_vm_variant_list[i][h].name, variant.type_name), execute_vm_variant_list[i][h].func));
+		}
+		else
+		{
+			specialized.push_back(specialized_kernel(kernel_expression(init_vm_names[w], variant.type_name), kernels.init_vm[w]));
+			if (persistent)
+				specialized.push_back(specialized_kernel(kernel_expression(execute_vm_persistent_names[w], variant.type_name), kernels.execute_vm_persistent[w]));
+			else
+				specialized.push_back(specialized_kernel(kernel_expression(execute_vm_instance.name, variant.type_name), execute_vm_instance.func));
+		}
+
+		if (!specialize_kernels(specialized, batch_size, variant.program_iterations >> bfactor, cost_model, specialized_library))
+			printf("Using generic kernels\n");
+	}
+#else
+	if (specialize)
+		printf("--specialize is not supported by this build (it needs NVRTC_SPECIALIZATION=1), using generic kernels\n");
+#endif
+
+	const uint32_t execute_vm_block_size = thread ? EXECUTE_VM_THREAD_BLOCK_SIZE : hashes_per_block * 8U;
+	const uint32_t execute_vm_blocks = thread ? (batch_size / EXECUTE_VM_THREAD_BLOCK_SIZE) : (batch_size / (hashes_per_block * (interleaved ? 2 : 1)));
+
+	// Persistent kernels always run 2 hashes per block
+	std::vector<LaunchConfig> launch_configs = {
+		persistent ?
+			LaunchConfig{ execute_vm_persistent_names[w], (const void*) kernels.execute_vm_persistent[w], 2 * 8, 0, 0 } :
+			LaunchConfig{ execute_vm_instance.name, (const void*) execute_vm_instance.func, execute_vm_block_size, execute_vm_instance.dynamic_shared_per_hash * hashes_per_block, 0 },
+		{ "blake2b_initial_hash", (const void*) blake2b_initial_hash<sizeof(blockTemplate)>, 32, 0, 0 },
+		{ "fillAes1Rx4", (const void*) kernels.fill_scratchpads[aes_engine], 32 * 4, 0, 0 },
+		adaptive ?
+			LaunchConfig{ "init_vm_adaptive", (const void*) kernels.init_vm_adaptive, 4 * 8, 0, 0 } :
+			LaunchConfig{ init_vm_names[w], (const void*) kernels.init_vm[w], 4 * 8, 0, 0 },
+		{ "finalize_hashes", (const void*) kernels.finalize_hashes[aes_engine], 32 * 4, 0, 0 },
+	};
+
+	if (group)
+		launch_configs.push_back({ "group_programs", (const void*) group_programs, 1024, 0, 0 });
+
+	// All instances with the same variant and hashes per block have the same block size and shared memory size
+	if (adaptive)
+	{
+		for (int i = 0; i < 3; ++i)
+		{
+			if (i != w)
+				launch_configs.push_back({ execute_vm_variant_list[i][h].name, (const void*) execute_vm_variant_list[i][h].func, hashes_per_block * 8U, execute_vm_variant_list[i][h].dynamic_shared_per_hash * hashes_per_block, 0 });
+		}
+	}
+
+	printf("Kernel launch configurations (%d SMs, %d threads per SM):\n", num_sm, max_threads_per_sm);
+	for (LaunchConfig& config : launch_configs)
+	{
+		if (!setup_launch_config(config, carveout, max_threads_per_sm))
+			return false;
+	}
+	const LaunchConfig execute_vm_config = launch_configs[0];
+
+	// Persistent kernels are launched with as many blocks as can be resident at the same time
+	const uint32_t execute_vm_persistent_blocks = std::min<uint32_t>(num_sm * execute_vm_config.blocks_per_sm, batch_size / 2);
+
+	if (l1_shared)
+	{
+		// Shared memory size of the SM limits how many hashes can run at the same time
+		printf("L1 in shared memory: %d hashes per SM\n", execute_vm_config.blocks_per_sm * hashes_per_block);
+	}
+
+	long long int time_budget = 0;
+	if (time_slice > 0)
+	{
+		int device_id, clock_rate_khz;
+		if ((cudaGetDevice(&device_id) != cudaSuccess) || (cudaDeviceGetAttribute(&clock_rate_khz, cudaDevAttrClockRate, device_id) != cudaSuccess))
+		{
+			fprintf(stderr, "Failed to get GPU clock rate!");
+			return false;
+		}
+		time_budget = static_cast<long long int>(time_slice) * clock_rate_khz;
+	}
+
+	// Relative VM cycle costs for 2, 4 and 8 workers, they're replaced with measured values after every batch
+	// Workers counts which weren't picked in a batch get cheaper by 10%, so every option is tried from time to time
+	AdaptiveWorkersCosts adaptive_costs = { { 0.55f, 0.75f, 1.0f } };
+	char adaptive_status[128] = "";
+	char group_status[64] = "";
+
+	// Start and end of every workers count's launches for each program
+	GPUEvents adaptive_events(adaptive ? variant.program_count * 4 : 0);
+	if (!adaptive_events.valid())
+	{
+		fprintf(stderr, "Failed to create CUDA event!");
+		return false;
+	}
+
+	time_point<steady_clock> prev_time;
+
+	std::vector<uint8_t> hashes, hashes_check;
+	std::vector<uint32_t> result_indices;
+	hashes.resize(batch_size * 32);
+	hashes_check.resize(batch_size * 32);
+
+	std::vector<std::thread> threads;
+	std::atomic<uint32_t> nonce_counter;
+	bool cpu_limited = false;
+
+	for (uint32_t nonce = 0, k = 0; nonce < 0xFFFFFFFFUL; nonce += batch_size, ++k)
+	{
+		auto validation_thread = [&nonce_counter, myDataset, &hashes_check, batch_size, nonce]() {
+			randomx_vm *myMachine = randomx_create_vm((randomx_flags)(RANDOMX_FLAG_FULL_MEM | RANDOMX_FLAG_JIT | RANDOMX_FLAG_HARD_AES | RANDOMX_FLAG_LARGE_PAGES), nullptr, myDataset);
+
+			uint8_t buf[sizeof(blockTemplate)];
+			memcpy(buf, blockTemplate, sizeof(buf));
+
+			for (;;)
+			{
+				const uint32_t i = nonce_counter.fetch_add(1);
+				if (i >= batch_size)
+					break;
+
+				*(uint32_t*)(buf + 39) = nonce + i;
+
+				randomx_calculate_hash(myMachine, buf, sizeof(buf), (hashes_check.data() + i * 32));
+			}
+			randomx_destroy_vm(myMachine);
+		};
+
+		if (validate)
+		{
+			nonce_counter = 0;
+
+			const uint32_t n = std::max(std::thread::hardware_concurrency() / 2, 1U);
+
+			threads.clear();
+			for (uint32_t i = 0; i < n; ++i)
+				threads.emplace_back(validation_thread);
+		}
+
+		time_point<steady_clock> cur_time = steady_clock::now();
+		if (k > 0)
+		{
+			const double dt = duration_cast<nanoseconds>(cur_time - prev_time).count() / 1e9;
+			uint64_t data = uint64_t(-1);
+			cudaMemcpy(&data, num_vm_cycles_gpu, sizeof(uint64_t), cudaMemcpyDeviceToHost);
+
+			const double num_vm_cycles = static_cast<uint32_t>(data);
+			const double num_slots_used = static_cast<uint32_t>(data >> 32);
+			if (validate)
+				printf("%u hashes validated successfully, IPC %.4f, WPC %.4f, %.0f h/s%s%s%s    \r", nonce, nonce * RANDOMX_PROGRAM_SIZE * variant.program_count / num_vm_cycles, num_slots_used / num_vm_cycles, batch_size / dt, adaptive_status, group_status, cpu_limited ? ", limited by CPU" : "                ");
+			else
+				printf("%.0f h/s%s%s, %llu hashes found at difficulty %llu\t\r", batch_size / dt, adaptive_status, group_status, num_results, TEST_DIFFICULTY);
+		}
+		prev_time = cur_time;
+
+		blake2b_initial_hash<sizeof(blockTemplate)><<<batch_size / 32, 32>>>(hashes_gpu, blockTemplate_gpu, nonce);
+		cudaStatus = cudaGetLastError();
+		if (cudaStatus != cudaSuccess) {
+			fprintf(stderr, "blake2b_initial_hash launch failed: %s\n", cudaGetErrorString(cudaStatus));
+			return false;
+		}
+
+		launch_kernel(kernels.fill_scratchpads[aes_engine], batch_size / 32, 32 * 4, 0, hashes_gpu, scratchpads_gpu, batch_size);
+		cudaStatus = cudaGetLastError();
+		if (cudaStatus != cudaSuccess) {
+			fprintf(stderr, "fillAes1Rx4 launch failed: %s\n", cudaGetErrorString(cudaStatus));
+			return false;
+		}
+
+		cudaStatus = cudaMemset(results_gpu, 0, sizeof(uint32_t));
+		if (cudaStatus != cudaSuccess) {
+			fprintf(stderr, "cudaMemset failed!");
+			return false;
+		}
+
+		cudaStatus = cudaMemset(adaptive_stats_gpu, 0, 9 * sizeof(uint64_t));
+		if (cudaStatus != cudaSuccess) {
+			fprintf(stderr, "cudaMemset failed!");
+			return false;
+		}
+
+		cudaStatus = cudaMemset(group_stats_gpu, 0, 3 * sizeof(uint64_t));
 		if (cudaStatus != cudaSuccess) {
 			fprintf(stderr, "cudaMemset failed!");
 			return false;
 		}
 
-		for (size_t i = 0; i < RANDOMX_PROGRAM_COUNT; ++i)
+		for (size_t i = 0; i < variant.program_count; ++i)
+		{
+			// The first program is generated from the scratchpad seed, the next ones from the previous program's registers
+			if (adaptive)
+			{
+				for (int k = 0; k < 3; ++k)
+				{
+					cudaStatus = cudaMemset(selected_lists + hash_list_size(batch_size) * k, 0, sizeof(uint32_t));
+					if (cudaStatus != cudaSuccess) {
+						fprintf(stderr, "cudaMemset failed!");
+						return false;
+					}
+				}
+
+				launch_kernel(kernels.init_vm_adaptive, batch_size / 4, 4 * 8, 0, hashes_gpu, vm_states_gpu, num_vm_cycles_gpu, i > 0, batch_size, selected_lists, (uint64_t*)(void*)(adaptive_stats_gpu), adaptive_costs);
+
+				// Hashes of a pair have the same number of workers, so they can be regrouped within their list
+				if (group)
+				{
+					for (int k = 0; k < 3; ++k)
+						group_programs<<<1, 1024>>>(vm_states_gpu, batch_size, selected_lists + hash_list_size(batch_size) * k, grouped_lists + hash_list_size(batch_size) * k, hashes_per_warp, (uint64_t*)(void*)(group_stats_gpu));
+				}
+
+				// Each hash list runs with its own execute_vm instance, the grid is sized for the whole batch because list sizes are only known on the GPU
+				for (int k = 0; k < 3; ++k)
+				{
+					const uint32_t* hash_list = (group ? grouped_lists : selected_lists) + hash_list_size(batch_size) * k;
+
+					if (cudaEventRecord(adaptive_events[i * 4 + k]) != cudaSuccess) {
+						fprintf(stderr, "cudaEventRecord failed!");
+						return false;
+					}
+					for (int j = 0, n = 1 << bfactor; j < n; ++j)
+						launch_kernel(execute_vm_variant_list[k][h].func, execute_vm_blocks, execute_vm_config.block_size, execute_vm_config.dynamic_shared, vm_states_gpu, scratchpads_gpu, dataset_gpu, batch_size, variant.program_iterations >> bfactor, j == 0, j == n - 1, hash_list);
+				}
+				if (cudaEventRecord(adaptive_events[i * 4 + 3]) != cudaSuccess) {
+					fprintf(stderr, "cudaEventRecord failed!");
+					return false;
+				}
+			}
+			else
+			{
+				launch_kernel(kernels.init_vm[w], batch_size / 4, 4 * 8, 0, hashes_gpu, vm_states_gpu, num_vm_cycles_gpu, i > 0);
+
+				const uint32_t* hash_list = nullptr;
+				if (group)
+				{
+					group_programs<<<1, 1024>>>(vm_states_gpu, batch_size, nullptr, grouped_lists, hashes_per_warp, (uint64_t*)(void*)(group_stats_gpu));
+					hash_list = grouped_lists;
+				}
+
+				if (persistent)
+				{
+					if (!run_execute_vm_persistent(kernels.execute_vm_persistent[w], execute_vm_persistent_blocks, vm_states_gpu, scratchpads_gpu, dataset_gpu, batch_size, (uint32_t*)(void*)(work_items_gpu), stop_flag, time_budget, hash_list))
+						return false;
+				}
+				else
+				{
+					for (int j = 0, n = 1 << bfactor; j < n; ++j)
+						launch_kernel(execute_vm_instance.func, execute_vm_blocks, execute_vm_config.block_size, execute_vm_config.dynamic_shared, vm_states_gpu, scratchpads_gpu, dataset_gpu, batch_size, variant.program_iterations >> bfactor, j == 0, j == n - 1, hash_list);
+				}
+			}
+
+			if (persistent && stop_flag.is_set())
+				break;
+
+			if (i == variant.program_count - 1)
+			{
+				launch_kernel(kernels.finalize_hashes[aes_engine], batch_size / 32, 32 * 4, 0, scratchpads_gpu, vm_states_gpu, hashes_gpu, (uint32_t*)(void*)(results_gpu), target, batch_size);
+				cudaStatus = cudaGetLastError();
+				if (cudaStatus != cudaSuccess) {
+					fprintf(stderr, "finalize_hashes launch failed: %s\n", cudaGetErrorString(cudaStatus));
+					return false;
+				}
+			}
+		}
+
+		cudaStatus = cudaDeviceSynchronize();
+		if (cudaStatus != cudaSuccess) {
+			fprintf(stderr, "cudaDeviceSynchronize returned error code %d!\n", cudaStatus);
+			return false;
+		}
+
+		if (adaptive && !update_adaptive_costs(adaptive_costs, adaptive_events, (const uint64_t*)(void*)(adaptive_stats_gpu), adaptive_status, sizeof(adaptive_status)))
+			return false;
+
+		if (group && !update_group_status((const uint64_t*)(void*)(group_stats_gpu), group_status, sizeof(group_status)))
+			return false;
+
+		if (persistent && stop_flag.is_set())
+		{
+			for (auto& thread : threads)
+				thread.join();
+
+			printf("\nStopped\n");
+			return true;
+		}
+
+		// finalize_hashes lists the batch indices of hashes at or below the target, nonce + index is what a miner submits
+		uint32_t batch_results = 0;
+		cudaStatus = cudaMemcpy(&batch_results, results_gpu, sizeof(uint32_t), cudaMemcpyDeviceToHost);
+		if ((cudaStatus != cudaSuccess) || (batch_results > batch_size)) {
+			fprintf(stderr, "\nFailed to read results!\n");
+			return false;
+		}
+		num_results += batch_results;
+
+		result_indices.resize(batch_results);
+		if (batch_results > 0)
+		{
+			if ((cudaMemcpy(result_indices.data(), (uint32_t*)(void*)(results_gpu) + 1, batch_results * sizeof(uint32_t), cudaMemcpyDeviceToHost) != cudaSuccess) ||
+				(cudaMemcpy(hashes.data(), hashes_gpu, batch_size * 32, cudaMemcpyDeviceToHost) != cudaSuccess))
+			{
+				fprintf(stderr, "\nFailed to read results!\n");
+				return false;
+			}
+		}
+
+		for (uint32_t index : result_indices)
+		{
+			uint64_t h3 = 0;
+			if (index < batch_size)
+				memcpy(&h3, hashes.data() + index * 32 + 24, sizeof(h3));
+
+			if ((index >= batch_size) || (h3 > target))
+			{
+				fprintf(stderr, "\nInvalid result for nonce %u!\n", nonce + index);
+				return false;
+			}
+		}
+
+		if (validate)
+		{
+			// The target is all ones, so every hash must be listed
+			if (batch_results != batch_size)
+			{
+				fprintf(stderr, "\nOnly %u of %u hashes were found!\n", batch_results, batch_size);
+				return false;
+			}
+
+			cpu_limited = nonce_counter.load() < batch_size;
+
+			for (auto& thread : threads)
+				thread.join();
+
+			if (memcmp(hashes.data(), hashes_check.data(), batch_size * 32) != 0)
+			{
+				fprintf(stderr, "\nCPU validation error, ");
+				for (uint32_t i = 0; i < batch_size * 32; i += 32)
+				{
+					if (memcmp(hashes.data() + i, hashes_check.data() + i, 32))
+					{
+						fprintf(stderr, "failing nonce = %u\n", nonce + i / 32);
+						break;
+					}
+				}
+				return false;
+			}
+		}
+	}
+
+	return true;
+}
+
+// Shared memory accesses of one warp in execute_vm, replayed on the host to count bank conflicts
+// Instruction classes are execute_vm opcodes (0-16), followed by instruction fetch and the code around the program (iteration start/end)
+constexpr uint32_t BANK_CONFLICT_CLASSES = 19;
+
+static const char* bank_conflict_class_names[BANK_CONFLICT_CLASSES] = {
+	"add_rs", "add", "mul", "umul_hi", "imul_hi", "neg", "xor", "ror", "swap", "cbranch", "store", "fswap", "fadd", "fmul", "fsqrt", "fdiv", "cfround",
+	"fetch", "iteration"
+};
+
+struct BankConflictStats
+{
+	uint64_t lane_accesses[BANK_CONFLICT_CLASSES];
+	uint64_t conflicted_lane_accesses[BANK_CONFLICT_CLASSES];
+	uint64_t passes;
+	uint64_t extra_passes;
+};
+
+// One shared memory instruction of a warp: byte address and instruction class of every lane, inactive lanes have address -1
+struct WarpAccess
+{
+	int64_t addr[32];
+	uint32_t cls[32];
+	uint32_t size;
+
+	WarpAccess(uint32_t access_size, uint32_t access_cls) : size(access_size)
+	{
+		for (uint32_t i = 0; i < 32; ++i)
+		{
+			addr[i] = -1;
+			cls[i] = access_cls;
+		}
+	}
+};
+
+// 32-bit accesses are served in one pass per warp and 64-bit accesses in one pass per half-warp, every pass reads one address per bank
+// A lane access is conflicted if another lane in the same pass needs a different address in its bank
+static void count_bank_conflicts(const WarpAccess& a, BankConflictStats& stats)
+{
+	const uint32_t lanes_per_pass = (a.size == 8) ? 16 : 32;
+	const uint32_t num_banks = 128 / a.size;
+
+	for (uint32_t first = 0; first < 32; first += lanes_per_pass)
+	{
+		int64_t bank_addr[32][32];
+		uint32_t bank_count[32] = {};
+		bool any = false;
+
+		for (uint32_t i = first; i < first + lanes_per_pass; ++i)
+		{
+			if (a.addr[i] < 0)
+				continue;
+
+			any = true;
+			const int64_t word = a.addr[i] / a.size;
+			const uint32_t bank = static_cast<uint32_t>(word % num_banks);
+			if (std::find(bank_addr[bank], bank_addr[bank] + bank_count[bank], word) == bank_addr[bank] + bank_count[bank])
+				bank_addr[bank][bank_count[bank]++] = word;
+		}
+
+		if (!any)
+			continue;
+
+		const uint32_t passes = *std::max_element(bank_count, bank_count + num_banks);
+		stats.passes += passes;
+		stats.extra_passes += passes - 1;
+
+		for (uint32_t i = first; i < first + lanes_per_pass; ++i)
 		{
-			fillAes1Rx4<ENTROPY_SIZE, false><<<batch_size / 32, 32 * 4>>>(hashes_gpu, entropy_gpu, batch_size);
-			cudaStatus = cudaGetLastError();
-			if (cudaStatus != cudaSuccess) {
-				fprintf(stderr, "fillAes1Rx4 launch failed: %s\n", cudaGetErrorString(cudaStatus));
-				return false;
-			}
+			if (a.addr[i] < 0)
+				continue;
 
-			switch (workers_per_hash)
+			++stats.lane_accesses[a.cls[i]];
+			if (bank_count[(a.addr[i] / a.size) % num_banks] > 1)
+				++stats.conflicted_lane_accesses[a.cls[i]];
+		}
+	}
+}
+
+// Replays shared memory accesses of execute_vm for compiled VM states (as written by init_vm), 4 hashes per warp with VM states stride bytes apart
+// Only one iteration is replayed: iteration start/end and the first pass over the program, CBRANCH is never taken
+static void replay_bank_conflicts(const uint8_t* vm_states, uint32_t batch_size, uint32_t workers_per_hash, uint32_t stride, BankConflictStats& stats)
+{
+	for (uint32_t warp = 0; warp < batch_size / 4; ++warp)
+	{
+		const uint8_t* states[4];
+		const uint32_t* programs[4];
+		uint32_t program_length[4];
+		uint32_t ip[4] = {};
+		for (uint32_t h = 0; h < 4; ++h)
+		{
+			states[h] = vm_states + (warp * 4 + h) * VM_STATE_SIZE;
+			const uint32_t num_imm = *(const uint32_t*)(states[h] + 140);
+			programs[h] = (const uint32_t*)(states[h] + REGISTERS_SIZE) + num_imm;
+			program_length[h] = *(const uint32_t*)(states[h] + 160);
+		}
+
+		// Iteration start: spMix, r ^= scratchpad, F/E loads, then mx and register renaming at the end
+		{
+			constexpr uint32_t c = BANK_CONFLICT_CLASSES - 1;
+			WarpAccess readReg0(8, c), readReg1(8, c), r(8, c), fe0(8, c), fe1(8, c), readReg2(4, c), readReg3(4, c), r_end(8, c), f_end(8, c), e_end(8, c), f(8, c), e(8, c);
+			for (uint32_t h = 0; h < 4; ++h)
 			{
-			case 2:
-				init_vm<2><<<batch_size / 4, 4 * 8>>>(entropy_gpu, vm_states_gpu, num_vm_cycles_gpu);
-				for (int j = 0, n = 1 << bfactor; j < n; ++j)
+				const uint32_t addressRegisters = *(const uint32_t*)(states[h] + 176);
+				const uint32_t end_map = *(const uint32_t*)(states[h] + 172);
+				const int64_t base = h * stride;
+
+				for (uint32_t sub = 0; sub < 8; ++sub)
 				{
-					execute_vm<2><<<batch_size / 2, 2 * 8>>>(vm_states_gpu, rounding_gpu, scratchpads_gpu, dataset_gpu, batch_size, RANDOMX_PROGRAM_ITERATIONS >> bfactor, j == 0, j == n - 1);
+					const uint32_t lane = h * 8 + sub;
+					const int64_t fe_offset = (sub < 4) ? (64 + sub * 16) : (128 + (sub - 4) * 16);
+
+					readReg0.addr[lane] = base + (addressRegisters & 0xff);
+					readReg1.addr[lane] = base + ((addressRegisters >> 8) & 0xff);
+					r.addr[lane] = base + sub * 8;
+					fe0.addr[lane] = base + fe_offset;
+					fe1.addr[lane] = base + fe_offset + 8;
+					readReg2.addr[lane] = base + ((addressRegisters >> 16) & 0xff);
+					readReg3.addr[lane] = base + (addressRegisters >> 24);
+					r_end.addr[lane] = base + ((end_map >> (sub * 3)) & 7) * 8;
+					f_end.addr[lane] = base + 64 + (sub ^ ((end_map >> (24 + sub / 2)) & 1)) * 8;
+					e_end.addr[lane] = base + 128 + (sub ^ ((end_map >> (28 + sub / 2)) & 1)) * 8;
+					f.addr[lane] = base + 64 + sub * 8;
+					e.addr[lane] = base + 128 + sub * 8;
 				}
-				break;
+			}
 
-			case 4:
-				init_vm<4><<<batch_size / 4, 4 * 8>>>(entropy_gpu, vm_states_gpu, num_vm_cycles_gpu);
-				for (int j = 0, n = 1 << bfactor; j < n; ++j)
+#if COMPILE_PROGRAM_RENAME_SWAPS
+			for (const WarpAccess* a : { &readReg0, &readReg1, &r, &r, &fe0, &fe1, &readReg2, &readReg3, &r_end, &f_end, &e_end, &f, &e, &r, &f, &e })
+#else
+			for (const WarpAccess* a : { &readReg0, &readReg1, &r, &r, &fe0, &fe1, &readReg2, &readReg3, &r, &r, &f, &e })
+#endif
+				count_bank_conflicts(*a, stats);
+		}
+
+		// The program: every step is one pass of the execute_program loop for all 4 hashes
+		for (;;)
+		{
+			WarpAccess fetch(4, BANK_CONFLICT_CLASSES - 2), decode(4, 0), dst(8, 0), src(8, 0), imm0(4, 0), imm1(4, 0), src_write(8, 0), dst_write(8, 0);
+			bool active = false;
+
+			for (uint32_t h = 0; h < 4; ++h)
+			{
+				if (ip[h] >= program_length[h])
+					continue;
+
+				active = true;
+
+				const int64_t base = h * stride;
+				const int64_t program_offset = (const uint8_t*)(programs[h]) - states[h];
+				const uint32_t inst0 = programs[h][ip[h]];
+				const uint32_t num_workers = (inst0 >> NUM_INSTS_OFFSET) & (workers_per_hash - 1);
+				const uint32_t num_fp_insts = (inst0 >> NUM_FP_INSTS_OFFSET) & (workers_per_hash - 1);
+
+				for (uint32_t sub = 0; sub < workers_per_hash; ++sub)
 				{
-					execute_vm<4><<<batch_size / 2, 2 * 8>>>(vm_states_gpu, rounding_gpu, scratchpads_gpu, dataset_gpu, batch_size, RANDOMX_PROGRAM_ITERATIONS >> bfactor, j == 0, j == n - 1);
+					const uint32_t lane = h * 8 + sub;
+					fetch.addr[lane] = base + program_offset + ip[h] * 4;
+
+					if (sub > num_workers)
+						continue;
+
+					const bool is_fp = sub < num_fp_insts * 2;
+					const uint32_t k = ip[h] + (is_fp ? (sub / 2) : (sub - num_fp_insts));
+					const uint32_t inst = programs[h][k];
+					const uint32_t opcode = (inst >> OPCODE_OFFSET) & 31;
+					const uint32_t location = (inst >> LOC_OFFSET) & 3;
+
+					uint32_t dst_offset = is_fp ? (64 + (sub & 1) * 8 + ((inst >> DST_OFFSET) & 7) * 16) : (((inst >> DST_OFFSET) & 7) * 8);
+					if (COMPILE_PROGRAM_RENAME_SWAPS && is_fp)
+						dst_offset ^= ((inst >> SHIFT_OFFSET) & 1) * 8;
+
+					const uint32_t src_offset = ((inst >> SRC_OFFSET) & 7) * 8 + ((is_fp && !location) ? (192 + (sub & 1) * 8) : 0);
+					const uint32_t imm_offset = REGISTERS_SIZE + ((inst >> IMM_OFFSET) & 255) * 4;
+
+					decode.addr[lane] = base + program_offset + k * 4;
+					dst.addr[lane] = base + dst_offset;
+					src.addr[lane] = base + src_offset;
+					imm0.addr[lane] = base + imm_offset;
+					imm1.addr[lane] = base + imm_offset + 4;
+					if (opcode == 8)
+						src_write.addr[lane] = base + src_offset;
+					if ((opcode != 10) && (opcode != 16))
+						dst_write.addr[lane] = base + dst_offset;
+
+					decode.cls[lane] = dst.cls[lane] = src.cls[lane] = imm0.cls[lane] = imm1.cls[lane] = src_write.cls[lane] = dst_write.cls[lane] = opcode;
 				}
+
+				ip[h] += num_workers - num_fp_insts + 1;
+			}
+
+			if (!active)
 				break;
 
-			case 8:
-				init_vm<8><<<batch_size / 4, 4 * 8>>>(entropy_gpu, vm_states_gpu, num_vm_cycles_gpu);
-				for (int j = 0, n = 1 << bfactor; j < n; ++j)
+			for (const WarpAccess* a : { &fetch, &decode, &dst, &src, &imm0, &imm1, &src_write, &dst_write })
+				count_bank_conflicts(*a, stats);
+		}
+	}
+}
+
+// Compiles a batch of programs on the GPU and reports bank conflicts in execute_vm for packed and padded VM state layouts
+void bank_conflicts(int workers_per_hash)
+{
+	constexpr uint32_t batch_size = 4096;
+
+	GPUPtr hashes_gpu(batch_size * HASH_SIZE);
+	GPUPtr vm_states_gpu(batch_size * VM_STATE_SIZE);
+	GPUPtr blockTemplate_gpu(sizeof(blockTemplate));
+	if (!hashes_gpu || !vm_states_gpu || !blockTemplate_gpu) {
+		fprintf(stderr, "cudaMalloc failed!");
+		return;
+	}
+
+	cudaError_t cudaStatus = cudaMemcpy(blockTemplate_gpu, blockTemplate, sizeof(blockTemplate), cudaMemcpyHostToDevice);
+	if (cudaStatus != cudaSuccess) {
+		fprintf(stderr, "cudaMemcpy failed!");
+		return;
+	}
+
+	const int w = (workers_per_hash == 2) ? 0 : ((workers_per_hash == 4) ? 1 : 2);
+
+	blake2b_initial_hash<sizeof(blockTemplate)><<<batch_size / 32, 32>>>(hashes_gpu, blockTemplate_gpu, 0);
+	randomx_variants[0].init_vm[w]<<<batch_size / 4, 4 * 8>>>(hashes_gpu, vm_states_gpu, nullptr, false);
+
+	cudaStatus = cudaDeviceSynchronize();
+	if (cudaStatus != cudaSuccess) {
+		fprintf(stderr, "cudaDeviceSynchronize returned error code %d after launching %s!\n", cudaStatus, init_vm_names[w]);
+		return;
+	}
+
+	std::vector<uint8_t> vm_states(batch_size * VM_STATE_SIZE);
+	cudaStatus = cudaMemcpy(vm_states.data(), vm_states_gpu, vm_states.size(), cudaMemcpyDeviceToHost);
+	if (cudaStatus != cudaSuccess) {
+		fprintf(stderr, "cudaMemcpy failed!");
+		return;
+	}
+
+	printf("Shared memory bank conflicts in execute_vm with %d workers per hash, %u programs, one iteration each\n\n", workers_per_hash, batch_size);
+	printf("Padding     Passes  Extra passes\n");
+
+	const uint32_t paddings[] = { 0, 16, 32, 48, 64, 80, 96, 128 };
+	BankConflictStats packed = {};
+	BankConflictStats best = {};
+	uint32_t best_padding = 0;
+	for (uint32_t padding : paddings)
+	{
+		BankConflictStats stats = {};
+		replay_bank_conflicts(vm_states.data(), batch_size, workers_per_hash, VM_STATE_SIZE + padding, stats);
+		printf("%5u B %10llu %8llu (%.1f%%)%s\n", padding, static_cast<unsigned long long>(stats.passes), static_cast<unsigned long long>(stats.extra_passes), stats.extra_passes * 100.0 / stats.passes, (padding == VM_STATE_SHARED_PADDING) ? " <- VM_STATE_SHARED_PADDING" : "");
+
+		if (padding == 0)
+			packed = stats;
+
+		if ((padding == 0) || (stats.extra_passes < best.extra_passes))
+		{
+			best = stats;
+			best_padding = padding;
+		}
+	}
+
+	// Fewer extra passes don't always mean more hashes per second: padding uses shared memory, which can lower occupancy
+	printf("\nConflicted lane accesses by instruction class, padding 0 B -> %u B (fewest extra passes)\n", best_padding);
+	for (uint32_t i = 0; i < BANK_CONFLICT_CLASSES; ++i)
+	{
+		if (packed.lane_accesses[i] == 0)
+			continue;
+
+		printf("%-10s %10llu %5.1f%% -> %5.1f%%\n", bank_conflict_class_names[i], static_cast<unsigned long long>(packed.lane_accesses[i]), packed.conflicted_lane_accesses[i] * 100.0 / packed.lane_accesses[i], best.conflicted_lane_accesses[i] * 100.0 / best.lane_accesses[i]);
+	}
+}
+
+// Runs whole batches of hashes with execute_vm for 2, 4 and 8 workers per hash, with execute_vm_interleaved for 2 and 4 workers
+// and with execute_vm_thread, for every batch size that fits in memory
+// Hashrate includes all kernels of a batch, IPC is RandomX instructions per SM clock cycle in the execute_vm kernels only
+// The dataset is zeroed instead of initialized, so hashes are only compared between the engines
+void benchmark_engines(const VariantKernels& variant)
+{
+	struct Engine
+	{
+		const ExecuteVMInstance& instance;
+		uint32_t block_size;
+		uint32_t hashes_per_block;
+
+		// Index in variant.init_vm
+		int w;
+	};
+
+	const Engine engines[] = {
+		{ variant.execute_vm[0][0], 2 * 8, 2, 0 },
+		{ variant.execute_vm[1][0], 2 * 8, 2, 1 },
+		{ variant.execute_vm[2][0], 2 * 8, 2, 2 },
+		{ variant.execute_vm_interleaved[0][0], 2 * 8, 4, 0 },
+		{ variant.execute_vm_interleaved[1][0], 2 * 8, 4, 1 },
+		{ variant.execute_vm_thread, EXECUTE_VM_THREAD_BLOCK_SIZE, EXECUTE_VM_THREAD_BLOCK_SIZE, 2 },
+	};
+	constexpr int num_engines = sizeof(engines) / sizeof(engines[0]);
+
+	int device_id, num_sm, clock_rate_khz;
+	if ((cudaGetDevice(&device_id) != cudaSuccess) ||
+		(cudaDeviceGetAttribute(&num_sm, cudaDevAttrMultiProcessorCount, device_id) != cudaSuccess) ||
+		(cudaDeviceGetAttribute(&clock_rate_khz, cudaDevAttrClockRate, device_id) != cudaSuccess))
+	{
+		fprintf(stderr, "Failed to get GPU attributes!");
+		return;
+	}
+
+	const size_t dataset_size = variant.dataset_size;
+
+	GPUPtr dataset_gpu(dataset_size);
+	GPUPtr blockTemplate_gpu(sizeof(blockTemplate));
+	if (!dataset_gpu || !blockTemplate_gpu) {
+		fprintf(stderr, "cudaMalloc failed!");
+		return;
+	}
+
+	cudaError_t cudaStatus = cudaMemset(dataset_gpu, 0, dataset_size);
+	if (cudaStatus != cudaSuccess) {
+		fprintf(stderr, "cudaMemset failed!");
+		return;
+	}
+
+	cudaStatus = cudaMemcpy(blockTemplate_gpu, blockTemplate, sizeof(blockTemplate), cudaMemcpyHostToDevice);
+	if (cudaStatus != cudaSuccess) {
+		fprintf(stderr, "cudaMemcpy failed!");
+		return;
+	}
+
+	size_t free_mem, total_mem;
+	cudaStatus = cudaMemGetInfo(&free_mem, &total_mem);
+	if (cudaStatus != cudaSuccess)
+	{
+		fprintf(stderr, "Failed to get free memory info!");
+		return;
+	}
+
+	// Scratchpad, hash, VM state and result of every hash, and 64 MB for everything else
+	const size_t per_hash_size = variant.scratchpad_size + HASH_SIZE + VM_STATE_SIZE + sizeof(uint32_t);
+	if (free_mem <= (32U * per_hash_size) + (64U << 20))
+	{
+		fprintf(stderr, "Not enough free GPU memory!");
+		return;
+	}
+
+	const uint32_t max_batch_size = static_cast<uint32_t>((((free_mem - (64U << 20)) / per_hash_size) / 32) * 32);
+
+	GPUPtr scratchpads_gpu(max_batch_size * variant.scratchpad_size);
+	GPUPtr hashes_gpu(max_batch_size * HASH_SIZE);
+	GPUPtr vm_states_gpu(max_batch_size * VM_STATE_SIZE);
+	GPUPtr results_gpu((max_batch_size + 1) * sizeof(uint32_t));
+	if (!scratchpads_gpu || !hashes_gpu || !vm_states_gpu || !results_gpu) {
+		fprintf(stderr, "cudaMalloc failed!");
+		return;
+	}
+
+	// Start and end of the whole batch, followed by start and end of every execute_vm launch
+	GPUEvents events(2 + variant.program_count * 2);
+	if (!events.valid())
+	{
+		fprintf(stderr, "Failed to create CUDA event!");
+		return;
+	}
+
+	std::vector<uint32_t> batch_sizes;
+	for (uint32_t batch_size = 256; batch_size < max_batch_size; batch_size *= 2)
+		batch_sizes.push_back(batch_size);
+	batch_sizes.push_back(max_batch_size);
+
+	std::vector<double> hashrate(batch_sizes.size() * num_engines);
+	std::vector<double> ipc(batch_sizes.size() * num_engines);
+
+	std::vector<uint8_t> hashes, hashes_ref;
+
+	for (size_t b = 0; b < batch_sizes.size(); ++b)
+	{
+		const uint32_t batch_size = batch_sizes[b];
+
+		for (int k = 0; k < num_engines; ++k)
+		{
+			const Engine& e = engines[k];
+			printf("Benchmarking %s, batch size %u        \r", e.instance.name, batch_size);
+			fflush(stdout);
+
+			float best_ms = 0.0f;
+			float best_execute_ms = 0.0f;
+
+			// The first run is a warm-up
+			for (int run = 0; run < 3; ++run)
+			{
+				cudaEventRecord(events[0]);
+
+				blake2b_initial_hash<sizeof(blockTemplate)><<<batch_size / 32, 32>>>(hashes_gpu, blockTemplate_gpu, 0);
+				variant.fill_scratchpads[AES_ENGINE_TTABLE]<<<batch_size / 32, 32 * 4>>>(hashes_gpu, scratchpads_gpu, batch_size);
+
+				for (size_t i = 0; i < variant.program_count; ++i)
 				{
-					execute_vm<8><<<batch_size / 2, 2 * 8>>>(vm_states_gpu, rounding_gpu, scratchpads_gpu, dataset_gpu, batch_size, RANDOMX_PROGRAM_ITERATIONS >> bfactor, j == 0, j == n - 1);
+					variant.init_vm[e.w]<<<batch_size / 4, 4 * 8>>>(hashes_gpu, vm_states_gpu, nullptr, i > 0);
+
+					cudaEventRecord(events[2 + i * 2]);
+					e.instance.func<<<batch_size / e.hashes_per_block, e.block_size>>>(vm_states_gpu, scratchpads_gpu, dataset_gpu, batch_size, variant.program_iterations, true, true, nullptr);
+					cudaEventRecord(events[3 + i * 2]);
 				}
-				break;
-			}
 
-			if (i == RANDOMX_PROGRAM_COUNT - 1)
-			{
-				hashAes1Rx4<SCRATCHPAD_SIZE, 192, VM_STATE_SIZE><<<batch_size / 32, 32 * 4>>>(scratchpads_gpu, vm_states_gpu, batch_size);
-				cudaStatus = cudaGetLastError();
+				cudaMemsetAsync(results_gpu, 0, sizeof(uint32_t));
+				variant.finalize_hashes[AES_ENGINE_TTABLE]<<<batch_size / 32, 32 * 4>>>(scratchpads_gpu, vm_states_gpu, hashes_gpu, (uint32_t*)(void*)(results_gpu), uint64_t(-1), batch_size);
+
+				cudaEventRecord(events[1]);
+
+				cudaStatus = cudaEventSynchronize(events[1]);
 				if (cudaStatus != cudaSuccess) {
-					fprintf(stderr, "hashAes1Rx4 launch failed: %s\n", cudaGetErrorString(cudaStatus));
-					return false;
+					fprintf(stderr, "\n%s failed: %s\n", e.instance.name, cudaGetErrorString(cudaStatus));
+					return;
 				}
 
-				blake2b_hash_registers<REGISTERS_SIZE, VM_STATE_SIZE, 32><<<batch_size / 32, 32>>>(hashes_gpu, vm_states_gpu);
-				cudaStatus = cudaGetLastError();
-				if (cudaStatus != cudaSuccess) {
-					fprintf(stderr, "blake2b_hash_registers launch failed: %s\n", cudaGetErrorString(cudaStatus));
-					return false;
+				float ms = 0.0f;
+				float execute_ms = 0.0f;
+				bool ok = (cudaEventElapsedTime(&ms, events[0], events[1]) == cudaSuccess);
+				for (size_t i = 0; i < variant.program_count; ++i)
+				{
+					float dt = 0.0f;
+					ok = ok && (cudaEventElapsedTime(&dt, events[2 + i * 2], events[3 + i * 2]) == cudaSuccess);
+					execute_ms += dt;
+				}
+
+				if (!ok) {
+					fprintf(stderr, "\nFailed to get elapsed time for %s!\n", e.instance.name);
+					return;
+				}
+
+				if ((run > 0) && ((run == 1) || (ms < best_ms)))
+				{
+					best_ms = ms;
+					best_execute_ms = execute_ms;
 				}
 			}
-			else
+
+			hashes.resize(batch_size * HASH_SIZE);
+			cudaStatus = cudaMemcpy(hashes.data(), hashes_gpu, hashes.size(), cudaMemcpyDeviceToHost);
+			if (cudaStatus != cudaSuccess) {
+				fprintf(stderr, "\ncudaMemcpy failed!");
+				return;
+			}
+
+			if (k == 0)
+				hashes_ref = hashes;
+			else if (hashes != hashes_ref)
 			{
-				blake2b_hash_registers<REGISTERS_SIZE, VM_STATE_SIZE, 64><<<batch_size / 32, 32>>>(hashes_gpu, vm_states_gpu);
-				cudaStatus = cudaGetLastError();
-				if (cudaStatus != cudaSuccess) {
-					fprintf(stderr, "blake2b_hash_registers launch failed: %s\n", cudaGetErrorString(cudaStatus));
-					return false;
-				}
+				fprintf(stderr, "\n%s and %s computed different hashes!\n", engines[0].instance.name, e.instance.name);
+				return;
 			}
+
+			const double num_instructions = static_cast<double>(batch_size) * variant.program_count * variant.program_iterations * RANDOMX_PROGRAM_SIZE;
+			hashrate[b * num_engines + k] = batch_size * 1000.0 / best_ms;
+			ipc[b * num_engines + k] = num_instructions / (best_execute_ms * clock_rate_khz * num_sm);
 		}
+	}
 
-		cudaStatus = cudaDeviceSynchronize();
-		if (cudaStatus != cudaSuccess) {
-			fprintf(stderr, "cudaDeviceSynchronize returned error code %d!\n", cudaStatus);
-			return false;
+	for (int t = 0; t < 2; ++t)
+	{
+		if (t == 0)
+			printf("Hashrate (h/s) of execute_vm engines, up to %u hashes per batch                    \n\n", max_batch_size);
+		else
+			printf("\nIPC (RandomX instructions per SM clock cycle) in execute_vm kernels\n\n");
+
+		printf("Batch size");
+		for (const Engine& e : engines)
+			printf(" %29s", e.instance.name);
+		printf("\n");
+
+		for (size_t b = 0; b < batch_sizes.size(); ++b)
+		{
+			printf("%10u", batch_sizes[b]);
+			for (int k = 0; k < num_engines; ++k)
+				printf(t ? " %29.3f" : " %29.0f", (t ? ipc : hashrate)[b * num_engines + k]);
+			printf("\n");
 		}
+	}
+}
 
-		if (validate)
+typedef void (*measure_instruction_costs_func)(void*, uint32_t, uint32_t, bool, uint32_t, uint64_t*);
+
+static const measure_instruction_costs_func measure_instruction_costs_list[3] = { measure_instruction_costs<RandomX_Default, 2>, measure_instruction_costs<RandomX_Default, 4>, measure_instruction_costs<RandomX_Default, 8> };
+
+static const char* instruction_cost_class_names[INSTRUCTION_COST_CLASSES] = {
+	"add_rs", "add", "mul", "umul_hi", "imul_hi", "neg", "xor", "ror", "swap", "cbranch", "store", "fswap", "fadd", "fmul", "fsqrt", "fdiv", "cfround",
+	"read_l1", "read_l3"
+};
+
+// Runs measure_instruction_costs for every instruction class: latency with 1 instruction per group in a single block,
+// and throughput with full groups in as many blocks as the GPU can run at once
+// Costs of execute_vm opcodes are their clock cycles per group, costs of scratchpad reads are the difference between XOR with a memory and a register operand
+static bool measure_costs(int workers_per_hash, uint16_t (&costs)[INSTRUCTION_COST_CLASSES])
+{
+	const int w = (workers_per_hash == 2) ? 0 : ((workers_per_hash == 4) ? 1 : 2);
+	const measure_instruction_costs_func kernel = measure_instruction_costs_list[w];
+
+	int device_id, num_sm, blocks_per_sm;
+	if ((cudaGetDevice(&device_id) != cudaSuccess) ||
+		(cudaDeviceGetAttribute(&num_sm, cudaDevAttrMultiProcessorCount, device_id) != cudaSuccess) ||
+		(cudaOccupancyMaxActiveBlocksPerMultiprocessor(&blocks_per_sm, (const void*) kernel, 16, 0) != cudaSuccess))
+	{
+		fprintf(stderr, "Failed to get GPU attributes!");
+		return false;
+	}
+
+	size_t free_mem, total_mem;
+	if (cudaMemGetInfo(&free_mem, &total_mem) != cudaSuccess)
+	{
+		fprintf(stderr, "Failed to get free memory info!");
+		return false;
+	}
+
+	// Throughput is measured with as many scratchpads as fit in memory, up to full occupancy
+	uint32_t batch_size = static_cast<uint32_t>(num_sm * blocks_per_sm * 2);
+	if (free_mem <= (2U * RandomX_Default::SCRATCHPAD_SIZE) + (64U << 20))
+	{
+		fprintf(stderr, "Not enough free GPU memory!");
+		return false;
+	}
+	batch_size = std::min(batch_size, static_cast<uint32_t>(((free_mem - (64U << 20)) / RandomX_Default::SCRATCHPAD_SIZE) & ~size_t(1)));
+
+	GPUPtr scratchpads_gpu(batch_size * RandomX_Default::SCRATCHPAD_SIZE);
+	GPUPtr cycles_gpu(batch_size * sizeof(uint64_t));
+	if (!scratchpads_gpu || !cycles_gpu) {
+		fprintf(stderr, "cudaMalloc failed!");
+		return false;
+	}
+
+	constexpr uint32_t latency_passes = 64;
+	constexpr uint32_t throughput_passes = 16;
+
+	double latency[INSTRUCTION_COST_CLASSES];
+	double throughput[INSTRUCTION_COST_CLASSES];
+	std::vector<uint64_t> cycles(batch_size);
+
+	for (uint32_t cls = 0; cls < INSTRUCTION_COST_CLASSES; ++cls)
+	{
+		const bool is_fp = (cls >= 11) && (cls <= 15);
+		const uint32_t insts_per_group = is_fp ? (workers_per_hash / 2) : workers_per_hash;
+
+		for (int full_groups = 0; full_groups < 2; ++full_groups)
 		{
-			cudaMemcpy(hashes.data(), hashes_gpu, batch_size * 32, cudaMemcpyDeviceToHost);
+			const uint32_t num_hashes = full_groups ? batch_size : 2;
+			const uint32_t num_passes = full_groups ? throughput_passes : latency_passes;
 
-			cpu_limited = nonce_counter.load() < batch_size;
+			kernel<<<num_hashes / 2, 16>>>(scratchpads_gpu, batch_size, cls, full_groups != 0, num_passes, (uint64_t*)(void*)(cycles_gpu));
+
+			cudaError_t cudaStatus = cudaDeviceSynchronize();
+			if (cudaStatus != cudaSuccess) {
+				fprintf(stderr, "measure_instruction_costs failed for %s: %s\n", instruction_cost_class_names[cls], cudaGetErrorString(cudaStatus));
+				return false;
+			}
+
+			cudaStatus = cudaMemcpy(cycles.data(), cycles_gpu, num_hashes * sizeof(uint64_t), cudaMemcpyDeviceToHost);
+			if (cudaStatus != cudaSuccess) {
+				fprintf(stderr, "cudaMemcpy failed!");
+				return false;
+			}
+
+			double cycles_per_group = 0.0;
+			for (uint32_t i = 0; i < num_hashes; ++i)
+				cycles_per_group += cycles[i];
+			cycles_per_group /= static_cast<double>(num_hashes) * num_passes * INSTRUCTION_COST_GROUPS;
+
+			if (full_groups)
+				throughput[cls] = insts_per_group * (static_cast<double>(num_hashes) / num_sm) / cycles_per_group;
+			else
+				latency[cls] = cycles_per_group;
+		}
+	}
+
+	for (uint32_t cls = 0; cls < INSTRUCTION_COST_CLASSES; ++cls)
+	{
+		double cost = latency[cls];
+		if ((cls == INSTRUCTION_COST_READ_L1_L2) || (cls == INSTRUCTION_COST_READ_L3))
+			cost -= latency[6];
+
+		costs[cls] = static_cast<uint16_t>(std::min(std::max(cost + 0.5, 0.0), 65535.0));
+	}
+
+	printf("Instruction classes in execute_vm with %d workers per hash, %u hashes for throughput\n\n", workers_per_hash, batch_size);
+	printf("Class      Latency (cycles per group)  Throughput (per SM cycle)   Cost\n");
+	for (uint32_t cls = 0; cls < INSTRUCTION_COST_CLASSES; ++cls)
+		printf("%-10s %26.1f %26.3f %6u\n", instruction_cost_class_names[cls], latency[cls], throughput[cls], costs[cls]);
+	printf("\n");
+
+	return true;
+}
+
+// Instruction costs depend on the GPU model, so they're cached in instruction_costs_<GPU name>_<workers per hash>.txt in the current directory
+// The cached table is measured again if recalibrate is true or if it can't be read, then it's uploaded to the table for workers_per_hash in instruction_costs
+bool load_instruction_costs(int workers_per_hash, bool recalibrate)
+{
+	int device_id;
+	cudaDeviceProp props;
+	if ((cudaGetDevice(&device_id) != cudaSuccess) || (cudaGetDeviceProperties(&props, device_id) != cudaSuccess))
+	{
+		fprintf(stderr, "Failed to get GPU attributes!");
+		return false;
+	}
+
+	char file_name[512];
+	{
+		char gpu_name[sizeof(props.name)];
+		for (size_t i = 0; i < sizeof(gpu_name); ++i)
+		{
+			const char c = (i + 1 < sizeof(gpu_name)) ? props.name[i] : '\0';
+			gpu_name[i] = (c && !isalnum(static_cast<unsigned char>(c))) ? '_' : c;
+			if (!c)
+				break;
+		}
+		snprintf(file_name, sizeof(file_name), "instruction_costs_%s_%d.txt", gpu_name, workers_per_hash);
+	}
+
+	uint16_t costs[INSTRUCTION_COST_CLASSES];
+
+	bool loaded = false;
+	if (!recalibrate)
+	{
+		FILE* f = fopen(file_name, "r");
+		if (f)
+		{
+			loaded = true;
+			for (uint32_t cls = 0; loaded && (cls < INSTRUCTION_COST_CLASSES); ++cls)
+			{
+				char name[32];
+				unsigned int cost;
+				loaded = (fscanf(f, "%31s %u", name, &cost) == 2) && (strcmp(name, instruction_cost_class_names[cls]) == 0) && (cost <= 65535);
+				costs[cls] = static_cast<uint16_t>(cost);
+			}
+			fclose(f);
+
+			if (loaded)
+				printf("Using instruction costs from %s\n", file_name);
+			else
+				printf("%s is not valid, measuring instruction costs again\n", file_name);
+		}
+	}
 
-			for (auto& thread : threads)
-				thread.join();
+	if (!loaded)
+	{
+		printf("Measuring instruction costs on %s\n", props.name);
+		if (!measure_costs(workers_per_hash, costs))
+			return false;
 
-			if (memcmp(hashes.data(), hashes_check.data(), batch_size * 32) != 0)
-			{
-				fprintf(stderr, "\nCPU validation error, ");
-				for (uint32_t i = 0; i < batch_size * 32; i += 32)
-				{
-					if (memcmp(hashes.data() + i, hashes_check.data() + i, 32))
-					{
-						fprintf(stderr, "failing nonce = %u\n", nonce + i / 32);
-						break;
-					}
-				}
-				return false;
-			}
+		FILE* f = fopen(file_name, "w");
+		if (f)
+		{
+			for (uint32_t cls = 0; cls < INSTRUCTION_COST_CLASSES; ++cls)
+				fprintf(f, "%s %u\n", instruction_cost_class_names[cls], costs[cls]);
+			fclose(f);
+			printf("Instruction costs saved to %s\n", file_name);
+		}
+		else
+		{
+			fprintf(stderr, "Failed to save instruction costs to %s\n", file_name);
 		}
 	}
 
+	cudaError_t cudaStatus = cudaMemcpyToSymbol(instruction_costs, costs, sizeof(costs), instruction_cost_table(workers_per_hash) * sizeof(costs));
+	if (cudaStatus != cudaSuccess) {
+		fprintf(stderr, "Failed to upload instruction costs: %s\n", cudaGetErrorString(cudaStatus));
+		return false;
+	}
+
 	return true;
 }
 
 void tests()
 {
+	// Reference results come from the RandomX library, so only the configuration.h variant is tested
+	constexpr size_t SCRATCHPAD_SIZE = RandomX_Default::SCRATCHPAD_SIZE;
 	constexpr size_t NUM_SCRATCHPADS_TEST = 128;
 	constexpr size_t NUM_SCRATCHPADS_BENCH = 2048;
 	constexpr size_t BLAKE2B_STEP = 1 << 28;
 
+	// Kernels which have a version for every AES engine
+	const VariantKernels& default_kernels = *find_variant("default");
+
 	std::vector<uint8_t> scratchpads(SCRATCHPAD_SIZE * NUM_SCRATCHPADS_TEST * 2);
 	std::vector<uint8_t> programs(ENTROPY_SIZE * NUM_SCRATCHPADS_TEST * 2);
 
@@ -682,6 +2659,91 @@ void tests()
 		printf("hashAes1Rx4 test passed\n");
 	}
 
+	// Other AES engines are tested against the RandomX library with the current states, they write scratchpads after the ones tested above
+	{
+		uint8_t* engine_scratchpads_gpu = (uint8_t*)(void*)(scratchpads_gpu) + SCRATCHPAD_SIZE * NUM_SCRATCHPADS_TEST;
+		uint8_t* engine_hashes_gpu = (uint8_t*)(void*)(states_gpu) + sizeof(hash);
+
+		// Reference states, scratchpads and hashes
+		uint64_t states_ref[NUM_SCRATCHPADS_TEST * 8];
+		uint8_t hashes_ref[NUM_SCRATCHPADS_TEST * 64];
+		memcpy(states_ref, hash, sizeof(hash));
+		for (int i = 0; i < NUM_SCRATCHPADS_TEST; ++i)
+		{
+			uint8_t* p = scratchpads.data() + SCRATCHPAD_SIZE * (NUM_SCRATCHPADS_TEST + i);
+			fillAes1Rx4<false>(states_ref + i * 8, SCRATCHPAD_SIZE, p);
+			hashAes1Rx4<false>(p, SCRATCHPAD_SIZE, hashes_ref + i * 64);
+		}
+
+		for (uint32_t e = AES_ENGINE_TTABLE + 1; e < AES_ENGINE_COUNT; ++e)
+		{
+			cudaStatus = cudaMemcpy(states_gpu, hash, sizeof(hash), cudaMemcpyHostToDevice);
+			if (cudaStatus != cudaSuccess) {
+				fprintf(stderr, "cudaMemcpy failed!");
+				return;
+			}
+
+			default_kernels.fill_scratchpads[e]<<<NUM_SCRATCHPADS_TEST / 32, 32 * 4>>>(states_gpu, engine_scratchpads_gpu, NUM_SCRATCHPADS_TEST);
+			default_kernels.hash_scratchpads[e]<<<NUM_SCRATCHPADS_TEST / 32, 32 * 4>>>(engine_scratchpads_gpu, engine_hashes_gpu, NUM_SCRATCHPADS_TEST);
+
+			cudaStatus = cudaDeviceSynchronize();
+			if (cudaStatus != cudaSuccess) {
+				fprintf(stderr, "cudaDeviceSynchronize returned error code %d after launching %s AES engine!\n", cudaStatus, aes_engine_names[e]);
+				return;
+			}
+
+			uint64_t states[NUM_SCRATCHPADS_TEST * 8];
+			uint8_t hashes[NUM_SCRATCHPADS_TEST * 64];
+
+			cudaStatus = cudaMemcpy(states, states_gpu, sizeof(states), cudaMemcpyDeviceToHost);
+			if (cudaStatus != cudaSuccess) {
+				fprintf(stderr, "cudaMemcpy failed!");
+				return;
+			}
+
+			cudaStatus = cudaMemcpy(hashes, engine_hashes_gpu, sizeof(hashes), cudaMemcpyDeviceToHost);
+			if (cudaStatus != cudaSuccess) {
+				fprintf(stderr, "cudaMemcpy failed!");
+				return;
+			}
+
+			// The first half of scratchpads isn't used by later tests
+			cudaStatus = cudaMemcpy(scratchpads.data(), engine_scratchpads_gpu, SCRATCHPAD_SIZE * NUM_SCRATCHPADS_TEST, cudaMemcpyDeviceToHost);
+			if (cudaStatus != cudaSuccess) {
+				fprintf(stderr, "cudaMemcpy failed!");
+				return;
+			}
+
+			if (memcmp(states, states_ref, sizeof(states)) != 0)
+			{
+				fprintf(stderr, "fillAes1Rx4 test (%s, hash) failed!", aes_engine_names[e]);
+				return;
+			}
+
+			for (int i = 0; i < NUM_SCRATCHPADS_TEST; ++i)
+			{
+				const uint8_t* p1 = scratchpads.data() + i * 64;
+				const uint8_t* p2 = scratchpads.data() + SCRATCHPAD_SIZE * (NUM_SCRATCHPADS_TEST + i);
+				for (int j = 0; j < SCRATCHPAD_SIZE; j += 64)
+				{
+					if (memcmp(p1 + j * NUM_SCRATCHPADS_TEST, p2 + j, 64) != 0)
+					{
+						fprintf(stderr, "fillAes1Rx4 test (%s, scratchpad) failed!", aes_engine_names[e]);
+						return;
+					}
+				}
+			}
+
+			if (memcmp(hashes, hashes_ref, sizeof(hashes)) != 0)
+			{
+				fprintf(stderr, "hashAes1Rx4 test (%s) failed!", aes_engine_names[e]);
+				return;
+			}
+
+			printf("fillAes1Rx4 and hashAes1Rx4 (%s) tests passed\n", aes_engine_names[e]);
+		}
+	}
+
 	{
 		blake2b_hash_registers<REGISTERS_SIZE, REGISTERS_SIZE, 32><<<NUM_SCRATCHPADS_TEST / 32, 32>>>(hash_gpu, registers_gpu);
 		cudaStatus = cudaGetLastError();
@@ -738,67 +2800,393 @@ void tests()
 		printf("blake2b_hash_registers (64 byte hash) test passed\n");
 	}
 
-	time_point<steady_clock> start_time = high_resolution_clock::now();
+	{
+		GPUPtr vm_states_gpu(VM_STATE_SIZE * NUM_SCRATCHPADS_TEST * 2);
+		if (!vm_states_gpu) {
+			fprintf(stderr, "cudaMalloc failed!");
+			return;
+		}
+
+		GPUPtr num_vm_cycles_gpu(sizeof(uint64_t));
+		if (!num_vm_cycles_gpu) {
+			fprintf(stderr, "cudaMalloc failed!");
+			return;
+		}
+
+		// Both halves start with the same register files
+		std::vector<uint8_t> vm_states(VM_STATE_SIZE * NUM_SCRATCHPADS_TEST * 2);
+		for (uint32_t i = 0; i < NUM_SCRATCHPADS_TEST * 2; ++i)
+			memcpy(vm_states.data() + i * VM_STATE_SIZE, registers2 + (i % NUM_SCRATCHPADS_TEST) * REGISTERS_SIZE, REGISTERS_SIZE);
+
+		cudaStatus = cudaMemcpy(vm_states_gpu, vm_states.data(), vm_states.size(), cudaMemcpyHostToDevice);
+		if (cudaStatus != cudaSuccess) {
+			fprintf(stderr, "cudaMemcpy failed!");
+			return;
+		}
+
+		uint8_t* vm_states_fused_gpu = ((uint8_t*)(void*)(vm_states_gpu)) + VM_STATE_SIZE * NUM_SCRATCHPADS_TEST;
+
+		blake2b_hash_registers<REGISTERS_SIZE, VM_STATE_SIZE, 64><<<NUM_SCRATCHPADS_TEST / 32, 32>>>(hash_gpu, vm_states_gpu);
+		fillAes1Rx4<ENTROPY_SIZE, false><<<NUM_SCRATCHPADS_TEST / 32, 32 * 4>>>(hash_gpu, programs_gpu, NUM_SCRATCHPADS_TEST);
+		init_vm<RandomX_Default, 8><<<NUM_SCRATCHPADS_TEST / 4, 4 * 8>>>(programs_gpu, vm_states_gpu, num_vm_cycles_gpu);
+		init_vm_fused<RandomX_Default, 8><<<NUM_SCRATCHPADS_TEST / 4, 4 * 8>>>(hash_gpu, vm_states_fused_gpu, num_vm_cycles_gpu, true);
+
+		cudaStatus = cudaDeviceSynchronize();
+		if (cudaStatus != cudaSuccess) {
+			fprintf(stderr, "cudaDeviceSynchronize returned error code %d after launching init_vm_fused!\n", cudaStatus);
+			return;
+		}
+
+		cudaStatus = cudaMemcpy(vm_states.data(), vm_states_gpu, vm_states.size(), cudaMemcpyDeviceToHost);
+		if (cudaStatus != cudaSuccess) {
+			fprintf(stderr, "cudaMemcpy failed!");
+			return;
+		}
+
+		for (uint32_t i = 0; i < NUM_SCRATCHPADS_TEST; ++i)
+		{
+			const uint8_t* p1 = vm_states.data() + i * VM_STATE_SIZE;
+			const uint8_t* p2 = vm_states.data() + (NUM_SCRATCHPADS_TEST + i) * VM_STATE_SIZE;
+
+			// Registers (with the program header), immediate values and the program are stored contiguously
+			const uint32_t num_imm = *(const uint32_t*)(p1 + 140);
+			const uint32_t program_length = *(const uint32_t*)(p1 + 160);
+			if (memcmp(p1, p2, REGISTERS_SIZE + (num_imm + program_length) * sizeof(uint32_t)))
+			{
+				fprintf(stderr, "init_vm_fused test failed!");
+				return;
+			}
+		}
+
+		printf("init_vm_fused test passed\n");
+
+		GPUPtr hash_list_gpu(hash_list_size(NUM_SCRATCHPADS_TEST) * sizeof(uint32_t));
+		GPUPtr group_stats_gpu(3 * sizeof(uint64_t));
+		if (!hash_list_gpu || !group_stats_gpu) {
+			fprintf(stderr, "cudaMalloc failed!");
+			return;
+		}
+
+		cudaStatus = cudaMemset(group_stats_gpu, 0, 3 * sizeof(uint64_t));
+		if (cudaStatus != cudaSuccess) {
+			fprintf(stderr, "cudaMemset failed!");
+			return;
+		}
+
+		group_programs<<<1, 1024>>>(vm_states_gpu, NUM_SCRATCHPADS_TEST, nullptr, (uint32_t*)(void*)(hash_list_gpu), 4, (uint64_t*)(void*)(group_stats_gpu));
+
+		cudaStatus = cudaDeviceSynchronize();
+		if (cudaStatus != cudaSuccess) {
+			fprintf(stderr, "cudaDeviceSynchronize returned error code %d after launching group_programs!\n", cudaStatus);
+			return;
+		}
+
+		std::vector<uint32_t> hash_list(hash_list_size(NUM_SCRATCHPADS_TEST));
+		uint64_t group_stats[3];
+		if ((cudaMemcpy(hash_list.data(), hash_list_gpu, hash_list.size() * sizeof(uint32_t), cudaMemcpyDeviceToHost) != cudaSuccess) ||
+			(cudaMemcpy(group_stats, group_stats_gpu, sizeof(group_stats), cudaMemcpyDeviceToHost) != cudaSuccess)) {
+			fprintf(stderr, "cudaMemcpy failed!");
+			return;
+		}
+
+		// The list must have every hash exactly once, ordered by the number of execute_vm loop steps and then by the number of branches
+		auto group_key = [&vm_states](uint32_t i) {
+			const uint32_t* p = (const uint32_t*)(vm_states.data() + i * VM_STATE_SIZE + 160);
+			return std::min<uint32_t>(p[1], RANDOMX_PROGRAM_SIZE) * 32 + std::min<uint32_t>(p[2], 31);
+		};
+
+		std::vector<uint32_t> sorted_hashes(hash_list.begin() + 1, hash_list.end());
+		std::sort(sorted_hashes.begin(), sorted_hashes.end());
+
+		bool group_ok = (hash_list[0] == NUM_SCRATCHPADS_TEST / 2) && (group_stats[2] <= group_stats[1]) && (group_stats[0] <= group_stats[2]);
+		for (uint32_t i = 0; i < NUM_SCRATCHPADS_TEST; ++i)
+		{
+			if ((sorted_hashes[i] != i) || ((i > 0) && (group_key(hash_list[i]) > group_key(hash_list[i + 1]))))
+				group_ok = false;
+		}
+
+		if (!group_ok)
+		{
+			fprintf(stderr, "group_programs test failed!");
+			return;
+		}
+
+		printf("group_programs test passed, idle lanes %.1f%% -> %.1f%%\n", 100.0 - group_stats[0] * 100.0 / group_stats[1], 100.0 - group_stats[0] * 100.0 / group_stats[2]);
+	}
 
-	for (int i = 0; i < 100; ++i)
 	{
-		printf("Benchmarking fillAes1Rx4 %d/100", i + 1);
-		if (i > 0)
+		GPUPtr vm_states_gpu(VM_STATE_SIZE * NUM_SCRATCHPADS_TEST);
+		if (!vm_states_gpu) {
+			fprintf(stderr, "cudaMalloc failed!");
+			return;
+		}
+
+		GPUPtr results_gpu((NUM_SCRATCHPADS_TEST + 1) * sizeof(uint32_t));
+		if (!results_gpu) {
+			fprintf(stderr, "cudaMalloc failed!");
+			return;
+		}
+
+		// The last 64 bytes of registers2 already have AES hashes of the scratchpads, finalize_hashes must compute them again
+		std::vector<uint8_t> vm_states(VM_STATE_SIZE * NUM_SCRATCHPADS_TEST);
+		for (uint32_t i = 0; i < NUM_SCRATCHPADS_TEST; ++i)
+			memcpy(vm_states.data() + i * VM_STATE_SIZE, registers2 + i * REGISTERS_SIZE, 192);
+
+		cudaStatus = cudaMemcpy(vm_states_gpu, vm_states.data(), vm_states.size(), cudaMemcpyHostToDevice);
+		if (cudaStatus != cudaSuccess) {
+			fprintf(stderr, "cudaMemcpy failed!");
+			return;
+		}
+
+		for (uint32_t i = 0; i < NUM_SCRATCHPADS_TEST; ++i)
 		{
-			const double dt = duration_cast<nanoseconds>(high_resolution_clock::now() - start_time).count() / 1e9;
-			printf(", %.0f scratchpads/s", (i * NUM_SCRATCHPADS_BENCH * 10) / dt);
+			blake2b(hash2 + i * 4, 32, registers2 + i * REGISTERS_SIZE, REGISTERS_SIZE, nullptr, 0);
 		}
-		printf("\r");
 
-		for (int j = 0; j < 10; ++j)
+		for (uint32_t e = 0; e < AES_ENGINE_COUNT; ++e)
 		{
-			fillAes1Rx4<SCRATCHPAD_SIZE, true><<<NUM_SCRATCHPADS_BENCH / 32, 32 * 4>>>(states_gpu, scratchpads_gpu, NUM_SCRATCHPADS_BENCH);
+			cudaStatus = cudaMemset(results_gpu, 0, sizeof(uint32_t));
+			if (cudaStatus != cudaSuccess) {
+				fprintf(stderr, "cudaMemset failed!");
+				return;
+			}
+
+			default_kernels.finalize_hashes[e]<<<NUM_SCRATCHPADS_TEST / 32, 32 * 4>>>(scratchpads_gpu, vm_states_gpu, hash_gpu, (uint32_t*)(void*)(results_gpu), uint64_t(-1), NUM_SCRATCHPADS_TEST);
+
+			cudaStatus = cudaDeviceSynchronize();
+			if (cudaStatus != cudaSuccess) {
+				fprintf(stderr, "cudaDeviceSynchronize returned error code %d after launching finalize_hashes!\n", cudaStatus);
+				return;
+			}
 
-			cudaStatus = cudaGetLastError();
+			uint32_t num_results = 0;
+			cudaStatus = cudaMemcpy(&num_results, results_gpu, sizeof(uint32_t), cudaMemcpyDeviceToHost);
 			if (cudaStatus != cudaSuccess) {
-				fprintf(stderr, "fillAes1Rx4 launch failed: %s\n", cudaGetErrorString(cudaStatus));
+				fprintf(stderr, "cudaMemcpy failed!");
 				return;
 			}
+
+			cudaStatus = cudaMemcpy(&hash, hash_gpu, sizeof(hash), cudaMemcpyDeviceToHost);
+			if (cudaStatus != cudaSuccess) {
+				fprintf(stderr, "cudaMemcpy failed!");
+				return;
+			}
+
+			if ((num_results != NUM_SCRATCHPADS_TEST) || (memcmp(hash, hash2, NUM_SCRATCHPADS_TEST * 32) != 0))
+			{
+				fprintf(stderr, "finalize_hashes test (%s) failed!", aes_engine_names[e]);
+				return;
+			}
+		}
+
+		printf("finalize_hashes test passed\n");
+	}
+
+	{
+		const uint64_t edge[] = {
+			0, 1ULL << 63, 1, (1ULL << 63) | 1, 0x000FFFFFFFFFFFFFULL, 0x0010000000000000ULL, 0x7FEFFFFFFFFFFFFFULL, 0xFFEFFFFFFFFFFFFFULL,
+			0x7FF0000000000000ULL, 0xFFF0000000000000ULL, 0x3FF0000000000000ULL, 0xBFF0000000000000ULL, 0x3FF0000000000001ULL, 0x3FEFFFFFFFFFFFFFULL,
+			0x4000000000000000ULL, 0x41DFFFFFFFC00000ULL, 0x3CA0000000000000ULL, 0x7FE0000000000000ULL, 0x0008000000000000ULL, 0x0000000100000000ULL,
+		};
+		constexpr uint32_t NUM_EDGE = sizeof(edge) / sizeof(edge[0]);
+		constexpr uint32_t NUM_PAIRS = NUM_EDGE * NUM_EDGE + 16384;
+
+		std::vector<uint64_t> inputs(NUM_PAIRS * 2);
+		for (uint32_t i = 0; i < NUM_EDGE * NUM_EDGE; ++i)
+		{
+			inputs[i * 2] = edge[i / NUM_EDGE];
+			inputs[i * 2 + 1] = edge[i % NUM_EDGE];
+		}
+
+		// Random pairs with exponents in the same ranges as RandomX F/E registers, plus short mantissas to hit exact results and ties
+		std::mt19937_64 rng(12345);
+		for (uint32_t i = NUM_EDGE * NUM_EDGE; i < NUM_PAIRS; ++i)
+		{
+			uint64_t a = rng();
+			uint64_t b = rng();
+			if (i & 1)
+			{
+				a = (a & 0x800FFFFFFFFFFFFFULL) | ((uint64_t)(992 + rng() % 64) << 52);
+				b = (b & 0x800FFFFFFFFFFFFFULL) | ((uint64_t)(992 + rng() % 64) << 52);
+			}
+			if (i & 2)
+				b &= ~0xFFFULL;
+			inputs[i * 2] = a;
+			inputs[i * 2 + 1] = b;
+		}
+
+		GPUPtr inputs_gpu(inputs.size() * sizeof(uint64_t));
+		if (!inputs_gpu) {
+			fprintf(stderr, "cudaMalloc failed!");
+			return;
+		}
+
+		GPUPtr results_gpu(NUM_PAIRS * 20 * sizeof(uint64_t));
+		if (!results_gpu) {
+			fprintf(stderr, "cudaMalloc failed!");
+			return;
+		}
+
+		cudaStatus = cudaMemcpy(inputs_gpu, inputs.data(), inputs.size() * sizeof(uint64_t), cudaMemcpyHostToDevice);
+		if (cudaStatus != cudaSuccess) {
+			fprintf(stderr, "cudaMemcpy failed!");
+			return;
 		}
 
+		soft_fp64_test<<<(NUM_PAIRS + 255) / 256, 256>>>((const uint64_t*)(void*)(inputs_gpu), (uint64_t*)(void*)(results_gpu), NUM_PAIRS);
+
 		cudaStatus = cudaDeviceSynchronize();
 		if (cudaStatus != cudaSuccess) {
-			fprintf(stderr, "cudaDeviceSynchronize returned error code %d after launching fillAes1Rx4!\n", cudaStatus);
+			fprintf(stderr, "cudaDeviceSynchronize returned error code %d after launching soft_fp64_test!\n", cudaStatus);
+			return;
+		}
+
+		std::vector<uint64_t> results(NUM_PAIRS * 20);
+		cudaStatus = cudaMemcpy(results.data(), results_gpu, results.size() * sizeof(uint64_t), cudaMemcpyDeviceToHost);
+		if (cudaStatus != cudaSuccess) {
+			fprintf(stderr, "cudaMemcpy failed!");
 			return;
 		}
+
+		// RandomX rounding modes: 0 = nearest, 1 = down, 2 = up, 3 = towards zero
+		const int fe_modes[4] = { FE_TONEAREST, FE_DOWNWARD, FE_UPWARD, FE_TOWARDZERO };
+		const int prev_mode = fegetround();
+
+		auto to_bits = [](double x) {
+			uint64_t k;
+			memcpy(&k, &x, sizeof(k));
+			return std::isnan(x) ? SOFT_FP64_NAN : k;
+		};
+
+		bool ok = true;
+		for (uint32_t i = 0; (i < NUM_PAIRS) && ok; ++i)
+		{
+			volatile double a, b;
+			memcpy((void*)&a, &inputs[i * 2], sizeof(double));
+			memcpy((void*)&b, &inputs[i * 2 + 1], sizeof(double));
+
+			for (uint32_t mode = 0; mode < 4; ++mode)
+			{
+				fesetround(fe_modes[mode]);
+
+				const uint64_t expected[5] = {
+					to_bits(a + b),
+					to_bits(a * b),
+					to_bits(a / b),
+					to_bits(std::sqrt(a)),
+					to_bits(static_cast<double>(static_cast<int32_t>(inputs[i * 2 + 1]))),
+				};
+
+				const uint64_t* r = results.data() + i * 20 + mode * 5;
+				for (uint32_t k = 0; k < 5; ++k)
+				{
+					if (r[k] != expected[k])
+					{
+						fprintf(stderr, "soft_fp64 test failed: op %u, mode %u, inputs %016llx %016llx, result %016llx, expected %016llx\n",
+							k, mode, (unsigned long long)inputs[i * 2], (unsigned long long)inputs[i * 2 + 1], (unsigned long long)r[k], (unsigned long long)expected[k]);
+						ok = false;
+						break;
+					}
+				}
+				if (!ok)
+					break;
+			}
+		}
+
+		fesetround(prev_mode);
+
+		if (!ok)
+			return;
+
+		printf("soft_fp64 test passed\n");
 	}
-	printf("\n");
 
-	start_time = high_resolution_clock::now();
+	// Every AES engine is benchmarked, the fastest one on this GPU is what RandomX_CUDA.exe --mine picks by default
+	double fill_speed[AES_ENGINE_COUNT] = {};
+	double hash_speed[AES_ENGINE_COUNT] = {};
 
-	for (int i = 0; i < 100; ++i)
+	time_point<steady_clock> start_time;
+
+	for (uint32_t e = 0; e < AES_ENGINE_COUNT; ++e)
 	{
-		printf("Benchmarking hashAes1Rx4 %d/100", i + 1);
-		if (i > 0)
+		start_time = steady_clock::now();
+
+		for (int i = 0; i < 100; ++i)
 		{
-			const double dt = duration_cast<nanoseconds>(high_resolution_clock::now() - start_time).count() / 1e9;
-			printf(", %.0f scratchpads/s", (i * NUM_SCRATCHPADS_BENCH * 10) / dt);
+			printf("Benchmarking fillAes1Rx4 (%s) %d/100", aes_engine_names[e], i + 1);
+			if (i > 0)
+			{
+				const double dt = duration_cast<nanoseconds>(steady_clock::now() - start_time).count() / 1e9;
+				fill_speed[e] = (i * NUM_SCRATCHPADS_BENCH * 10) / dt;
+				printf(", %.0f scratchpads/s", fill_speed[e]);
+			}
+			printf("\r");
+
+			for (int j = 0; j < 10; ++j)
+			{
+				default_kernels.fill_scratchpads[e]<<<NUM_SCRATCHPADS_BENCH / 32, 32 * 4>>>(states_gpu, scratchpads_gpu, NUM_SCRATCHPADS_BENCH);
+
+				cudaStatus = cudaGetLastError();
+				if (cudaStatus != cudaSuccess) {
+					fprintf(stderr, "fillAes1Rx4 launch failed: %s\n", cudaGetErrorString(cudaStatus));
+					return;
+				}
+			}
+
+			cudaStatus = cudaDeviceSynchronize();
+			if (cudaStatus != cudaSuccess) {
+				fprintf(stderr, "cudaDeviceSynchronize returned error code %d after launching fillAes1Rx4!\n", cudaStatus);
+				return;
+			}
 		}
-		printf("\r");
+		printf("\n");
+	}
 
-		for (int j = 0; j < 10; ++j)
+	for (uint32_t e = 0; e < AES_ENGINE_COUNT; ++e)
+	{
+		start_time = steady_clock::now();
+
+		for (int i = 0; i < 100; ++i)
 		{
-			hashAes1Rx4<SCRATCHPAD_SIZE, 0, 64><<<NUM_SCRATCHPADS_BENCH / 32, 32 * 4>>>(scratchpads_gpu, states_gpu, NUM_SCRATCHPADS_BENCH);
+			printf("Benchmarking hashAes1Rx4 (%s) %d/100", aes_engine_names[e], i + 1);
+			if (i > 0)
+			{
+				const double dt = duration_cast<nanoseconds>(steady_clock::now() - start_time).count() / 1e9;
+				hash_speed[e] = (i * NUM_SCRATCHPADS_BENCH * 10) / dt;
+				printf(", %.0f scratchpads/s", hash_speed[e]);
+			}
+			printf("\r");
 
-			cudaStatus = cudaGetLastError();
+			for (int j = 0; j < 10; ++j)
+			{
+				default_kernels.hash_scratchpads[e]<<<NUM_SCRATCHPADS_BENCH / 32, 32 * 4>>>(scratchpads_gpu, states_gpu, NUM_SCRATCHPADS_BENCH);
+
+				cudaStatus = cudaGetLastError();
+				if (cudaStatus != cudaSuccess) {
+					fprintf(stderr, "hashAes1Rx4 launch failed: %s\n", cudaGetErrorString(cudaStatus));
+					return;
+				}
+			}
+
+			cudaStatus = cudaDeviceSynchronize();
 			if (cudaStatus != cudaSuccess) {
-				fprintf(stderr, "hashAes1Rx4 launch failed: %s\n", cudaGetErrorString(cudaStatus));
+				fprintf(stderr, "cudaDeviceSynchronize returned error code %d after launching hashAes1Rx4!\n", cudaStatus);
 				return;
 			}
 		}
+		printf("\n");
+	}
 
-		cudaStatus = cudaDeviceSynchronize();
-		if (cudaStatus != cudaSuccess) {
-			fprintf(stderr, "cudaDeviceSynchronize returned error code %d after launching hashAes1Rx4!\n", cudaStatus);
-			return;
+	// Mining runs both once per hash, so the engine with the shortest total time is the fastest
+	{
+		uint32_t best = 0;
+		for (uint32_t e = 1; e < AES_ENGINE_COUNT; ++e)
+		{
+			if (1.0 / fill_speed[e] + 1.0 / hash_speed[e] < 1.0 / fill_speed[best] + 1.0 / hash_speed[best])
+				best = e;
 		}
+		printf("Fastest AES engine: %s (--aes-engine %u)\n", aes_engine_names[best], best);
 	}
-	printf("\n");
 
 	cudaStatus = cudaMemcpy(block_template_gpu, blockTemplate, sizeof(blockTemplate), cudaMemcpyHostToDevice);
 	if (cudaStatus != cudaSuccess) {
@@ -806,14 +3194,14 @@ void tests()
 		return;
 	}
 
-	start_time = high_resolution_clock::now();
+	start_time = steady_clock::now();
 
 	for (uint64_t start_nonce = 0; start_nonce < BLAKE2B_STEP * 100; start_nonce += BLAKE2B_STEP)
 	{
 		printf("Benchmarking blake2b_512_single_block %llu/100", (start_nonce + BLAKE2B_STEP) / BLAKE2B_STEP);
 		if (start_nonce > 0)
 		{
-			const double dt = duration_cast<nanoseconds>(high_resolution_clock::now() - start_time).count() / 1e9;
+			const double dt = duration_cast<nanoseconds>(steady_clock::now() - start_time).count() / 1e9;
 			printf(", %.2f MH/s", start_nonce / dt / 1e6);
 		}
 		printf("\r");
@@ -855,14 +3243,14 @@ void tests()
 	}
 	printf("\n");
 
-	start_time = high_resolution_clock::now();
+	start_time = steady_clock::now();
 
 	for (uint64_t start_nonce = 0; start_nonce < BLAKE2B_STEP * 100; start_nonce += BLAKE2B_STEP)
 	{
 		printf("Benchmarking blake2b_512_double_block %llu/100", (start_nonce + BLAKE2B_STEP) / BLAKE2B_STEP);
 		if (start_nonce > 0)
 		{
-			const double dt = duration_cast<nanoseconds>(high_resolution_clock::now() - start_time).count() / 1e9;
+			const double dt = duration_cast<nanoseconds>(steady_clock::now() - start_time).count() / 1e9;
 			printf(", %.2f MH/s", start_nonce / dt / 1e6);
 		}
 		printf("\r");
@@ -20,18 +20,145 @@ You should have received a copy of the GNU General Public License
 along with RandomX CUDA.  If not, see<http://www.gnu.org/licenses/>.
 */
 
-constexpr size_t DATASET_SIZE = 1U << 31;
-constexpr size_t SCRATCHPAD_SIZE = 1U << 21;
 constexpr size_t HASH_SIZE = 64;
-constexpr size_t ENTROPY_SIZE = 128 + 2048;
+constexpr size_t ENTROPY_SIZE = 128 + RANDOMX_PROGRAM_SIZE * sizeof(uint64_t);
 constexpr size_t VM_STATE_SIZE = 2048;
 constexpr size_t REGISTERS_SIZE = 256;
 constexpr size_t IMM_BUF_SIZE = 768;
 
-constexpr int ScratchpadL3Mask64 = (1 << 21) - 64;
+// Padding after every VM state in shared memory (bytes, a multiple of 16), it can be set at build time with -DVM_STATE_SHARED_PADDING=N
+// 0: VM states are packed 2 KB apart, so the same register, immediate or instruction offset of all hashes in a warp is in the same bank
+// N: every next hash's VM state starts N / 4 banks further, execute_vm_resident pads its immediates and programs the same way
+// N is experimental: it costs shared memory (occupancy), so use RandomX_CUDA.exe --bank-conflicts to pick a padding and --mine to check the hashrate
+#ifndef VM_STATE_SHARED_PADDING
+#define VM_STATE_SHARED_PADDING 0
+#endif
+
+// Padding after every execution plan in init_vm shared memory (bytes, a multiple of 4), it can be set at build time with -DEXECUTION_PLAN_PADDING=N
+// 0: execution plans are packed RANDOMX_PROGRAM_SIZE * WORKERS_PER_HASH bytes apart, so the same slot of all hashes in a warp is in the same bank
+// N: every next hash's execution plan starts N / 4 banks further (experimental, like VM_STATE_SHARED_PADDING)
+#ifndef EXECUTION_PLAN_PADDING
+#define EXECUTION_PLAN_PADDING 0
+#endif
+
+// Iterations per execute_vm launch (RANDOMX_PROGRAM_ITERATIONS >> bfactor) as a literal in kernels compiled with NVRTC,
+// so the iteration loop has a known trip count. It's a no-op in normal builds, see SPECIALIZE_BATCH_SIZE
+#ifdef NVRTC_NUM_ITERATIONS
+#define SPECIALIZE_NUM_ITERATIONS(num_iterations) num_iterations = NVRTC_NUM_ITERATIONS
+#else
+#define SPECIALIZE_NUM_ITERATIONS(num_iterations) (void)(num_iterations)
+#endif
+
+// Distance between VM states of consecutive hashes in shared memory
+constexpr size_t VM_STATE_SHARED_STRIDE = VM_STATE_SIZE + VM_STATE_SHARED_PADDING;
+
+// Opcode dispatch in execute_vm, it can be set at build time with -DEXECUTE_VM_SWITCH_DISPATCH=1
+// 0: if/else chain with the most frequent opcodes checked first
+// 1: switch over the opcode, which the compiler turns into an indexed branch (brx.idx) through a jump table (experimental, not measured on a GPU yet)
+#ifndef EXECUTE_VM_SWITCH_DISPATCH
+#define EXECUTE_VM_SWITCH_DISPATCH 0
+#endif
+
+// Dataset read in execute_vm, it can be set at build time with -DEXECUTE_VM_DATASET_PREFETCH=0
+// 0: dataset is read at the end of the iteration, right where it's used
+// 1: dataset is read through the read-only cache at the start of the iteration, so its latency is hidden behind the program
+#ifndef EXECUTE_VM_DATASET_PREFETCH
+#define EXECUTE_VM_DATASET_PREFETCH 1
+#endif
+
+// Rounding mode handling in execute_vm, it can be set at build time with -DEXECUTE_VM_FPRC_SPECIALIZATION=1
+// 0: one interpreter instance, every FP instruction selects the rounding mode at runtime
+// 1: one interpreter instance per rounding mode, control goes to another instance only when CFROUND changes the mode
+// 1 is experimental: it puts 4 copies of the interpreter in execute_vm and hasn't been measured against 0 on a GPU yet
+#ifndef EXECUTE_VM_FPRC_SPECIALIZATION
+#define EXECUTE_VM_FPRC_SPECIALIZATION 0
+#endif
+
+// FP64 arithmetic in execute_vm, it can be set at build time with -DEXECUTE_VM_SOFT_FP64=1
+// 0: native FP64 instructions
+// 1: integer/FP32 emulation from soft_fp64_cuda.hpp, for GPUs with 1/32 or 1/64 rate FP64
+// It's checked in device code, so it can select architectures, for example -DEXECUTE_VM_SOFT_FP64="(__CUDA_ARCH__ == 610 || __CUDA_ARCH__ == 750)"
+#ifndef EXECUTE_VM_SOFT_FP64
+#define EXECUTE_VM_SOFT_FP64 0
+#endif
+
+// Synchronization of ip and rounding mode in execute_vm, it can be set at build time with -DEXECUTE_VM_CONDITIONAL_SYNC=0
+// 0: warp-wide vote after every group of parallel instructions
+// 1: vote only after groups which have CBRANCH or CFROUND (marked by compile_program), other groups only need __syncwarp
+#ifndef EXECUTE_VM_CONDITIONAL_SYNC
+#define EXECUTE_VM_CONDITIONAL_SYNC 1
+#endif
+
+// ISWAP_R/FSWAP_R handling in compile_program, it can be set at build time with -DCOMPILE_PROGRAM_RENAME_SWAPS=0
+// 0: every swap is scheduled and executed
+// 1: swaps outside of CBRANCH loops are removed by renaming registers, execute_vm undoes the renaming at the end of each iteration
+#ifndef COMPILE_PROGRAM_RENAME_SWAPS
+#define COMPILE_PROGRAM_RENAME_SWAPS 1
+#endif
+
+// Cost-driven instruction placement in compile_program, it can be set at build time with -DCOMPILE_PROGRAM_COST_WINDOW=N
+// 0: every instruction goes to the first slot where its operands are ready
+// N: when an instruction cost table is uploaded (RandomX_CUDA.exe --mine --cost-model), an instruction can go up to N groups further
+//    if that group already has an instruction which is at least as expensive, so its cost is hidden there
+#ifndef COMPILE_PROGRAM_COST_WINDOW
+#define COMPILE_PROGRAM_COST_WINDOW 4
+#endif
 
 constexpr uint32_t CacheLineSize = 64;
-constexpr uint32_t CacheLineAlignMask = (DATASET_SIZE - 1) & ~(CacheLineSize - 1);
+
+__host__ __device__ constexpr uint32_t const_log2(uint64_t x)
+{
+	return (x > 1) ? const_log2(x / 2) + 1 : 0;
+}
+
+// Instruction frequency tables, RandomXVariant selects one of them
+constexpr uint32_t INSTRUCTION_FREQUENCIES_CONFIGURATION = 0;	// RANDOMX_FREQ_* from configuration.h
+constexpr uint32_t INSTRUCTION_FREQUENCIES_RANDOMWOW = 1;		// RandomWOW (Wownero)
+constexpr uint32_t INSTRUCTION_FREQUENCIES_COUNT = 2;
+
+// Parameters of a RandomX variant (see configuration.h), every kernel is specialized for one variant, so all sizes and masks are immediates
+// Program size is the same for all variants, it always comes from configuration.h
+template<uint32_t L1, uint32_t L2, uint32_t L3, uint32_t ITERATIONS, uint32_t COUNT, uint64_t DATASET_BASE, uint64_t DATASET_EXTRA, uint32_t FREQUENCIES = INSTRUCTION_FREQUENCIES_CONFIGURATION>
+struct RandomXVariant
+{
+	static constexpr size_t SCRATCHPAD_L1_SIZE = L1;
+	static constexpr size_t SCRATCHPAD_L2_SIZE = L2;
+	static constexpr size_t SCRATCHPAD_SIZE = L3;
+	static constexpr uint32_t PROGRAM_ITERATIONS = ITERATIONS;
+	static constexpr uint32_t PROGRAM_COUNT = COUNT;
+	static constexpr size_t DATASET_SIZE = DATASET_BASE + DATASET_EXTRA;
+	static constexpr uint32_t INSTRUCTION_FREQUENCIES = FREQUENCIES;
+
+	static constexpr uint32_t ScratchpadL3Mask64 = L3 - 64;
+	static constexpr uint32_t CacheLineAlignMask = (DATASET_BASE - 1) & ~(CacheLineSize - 1);
+	static constexpr uint32_t DatasetExtraItems = DATASET_EXTRA / CacheLineSize;
+
+	// Scratchpad level of a memory operand is encoded as a shift in bits 21-25 of its imm32 (address mask is 0xFFFFFFFF >> shift)
+	static constexpr uint32_t LOC_L1 = 32 - const_log2(L1);
+	static constexpr uint32_t LOC_L2 = 32 - const_log2(L2);
+	static constexpr uint32_t LOC_L3 = 32 - const_log2(L3);
+
+	static_assert(((L1 & (L1 - 1)) == 0) && ((L2 & (L2 - 1)) == 0) && ((L3 & (L3 - 1)) == 0), "Scratchpad sizes must be powers of 2");
+	static_assert((64 <= L1) && (L1 < L2) && (L2 < L3), "Scratchpad levels must be different, execute_vm tells them apart by their masks");
+	static_assert(L3 <= (1U << 21), "Bits 21-25 of imm32 are replaced with the location, so addresses can't be longer than 21 bits");
+	static_assert(((DATASET_BASE & (DATASET_BASE - 1)) == 0) && (DATASET_BASE <= (1ULL << 32)), "Dataset base size must be a power of 2 up to 4 GB");
+	static_assert((DatasetExtraItems & (DatasetExtraItems + 1)) == 0, "Extra dataset items are selected with a mask");
+	static_assert(FREQUENCIES < INSTRUCTION_FREQUENCIES_COUNT, "Unknown instruction frequency table");
+};
+
+// The variant configuration.h describes, the RandomX library computes reference hashes only for it
+typedef RandomXVariant<RANDOMX_SCRATCHPAD_L1, RANDOMX_SCRATCHPAD_L2, RANDOMX_SCRATCHPAD_L3, RANDOMX_PROGRAM_ITERATIONS, RANDOMX_PROGRAM_COUNT, RANDOMX_DATASET_BASE_SIZE, RANDOMX_DATASET_EXTRA_SIZE> RandomX_Default;
+
+typedef RandomXVariant<16384, 262144, 2097152, 2048, 8, 2147483648ULL, 33554368> RandomX_Monero;
+typedef RandomXVariant<16384, 131072, 1048576, 1024, 16, 2147483648ULL, 33554368, INSTRUCTION_FREQUENCIES_RANDOMWOW> RandomX_Wownero;
+typedef RandomXVariant<16384, 131072, 262144, 1024, 4, 2147483648ULL, 33554368> RandomX_Arqma;
+
+// Shared memory needed for one hash in execute_vm_l1_shared
+template<typename VARIANT>
+constexpr size_t execute_vm_l1_shared_size_per_hash()
+{
+	return VM_STATE_SHARED_STRIDE + VARIANT::SCRATCHPAD_L1_SIZE;
+}
 
 __device__ double getSmallPositiveFloatBits(uint64_t entropy)
 {
@@ -63,9 +190,83 @@ __device__ T bit_cast(double value)
 	return static_cast<T>(__double_as_longlong(value));
 }
 
+// Floating point operations in the rounding mode set by CFROUND: 0 = to nearest, 1 = down, 2 = up, 3 = towards zero
+__device__ double fp_add(double a, double b, uint32_t fprc)
+{
+#if EXECUTE_VM_SOFT_FP64
+	return __longlong_as_double(soft_fp64_add(__double_as_longlong(a), __double_as_longlong(b), fprc));
+#else
+	if (fprc == 0)
+		return __dadd_rn(a, b);
+	else if (fprc == 1)
+		return __dadd_rd(a, b);
+	else if (fprc == 2)
+		return __dadd_ru(a, b);
+	else
+		return __dadd_rz(a, b);
+#endif
+}
+
+__device__ double fp_mul(double a, double b, uint32_t fprc)
+{
+#if EXECUTE_VM_SOFT_FP64
+	return __longlong_as_double(soft_fp64_mul(__double_as_longlong(a), __double_as_longlong(b), fprc));
+#else
+	if (fprc == 0)
+		return __dmul_rn(a, b);
+	else if (fprc == 1)
+		return __dmul_rd(a, b);
+	else if (fprc == 2)
+		return __dmul_ru(a, b);
+	else
+		return __dmul_rz(a, b);
+#endif
+}
+
+__device__ double fp_div(double a, double b, uint32_t fprc)
+{
+#if EXECUTE_VM_SOFT_FP64
+	return __longlong_as_double(soft_fp64_div(__double_as_longlong(a), __double_as_longlong(b), fprc));
+#else
+	if (fprc == 0)
+		return __ddiv_rn(a, b);
+	else if (fprc == 1)
+		return __ddiv_rd(a, b);
+	else if (fprc == 2)
+		return __ddiv_ru(a, b);
+	else
+		return __ddiv_rz(a, b);
+#endif
+}
+
+__device__ double fp_sqrt(double a, uint32_t fprc)
+{
+#if EXECUTE_VM_SOFT_FP64
+	return __longlong_as_double(soft_fp64_sqrt(__double_as_longlong(a), fprc));
+#else
+	if (fprc == 0)
+		return __dsqrt_rn(a);
+	else if (fprc == 1)
+		return __dsqrt_rd(a);
+	else if (fprc == 2)
+		return __dsqrt_ru(a);
+	else
+		return __dsqrt_rz(a);
+#endif
+}
+
+__device__ double fp_from_int(int32_t value)
+{
+#if EXECUTE_VM_SOFT_FP64
+	return __longlong_as_double(soft_fp64_from_int32(value));
+#else
+	return __int2double_rn(value);
+#endif
+}
+
 __device__ double load_F_E_groups(int value, uint64_t andMask, uint64_t orMask)
 {
-	uint64_t x = bit_cast<uint64_t>(__int2double_rn(value));
+	uint64_t x = bit_cast<uint64_t>(fp_from_int(value));
 	x &= andMask;
 	x |= orMask;
 	return __longlong_as_double(static_cast<int64_t>(x));
@@ -104,8 +305,16 @@ __device__ void test_memory_access(uint64_t* r, uint8_t* scratchpad, uint32_t ba
 // VM state:
 //
 // Bytes 0-255: registers
-// Bytes 256-1023: imm32 values (up to 192 values can be stored). IMUL_RCP and CBRANCH use 2 consecutive imm32 values.
-// Bytes 1024-2047: up to 256 instructions
+// Bytes 256-...: imm32 values (up to 192 values can be stored), followed by the program (up to 256 instructions). IMUL_RCP and CBRANCH use 2 consecutive imm32 values.
+// Only registers, immediate values and the program are copied between global and shared memory, see vm_state_used_size
+//
+// Bytes 128-191 of registers (E registers) hold the program header until the first iteration overwrites them:
+// Bytes 128-143: ma, mx, fprc, number of imm32 values. It's the only part of the header which changes, execute_vm writes it back after every chunk
+// Bytes 144-159: eMask
+// Bytes 160-175: program length, number of execute_vm loop steps, number of CBRANCH instructions, register map at the end of the program
+// Bytes 176-183: addressRegisters, datasetOffset
+//
+// After the last iteration of a program, bytes 256-259 hold fprc for the next program (RandomX resets it only once per hash)
 //
 // Instruction encoding:
 //
@@ -113,10 +322,10 @@ __device__ void test_memory_access(uint64_t* r, uint8_t* scratchpad, uint32_t ba
 // Bits 3-5: src (0-7)
 // Bits 6-13: imm32/64 offset (in DWORDs, 0-191)
 // Bits 14-15: src location (register, L1, L2, L3)
-// Bits 16-17: src shift (0-3)
+// Bits 16-17: src shift (0-3), bit 16 for FP instructions: halves of the dst register are swapped
 // Bit 18: src=imm32
-// Bit 19: src=imm64
-// Bit 20: src = -src
+// Bit 19: CBRANCH or CFROUND is in this group of parallel instructions (starting with this one), so ip and rounding mode must be synchronized after it
+// Bit 20: src = -src (add, fadd), src=imm64 (mul)
 // Bits 21-25: opcode (add_rs, add, mul, umul_hi, imul_hi, neg, xor, ror, swap, cbranch, store, fswap, fadd, fmul, fsqrt, fdiv, cfround)
 // Bits 26-28: how many parallel instructions to run starting with this one (1-8)
 // Bits 29-31: how many of them are FP instructions (0-4)
@@ -128,7 +337,8 @@ __device__ void test_memory_access(uint64_t* r, uint8_t* scratchpad, uint32_t ba
 #define LOC_OFFSET			14
 #define SHIFT_OFFSET		16
 #define SRC_IS_IMM32_OFFSET	18
-#define SRC_IS_IMM64_OFFSET	19
+#define SYNC_GROUP_OFFSET	19
+#define SRC_IS_IMM64_OFFSET	20
 #define NEGATIVE_SRC_OFFSET	20
 #define OPCODE_OFFSET		21
 #define NUM_INSTS_OFFSET	26
@@ -137,10 +347,6 @@ __device__ void test_memory_access(uint64_t* r, uint8_t* scratchpad, uint32_t ba
 // ISWAP r0, r0
 #define INST_NOP			(8 << OPCODE_OFFSET)
 
-#define LOC_L1 (32 - 14)
-#define LOC_L2 (32 - 18)
-#define LOC_L3 (32 - 21)
-
 __device__ uint64_t imul_rcp_value(uint32_t divisor)
 {
 	if ((divisor & (divisor - 1)) == 0)
@@ -192,27 +398,36 @@ __device__ void set_buffer(T (&dst_buf)[N], const U value)
 	}
 }
 
-__device__ uint32_t get_condition_register(uint64_t registerLastChanged, uint64_t registerWasChanged, uint64_t& registerUsageCount, int32_t& lastChanged)
+// Number of uint64_t values in the used part of a VM state, header points to bytes 128-143 of the VM state
+__device__ uint32_t vm_state_used_size(const uint32_t* header)
+{
+	const uint32_t program_length = header[8];
+	const uint32_t num_imm = header[3];
+	return static_cast<uint32_t>(REGISTERS_SIZE / sizeof(uint64_t)) + (num_imm + program_length + 1) / 2;
+}
+
+// Copies the used part of a VM state, all 8 lanes of the hash must call it
+__device__ void copy_vm_state(uint64_t* dst, const uint64_t* src, uint32_t sub)
 {
-	lastChanged = INT_MAX;
-	uint32_t minCount = 0xFFFFFFFFU;
-	uint32_t creg = 0;
+	const uint32_t n = vm_state_used_size((const uint32_t*)(src + 16));
+	for (uint32_t i = sub; i < n; i += 8)
+		dst[i] = src[i];
+}
 
-	for (uint32_t j = 0; j < 8; ++j)
+template<typename T, size_t N>
+__device__ void store_buffer(const T (&src_buf)[N], void* dst_buf)
+{
+	uint32_t i = threadIdx.x * sizeof(T);
+	const uint32_t step = blockDim.x * sizeof(T);
+	const uint8_t* src = ((const uint8_t*) src_buf) + i;
+	uint8_t* dst = ((uint8_t*) dst_buf) + blockIdx.x * sizeof(T) * N + i;
+	while (i < sizeof(T) * N)
 	{
-		uint32_t change = get_byte(registerLastChanged, j);
-		int32_t count = get_byte(registerUsageCount, j);
-		const int32_t k = (get_byte(registerWasChanged, j) == 0) ? -1 : static_cast<int32_t>(change);
-		if ((k < lastChanged) || ((change == lastChanged) && (count < minCount)))
-		{
-			lastChanged = k;
-			minCount = count;
-			creg = j;
-		}
+		*(T*)(dst) = *(const T*)(src);
+		src += step;
+		dst += step;
+		i += step;
 	}
-
-	registerUsageCount += (1ULL << (creg * 8));
-	return creg;
 }
 
 template<typename T, typename U>
@@ -222,9 +437,135 @@ __device__ void update_max(T& value, const U next_value)
 		value = static_cast<T>(next_value);
 }
 
+// RandomX instruction types in the order of their opcode ranges in configuration.h, opcodes after ISTORE are NOPs
+enum RandomXInstruction : uint8_t
+{
+	RX_IADD_RS, RX_IADD_M, RX_ISUB_R, RX_ISUB_M, RX_IMUL_R, RX_IMUL_M, RX_IMULH_R, RX_IMULH_M, RX_ISMULH_R, RX_ISMULH_M, RX_IMUL_RCP,
+	RX_INEG_R, RX_IXOR_R, RX_IXOR_M, RX_IROR_R, RX_ISWAP_R,
+	RX_FSWAP_R, RX_FADD_R, RX_FADD_M, RX_FSUB_R, RX_FSUB_M, RX_FSCAL_R, RX_FMUL_R, RX_FDIV_M, RX_FSQRT_R,
+	RX_CBRANCH, RX_CFROUND, RX_ISTORE,
+	RX_NOP,
+};
+
+// Instruction properties in OpcodeInfo::flags
+constexpr uint32_t OPCODE_MEM = 1;				// Reads a memory operand, src is the address register
+constexpr uint32_t OPCODE_FP = 2;				// FP instruction, takes 2 slots in the execution plan
+constexpr uint32_t OPCODE_E_DST = 4;			// FP dst is an E register
+constexpr uint32_t OPCODE_NEGATIVE_SRC = 8;		// Encoded as add/fadd with src = -src
+constexpr uint32_t OPCODE_SRC_IMM32 = 16;		// Uses imm32 instead of src when src == dst
+constexpr uint32_t OPCODE_INT_DST = 32;			// Writes its integer dst register (IMUL_RCP only if imm32 is not a power of 2)
+constexpr uint32_t OPCODE_INT_SRC = 64;			// Reads its integer src register
+
+struct alignas(4) OpcodeInfo
+{
+	uint8_t type;			// RandomXInstruction
+	uint8_t gpu_opcode;		// execute_vm opcode of the usual encoding, it's also the instruction's cost class
+	uint8_t flags;			// OPCODE_*
+	uint8_t first_opcode;	// First opcode of this instruction type
+};
+
+__host__ __device__ constexpr uint32_t opcode_frequency(uint32_t frequencies, uint32_t type)
+{
+	const uint32_t table[INSTRUCTION_FREQUENCIES_COUNT][RX_NOP] = {
+		{
+			RANDOMX_FREQ_IADD_RS, RANDOMX_FREQ_IADD_M, RANDOMX_FREQ_ISUB_R, RANDOMX_FREQ_ISUB_M, RANDOMX_FREQ_IMUL_R, RANDOMX_FREQ_IMUL_M, RANDOMX_FREQ_IMULH_R, RANDOMX_FREQ_IMULH_M, RANDOMX_FREQ_ISMULH_R, RANDOMX_FREQ_ISMULH_M, RANDOMX_FREQ_IMUL_RCP,
+			RANDOMX_FREQ_INEG_R, RANDOMX_FREQ_IXOR_R, RANDOMX_FREQ_IXOR_M, RANDOMX_FREQ_IROR_R, RANDOMX_FREQ_ISWAP_R,
+			RANDOMX_FREQ_FSWAP_R, RANDOMX_FREQ_FADD_R, RANDOMX_FREQ_FADD_M, RANDOMX_FREQ_FSUB_R, RANDOMX_FREQ_FSUB_M, RANDOMX_FREQ_FSCAL_R, RANDOMX_FREQ_FMUL_R, RANDOMX_FREQ_FDIV_M, RANDOMX_FREQ_FSQRT_R,
+			RANDOMX_FREQ_CBRANCH, RANDOMX_FREQ_CFROUND, RANDOMX_FREQ_ISTORE,
+		},
+		// RandomWOW keeps them fixed, so Wownero hashes don't depend on configuration.h
+		{
+			25, 7, 16, 7, 16, 4, 4, 1, 4, 1, 8,
+			2, 15, 5, 10, 4,
+			8, 20, 5, 20, 5, 6, 20, 4, 6,
+			16, 1, 16,
+		},
+	};
+	return (type < RX_NOP) ? table[frequencies][type] : 0;
+}
+
+__host__ __device__ constexpr uint32_t opcode_begin(uint32_t frequencies, uint32_t type)
+{
+	uint32_t opcode = 0;
+	for (uint32_t i = 0; i < type; ++i)
+		opcode += opcode_frequency(frequencies, i);
+	return opcode;
+}
+
+static_assert(opcode_begin(INSTRUCTION_FREQUENCIES_CONFIGURATION, RX_NOP) <= 256, "Sum of instruction frequencies can't be more than 256");
+static_assert(opcode_begin(INSTRUCTION_FREQUENCIES_RANDOMWOW, RX_NOP) == 256, "RandomWOW instruction frequencies must add up to 256");
+
+__host__ __device__ constexpr OpcodeInfo instruction_info(uint32_t frequencies, uint32_t type)
+{
+	const OpcodeInfo info[] = {
+		{ RX_IADD_RS,	0,	OPCODE_INT_DST | OPCODE_INT_SRC },
+		{ RX_IADD_M,	1,	OPCODE_INT_DST | OPCODE_INT_SRC | OPCODE_MEM },
+		{ RX_ISUB_R,	1,	OPCODE_INT_DST | OPCODE_INT_SRC | OPCODE_NEGATIVE_SRC | OPCODE_SRC_IMM32 },
+		{ RX_ISUB_M,	1,	OPCODE_INT_DST | OPCODE_INT_SRC | OPCODE_NEGATIVE_SRC | OPCODE_MEM },
+		{ RX_IMUL_R,	2,	OPCODE_INT_DST | OPCODE_INT_SRC | OPCODE_SRC_IMM32 },
+		{ RX_IMUL_M,	2,	OPCODE_INT_DST | OPCODE_INT_SRC | OPCODE_MEM },
+		{ RX_IMULH_R,	3,	OPCODE_INT_DST | OPCODE_INT_SRC },
+		{ RX_IMULH_M,	3,	OPCODE_INT_DST | OPCODE_INT_SRC | OPCODE_MEM },
+		{ RX_ISMULH_R,	4,	OPCODE_INT_DST | OPCODE_INT_SRC },
+		{ RX_ISMULH_M,	4,	OPCODE_INT_DST | OPCODE_INT_SRC | OPCODE_MEM },
+		{ RX_IMUL_RCP,	2,	OPCODE_INT_DST },
+		{ RX_INEG_R,	5,	OPCODE_INT_DST },
+		{ RX_IXOR_R,	6,	OPCODE_INT_DST | OPCODE_INT_SRC | OPCODE_SRC_IMM32 },
+		{ RX_IXOR_M,	6,	OPCODE_INT_DST | OPCODE_INT_SRC | OPCODE_MEM },
+		{ RX_IROR_R,	7,	OPCODE_INT_DST | OPCODE_INT_SRC | OPCODE_SRC_IMM32 },
+		{ RX_ISWAP_R,	8,	OPCODE_INT_SRC },
+		{ RX_FSWAP_R,	11,	OPCODE_FP },
+		{ RX_FADD_R,	12,	OPCODE_FP },
+		{ RX_FADD_M,	12,	OPCODE_FP | OPCODE_INT_SRC | OPCODE_MEM },
+		{ RX_FSUB_R,	12,	OPCODE_FP | OPCODE_NEGATIVE_SRC },
+		{ RX_FSUB_M,	12,	OPCODE_FP | OPCODE_INT_SRC | OPCODE_MEM | OPCODE_NEGATIVE_SRC },
+		{ RX_FSCAL_R,	6,	OPCODE_FP },
+		{ RX_FMUL_R,	13,	OPCODE_FP | OPCODE_E_DST },
+		{ RX_FDIV_M,	15,	OPCODE_FP | OPCODE_E_DST | OPCODE_INT_SRC | OPCODE_MEM },
+		{ RX_FSQRT_R,	14,	OPCODE_FP | OPCODE_E_DST },
+		{ RX_CBRANCH,	9,	0 },
+		{ RX_CFROUND,	16,	OPCODE_INT_SRC },
+		{ RX_ISTORE,	10,	OPCODE_INT_SRC },
+		{ RX_NOP,		8,	0 },
+	};
+
+	OpcodeInfo result = info[type];
+	result.first_opcode = static_cast<uint8_t>(opcode_begin(frequencies, type));
+	return result;
+}
+
+struct OpcodeTable
+{
+	OpcodeInfo info[256];
+};
+
+__host__ __device__ constexpr OpcodeTable make_opcode_table(uint32_t frequencies)
+{
+	OpcodeTable table{};
+	uint32_t type = 0;
+	for (uint32_t opcode = 0; opcode < 256; ++opcode)
+	{
+		while ((type < RX_NOP) && (opcode >= opcode_begin(frequencies, type + 1)))
+			++type;
+		table.info[opcode] = instruction_info(frequencies, type);
+	}
+	return table;
+}
+
+// Decoded RandomX opcodes for every instruction frequency table, generated at compile time
+// All instruction decoders (print_inst, get_imm_count, encode_instruction, instruction_cost and compile_program) read them with opcode_info, so they always agree with each other
+static __constant__ OpcodeTable opcode_tables[INSTRUCTION_FREQUENCIES_COUNT] = { make_opcode_table(INSTRUCTION_FREQUENCIES_CONFIGURATION), make_opcode_table(INSTRUCTION_FREQUENCIES_RANDOMWOW) };
+
+template<typename VARIANT>
+__device__ OpcodeInfo opcode_info(uint32_t x)
+{
+	return opcode_tables[VARIANT::INSTRUCTION_FREQUENCIES].info[x & 0xff];
+}
+
+template<typename VARIANT>
 __device__ void print_inst(uint2 inst)
 {
-	uint32_t opcode = inst.x & 0xff;
+	const OpcodeInfo info = opcode_info<VARIANT>(inst.x);
 	const uint32_t dst = (inst.x >> 8) & 7;
 	const uint32_t src = (inst.x >> 16) & 7;
 	const uint32_t mod = (inst.x >> 24);
@@ -232,895 +573,918 @@ __device__ void print_inst(uint2 inst)
 	const char* branch_target = ((inst.x & (0x40 << 8)) != 0) ? "*" : (((inst.x & (0x10 << 8)) != 0) ? "!" : " ");
 	const char* fp_inst = ((inst.x & (0x20 << 8)) != 0) ? "^" : " ";
 
-	do {
-		if (opcode < RANDOMX_FREQ_IADD_RS)
-		{
-			printf("%s%sIADD_RS  r%u, r%u    ", branch_target, fp_inst, dst, src);
-			break;
-		}
-		opcode -= RANDOMX_FREQ_IADD_RS;
+	const char* names[] = {
+		"IADD_RS", "IADD_M", "ISUB_R", "ISUB_M", "IMUL_R", "IMUL_M", "IMULH_R", "IMULH_M", "ISMULH_R", "ISMULH_M", "IMUL_RCP",
+		"INEG_R", "IXOR_R", "IXOR_M", "IROR_R", "ISWAP_R",
+		"FSWAP_R", "FADD_R", "FADD_M", "FSUB_R", "FSUB_M", "FSCAL_R", "FMUL_R", "FDIV_M", "FSQRT_R",
+		"CBRANCH", "CFROUND", "ISTORE",
+	};
+	const char* name = names[info.type < RX_NOP ? info.type : 0];
+	const char* fp_dst = (info.flags & OPCODE_E_DST) ? "e" : "f";
 
-		if (opcode < RANDOMX_FREQ_IADD_M)
-		{
-			printf("%s%sIADD_M   r%u, %s[r%u]", branch_target, fp_inst, dst, location, src);
-			break;
-		}
-		opcode -= RANDOMX_FREQ_IADD_M;
+	switch (info.type)
+	{
+	case RX_IMUL_RCP:
+	case RX_INEG_R:
+		printf("%s%s%-9sr%u        ", branch_target, fp_inst, name, dst);
+		break;
 
-		if (opcode < RANDOMX_FREQ_ISUB_R)
-		{
-			printf("%s%sISUB_R   r%u, r%u    ", branch_target, fp_inst, dst, src);
-			break;
-		}
-		opcode -= RANDOMX_FREQ_ISUB_R;
+	case RX_FSWAP_R:
+		printf("%s%s%-9s%s%u        ", branch_target, fp_inst, name, (dst < randomx::RegisterCountFlt) ? "f" : "e", dst % randomx::RegisterCountFlt);
+		break;
 
-		if (opcode < RANDOMX_FREQ_ISUB_M)
-		{
-			printf("%s%sISUB_M   r%u, %s[r%u]", branch_target, fp_inst, dst, location, src);
-			break;
-		}
-		opcode -= RANDOMX_FREQ_ISUB_M;
+	case RX_FSCAL_R:
+	case RX_FSQRT_R:
+		printf("%s%s%-9s%s%u        ", branch_target, fp_inst, name, fp_dst, dst % randomx::RegisterCountFlt);
+		break;
 
-		if (opcode < RANDOMX_FREQ_IMUL_R)
+	case RX_CBRANCH:
 		{
-			printf("%s%sIMUL_R   r%u, r%u    ", branch_target, fp_inst, dst, src);
-			break;
+			const int32_t lastChanged = (inst.x & (0x80 << 8)) ? -1 : static_cast<int32_t>((inst.x >> 16) & 0xFF);
+			printf("%s%s%-9sr%u, %3d   ", branch_target, fp_inst, name, dst, lastChanged + 1);
 		}
-		opcode -= RANDOMX_FREQ_IMUL_R;
+		break;
 
-		if (opcode < RANDOMX_FREQ_IMUL_M)
-		{
-			printf("%s%sIMUL_M   r%u, %s[r%u]", branch_target, fp_inst, dst, location, src);
-			break;
-		}
-		opcode -= RANDOMX_FREQ_IMUL_M;
+	case RX_CFROUND:
+		printf("%s%s%-9sr%u, %2d    ", branch_target, fp_inst, name, src, inst.y & 63);
+		break;
 
-		if (opcode < RANDOMX_FREQ_IMULH_R)
-		{
-			printf("%s%sIMULH_R  r%u, r%u    ", branch_target, fp_inst, dst, src);
-			break;
-		}
-		opcode -= RANDOMX_FREQ_IMULH_R;
+	case RX_ISTORE:
+		location = ((mod >> 4) >= randomx::StoreL3Condition) ? "L3" : ((mod % 4) ? "L1" : "L2");
+		printf("%s%s%-9s%s[r%u], r%u", branch_target, fp_inst, name, location, dst, src);
+		break;
 
-		if (opcode < RANDOMX_FREQ_IMULH_M)
-		{
-			printf("%s%sIMULH_M  r%u, %s[r%u]", branch_target, fp_inst, dst, location, src);
-			break;
-		}
-		opcode -= RANDOMX_FREQ_IMULH_M;
+	case RX_NOP:
+		printf("%s%sNOP%03u   r%u, r%u    ", branch_target, fp_inst, (inst.x & 0xff) - info.first_opcode, dst, src);
+		break;
 
-		if (opcode < RANDOMX_FREQ_ISMULH_R)
+	default:
+		if (info.flags & OPCODE_FP)
 		{
-			printf("%s%sISMULH_R r%u, r%u    ", branch_target, fp_inst, dst, src);
-			break;
+			if (info.flags & OPCODE_MEM)
+				printf("%s%s%-9s%s%u, %s[r%u]", branch_target, fp_inst, name, fp_dst, dst % randomx::RegisterCountFlt, location, src);
+			else
+				printf("%s%s%-9s%s%u, a%u    ", branch_target, fp_inst, name, fp_dst, dst % randomx::RegisterCountFlt, src % randomx::RegisterCountFlt);
 		}
-		opcode -= RANDOMX_FREQ_ISMULH_R;
-
-		if (opcode < RANDOMX_FREQ_ISMULH_M)
+		else
 		{
-			printf("%s%sISMULH_M r%u, %s[r%u]", branch_target, fp_inst, dst, location, src);
-			break;
+			if (info.flags & OPCODE_MEM)
+				printf("%s%s%-9sr%u, %s[r%u]", branch_target, fp_inst, name, dst, location, src);
+			else
+				printf("%s%s%-9sr%u, r%u    ", branch_target, fp_inst, name, dst, src);
 		}
-		opcode -= RANDOMX_FREQ_ISMULH_M;
+		break;
+	}
+}
 
-		if (opcode < RANDOMX_FREQ_IMUL_RCP)
-		{
-			printf("%s%sIMUL_RCP r%u        ", branch_target, fp_inst, dst);
-			break;
-		}
-		opcode -= RANDOMX_FREQ_IMUL_RCP;
+__device__ bool iadd_rs_needs_displacement(uint32_t x)
+{
+#if COMPILE_PROGRAM_RENAME_SWAPS
+	// dst is a physical register after renaming, compile_program marks the instruction instead
+	return (x & (0x08 << 16)) != 0;
+#else
+	return ((x >> 8) & 7) == randomx::RegisterNeedsDisplacement;
+#endif
+}
 
-		if (opcode < RANDOMX_FREQ_INEG_R)
-		{
-			printf("%s%sINEG_R   r%u        ", branch_target, fp_inst, dst);
-			break;
-		}
-		opcode -= RANDOMX_FREQ_INEG_R;
+template<typename VARIANT>
+__device__ uint32_t get_imm_count(uint2 inst)
+{
+	const OpcodeInfo info = opcode_info<VARIANT>(inst.x);
+	const uint32_t dst = (inst.x >> 8) & 7;
+	const uint32_t src = (inst.x >> 16) & 7;
 
-		if (opcode < RANDOMX_FREQ_IXOR_R)
-		{
-			printf("%s%sIXOR_R   r%u, r%u    ", branch_target, fp_inst, dst, src);
-			break;
-		}
-		opcode -= RANDOMX_FREQ_IXOR_R;
+	switch (info.type)
+	{
+	case RX_IADD_RS:
+		return iadd_rs_needs_displacement(inst.x) ? 1 : 0;
 
-		if (opcode < RANDOMX_FREQ_IXOR_M)
-		{
-			printf("%s%sIXOR_M   r%u, %s[r%u]", branch_target, fp_inst, dst, location, src);
-			break;
-		}
-		opcode -= RANDOMX_FREQ_IXOR_M;
+	case RX_IMUL_RCP:
+		return (inst.y & (inst.y - 1)) ? 2 : 0;
 
-		if (opcode < RANDOMX_FREQ_IROR_R)
-		{
-			printf("%s%sIROR_R   r%u, r%u    ", branch_target, fp_inst, dst, src);
-			break;
-		}
-		opcode -= RANDOMX_FREQ_IROR_R;
+	case RX_CBRANCH:
+		return 2;
 
-		if (opcode < RANDOMX_FREQ_ISWAP_R)
-		{
-			printf("%s%sISWAP_R  r%u, r%u    ", branch_target, fp_inst, dst, src);
-			break;
-		}
-		opcode -= RANDOMX_FREQ_ISWAP_R;
+	case RX_ISTORE:
+		return 1;
 
-		if (opcode < RANDOMX_FREQ_FSWAP_R)
-		{
-			printf("%s%sFSWAP_R  %s%u        ", branch_target, fp_inst, (dst < randomx::RegisterCountFlt) ? "f" : "e", dst % randomx::RegisterCountFlt);
-			break;
-		}
-		opcode -= RANDOMX_FREQ_FSWAP_R;
+	default:
+		if (info.flags & OPCODE_MEM)
+			return 1;
+		return ((info.flags & OPCODE_SRC_IMM32) && (src == dst)) ? 1 : 0;
+	}
+}
 
-		if (opcode < RANDOMX_FREQ_FADD_R)
-		{
-			printf("%s%sFADD_R   f%u, a%u    ", branch_target, fp_inst, dst % randomx::RegisterCountFlt, src % randomx::RegisterCountFlt);
-			break;
-		}
-		opcode -= RANDOMX_FREQ_FADD_R;
+// Encodes one scheduled instruction for execute_vm and stores its immediate values at imm_buf[imm_index]
+// The number of immediate values written is always equal to get_imm_count(inst)
+template<typename VARIANT>
+__device__ uint32_t encode_instruction(uint2 inst, uint32_t imm_index, uint32_t* imm_buf, int32_t branch_target_slot)
+{
+	const OpcodeInfo info = opcode_info<VARIANT>(inst.x);
+	const uint32_t dst = (inst.x >> 8) & 7;
+	const uint32_t src = (inst.x >> 16) & 7;
+	const uint32_t mod = (inst.x >> 24);
+	const bool needs_displacement = iadd_rs_needs_displacement(inst.x);
 
-		if (opcode < RANDOMX_FREQ_FADD_M)
-		{
-			printf("%s%sFADD_M   f%u, %s[r%u]", branch_target, fp_inst, dst % randomx::RegisterCountFlt, location, src);
-			break;
-		}
-		opcode -= RANDOMX_FREQ_FADD_M;
+#if COMPILE_PROGRAM_RENAME_SWAPS
+	// Set by compile_program for FP instructions if halves of the dst register are swapped (src |= 0x08)
+	const uint32_t fp_dst_swap = ((inst.x >> 19) & 1) << SHIFT_OFFSET;
+#else
+	const uint32_t fp_dst_swap = 0;
+#endif
 
-		if (opcode < RANDOMX_FREQ_FSUB_R)
-		{
-			printf("%s%sFSUB_R   f%u, a%u    ", branch_target, fp_inst, dst % randomx::RegisterCountFlt, src % randomx::RegisterCountFlt);
-			break;
-		}
-		opcode -= RANDOMX_FREQ_FSUB_R;
+	const uint32_t fp_dst = (dst % randomx::RegisterCountFlt) + ((info.flags & OPCODE_E_DST) ? randomx::RegisterCountFlt : 0);
+	const uint32_t negative_src = (info.flags & OPCODE_NEGATIVE_SRC) ? (1 << NEGATIVE_SRC_OFFSET) : 0;
 
-		if (opcode < RANDOMX_FREQ_FSUB_M)
+	switch (info.type)
+	{
+	case RX_IADD_RS:
 		{
-			printf("%s%sFSUB_M   f%u, %s[r%u]", branch_target, fp_inst, dst % randomx::RegisterCountFlt, location, src);
-			break;
-		}
-		opcode -= RANDOMX_FREQ_FSUB_M;
+			const uint32_t shift = (mod >> 2) % 4;
 
-		if (opcode < RANDOMX_FREQ_FSCAL_R)
-		{
-			printf("%s%sFSCAL_R  f%u        ", branch_target, fp_inst, dst % randomx::RegisterCountFlt);
-			break;
-		}
-		opcode -= RANDOMX_FREQ_FSCAL_R;
+			inst.x = (dst << DST_OFFSET) | (src << SRC_OFFSET) | (shift << SHIFT_OFFSET);
 
-		if (opcode < RANDOMX_FREQ_FMUL_R)
-		{
-			printf("%s%sFMUL_R   e%u, a%u    ", branch_target, fp_inst, dst % randomx::RegisterCountFlt, src % randomx::RegisterCountFlt);
-			break;
+			if (!needs_displacement)
+			{
+				// Encode regular ADD (opcode 1)
+				inst.x |= (1 << OPCODE_OFFSET);
+			}
+			else
+			{
+				// Encode ADD with src and imm32 (opcode 0)
+				inst.x |= imm_index << IMM_OFFSET;
+				imm_buf[imm_index++] = inst.y;
+			}
 		}
-		opcode -= RANDOMX_FREQ_FMUL_R;
+		return inst.x;
 
-		if (opcode < RANDOMX_FREQ_FDIV_M)
+	case RX_IMUL_RCP:
 		{
-			printf("%s%sFDIV_M   e%u, %s[r%u]", branch_target, fp_inst, dst % randomx::RegisterCountFlt, location, src);
-			break;
-		}
-		opcode -= RANDOMX_FREQ_FDIV_M;
+			const uint64_t r = imul_rcp_value(inst.y);
+			if (r == 1)
+			{
+				return INST_NOP;
+			}
 
-		if (opcode < RANDOMX_FREQ_FSQRT_R)
-		{
-			printf("%s%sFSQRT_R  e%u        ", branch_target, fp_inst, dst % randomx::RegisterCountFlt);
-			break;
-		}
-		opcode -= RANDOMX_FREQ_FSQRT_R;
+			inst.x = (dst << DST_OFFSET) | (src << SRC_OFFSET) | (2 << OPCODE_OFFSET);
+			inst.x |= (imm_index << IMM_OFFSET) | (1 << SRC_IS_IMM64_OFFSET);
 
-		if (opcode < RANDOMX_FREQ_CBRANCH)
-		{
-			const int32_t lastChanged = (inst.x & (0x80 << 8)) ? -1 : static_cast<int32_t>((inst.x >> 16) & 0xFF);
-			printf("%s%sCBRANCH  r%u, %3d   ", branch_target, fp_inst, dst, lastChanged + 1);
-			break;
+			imm_buf[imm_index] = ((const uint32_t*) &r)[0];
+			imm_buf[imm_index + 1] = ((const uint32_t*) &r)[1];
+			imm_index += 2;
 		}
-		opcode -= RANDOMX_FREQ_CBRANCH;
+		return inst.x;
+
+	case RX_INEG_R:
+		return (dst << DST_OFFSET) | (5 << OPCODE_OFFSET);
+
+	case RX_ISWAP_R:
+		inst.x = (dst << DST_OFFSET) | (src << SRC_OFFSET) | (8 << OPCODE_OFFSET);
+		return (src != dst) ? inst.x : INST_NOP;
+
+	case RX_FSWAP_R:
+		return (dst << DST_OFFSET) | (11 << OPCODE_OFFSET);
 
-		if (opcode < RANDOMX_FREQ_CFROUND)
+	case RX_FSCAL_R:
+	case RX_FSQRT_R:
+		return (fp_dst << DST_OFFSET) | (info.gpu_opcode << OPCODE_OFFSET) | fp_dst_swap;
+
+	case RX_CBRANCH:
 		{
-			printf("%s%sCFROUND  r%u, %2d    ", branch_target, fp_inst, src, inst.y & 63);
-			break;
+			inst.x = (dst << DST_OFFSET) | (9 << OPCODE_OFFSET);
+			inst.x |= (imm_index << IMM_OFFSET);
+
+			const uint32_t cshift = (mod >> 4) + randomx::ConditionOffset;
+
+			uint32_t imm = inst.y | (1U << cshift);
+			if (cshift > 0)
+				imm &= ~(1U << (cshift - 1));
+
+			imm_buf[imm_index] = imm;
+			imm_buf[imm_index + 1] = cshift | (static_cast<uint32_t>(branch_target_slot) << 5);
+			imm_index += 2;
 		}
-		opcode -= RANDOMX_FREQ_CFROUND;
+		return inst.x;
+
+	case RX_CFROUND:
+		return (src << SRC_OFFSET) | (16 << OPCODE_OFFSET) | ((inst.y & 63) << IMM_OFFSET);
 
-		if (opcode < RANDOMX_FREQ_ISTORE)
+	case RX_ISTORE:
 		{
-			location = ((mod >> 4) >= randomx::StoreL3Condition) ? "L3" : ((mod % 4) ? "L1" : "L2");
-			printf("%s%sISTORE   %s[r%u], r%u", branch_target, fp_inst, location, dst, src);
-			break;
+			const uint32_t location = ((mod >> 4) >= randomx::StoreL3Condition) ? 3 : ((mod % 4) ? 1 : 2);
+			inst.x = (dst << DST_OFFSET) | (src << SRC_OFFSET) | (location << LOC_OFFSET) | (10 << OPCODE_OFFSET);
+			inst.x |= imm_index << IMM_OFFSET;
+			imm_buf[imm_index++] = (inst.y & 0xFC1FFFFFU) | (((location == 1) ? VARIANT::LOC_L1 : ((location == 2) ? VARIANT::LOC_L2 : VARIANT::LOC_L3)) << 21);
 		}
-		opcode -= RANDOMX_FREQ_ISTORE;
+		return inst.x;
+
+	case RX_NOP:
+		return INST_NOP;
+	}
+
+	// Everything else is an integer or FP instruction with a register or memory operand, execute_vm opcode comes from the table
+	if (info.flags & OPCODE_MEM)
+	{
+		const bool is_fp = (info.flags & OPCODE_FP) != 0;
+		const uint32_t location = ((src == dst) && !is_fp) ? 3 : ((mod % 4) ? 1 : 2);
+		inst.x = ((is_fp ? fp_dst : dst) << DST_OFFSET) | (src << SRC_OFFSET) | (location << LOC_OFFSET) | (info.gpu_opcode << OPCODE_OFFSET) | negative_src;
+		if (is_fp)
+			inst.x |= fp_dst_swap;
+		inst.x |= imm_index << IMM_OFFSET;
+		imm_buf[imm_index++] = (inst.y & 0xFC1FFFFFU) | (((location == 1) ? VARIANT::LOC_L1 : ((location == 2) ? VARIANT::LOC_L2 : VARIANT::LOC_L3)) << 21);
+
+		return inst.x;
+	}
+
+	if (info.flags & OPCODE_FP)
+		return (fp_dst << DST_OFFSET) | ((src % randomx::RegisterCountFlt) << (SRC_OFFSET + 1)) | (info.gpu_opcode << OPCODE_OFFSET) | negative_src | fp_dst_swap;
+
+	inst.x = (dst << DST_OFFSET) | (src << SRC_OFFSET) | (info.gpu_opcode << OPCODE_OFFSET) | negative_src;
+	if ((info.flags & OPCODE_SRC_IMM32) && (src == dst))
+	{
+		inst.x |= (imm_index << IMM_OFFSET) | (1 << SRC_IS_IMM32_OFFSET);
+		imm_buf[imm_index++] = inst.y;
+	}
+
+	return inst.x;
+}
+
+// Returns the index of the first lane (relative to the first lane in lanes_mask) where pred is true, or -1 if there is no such lane
+__device__ int32_t first_set_lane(uint32_t lanes_mask, bool pred)
+{
+	const uint32_t mask = __ballot_sync(lanes_mask, pred) & lanes_mask;
+	return mask ? (__ffs(mask) - __ffs(lanes_mask)) : -1;
+}
+
+// Minimum of x over lanes_mask, which must be 8 aligned lanes
+__device__ uint32_t min_lanes8(uint32_t lanes_mask, uint32_t x)
+{
+#if __CUDA_ARCH__ >= 800
+	// sm_80 and newer have a warp-wide reduction instruction (redux.sync)
+	return __reduce_min_sync(lanes_mask, x);
+#else
+	x = min(x, __shfl_xor_sync(lanes_mask, x, 1, 8));
+	x = min(x, __shfl_xor_sync(lanes_mask, x, 2, 8));
+	x = min(x, __shfl_xor_sync(lanes_mask, x, 4, 8));
+	return x;
+#endif
+}
 
-		printf("%s%sNOP%03u   r%u, r%u    ", branch_target, fp_inst, opcode, dst, src);
-	} while (false);
+// Instruction classes of the execute_vm cost model: execute_vm opcodes (0-16), followed by scratchpad reads of memory operands
+constexpr uint32_t INSTRUCTION_COST_CLASSES = 19;
+constexpr uint32_t INSTRUCTION_COST_READ_L1_L2 = 17;
+constexpr uint32_t INSTRUCTION_COST_READ_L3 = 18;
+
+// There is one cost table for every number of workers per hash (2, 4, 8)
+constexpr uint32_t INSTRUCTION_COST_TABLES = 3;
+
+__host__ __device__ constexpr uint32_t instruction_cost_table(uint32_t workers_per_hash)
+{
+	return const_log2(workers_per_hash) - 1;
+}
+
+// Clock cycles which one instruction of every class adds to a group of parallel instructions in execute_vm, measured by measure_instruction_costs
+// It's all zeroes unless the host uploads a table, compile_program places instructions as soon as their operands are ready then
+static __constant__ uint16_t instruction_costs[INSTRUCTION_COST_TABLES][INSTRUCTION_COST_CLASSES];
+
+// Cost of one RandomX instruction in execute_vm with WORKERS_PER_HASH workers: its opcode class, plus the scratchpad read if it has a memory operand
+template<typename VARIANT, int WORKERS_PER_HASH>
+__device__ uint32_t instruction_cost(uint2 inst)
+{
+	const uint16_t* costs = instruction_costs[instruction_cost_table(WORKERS_PER_HASH)];
+
+	const OpcodeInfo info = opcode_info<VARIANT>(inst.x);
+	const uint32_t dst = (inst.x >> 8) & 7;
+	const uint32_t src = (inst.x >> 16) & 7;
+
+	uint32_t cost = costs[info.gpu_opcode];
+
+	// FP instructions never read from L3
+	if (info.flags & OPCODE_MEM)
+		cost += costs[((src == dst) && !(info.flags & OPCODE_FP)) ? INSTRUCTION_COST_READ_L3 : INSTRUCTION_COST_READ_L1_L2];
+
+	return cost;
+}
+
+// Checks if nothing is scheduled in this slot yet, execution_plan can't tell the first instruction (index 0) from an empty slot
+__device__ bool slot_is_free(const uint8_t* execution_plan, int32_t j, int32_t first_instruction_slot, bool first_instruction_fp)
+{
+	return (execution_plan[j] == 0) && (j != first_instruction_slot) && ((j != first_instruction_slot + 1) || !first_instruction_fp);
 }
 
+// Cost of the group of parallel instructions which has this slot, it's the cost of its most expensive instruction
+template<typename VARIANT, int WORKERS_PER_HASH>
+__device__ uint32_t group_cost(const uint2* src_program, const uint8_t* execution_plan, int32_t slot, int32_t first_instruction_slot)
+{
+	uint32_t cost = 0;
+	for (int32_t k = (slot / WORKERS_PER_HASH) * WORKERS_PER_HASH, end = k + WORKERS_PER_HASH; k < end; ++k)
+	{
+		if (execution_plan[k] || (k == first_instruction_slot))
+			update_max(cost, instruction_cost<VARIANT, WORKERS_PER_HASH>(src_program[execution_plan[k]]));
+	}
+	return cost;
+}
+
+// Checks if an FP instruction can take slots j and j + 1 in compile_program
+// Integer instructions which come first in j's group are moved after it, unless one of them is a branch or a branch target, or the FP instruction is a branch target itself
 template<int WORKERS_PER_HASH>
-__global__ void __launch_bounds__(32, 16) init_vm(void* entropy_data, void* vm_states, void* num_vm_cycles)
+__device__ bool fp_slots_suitable(const uint2* src_program, const uint8_t* execution_plan, int32_t j, int32_t first_instruction_slot, bool is_branch_target)
 {
-	__shared__ uint32_t execution_plan_buf[RANDOMX_PROGRAM_SIZE * WORKERS_PER_HASH * (32 / 8) / sizeof(uint32_t)];
+	if ((j + 1 >= RANDOMX_PROGRAM_SIZE * WORKERS_PER_HASH) || execution_plan[j] || execution_plan[j + 1] || (((j + 1) % WORKERS_PER_HASH) == 0))
+		return false;
 
-	set_buffer(execution_plan_buf, 0);
-	__syncwarp();
+	for (int32_t k = (j / WORKERS_PER_HASH) * WORKERS_PER_HASH; k < j; ++k)
+	{
+		if (execution_plan[k] || (k == first_instruction_slot))
+		{
+			const uint32_t inst = src_program[execution_plan[k]].x;
+			if (((inst & (0x20 << 8)) == 0) && (((inst & (0x50 << 8)) != 0) || is_branch_target))
+				return false;
+		}
+	}
 
-	const uint32_t global_index = blockIdx.x * blockDim.x + threadIdx.x;
-	const uint32_t idx = global_index / 8;
-	const uint32_t sub = global_index % 8;
+	return true;
+}
+
+// Compiles one program for execute_vm, all 8 lanes of a hash must call it
+// entropy points to the first 128 bytes of program entropy, src_program must already contain the raw program
+// execution_plan must be zeroed, the compiled VM state is written to R, fprc is the rounding mode the program starts with
+// Returns the number of VM cycles (low 32 bits) and the number of used slots (high 32 bits), the same value is added to num_vm_cycles if it's not null
+template<typename VARIANT, int WORKERS_PER_HASH>
+__device__ uint64_t compile_program(const uint64_t* entropy, uint2* src_program, uint8_t* execution_plan, uint64_t* R, void* num_vm_cycles, uint32_t fprc)
+{
+	const uint32_t sub = threadIdx.x % 8;
 
-	uint8_t* execution_plan = (uint8_t*)(execution_plan_buf + (threadIdx.x / 8) * RANDOMX_PROGRAM_SIZE * WORKERS_PER_HASH / sizeof(uint32_t));
+	// All 8 lanes of a hash work together, lanes of different hashes can diverge
+	const uint32_t lanes_mask = 0xFFU << ((threadIdx.x / 8) * 8);
 
-	uint64_t* R = ((uint64_t*) vm_states) + idx * VM_STATE_SIZE / sizeof(uint64_t);
 	R[sub] = 0;
 
-	const uint64_t* entropy = ((const uint64_t*) entropy_data) + idx * ENTROPY_SIZE / sizeof(uint64_t);
-
 	double* A = (double*)(R + 24);
 	A[sub] = getSmallPositiveFloatBits(entropy[sub]);
 
-	if (sub == 0)
+	// Clear all src flags (branch target, FP, branch) and mark FP instructions (src |= 0x20)
+	for (uint32_t i = sub; i < RANDOMX_PROGRAM_SIZE; i += 8)
 	{
-		uint2* src_program = (uint2*)(entropy + 128 / sizeof(uint64_t));
+		uint32_t x = src_program[i].x & ~(0xF8U << 8);
 
-		uint64_t registerLastChanged = 0;
-		uint64_t registerWasChanged = 0;
-		uint64_t registerUsageCount = 0;
+		if (opcode_info<VARIANT>(x).flags & OPCODE_FP)
+			x |= 0x20 << 8;
 
-		// Initialize CBRANCH instructions
-		for (uint32_t i = 0; i < RANDOMX_PROGRAM_SIZE; ++i)
-		{
-			// Clear all src flags (branch target, FP, branch)
-			*(uint32_t*)(src_program + i) &= ~(0xF8U << 8);
+		src_program[i].x = x;
+	}
 
-			const uint2 src_inst = src_program[i];
-			uint2 inst = src_inst;
+	__syncwarp();
 
-			uint32_t opcode = inst.x & 0xff;
-			const uint32_t dst = (inst.x >> 8) & 7;
-			const uint32_t src = (inst.x >> 16) & 7;
+	// Initialize CBRANCH instructions
+	// Each lane tracks when its integer register was last changed, condition registers are selected with a warp-wide minimum
+	{
+		int32_t reg_last_changed = -1;
+		uint32_t reg_usage_count = 0;
 
-			if (opcode < RANDOMX_FREQ_IADD_RS + RANDOMX_FREQ_IADD_M + RANDOMX_FREQ_ISUB_R + RANDOMX_FREQ_ISUB_M + RANDOMX_FREQ_IMUL_R + RANDOMX_FREQ_IMUL_M + RANDOMX_FREQ_IMULH_R + RANDOMX_FREQ_IMULH_M + RANDOMX_FREQ_ISMULH_R + RANDOMX_FREQ_ISMULH_M)
-			{
-				set_byte(registerLastChanged, dst, i);
-				set_byte(registerWasChanged, dst, 1);
-				continue;
-			}
-			opcode -= RANDOMX_FREQ_IADD_RS + RANDOMX_FREQ_IADD_M + RANDOMX_FREQ_ISUB_R + RANDOMX_FREQ_ISUB_M + RANDOMX_FREQ_IMUL_R + RANDOMX_FREQ_IMUL_M + RANDOMX_FREQ_IMULH_R + RANDOMX_FREQ_IMULH_M + RANDOMX_FREQ_ISMULH_R + RANDOMX_FREQ_ISMULH_M;
+		for (uint32_t i = 0; i < RANDOMX_PROGRAM_SIZE; ++i)
+		{
+			const uint2 src_inst = src_program[i];
 
-			if (opcode < RANDOMX_FREQ_IMUL_RCP)
-			{
-				if (inst.y & (inst.y - 1))
-				{
-					set_byte(registerLastChanged, dst, i);
-					set_byte(registerWasChanged, dst, 1);
-				}
-				continue;
-			}
-			opcode -= RANDOMX_FREQ_IMUL_RCP;
+			const OpcodeInfo info = opcode_info<VARIANT>(src_inst.x);
+			const uint32_t dst = (src_inst.x >> 8) & 7;
+			const uint32_t src = (src_inst.x >> 16) & 7;
 
-			if (opcode < RANDOMX_FREQ_INEG_R + RANDOMX_FREQ_IXOR_R + RANDOMX_FREQ_IXOR_M + RANDOMX_FREQ_IROR_R)
+			if (info.flags & OPCODE_INT_DST)
 			{
-				set_byte(registerLastChanged, dst, i);
-				set_byte(registerWasChanged, dst, 1);
+				// IMUL_RCP with a power of 2 is a NOP
+				if ((dst == sub) && ((info.type != RX_IMUL_RCP) || (src_inst.y & (src_inst.y - 1))))
+					reg_last_changed = i;
 				continue;
 			}
-			opcode -= RANDOMX_FREQ_INEG_R + RANDOMX_FREQ_IXOR_R + RANDOMX_FREQ_IXOR_M + RANDOMX_FREQ_IROR_R;
 
-			if (opcode < RANDOMX_FREQ_ISWAP_R)
+			if (info.type == RX_ISWAP_R)
 			{
-				if (src != dst)
-				{
-					set_byte(registerLastChanged, dst, i);
-					set_byte(registerWasChanged, dst, 1);
-					set_byte(registerLastChanged, src, i);
-					set_byte(registerWasChanged, src, 1);
-				}
+				if ((src != dst) && ((dst == sub) || (src == sub)))
+					reg_last_changed = i;
 				continue;
 			}
-			opcode -= RANDOMX_FREQ_ISWAP_R;
 
-			if (opcode < RANDOMX_FREQ_FSWAP_R + RANDOMX_FREQ_FADD_R + RANDOMX_FREQ_FADD_M + RANDOMX_FREQ_FSUB_R + RANDOMX_FREQ_FSUB_M + RANDOMX_FREQ_FSCAL_R + RANDOMX_FREQ_FMUL_R + RANDOMX_FREQ_FDIV_M + RANDOMX_FREQ_FSQRT_R)
+			if (info.type == RX_CBRANCH)
 			{
-				// Mark FP instruction (src |= 0x20)
-				*(uint32_t*)(src_program + i) |= 0x20 << 8;
-				continue;
-			}
-			opcode -= RANDOMX_FREQ_FSWAP_R + RANDOMX_FREQ_FADD_R + RANDOMX_FREQ_FADD_M + RANDOMX_FREQ_FSUB_R + RANDOMX_FREQ_FSUB_M + RANDOMX_FREQ_FSCAL_R + RANDOMX_FREQ_FMUL_R + RANDOMX_FREQ_FDIV_M + RANDOMX_FREQ_FSQRT_R;
+				// Pick the register which was changed earliest, then the least used one, then the one with the lowest index
+				const uint32_t key = min_lanes8(lanes_mask, (static_cast<uint32_t>(reg_last_changed + 1) << 20) | (reg_usage_count << 4) | sub);
 
-			if (opcode < RANDOMX_FREQ_CBRANCH)
-			{
-				int32_t lastChanged;
-				uint32_t creg = get_condition_register(registerLastChanged, registerWasChanged, registerUsageCount, lastChanged);
+				const uint32_t creg = key & 7;
+				const int32_t lastChanged = static_cast<int32_t>(key >> 20) - 1;
 
-				// Store condition register and branch target in CBRANCH instruction
-				*(uint32_t*)(src_program + i) = (src_inst.x & 0xFF0000FFU) | ((creg | ((lastChanged == -1) ? 0x90 : 0x10)) << 8) | ((static_cast<uint32_t>(lastChanged) & 0xFF) << 16);
+				if (sub == creg)
+					++reg_usage_count;
 
-				// Mark branch target instruction (src |= 0x40)
-				*(uint32_t*)(src_program + lastChanged + 1) |= 0x40 << 8;
+				if (sub == 0)
+				{
+					// Store condition register and branch target in CBRANCH instruction
+					*(uint32_t*)(src_program + i) = (src_inst.x & 0xFF0000FFU) | ((creg | ((lastChanged == -1) ? 0x90 : 0x10)) << 8) | ((static_cast<uint32_t>(lastChanged) & 0xFF) << 16);
 
-				uint32_t tmp = i | (i << 8);
-				registerLastChanged = tmp | (tmp << 16);
-				registerLastChanged = registerLastChanged | (registerLastChanged << 32);
+					// Mark branch target instruction (src |= 0x40)
+					*(uint32_t*)(src_program + lastChanged + 1) |= 0x40 << 8;
+				}
 
-				registerWasChanged = 0x0101010101010101ULL;
+				reg_last_changed = i;
 			}
 		}
+	}
 
-		uint64_t registerLatency = 0;
-		uint64_t registerReadCycle = 0;
-		uint64_t registerLatencyFP = 0;
-		uint64_t registerReadCycleFP = 0;
-		uint32_t ScratchpadHighLatency = 0;
-		uint32_t ScratchpadLatency = 0;
-
-		int32_t first_available_slot = 0;
-		int32_t first_allowed_slot_cfround = 0;
-		int32_t last_used_slot = -1;
-		int32_t last_memory_op_slot = -1;
-
-		uint32_t num_slots_used = 0;
-		uint32_t num_instructions = 0;
+	__syncwarp();
 
-		int32_t first_instruction_slot = -1;
-		bool first_instruction_fp = false;
+	// Logical -> physical register mapping at the end of the program
+	// Bits 0-23: physical integer register for each logical register (3 bits each), bits 24-31: FP registers with swapped halves
+	uint32_t end_map = 0xFAC688U;
 
-		//if (global_index == 0)
-		//{
-		//	for (int j = 0; j < RANDOMX_PROGRAM_SIZE; ++j)
-		//	{
-		//		print_inst(src_program[j]);
-		//		printf("\n");
-		//	}
-		//	printf("\n");
-		//}
-
-		// Schedule instructions
-		bool update_branch_target_mark = false;
-		bool first_available_slot_is_branch_target = false;
-		for (uint32_t i = 0; i < RANDOMX_PROGRAM_SIZE; ++i)
+#if COMPILE_PROGRAM_RENAME_SWAPS
+	// Remove ISWAP_R and FSWAP_R by renaming registers
+	// Swaps inside of CBRANCH loops (from branch target to CBRANCH) are kept, so every pass through a loop sees the same mapping
+	// Instructions after a removed swap are rewritten to use physical registers, execute_vm restores the architectural mapping at the end of each iteration
+	static_assert(opcode_frequency(VARIANT::INSTRUCTION_FREQUENCIES, RX_ISWAP_R) > 0, "A removed FSWAP_R becomes ISWAP_R r0, r0, so the variant must have ISWAP_R opcodes");
+	if (sub == 0)
+	{
+		// Mark instructions inside of CBRANCH loops (src |= 0x08)
+		int32_t loop_start = RANDOMX_PROGRAM_SIZE;
+		for (int32_t i = RANDOMX_PROGRAM_SIZE - 1; i >= 0; --i)
 		{
-			const uint2 inst = src_program[i];
-
-			uint32_t opcode = inst.x & 0xff;
-			uint32_t dst = (inst.x >> 8) & 7;
-			const uint32_t src = (inst.x >> 16) & 7;
-			const uint32_t mod = (inst.x >> 24);
-
-			bool is_branch_target = (inst.x & (0x40 << 8)) != 0;
-			if (is_branch_target)
+			const uint32_t x = src_program[i].x;
+			if (x & (0x10 << 8))
 			{
-				// If an instruction is a branch target, we can't move it before any previous instructions
-				first_available_slot = last_used_slot + 1;
-
-				// Mark this slot as a branch target
-				// Whatever instruction takes this slot will receive branch target flag
-				first_available_slot_is_branch_target = true;
+				const int32_t target = (x & (0x80 << 8)) ? 0 : static_cast<int32_t>((x >> 16) & 0xFF) + 1;
+				if (target < loop_start)
+					loop_start = target;
 			}
+			if (i >= loop_start)
+				src_program[i].x = x | (0x08 << 8);
+		}
 
-			const uint32_t dst_latency = get_byte(registerLatency, dst);
-			const uint32_t src_latency = get_byte(registerLatency, src);
-			const uint32_t reg_read_latency = (dst_latency > src_latency) ? dst_latency : src_latency;
-			const uint32_t mem_read_latency = ((dst == src) && ((inst.y & ScratchpadL3Mask64) >= RANDOMX_SCRATCHPAD_L2)) ? ScratchpadHighLatency : ScratchpadLatency;
+		uint32_t int_map = 0xFAC688U;
+		uint32_t fp_swapped = 0;
 
-			uint32_t full_read_latency = mem_read_latency;
-			update_max(full_read_latency, reg_read_latency);
+		for (uint32_t i = 0; i < RANDOMX_PROGRAM_SIZE; ++i)
+		{
+			uint32_t x = src_program[i].x;
 
-			uint32_t latency = 0;
-			bool is_memory_op = false;
-			bool is_memory_store = false;
-			bool is_nop = false;
-			bool is_branch = false;
-			bool is_swap = false;
-			bool is_src_read = true;
-			bool is_fp = false;
-			bool is_cfround = false;
+			const OpcodeInfo info = opcode_info<VARIANT>(x);
+			const uint32_t dst = (x >> 8) & 7;
+			const uint32_t src = (x >> 16) & 7;
+			const uint32_t phys_dst = (int_map >> (dst * 3)) & 7;
+			const uint32_t phys_src = (int_map >> (src * 3)) & 7;
+			const bool in_loop = (x & (0x08 << 8)) != 0;
 
-			do {
-				if (opcode < RANDOMX_FREQ_IADD_RS)
-				{
-					latency = reg_read_latency;
-					break;
-				}
-				opcode -= RANDOMX_FREQ_IADD_RS;
+			if ((info.type == RX_ISWAP_R) && (dst != src) && !in_loop)
+			{
+				int_map &= ~((7U << (dst * 3)) | (7U << (src * 3)));
+				int_map |= (phys_src << (dst * 3)) | (phys_dst << (src * 3));
 
-				if (opcode < RANDOMX_FREQ_IADD_M)
+				// ISWAP_R with src == dst is a NOP
+				x = (x & 0xFF00FFFFU) | (dst << 16);
+			}
+			else if (info.type == RX_FSWAP_R)
+			{
+				if (!in_loop)
 				{
-					latency = full_read_latency;
-					is_memory_op = true;
-					break;
-				}
-				opcode -= RANDOMX_FREQ_IADD_M;
+					fp_swapped ^= 1U << dst;
 
-				if (opcode < RANDOMX_FREQ_ISUB_R)
-				{
-					latency = reg_read_latency;
-					break;
+					// Turn it into ISWAP_R r0, r0 (NOP), keep the branch target flag
+					x = (x & 0xFF00D800U) | opcode_begin(VARIANT::INSTRUCTION_FREQUENCIES, RX_ISWAP_R);
 				}
-				opcode -= RANDOMX_FREQ_ISUB_R;
+			}
+			else if (info.flags & OPCODE_FP)
+			{
+				const uint32_t fp_dst = dst % randomx::RegisterCountFlt + ((info.flags & OPCODE_E_DST) ? randomx::RegisterCountFlt : 0);
+				const bool is_mem = (info.flags & OPCODE_MEM) != 0;
 
-				if (opcode < RANDOMX_FREQ_ISUB_M)
-				{
-					latency = full_read_latency;
-					is_memory_op = true;
-					break;
-				}
-				opcode -= RANDOMX_FREQ_ISUB_M;
+				// Swapped halves of the dst register are marked in src (src |= 0x08)
+				x = (x & 0xFF00FFFFU) | ((is_mem ? phys_src : src) << 16) | (((fp_swapped >> fp_dst) & 1) << 19);
+			}
+			else if (info.type == RX_CBRANCH)
+			{
+				x = (x & 0xFFFFF8FFU) | (phys_dst << 8);
+			}
+			else if (info.type == RX_CFROUND)
+			{
+				x = (x & 0xFF00FFFFU) | (phys_src << 16);
+			}
+			else
+			{
+				x = (x & 0xFF00F8FFU) | (phys_dst << 8) | (phys_src << 16);
 
-				if (opcode < RANDOMX_FREQ_IMUL_R)
-				{
-					latency = reg_read_latency;
-					break;
-				}
-				opcode -= RANDOMX_FREQ_IMUL_R;
+				// IADD_RS with displacement is selected by the logical dst register (src |= 0x08)
+				if ((info.type == RX_IADD_RS) && (dst == randomx::RegisterNeedsDisplacement))
+					x |= 0x08 << 16;
+			}
 
-				if (opcode < RANDOMX_FREQ_IMUL_M)
-				{
-					latency = full_read_latency;
-					is_memory_op = true;
-					break;
-				}
-				opcode -= RANDOMX_FREQ_IMUL_M;
+			src_program[i].x = x;
+		}
 
-				if (opcode < RANDOMX_FREQ_IMULH_R)
-				{
-					latency = reg_read_latency;
-					break;
-				}
-				opcode -= RANDOMX_FREQ_IMULH_R;
+		end_map = int_map | (fp_swapped << 24);
+	}
 
-				if (opcode < RANDOMX_FREQ_IMULH_M)
-				{
-					latency = full_read_latency;
-					is_memory_op = true;
-					break;
-				}
-				opcode -= RANDOMX_FREQ_IMULH_M;
+	__syncwarp();
+#endif
+
+	// Schedule instructions
+	// All lanes of a hash run the scheduler in lockstep and keep identical copies of its state.
+	// Every lane performs the same stores to execution_plan and src_program, so each lane always sees an up to date plan
+	// and slot searches can be split between lanes without extra synchronization.
+	uint64_t registerLatency = 0;
+	uint64_t registerReadCycle = 0;
+	uint64_t registerLatencyFP = 0;
+	uint64_t registerReadCycleFP = 0;
+	uint32_t ScratchpadHighLatency = 0;
+	uint32_t ScratchpadLatency = 0;
+
+	int32_t first_available_slot = 0;
+	int32_t first_allowed_slot_cfround = 0;
+	int32_t last_used_slot = -1;
+	int32_t last_memory_op_slot = -1;
+
+	uint32_t num_slots_used = 0;
+	uint32_t num_instructions = 0;
+
+	int32_t first_instruction_slot = -1;
+	bool first_instruction_fp = false;
 
-				if (opcode < RANDOMX_FREQ_ISMULH_R)
-				{
-					latency = reg_read_latency;
-					break;
-				}
-				opcode -= RANDOMX_FREQ_ISMULH_R;
+	//if (global_index == 0)
+	//{
+	//	for (int j = 0; j < RANDOMX_PROGRAM_SIZE; ++j)
+	//	{
+	//		print_inst<VARIANT>(src_program[j]);
+	//		printf("\n");
+	//	}
+	//	printf("\n");
+	//}
 
-				if (opcode < RANDOMX_FREQ_ISMULH_M)
-				{
-					latency = full_read_latency;
-					is_memory_op = true;
-					break;
-				}
-				opcode -= RANDOMX_FREQ_ISMULH_M;
+	// Schedule instructions
+	bool update_branch_target_mark = false;
+	bool first_available_slot_is_branch_target = false;
+	for (uint32_t i = 0; i < RANDOMX_PROGRAM_SIZE; ++i)
+	{
+		const uint2 inst = src_program[i];
 
-				if (opcode < RANDOMX_FREQ_IMUL_RCP)
-				{
-					is_src_read = false;
-					if (inst.y & (inst.y - 1))
-						latency = dst_latency;
-					else
-						is_nop = true;
-					break;
-				}
-				opcode -= RANDOMX_FREQ_IMUL_RCP;
+		// Other lanes can mark this instruction as a branch target below
+		__syncwarp(lanes_mask);
 
-				if (opcode < RANDOMX_FREQ_INEG_R)
-				{
-					is_src_read = false;
-					latency = dst_latency;
-					break;
-				}
-				opcode -= RANDOMX_FREQ_INEG_R;
+		const OpcodeInfo info = opcode_info<VARIANT>(inst.x);
+		uint32_t dst = (inst.x >> 8) & 7;
+		const uint32_t src = (inst.x >> 16) & 7;
+		const uint32_t mod = (inst.x >> 24);
 
-				if (opcode < RANDOMX_FREQ_IXOR_R)
-				{
-					latency = reg_read_latency;
-					break;
-				}
-				opcode -= RANDOMX_FREQ_IXOR_R;
+		bool is_branch_target = (inst.x & (0x40 << 8)) != 0;
+		if (is_branch_target)
+		{
+			// If an instruction is a branch target, we can't move it before any previous instructions
+			first_available_slot = last_used_slot + 1;
 
-				if (opcode < RANDOMX_FREQ_IXOR_M)
-				{
-					latency = full_read_latency;
-					is_memory_op = true;
-					break;
-				}
-				opcode -= RANDOMX_FREQ_IXOR_M;
+			// Mark this slot as a branch target
+			// Whatever instruction takes this slot will receive branch target flag
+			first_available_slot_is_branch_target = true;
+		}
 
-				if (opcode < RANDOMX_FREQ_IROR_R)
-				{
-					latency = reg_read_latency;
-					break;
-				}
-				opcode -= RANDOMX_FREQ_IROR_R;
+		const uint32_t dst_latency = get_byte(registerLatency, dst);
+		const uint32_t src_latency = get_byte(registerLatency, src);
+		const uint32_t reg_read_latency = (dst_latency > src_latency) ? dst_latency : src_latency;
+		const uint32_t mem_read_latency = ((dst == src) && ((inst.y & VARIANT::ScratchpadL3Mask64) >= VARIANT::SCRATCHPAD_L2_SIZE)) ? ScratchpadHighLatency : ScratchpadLatency;
+
+		uint32_t full_read_latency = mem_read_latency;
+		update_max(full_read_latency, reg_read_latency);
+
+		uint32_t latency = 0;
+		bool is_memory_op = (info.flags & OPCODE_MEM) != 0;
+		bool is_memory_store = false;
+		bool is_nop = false;
+		bool is_branch = false;
+		bool is_swap = false;
+		const bool is_src_read = (info.flags & OPCODE_INT_SRC) != 0;
+		const bool is_fp = (info.flags & OPCODE_FP) != 0;
+		bool is_cfround = false;
+
+		switch (info.type)
+		{
+		case RX_IMUL_RCP:
+			if (inst.y & (inst.y - 1))
+				latency = dst_latency;
+			else
+				is_nop = true;
+			break;
 
-				if (opcode < RANDOMX_FREQ_ISWAP_R)
-				{
-					is_swap = true;
-					if (dst != src)
-						latency = reg_read_latency;
-					else
-						is_nop = true;
-					break;
-				}
-				opcode -= RANDOMX_FREQ_ISWAP_R;
+		case RX_INEG_R:
+			latency = dst_latency;
+			break;
 
-				if (opcode < RANDOMX_FREQ_FSWAP_R)
-				{
-					latency = get_byte(registerLatencyFP, dst);
-					is_fp = true;
-					is_src_read = false;
-					break;
-				}
-				opcode -= RANDOMX_FREQ_FSWAP_R;
+		case RX_ISWAP_R:
+			is_swap = true;
+			if (dst != src)
+				latency = reg_read_latency;
+			else
+				is_nop = true;
+			break;
 
-				if (opcode < RANDOMX_FREQ_FADD_R)
-				{
-					dst %= randomx::RegisterCountFlt;
-					latency = get_byte(registerLatencyFP, dst);
-					is_fp = true;
-					is_src_read = false;
-					break;
-				}
-				opcode -= RANDOMX_FREQ_FADD_R;
+		case RX_FSWAP_R:
+			latency = get_byte(registerLatencyFP, dst);
+			break;
 
-				if (opcode < RANDOMX_FREQ_FADD_M)
-				{
-					dst %= randomx::RegisterCountFlt;
-					latency = get_byte(registerLatencyFP, dst);
-					update_max(latency, src_latency);
-					update_max(latency, ScratchpadLatency);
-					is_fp = true;
-					is_memory_op = true;
-					break;
-				}
-				opcode -= RANDOMX_FREQ_FADD_M;
+		case RX_CBRANCH:
+			is_branch = true;
+			latency = dst_latency;
 
-				if (opcode < RANDOMX_FREQ_FSUB_R)
-				{
-					dst %= randomx::RegisterCountFlt;
-					latency = get_byte(registerLatencyFP, dst);
-					is_fp = true;
-					is_src_read = false;
-					break;
-				}
-				opcode -= RANDOMX_FREQ_FSUB_R;
+			// We can't move CBRANCH before any previous instructions
+			first_available_slot = last_used_slot + 1;
+			break;
 
-				if (opcode < RANDOMX_FREQ_FSUB_M)
-				{
-					dst %= randomx::RegisterCountFlt;
-					latency = get_byte(registerLatencyFP, dst);
-					update_max(latency, src_latency);
-					update_max(latency, ScratchpadLatency);
-					is_fp = true;
-					is_memory_op = true;
-					break;
-				}
-				opcode -= RANDOMX_FREQ_FSUB_M;
+		case RX_CFROUND:
+			latency = src_latency;
+			is_cfround = true;
+			break;
 
-				if (opcode < RANDOMX_FREQ_FSCAL_R)
-				{
-					dst %= randomx::RegisterCountFlt;
-					latency = get_byte(registerLatencyFP, dst);
-					is_fp = true;
-					is_src_read = false;
-					break;
-				}
-				opcode -= RANDOMX_FREQ_FSCAL_R;
+		case RX_ISTORE:
+			latency = reg_read_latency;
+			update_max(latency, (last_memory_op_slot + WORKERS_PER_HASH) / WORKERS_PER_HASH);
+			is_memory_op = true;
+			is_memory_store = true;
+			break;
 
-				if (opcode < RANDOMX_FREQ_FMUL_R)
-				{
-					dst = (dst % randomx::RegisterCountFlt) + randomx::RegisterCountFlt;
-					latency = get_byte(registerLatencyFP, dst);
-					is_fp = true;
-					is_src_read = false;
-					break;
-				}
-				opcode -= RANDOMX_FREQ_FMUL_R;
+		case RX_NOP:
+			is_nop = true;
+			break;
 
-				if (opcode < RANDOMX_FREQ_FDIV_M)
+		default:
+			if (is_fp)
+			{
+				dst = (dst % randomx::RegisterCountFlt) + ((info.flags & OPCODE_E_DST) ? randomx::RegisterCountFlt : 0);
+				latency = get_byte(registerLatencyFP, dst);
+				if (is_memory_op)
 				{
-					dst = (dst % randomx::RegisterCountFlt) + randomx::RegisterCountFlt;
-					latency = get_byte(registerLatencyFP, dst);
 					update_max(latency, src_latency);
 					update_max(latency, ScratchpadLatency);
-					is_fp = true;
-					is_memory_op = true;
-					break;
-				}
-				opcode -= RANDOMX_FREQ_FDIV_M;
-
-				if (opcode < RANDOMX_FREQ_FSQRT_R)
-				{
-					dst = (dst % randomx::RegisterCountFlt) + randomx::RegisterCountFlt;
-					latency = get_byte(registerLatencyFP, dst);
-					is_fp = true;
-					is_src_read = false;
-					break;
 				}
-				opcode -= RANDOMX_FREQ_FSQRT_R;
+			}
+			else
+			{
+				latency = is_memory_op ? full_read_latency : reg_read_latency;
+			}
+			break;
+		}
 
-				if (opcode < RANDOMX_FREQ_CBRANCH)
-				{
-					is_src_read = false;
-					is_branch = true;
-					latency = dst_latency;
+		if (is_nop)
+		{
+			if (is_branch_target)
+			{
+				// Mark next non-NOP instruction as the branch target instead of this NOP
+				update_branch_target_mark = true;
+			}
+			continue;
+		}
 
-					// We can't move CBRANCH before any previous instructions
-					first_available_slot = last_used_slot + 1;
-					break;
-				}
-				opcode -= RANDOMX_FREQ_CBRANCH;
+		if (update_branch_target_mark)
+		{
+			*(uint32_t*)(src_program + i) |= 0x40 << 8;
+			update_branch_target_mark = false;
+			is_branch_target = true;
+		}
 
-				if (opcode < RANDOMX_FREQ_CFROUND)
-				{
-					latency = src_latency;
-					is_cfround = true;
-					break;
-				}
-				opcode -= RANDOMX_FREQ_CFROUND;
+		int32_t first_allowed_slot = first_available_slot;
+		update_max(first_allowed_slot, latency * WORKERS_PER_HASH);
+		if (is_cfround)
+			update_max(first_allowed_slot, first_allowed_slot_cfround);
+		else
+			update_max(first_allowed_slot, get_byte(is_fp ? registerReadCycleFP : registerReadCycle, dst) * WORKERS_PER_HASH);
 
-				if (opcode < RANDOMX_FREQ_ISTORE)
-				{
-					latency = reg_read_latency;
-					update_max(latency, (last_memory_op_slot + WORKERS_PER_HASH) / WORKERS_PER_HASH);
-					is_memory_op = true;
-					is_memory_store = true;
-					break;
-				}
-				opcode -= RANDOMX_FREQ_ISTORE;
+		if (is_swap)
+			update_max(first_allowed_slot, get_byte(registerReadCycle, src) * WORKERS_PER_HASH);
 
-				is_nop = true;
-			} while (false);
+		int32_t slot_to_use = last_used_slot + 1;
+		update_max(slot_to_use, first_allowed_slot);
 
-			if (is_nop)
-			{
-				if (is_branch_target)
-				{
-					// Mark next non-NOP instruction as the branch target instead of this NOP
-					update_branch_target_mark = true;
-				}
-				continue;
-			}
+		// Instructions which other instructions are ordered around keep the first slot they can take
+		const uint32_t cost = (COMPILE_PROGRAM_COST_WINDOW && !is_branch && !is_branch_target && !first_available_slot_is_branch_target && !is_cfround) ? instruction_cost<VARIANT, WORKERS_PER_HASH>(inst) : 0;
 
-			if (update_branch_target_mark)
+		if (is_fp)
+		{
+			int32_t slot = -1;
+			for (int32_t j0 = first_allowed_slot; (slot < 0) && (j0 < RANDOMX_PROGRAM_SIZE * WORKERS_PER_HASH); j0 += 8)
 			{
-				*(uint32_t*)(src_program + i) |= 0x40 << 8;
-				update_branch_target_mark = false;
-				is_branch_target = true;
+				// Each lane checks one candidate slot, the first suitable one wins
+				const int32_t lane = first_set_lane(lanes_mask, fp_slots_suitable<WORKERS_PER_HASH>(src_program, execution_plan, j0 + sub, first_instruction_slot, is_branch_target));
+				if (lane >= 0)
+					slot = j0 + lane;
 			}
 
-			int32_t first_allowed_slot = first_available_slot;
-			update_max(first_allowed_slot, latency * WORKERS_PER_HASH);
-			if (is_cfround)
-				update_max(first_allowed_slot, first_allowed_slot_cfround);
-			else
-				update_max(first_allowed_slot, get_byte(is_fp ? registerReadCycleFP : registerReadCycle, dst) * WORKERS_PER_HASH);
-
-			if (is_swap)
-				update_max(first_allowed_slot, get_byte(registerReadCycle, src) * WORKERS_PER_HASH);
-
-			int32_t slot_to_use = last_used_slot + 1;
-			update_max(slot_to_use, first_allowed_slot);
+			// An instruction never starts more than one group after the last used slot, so all RANDOMX_PROGRAM_SIZE instructions fit in the plan
+			// and the first group after last_used_slot always has a free pair. Stop with a launch error rather than write past the plan
+			if (slot < 0)
+				__trap();
 
-			if (is_fp)
+			// A group which already has an instruction at least as expensive takes this one for free
+			if (cost)
 			{
-				slot_to_use = -1;
-				for (int32_t j = first_allowed_slot; slot_to_use < 0; ++j)
+				const int32_t last_slot = min(last_used_slot, (slot / WORKERS_PER_HASH + COMPILE_PROGRAM_COST_WINDOW + 1) * WORKERS_PER_HASH - 1);
+				for (int32_t j0 = slot; j0 <= last_slot; j0 += 8)
 				{
-					if ((execution_plan[j] == 0) && (execution_plan[j + 1] == 0) && ((j + 1) % WORKERS_PER_HASH))
+					const int32_t j = j0 + sub;
+					const bool suitable = (j <= last_slot) && fp_slots_suitable<WORKERS_PER_HASH>(src_program, execution_plan, j, first_instruction_slot, is_branch_target) &&
+						slot_is_free(execution_plan, j, first_instruction_slot, first_instruction_fp) && slot_is_free(execution_plan, j + 1, first_instruction_slot, first_instruction_fp) && (group_cost<VARIANT, WORKERS_PER_HASH>(src_program, execution_plan, j, first_instruction_slot) >= cost);
+
+					const int32_t lane = first_set_lane(lanes_mask, suitable);
+					if (lane >= 0)
 					{
-						bool blocked = false;
-						for (int32_t k = (j / WORKERS_PER_HASH) * WORKERS_PER_HASH; k < j; ++k)
-						{
-							if (execution_plan[k] || (k == first_instruction_slot))
-							{
-								const uint32_t inst = src_program[execution_plan[k]].x;
-
-								// If there is an integer instruction which is a branch target or a branch, or this FP instruction is a branch target itself, we can't reorder it to add more FP instructions to this cycle
-								if (((inst & (0x20 << 8)) == 0) && (((inst & (0x50 << 8)) != 0) || is_branch_target))
-								{
-									blocked = true;
-									continue;
-								}
-							}
-						}
-
-						if (!blocked)
-						{
-							for (int32_t k = (j / WORKERS_PER_HASH) * WORKERS_PER_HASH; k < j; ++k)
-							{
-								if (execution_plan[k] || (k == first_instruction_slot))
-								{
-									const uint32_t inst = src_program[execution_plan[k]].x;
-									if ((inst & (0x20 << 8)) == 0)
-									{
-										execution_plan[j] = execution_plan[k];
-										execution_plan[j + 1] = execution_plan[k + 1];
-										if (first_instruction_slot == k) first_instruction_slot = j;
-										if (first_instruction_slot == k + 1) first_instruction_slot = j + 1;
-										slot_to_use = k;
-										break;
-									}
-								}
-							}
-
-							if (slot_to_use < 0)
-							{
-								slot_to_use = j;
-							}
-
-							break;
-						}
+						slot = j0 + lane;
+						break;
 					}
 				}
 			}
-			else
+
+			// FP instructions come first in a group, so integer instructions before the chosen slot are moved after it
+			slot_to_use = slot;
+			for (int32_t k = (slot / WORKERS_PER_HASH) * WORKERS_PER_HASH; k < slot; ++k)
 			{
-				for (int32_t j = first_allowed_slot; j <= last_used_slot; ++j)
+				if (execution_plan[k] || (k == first_instruction_slot))
 				{
-					if (execution_plan[j] == 0)
+					const uint32_t x = src_program[execution_plan[k]].x;
+					if ((x & (0x20 << 8)) == 0)
 					{
-						slot_to_use = j;
+						execution_plan[slot] = execution_plan[k];
+						execution_plan[slot + 1] = execution_plan[k + 1];
+						if (first_instruction_slot == k) first_instruction_slot = slot;
+						if (first_instruction_slot == k + 1) first_instruction_slot = slot + 1;
+						slot_to_use = k;
 						break;
 					}
 				}
 			}
-
-			if (i == 0)
+		}
+		else
+		{
+			for (int32_t j0 = first_allowed_slot; j0 <= last_used_slot; j0 += 8)
 			{
-				first_instruction_slot = slot_to_use;
-				first_instruction_fp = is_fp;
+				const int32_t j = j0 + sub;
+				const int32_t lane = first_set_lane(lanes_mask, (j <= last_used_slot) && (execution_plan[j] == 0));
+				if (lane >= 0)
+				{
+					slot_to_use = j0 + lane;
+					break;
+				}
 			}
 
-			if (is_cfround)
+			// Same as for FP instructions, but only holes in existing groups are considered
+			if (cost && (slot_to_use <= last_used_slot))
 			{
-				first_allowed_slot_cfround = slot_to_use - (slot_to_use % WORKERS_PER_HASH) + WORKERS_PER_HASH;
+				const int32_t last_slot = min(last_used_slot, (slot_to_use / WORKERS_PER_HASH + COMPILE_PROGRAM_COST_WINDOW + 1) * WORKERS_PER_HASH - 1);
+				for (int32_t j0 = slot_to_use; j0 <= last_slot; j0 += 8)
+				{
+					const int32_t j = j0 + sub;
+					const bool suitable = (j <= last_slot) && slot_is_free(execution_plan, j, first_instruction_slot, first_instruction_fp) && (group_cost<VARIANT, WORKERS_PER_HASH>(src_program, execution_plan, j, first_instruction_slot) >= cost);
+
+					const int32_t lane = first_set_lane(lanes_mask, suitable);
+					if (lane >= 0)
+					{
+						slot_to_use = j0 + lane;
+						break;
+					}
+				}
 			}
+		}
+
+		if (slot_to_use >= RANDOMX_PROGRAM_SIZE * WORKERS_PER_HASH)
+			__trap();
+
+		if (i == 0)
+		{
+			first_instruction_slot = slot_to_use;
+			first_instruction_fp = is_fp;
+		}
+
+		if (is_cfround)
+		{
+			first_allowed_slot_cfround = slot_to_use - (slot_to_use % WORKERS_PER_HASH) + WORKERS_PER_HASH;
+		}
+
+		++num_instructions;
+
+		// All lanes must finish reading execution_plan before it's updated
+		__syncwarp(lanes_mask);
 
-			++num_instructions;
+		execution_plan[slot_to_use] = i;
+		++num_slots_used;
 
-			execution_plan[slot_to_use] = i;
+		if (is_fp)
+		{
+			execution_plan[slot_to_use + 1] = i;
 			++num_slots_used;
+		}
 
-			if (is_fp)
-			{
-				execution_plan[slot_to_use + 1] = i;
-				++num_slots_used;
-			}
+		const uint32_t next_latency = (slot_to_use / WORKERS_PER_HASH) + 1;
 
-			const uint32_t next_latency = (slot_to_use / WORKERS_PER_HASH) + 1;
+		if (is_src_read)
+		{
+			int32_t value = get_byte(registerReadCycle, src);
+			update_max(value, slot_to_use / WORKERS_PER_HASH);
+			set_byte(registerReadCycle, src, value);
+		}
 
-			if (is_src_read)
-			{
-				int32_t value = get_byte(registerReadCycle, src);
-				update_max(value, slot_to_use / WORKERS_PER_HASH);
-				set_byte(registerReadCycle, src, value);
-			}
+		if (is_memory_op)
+		{
+			update_max(last_memory_op_slot, slot_to_use);
+		}
+
+		if (is_cfround)
+		{
+			const uint32_t t = next_latency | (next_latency << 8);
+			registerLatencyFP = t | (t << 16);
+			registerLatencyFP = registerLatencyFP | (registerLatencyFP << 32);
+		}
+		else if (is_fp)
+		{
+			set_byte(registerLatencyFP, dst, next_latency);
 
-			if (is_memory_op)
+			int32_t value = get_byte(registerReadCycleFP, dst);
+			update_max(value, slot_to_use / WORKERS_PER_HASH);
+			set_byte(registerReadCycleFP, dst, value);
+		}
+		else
+		{
+			if (!is_memory_store && !is_nop)
 			{
-				update_max(last_memory_op_slot, slot_to_use);
+				set_byte(registerLatency, dst, next_latency);
+				if (is_swap)
+					set_byte(registerLatency, src, next_latency);
+
+				int32_t value = get_byte(registerReadCycle, dst);
+				update_max(value, slot_to_use / WORKERS_PER_HASH);
+				set_byte(registerReadCycle, dst, value);
 			}
 
-			if (is_cfround)
+			if (is_branch)
 			{
 				const uint32_t t = next_latency | (next_latency << 8);
-				registerLatencyFP = t | (t << 16);
-				registerLatencyFP = registerLatencyFP | (registerLatencyFP << 32);
+				registerLatency = t | (t << 16);
+				registerLatency = registerLatency | (registerLatency << 32);
 			}
-			else if (is_fp)
-			{
-				set_byte(registerLatencyFP, dst, next_latency);
 
-				int32_t value = get_byte(registerReadCycleFP, dst);
+			if (is_memory_store)
+			{
+				int32_t value = get_byte(registerReadCycle, dst);
 				update_max(value, slot_to_use / WORKERS_PER_HASH);
-				set_byte(registerReadCycleFP, dst, value);
+				set_byte(registerReadCycle, dst, value);
+				ScratchpadLatency = slot_to_use / WORKERS_PER_HASH;
+				if ((mod >> 4) >= randomx::StoreL3Condition)
+					ScratchpadHighLatency = slot_to_use / WORKERS_PER_HASH;
 			}
-			else
-			{
-				if (!is_memory_store && !is_nop)
-				{
-					set_byte(registerLatency, dst, next_latency);
-					if (is_swap)
-						set_byte(registerLatency, src, next_latency);
-
-					int32_t value = get_byte(registerReadCycle, dst);
-					update_max(value, slot_to_use / WORKERS_PER_HASH);
-					set_byte(registerReadCycle, dst, value);
-				}
-
-				if (is_branch)
-				{
-					const uint32_t t = next_latency | (next_latency << 8);
-					registerLatency = t | (t << 16);
-					registerLatency = registerLatency | (registerLatency << 32);
-				}
+		}
 
-				if (is_memory_store)
-				{
-					int32_t value = get_byte(registerReadCycle, dst);
-					update_max(value, slot_to_use / WORKERS_PER_HASH);
-					set_byte(registerReadCycle, dst, value);
-					ScratchpadLatency = slot_to_use / WORKERS_PER_HASH;
-					if ((mod >> 4) >= randomx::StoreL3Condition)
-						ScratchpadHighLatency = slot_to_use / WORKERS_PER_HASH;
-				}
+		if (execution_plan[first_available_slot] || (first_available_slot == first_instruction_slot))
+		{
+			if (first_available_slot_is_branch_target)
+			{
+				src_program[i].x |= 0x40 << 8;
+				first_available_slot_is_branch_target = false;
 			}
 
-			if (execution_plan[first_available_slot] || (first_available_slot == first_instruction_slot))
+			if (is_fp)
+				++first_available_slot;
+
+			for (int32_t j0 = first_available_slot + 1;; j0 += 8)
 			{
-				if (first_available_slot_is_branch_target)
+				const int32_t j = j0 + sub;
+				const int32_t lane = first_set_lane(lanes_mask, (j >= RANDOMX_PROGRAM_SIZE * WORKERS_PER_HASH) || (execution_plan[j] == 0));
+				if (lane >= 0)
 				{
-					src_program[i].x |= 0x40 << 8;
-					first_available_slot_is_branch_target = false;
+					first_available_slot = j0 + lane;
+					break;
 				}
-
-				if (is_fp)
-					++first_available_slot;
-
-				do {
-					++first_available_slot;
-				} while ((first_available_slot < RANDOMX_PROGRAM_SIZE * WORKERS_PER_HASH) && (execution_plan[first_available_slot] != 0));
 			}
+		}
 
-			if (is_branch_target)
-			{
-				update_max(first_available_slot, is_fp ? (slot_to_use + 2) : (slot_to_use + 1));
-			}
+		if (is_branch_target)
+		{
+			update_max(first_available_slot, is_fp ? (slot_to_use + 2) : (slot_to_use + 1));
+		}
 
-			update_max(last_used_slot, is_fp ? (slot_to_use + 1) : slot_to_use);
-			while (execution_plan[last_used_slot] || (last_used_slot == first_instruction_slot) || ((last_used_slot == first_instruction_slot + 1) && first_instruction_fp))
+		update_max(last_used_slot, is_fp ? (slot_to_use + 1) : slot_to_use);
+		for (int32_t j0 = last_used_slot;; j0 += 8)
+		{
+			const int32_t j = j0 + sub;
+			const bool used = (j < RANDOMX_PROGRAM_SIZE * WORKERS_PER_HASH) && (execution_plan[j] || (j == first_instruction_slot) || ((j == first_instruction_slot + 1) && first_instruction_fp));
+			const int32_t lane = first_set_lane(lanes_mask, !used);
+			if (lane >= 0)
 			{
-				++last_used_slot;
+				last_used_slot = j0 + lane - 1;
+				break;
 			}
-			--last_used_slot;
-
-			if (is_fp && (last_used_slot >= first_allowed_slot_cfround))
-				first_allowed_slot_cfround = last_used_slot + 1;
-
-			//if (global_index == 0)
-			//{
-			//	printf("slot_to_use = %d, first_available_slot = %d, last_used_slot = %d\n", slot_to_use, first_available_slot, last_used_slot);
-			//	for (int j = 0; j <= last_used_slot; ++j)
-			//	{
-			//		if (execution_plan[j] || (j == first_instruction_slot) || ((j == first_instruction_slot + 1) && first_instruction_fp))
-			//		{
-			//			print_inst(src_program[execution_plan[j]]);
-			//			printf(" | ");
-			//		}
-			//		else
-			//		{
-			//			printf("                      | ");
-			//		}
-			//		if (((j + 1) % WORKERS_PER_HASH) == 0) printf("\n");
-			//	}
-			//	printf("\n\n");
-			//}
 		}
 
+		if (is_fp && (last_used_slot >= first_allowed_slot_cfround))
+			first_allowed_slot_cfround = last_used_slot + 1;
+
 		//if (global_index == 0)
 		//{
-		//	printf("IPC = %.3f, WPC = %.3f, num_instructions = %u, num_slots_used = %u, first_instruction_slot = %d, last_used_slot = %d, registerLatency = %016llx, registerLatencyFP = %016llx \n",
-		//		num_instructions / static_cast<double>(last_used_slot / WORKERS_PER_HASH + 1),
-		//		num_slots_used / static_cast<double>(last_used_slot / WORKERS_PER_HASH + 1),
-		//		num_instructions,
-		//		num_slots_used,
-		//		first_instruction_slot,
-		//		last_used_slot,
-		//		registerLatency,
-		//		registerLatencyFP
-		//	);
-
-		//	//for (int j = 0; j < RANDOMX_PROGRAM_SIZE; ++j)
-		//	//{
-		//	//	print_inst(src_program[j]);
-		//	//	printf("\n");
-		//	//}
-		//	//printf("\n");
-
+		//	printf("slot_to_use = %d, first_available_slot = %d, last_used_slot = %d\n", slot_to_use, first_available_slot, last_used_slot);
 		//	for (int j = 0; j <= last_used_slot; ++j)
 		//	{
 		//		if (execution_plan[j] || (j == first_instruction_slot) || ((j == first_instruction_slot + 1) && first_instruction_fp))
 		//		{
-		//			print_inst(src_program[execution_plan[j]]);
+		//			print_inst<VARIANT>(src_program[execution_plan[j]]);
 		//			printf(" | ");
 		//		}
 		//		else
@@ -1131,844 +1495,2477 @@ __global__ void __launch_bounds__(32, 16) init_vm(void* entropy_data, void* vm_s
 		//	}
 		//	printf("\n\n");
 		//}
+	}
 
-		atomicAdd((uint64_t*) num_vm_cycles, static_cast<uint64_t>((last_used_slot / WORKERS_PER_HASH) + 1) + (static_cast<uint64_t>(num_slots_used) << 32));
-
-		uint32_t ma = static_cast<uint32_t>(entropy[8]) & CacheLineAlignMask;
-		uint32_t mx = static_cast<uint32_t>(entropy[10]) & CacheLineAlignMask;
+	//if (global_index == 0)
+	//{
+	//	printf("IPC = %.3f, WPC = %.3f, num_instructions = %u, num_slots_used = %u, first_instruction_slot = %d, last_used_slot = %d, registerLatency = %016llx, registerLatencyFP = %016llx \n",
+	//		num_instructions / static_cast<double>(last_used_slot / WORKERS_PER_HASH + 1),
+	//		num_slots_used / static_cast<double>(last_used_slot / WORKERS_PER_HASH + 1),
+	//		num_instructions,
+	//		num_slots_used,
+	//		first_instruction_slot,
+	//		last_used_slot,
+	//		registerLatency,
+	//		registerLatencyFP
+	//	);
+
+	//	//for (int j = 0; j < RANDOMX_PROGRAM_SIZE; ++j)
+	//	//{
+	//	//	print_inst<VARIANT>(src_program[j]);
+	//	//	printf("\n");
+	//	//}
+	//	//printf("\n");
+
+	//	for (int j = 0; j <= last_used_slot; ++j)
+	//	{
+	//		if (execution_plan[j] || (j == first_instruction_slot) || ((j == first_instruction_slot + 1) && first_instruction_fp))
+	//		{
+	//			print_inst<VARIANT>(src_program[execution_plan[j]]);
+	//			printf(" | ");
+	//		}
+	//		else
+	//		{
+	//			printf("                      | ");
+	//		}
+	//		if (((j + 1) % WORKERS_PER_HASH) == 0) printf("\n");
+	//	}
+	//	printf("\n\n");
+	//}
 
-		uint32_t addressRegisters = static_cast<uint32_t>(entropy[12]);
-		addressRegisters = ((addressRegisters & 1) | (((addressRegisters & 2) ? 3U : 2U) << 8) | (((addressRegisters & 4) ? 5U : 4U) << 16) | (((addressRegisters & 8) ? 7U : 6U) << 24)) * sizeof(uint64_t);
+	const uint64_t vm_cycles = static_cast<uint64_t>((last_used_slot / WORKERS_PER_HASH) + 1) + (static_cast<uint64_t>(num_slots_used) << 32);
+	if (num_vm_cycles && (sub == 0))
+		atomicAdd((uint64_t*) num_vm_cycles, vm_cycles);
 
-		uint32_t datasetOffset = (entropy[13] & randomx::DatasetExtraItems) * randomx::CacheLineSize;
 
-		ulonglong2 eMask = *(ulonglong2*)(entropy + 14);
-		eMask.x = getFloatMask(eMask.x);
-		eMask.y = getFloatMask(eMask.y);
+	uint32_t* imm_buf = (uint32_t*)(R + REGISTERS_SIZE / sizeof(uint64_t));
+	uint32_t* compiled_program = (uint32_t*)(R + (REGISTERS_SIZE + IMM_BUF_SIZE) / sizeof(uint64_t));
 
-		((uint32_t*)(R + 16))[0] = ma;
-		((uint32_t*)(R + 16))[1] = mx;
-		((uint32_t*)(R + 16))[2] = addressRegisters;
-		((uint32_t*)(R + 16))[3] = datasetOffset;
+	// Group scheduled slots into execute_vm instructions
+	// Each entry temporarily stores the slot index (bits 0-11), branch target + 1 for CBRANCH (bits 12-20), sync flag (bit 21) and the number of workers/FP instructions
+	uint32_t program_length = 0;
+	uint32_t num_branches = 0;
+	{
+		int32_t branch_target_slot = -1;
+		for (int32_t i = 0; i <= last_used_slot; ++i)
+		{
+			if (!(execution_plan[i] || (i == first_instruction_slot) || ((i == first_instruction_slot + 1) && first_instruction_fp)))
+				continue;
+
+			uint32_t num_workers = 0;
+			uint32_t num_fp_insts = 0;
+			bool sync_group = false;
+			do {
+				const uint32_t x = src_program[execution_plan[i + num_workers]].x;
+				if ((num_workers & 1) && ((x & (0x20 << 8)) != 0))
+					++num_fp_insts;
+
+				// CBRANCH or CFROUND
+				if ((x & (0x10 << 8)) || (opcode_info<VARIANT>(x).type == RX_CFROUND))
+					sync_group = true;
+
+				++num_workers;
+			} while ((i + num_workers <= last_used_slot) && ((i + num_workers) % WORKERS_PER_HASH) && (execution_plan[i + num_workers] || (i + num_workers == first_instruction_slot) || ((i + num_workers == first_instruction_slot + 1) && first_instruction_fp)));
+
+			num_workers = ((num_workers - 1) << NUM_INSTS_OFFSET) | (num_fp_insts << NUM_FP_INSTS_OFFSET) | (sync_group ? (1U << 21) : 0);
+
+			const uint32_t slot = static_cast<uint32_t>(i);
+			const uint32_t src_inst_x = src_program[execution_plan[i]].x;
+
+			const bool is_fp = (src_inst_x & (0x20 << 8)) != 0;
+			if (is_fp && ((i & 1) == 0))
+				++i;
+
+			const bool is_branch_target = (src_inst_x & (0x40 << 8)) != 0;
+			if (is_branch_target && (branch_target_slot < 0))
+				branch_target_slot = static_cast<int32_t>(program_length) - 1;
+
+			uint32_t entry = slot | num_workers;
+			if (src_inst_x & (0x10 << 8))
+			{
+				entry |= static_cast<uint32_t>(branch_target_slot + 1) << 12;
+				branch_target_slot = -1;
+				++num_branches;
+			}
+
+			compiled_program[program_length++] = entry;
+		}
+	}
+
+	__syncwarp(lanes_mask);
+
+	// Generate opcodes for execute_vm, 8 instructions at a time
+	// Immediate values are allocated with a prefix sum across lanes, IMUL_RCP divisions run in parallel
+	uint32_t imm_index = 0;
+	for (uint32_t k0 = 0; k0 < program_length; k0 += 8)
+	{
+		const uint32_t k = k0 + sub;
+
+		uint32_t entry = 0;
+		uint2 inst = make_uint2(0, 0);
+		uint32_t num_imm = 0;
+		if (k < program_length)
+		{
+			entry = compiled_program[k];
+			inst = src_program[execution_plan[entry & 0xFFF]];
+			num_imm = get_imm_count<VARIANT>(inst);
+		}
+
+		uint32_t imm_end = num_imm;
+		#pragma unroll
+		for (uint32_t d = 1; d < 8; d <<= 1)
+		{
+			const uint32_t t = __shfl_up_sync(lanes_mask, imm_end, d, 8);
+			if (sub >= d)
+				imm_end += t;
+		}
+
+		if (k < program_length)
+		{
+			const int32_t branch_target_slot = static_cast<int32_t>((entry >> 12) & 0x1FF) - 1;
+			compiled_program[k] = encode_instruction<VARIANT>(inst, imm_index + imm_end - num_imm, imm_buf, branch_target_slot) | (entry & (0x3FU << NUM_INSTS_OFFSET)) | (((entry >> 21) & 1) << SYNC_GROUP_OFFSET);
+		}
+
+		imm_index += __shfl_sync(lanes_mask, imm_end, 7, 8);
+	}
+
+	__syncwarp(lanes_mask);
+
+	// Move the program right after the immediate values, so the used part of the VM state is contiguous
+	// The program only moves down, so 8 instructions are read before any of them is overwritten
+	for (uint32_t k0 = 0; k0 < program_length; k0 += 8)
+	{
+		const uint32_t k = k0 + sub;
+		const uint32_t inst = (k < program_length) ? compiled_program[k] : 0;
+
+		__syncwarp(lanes_mask);
+
+		if (k < program_length)
+			imm_buf[imm_index + k] = inst;
+	}
+
+	compiled_program = imm_buf + imm_index;
+
+	__syncwarp(lanes_mask);
+
+	if (sub == 0)
+	{
+		// Number of steps of the execute_vm loop for one pass over the program, it's used to group similar programs
+		uint32_t num_steps = 0;
+		for (uint32_t ip = 0; ip < program_length; ++num_steps)
+		{
+			const uint32_t inst = compiled_program[ip];
+			const uint32_t num_workers = (inst >> NUM_INSTS_OFFSET) & (WORKERS_PER_HASH - 1);
+			const uint32_t num_fp_insts = (inst >> NUM_FP_INSTS_OFFSET) & (WORKERS_PER_HASH - 1);
+			ip += num_workers - num_fp_insts + 1;
+		}
+
+		uint32_t ma = static_cast<uint32_t>(entropy[8]) & VARIANT::CacheLineAlignMask;
+		uint32_t mx = static_cast<uint32_t>(entropy[10]) & VARIANT::CacheLineAlignMask;
+
+		uint32_t addressRegisters = static_cast<uint32_t>(entropy[12]);
+		{
+			// readReg2 and readReg3 are read at the end of the iteration, before the renaming is undone
+			const uint32_t readReg2 = (end_map >> (((addressRegisters & 4) ? 5U : 4U) * 3)) & 7;
+			const uint32_t readReg3 = (end_map >> (((addressRegisters & 8) ? 7U : 6U) * 3)) & 7;
+			addressRegisters = ((addressRegisters & 1) | (((addressRegisters & 2) ? 3U : 2U) << 8) | (readReg2 << 16) | (readReg3 << 24)) * sizeof(uint64_t);
+		}
+
+		uint32_t datasetOffset = (entropy[13] & VARIANT::DatasetExtraItems) * randomx::CacheLineSize;
+
+		ulonglong2 eMask = *(ulonglong2*)(entropy + 14);
+		eMask.x = getFloatMask(eMask.x);
+		eMask.y = getFloatMask(eMask.y);
+
+		((uint32_t*)(R + 16))[0] = ma;
+		((uint32_t*)(R + 16))[1] = mx;
+		((uint32_t*)(R + 16))[2] = fprc;
+		((uint32_t*)(R + 16))[3] = imm_index;
 		((ulonglong2*)(R + 18))[0] = eMask;
 
-		uint32_t* imm_buf = (uint32_t*)(R + REGISTERS_SIZE / sizeof(uint64_t));
-		uint32_t imm_index = 0;
-		uint32_t* compiled_program = (uint32_t*)(R + (REGISTERS_SIZE + IMM_BUF_SIZE) / sizeof(uint64_t));
+		((uint32_t*)(R + 20))[0] = program_length;
+		((uint32_t*)(R + 20))[1] = num_steps;
+		((uint32_t*)(R + 21))[0] = num_branches;
+		((uint32_t*)(R + 21))[1] = end_map;
+		((uint32_t*)(R + 22))[0] = addressRegisters;
+		((uint32_t*)(R + 22))[1] = datasetOffset;
+	}
+
+	return vm_cycles;
+}
+
+// Programs compiled by init_vm start with fprc = 0, so it doesn't carry the rounding mode over from the previous program like init_vm_fused does
+// init_vm kernels use 19-34 KB of shared memory per 32-thread block, which allows only a few blocks per SM,
+// so their launch bounds have no min blocks value that would limit registers without adding occupancy
+template<typename VARIANT, int WORKERS_PER_HASH>
+__global__ void __launch_bounds__(32) init_vm(void* entropy_data, void* vm_states, void* num_vm_cycles)
+{
+	__shared__ uint32_t execution_plan_buf[(RANDOMX_PROGRAM_SIZE * WORKERS_PER_HASH + EXECUTION_PLAN_PADDING) * (32 / 8) / sizeof(uint32_t)];
+
+	// 4 hashes per warp: source programs are processed and VM states are assembled in shared memory
+	__shared__ uint64_t programs_local[(RANDOMX_PROGRAM_SIZE * sizeof(uint2) * (32 / 8)) / sizeof(uint64_t)];
+	__shared__ uint64_t vm_states_local[(VM_STATE_SHARED_STRIDE * (32 / 8)) / sizeof(uint64_t)];
+
+	set_buffer(execution_plan_buf, 0);
+
+	const uint32_t global_index = blockIdx.x * blockDim.x + threadIdx.x;
+	const uint32_t idx = global_index / 8;
+	const uint32_t sub = global_index % 8;
+
+	uint8_t* execution_plan = (uint8_t*)(execution_plan_buf + (threadIdx.x / 8) * (RANDOMX_PROGRAM_SIZE * WORKERS_PER_HASH + EXECUTION_PLAN_PADDING) / sizeof(uint32_t));
+	uint2* src_program = (uint2*)(programs_local + (threadIdx.x / 8) * RANDOMX_PROGRAM_SIZE);
+	uint64_t* R = vm_states_local + (threadIdx.x / 8) * VM_STATE_SHARED_STRIDE / sizeof(uint64_t);
+
+	const uint64_t* entropy = ((const uint64_t*) entropy_data) + idx * ENTROPY_SIZE / sizeof(uint64_t);
+
+	{
+		const uint4* p = (const uint4*)(entropy + 128 / sizeof(uint64_t));
+		for (uint32_t i = sub; i < RANDOMX_PROGRAM_SIZE * sizeof(uint2) / sizeof(uint4); i += 8)
+			((uint4*) src_program)[i] = p[i];
+	}
+
+	__syncwarp();
+
+	compile_program<VARIANT, WORKERS_PER_HASH>(entropy, src_program, execution_plan, R, num_vm_cycles, 0);
+
+	__syncwarp();
+
+	copy_vm_state(((uint64_t*) vm_states) + idx * (VM_STATE_SIZE / sizeof(uint64_t)), R, sub);
+}
+
+// Writes the program entropy of one hash for init_vm_fused and init_vm_adaptive, it's the same as blake2b_hash_registers + fillAes1Rx4<ENTROPY_SIZE>
+// If hash_registers is true, the seed is BLAKE2b of the register file in the VM state p, otherwise it's read from hashes
+// T is the AES table in shared memory, all threads of the block must call it
+__device__ void fill_program_entropy(const void* hashes, uint64_t* p, bool hash_registers, const uint32_t* T, uint64_t* entropy, uint32_t idx, uint32_t sub)
+{
+	// The 64-byte seed is stored at the beginning of entropy until AES overwrites it
+	if (hash_registers)
+	{
+		if (sub == 0)
+		{
+			uint64_t m[16] = { p[0], p[1], p[2], p[3], p[4], p[5], p[6], p[7], p[8], p[9], p[10], p[11], p[12], p[13], p[14], p[15] };
+			blake2b_512_process_double_block<REGISTERS_SIZE, HASH_SIZE>(entropy, m, p);
+		}
+	}
+	else
+	{
+		entropy[sub] = ((const uint64_t*) hashes)[idx * (HASH_SIZE / sizeof(uint64_t)) + sub];
+	}
+
+	__syncthreads();
+
+	if (sub < 4)
+	{
+		const uint32_t k[4] = { AES_KEY_FILL[sub * 4], AES_KEY_FILL[sub * 4 + 1], AES_KEY_FILL[sub * 4 + 2], AES_KEY_FILL[sub * 4 + 3] };
+
+		uint32_t x[4];
+		*(uint4*)(x) = ((const uint4*) entropy)[sub];
+
+		const uint32_t s1 = (sub & 1) ? 8 : 24;
+		const uint32_t s3 = (sub & 1) ? 24 : 8;
+
+		const uint32_t* const t0 = (sub & 1) ? T : (T + 1024);
+		const uint32_t* const t1 = (sub & 1) ? (T + 256) : (T + 1792);
+		const uint32_t* const t2 = (sub & 1) ? (T + 512) : (T + 1536);
+		const uint32_t* const t3 = (sub & 1) ? (T + 768) : (T + 1280);
+
+		// Each lane overwrites its own part of the seed first, so no synchronization is needed here
+		uint4* dst = ((uint4*) entropy) + sub;
+
+		#pragma unroll(2)
+		for (uint32_t i = 0; i < ENTROPY_SIZE / sizeof(uint4); i += 4, dst += 4)
+		{
+			uint32_t y[4];
+
+			y[0] = t0[get_byte(x[0], 0)] ^ t1[get_byte(x[1], s1)] ^ t2[get_byte(x[2], 16)] ^ t3[get_byte(x[3], s3)] ^ k[0];
+			y[1] = t0[get_byte(x[1], 0)] ^ t1[get_byte(x[2], s1)] ^ t2[get_byte(x[3], 16)] ^ t3[get_byte(x[0], s3)] ^ k[1];
+			y[2] = t0[get_byte(x[2], 0)] ^ t1[get_byte(x[3], s1)] ^ t2[get_byte(x[0], 16)] ^ t3[get_byte(x[1], s3)] ^ k[2];
+			y[3] = t0[get_byte(x[3], 0)] ^ t1[get_byte(x[0], s1)] ^ t2[get_byte(x[1], 16)] ^ t3[get_byte(x[2], s3)] ^ k[3];
+
+			*dst = *(uint4*)(y);
+
+			x[0] = y[0];
+			x[1] = y[1];
+			x[2] = y[2];
+			x[3] = y[3];
+		}
+	}
+}
+
+// Prepares the next program for all hashes in one launch, replacing blake2b_hash_registers + fillAes1Rx4<ENTROPY_SIZE> + init_vm
+// If hash_registers is true, the seed is BLAKE2b of the register file left in vm_states by the previous program, otherwise it's read from hashes
+// Program entropy never leaves shared memory
+template<typename VARIANT, int WORKERS_PER_HASH>
+__global__ void __launch_bounds__(32) init_vm_fused(void* hashes, void* vm_states, void* num_vm_cycles, bool hash_registers)
+{
+	__shared__ uint32_t execution_plan_buf[(RANDOMX_PROGRAM_SIZE * WORKERS_PER_HASH + EXECUTION_PLAN_PADDING) * (32 / 8) / sizeof(uint32_t)];
+	__shared__ uint64_t entropy_local[(ENTROPY_SIZE * (32 / 8)) / sizeof(uint64_t)];
+	__shared__ uint64_t vm_states_local[(VM_STATE_SHARED_STRIDE * (32 / 8)) / sizeof(uint64_t)];
+
+	static_assert(sizeof(vm_states_local) >= sizeof(AES_TABLE), "AES table must fit in vm_states_local");
+
+	set_buffer(execution_plan_buf, 0);
+
+	// vm_states_local is not used until the program is compiled, so it holds the AES table for now
+	uint32_t* T = (uint32_t*) vm_states_local;
+	for (int i = threadIdx.x; i < 2048; i += blockDim.x)
+		T[i] = AES_TABLE[i];
+
+	const uint32_t global_index = blockIdx.x * blockDim.x + threadIdx.x;
+	const uint32_t idx = global_index / 8;
+	const uint32_t sub = global_index % 8;
+
+	uint8_t* execution_plan = (uint8_t*)(execution_plan_buf + (threadIdx.x / 8) * (RANDOMX_PROGRAM_SIZE * WORKERS_PER_HASH + EXECUTION_PLAN_PADDING) / sizeof(uint32_t));
+	uint64_t* entropy = entropy_local + (threadIdx.x / 8) * ENTROPY_SIZE / sizeof(uint64_t);
+	uint64_t* R = vm_states_local + (threadIdx.x / 8) * VM_STATE_SHARED_STRIDE / sizeof(uint64_t);
+
+	// fprc of the previous program must be read before the new VM state overwrites it
+	uint64_t* p = ((uint64_t*) vm_states) + idx * (VM_STATE_SIZE / sizeof(uint64_t));
+	const uint32_t fprc = hash_registers ? ((const uint32_t*)(p + REGISTERS_SIZE / sizeof(uint64_t)))[0] : 0;
+
+	fill_program_entropy(hashes, p, hash_registers, T, entropy, idx, sub);
+
+	// The AES table is no longer needed after this point
+	__syncthreads();
+
+	compile_program<VARIANT, WORKERS_PER_HASH>(entropy, (uint2*)(entropy + 128 / sizeof(uint64_t)), execution_plan, R, num_vm_cycles, fprc);
+
+	__syncwarp();
+
+	copy_vm_state(p, R, sub);
+}
+
+// Relative cost of one VM cycle for 2, 4 and 8 workers per hash, used to pick the number of workers for each hash pair
+struct AdaptiveWorkersCosts
+{
+	float per_cycle[3];
+};
+
+// Hash lists select which hashes execute_vm runs and how they're paired: list[0] is the number of pairs,
+// list[1 + i * 2] and list[2 + i * 2] are the indices of pair i's hashes in the batch (VM states, scratchpads and results stay at these indices)
+// Number of uint32_t values in one hash list which can hold the whole batch
+constexpr uint32_t hash_list_size(uint32_t batch_size) { return batch_size + 1; }
+
+// Same as init_vm_fused, but every program is compiled for 2, 4 and 8 workers per hash and each hash pair keeps the cheapest version
+// (the sum of both programs' VM cycles times costs.per_cycle[i]), both hashes of a pair always run with the same number of workers
+// Pairs are appended to hash lists at hash_lists + hash_list_size(batch_size) * i where i = 0, 1, 2 for 2, 4, 8 workers,
+// the first value of each hash list must be set to 0 before the launch
+// stats[i] += number of pairs which use 2 << i workers, stats[3 + i] += their VM cycles, stats[6 + i] += VM cycles if all pairs used 2 << i workers
+template<typename VARIANT>
+__global__ void __launch_bounds__(32) init_vm_adaptive(void* hashes, void* vm_states, void* num_vm_cycles, bool hash_registers, uint32_t batch_size, uint32_t* hash_lists, uint64_t* stats, AdaptiveWorkersCosts costs)
+{
+	SPECIALIZE_BATCH_SIZE(batch_size);
+
+	__shared__ uint32_t execution_plan_buf[(RANDOMX_PROGRAM_SIZE * 8 + EXECUTION_PLAN_PADDING) * (32 / 8) / sizeof(uint32_t)];
+	__shared__ uint64_t entropy_local[(ENTROPY_SIZE * (32 / 8)) / sizeof(uint64_t)];
+	__shared__ uint64_t vm_states_local[(VM_STATE_SHARED_STRIDE * (32 / 8)) / sizeof(uint64_t)];
+
+	// compile_program modifies the source program, so every compilation starts from a copy
+	__shared__ uint64_t programs_local[(RANDOMX_PROGRAM_SIZE * sizeof(uint2) * (32 / 8)) / sizeof(uint64_t)];
+
+	// vm_states_local is not used until the program is compiled, so it holds the AES table for now
+	uint32_t* T = (uint32_t*) vm_states_local;
+	for (int i = threadIdx.x; i < 2048; i += blockDim.x)
+		T[i] = AES_TABLE[i];
+
+	const uint32_t global_index = blockIdx.x * blockDim.x + threadIdx.x;
+	const uint32_t idx = global_index / 8;
+	const uint32_t sub = global_index % 8;
+
+	uint8_t* execution_plan = (uint8_t*)(execution_plan_buf + (threadIdx.x / 8) * (RANDOMX_PROGRAM_SIZE * 8 + EXECUTION_PLAN_PADDING) / sizeof(uint32_t));
+	uint64_t* entropy = entropy_local + (threadIdx.x / 8) * ENTROPY_SIZE / sizeof(uint64_t);
+	uint2* src_program = (uint2*)(entropy + 128 / sizeof(uint64_t));
+	uint4* program_copy = (uint4*)(programs_local + (threadIdx.x / 8) * RANDOMX_PROGRAM_SIZE);
+	uint64_t* R = vm_states_local + (threadIdx.x / 8) * VM_STATE_SHARED_STRIDE / sizeof(uint64_t);
+
+	uint64_t* p = ((uint64_t*) vm_states) + idx * (VM_STATE_SIZE / sizeof(uint64_t));
+	const uint32_t fprc = hash_registers ? ((const uint32_t*)(p + REGISTERS_SIZE / sizeof(uint64_t)))[0] : 0;
+
+	fill_program_entropy(hashes, p, hash_registers, T, entropy, idx, sub);
+
+	__syncthreads();
+
+	for (uint32_t i = sub; i < RANDOMX_PROGRAM_SIZE * sizeof(uint2) / sizeof(uint4); i += 8)
+		program_copy[i] = ((const uint4*) src_program)[i];
+
+	// Lanes 0-15 and 16-31 of the warp are hash pairs
+	const uint32_t pair_mask = 0xFFFFU << (threadIdx.x & 16);
+
+	float best_cost = 0.0f;
+	uint32_t best_cycles = 0;
+	uint64_t best_vm_cycles = 0;
+	int best_i = -1;
+
+	#pragma unroll
+	for (int i = 0; i < 3; ++i)
+	{
+		// All lanes must be done with the previous compilation and the AES table before the buffers are reused
+		__syncthreads();
+
+		set_buffer(execution_plan_buf, 0);
+		if (i > 0)
+		{
+			for (uint32_t j = sub; j < RANDOMX_PROGRAM_SIZE * sizeof(uint2) / sizeof(uint4); j += 8)
+				((uint4*) src_program)[j] = program_copy[j];
+		}
+
+		__syncthreads();
+
+		uint64_t vm_cycles;
+		switch (i)
+		{
+		case 0:
+			vm_cycles = compile_program<VARIANT, 2>(entropy, src_program, execution_plan, R, nullptr, fprc);
+			break;
+		case 1:
+			vm_cycles = compile_program<VARIANT, 4>(entropy, src_program, execution_plan, R, nullptr, fprc);
+			break;
+		default:
+			vm_cycles = compile_program<VARIANT, 8>(entropy, src_program, execution_plan, R, nullptr, fprc);
+			break;
+		}
+
+		__syncwarp();
+
+		const uint32_t pair_cycles = static_cast<uint32_t>(vm_cycles) + static_cast<uint32_t>(__shfl_xor_sync(pair_mask, vm_cycles, 8));
+		const float cost = pair_cycles * costs.per_cycle[i];
+
+		if ((threadIdx.x % 16) == 0)
+			atomicAdd(stats + 6 + i, static_cast<uint64_t>(pair_cycles));
+
+		// The decision is the same for both hashes of the pair because they see the same pair_cycles
+		if ((best_i < 0) || (cost < best_cost))
+		{
+			best_cost = cost;
+			best_cycles = pair_cycles;
+			best_vm_cycles = vm_cycles;
+			best_i = i;
+
+			// Only the best version so far is stored, so vm_states always has a complete program for the chosen number of workers
+			copy_vm_state(p, R, sub);
+		}
+	}
+
+	if (sub == 0)
+		atomicAdd((uint64_t*) num_vm_cycles, best_vm_cycles);
+
+	if ((threadIdx.x % 16) == 0)
+	{
+		uint32_t* hash_list = hash_lists + hash_list_size(batch_size) * best_i;
+		const uint32_t k = atomicAdd(hash_list, 1);
+		hash_list[1 + k * 2] = idx;
+		hash_list[2 + k * 2] = idx + 1;
+
+		atomicAdd(stats + best_i, static_cast<uint64_t>(1));
+		atomicAdd(stats + 3 + best_i, static_cast<uint64_t>(best_cycles));
+	}
+}
+
+// Programs are grouped by the number of execute_vm loop steps (see compile_program), then by the number of CBRANCH instructions (up to 31)
+constexpr uint32_t PROGRAM_GROUP_KEYS = (RANDOMX_PROGRAM_SIZE + 1) * 32;
+
+__device__ uint32_t program_group_key(const void* vm_states, uint32_t hash_index)
+{
+	const uint32_t* p = (const uint32_t*)(((const uint64_t*) vm_states) + hash_index * (VM_STATE_SIZE / sizeof(uint64_t)) + 20);
+	return min(p[1], static_cast<uint32_t>(RANDOMX_PROGRAM_SIZE)) * 32 + min(p[2], 31U);
+}
+
+// Lanes of a warp run the execute_vm loop until the longest program in the warp is done, so it returns the number of loop steps the warp spends
+// for count hashes starting at position first in hash_list (or the batch if it's null), program_steps is set to the number of steps the programs need
+__device__ uint32_t warp_program_steps(const void* vm_states, const uint32_t* hash_list, uint32_t first, uint32_t count, uint32_t& program_steps)
+{
+	uint32_t max_steps = 0;
+	program_steps = 0;
+	for (uint32_t i = first; i < first + count; ++i)
+	{
+		const uint32_t hash_index = hash_list ? hash_list[1 + i] : i;
+		const uint32_t num_steps = ((const uint32_t*)(((const uint64_t*) vm_states) + hash_index * (VM_STATE_SIZE / sizeof(uint64_t)) + 20))[1];
+		max_steps = max(max_steps, num_steps);
+		program_steps += num_steps;
+	}
+	return max_steps * count;
+}
+
+// Runs after init_vm: sorts hashes from in_list (all hashes in the batch if it's null) by program_group_key and writes them to out_list,
+// so the hashes which share a warp in execute_vm have programs of similar length. Hashes keep their indices, only the pairing changes.
+// It's a counting sort in one block of 1024 threads, in_list and out_list can't be the same
+// hashes_per_warp is the number of hashes execute_vm runs in one warp (2 or 4), it's only used for statistics:
+// stats[0] += loop steps needed by all programs, stats[1] += loop steps of all lanes with in_list order, stats[2] += the same with out_list order
+__global__ void __launch_bounds__(1024) group_programs(const void* vm_states, uint32_t batch_size, const uint32_t* in_list, uint32_t* out_list, uint32_t hashes_per_warp, uint64_t* stats)
+{
+	__shared__ uint32_t offsets[PROGRAM_GROUP_KEYS];
+	__shared__ uint32_t chunk_sums[1024];
+	__shared__ unsigned long long int steps[3];
+
+	const uint32_t num_hashes = in_list ? in_list[0] * 2 : batch_size;
+
+	for (uint32_t i = threadIdx.x; i < PROGRAM_GROUP_KEYS; i += blockDim.x)
+		offsets[i] = 0;
+
+	if (threadIdx.x < 3)
+		steps[threadIdx.x] = 0;
+
+	__syncthreads();
+
+	for (uint32_t i = threadIdx.x; i < num_hashes; i += blockDim.x)
+		atomicAdd(offsets + program_group_key(vm_states, in_list ? in_list[1 + i] : i), 1U);
+
+	__syncthreads();
+
+	// Exclusive prefix sum of the counts, every thread owns a contiguous chunk of keys
+	constexpr uint32_t CHUNK_SIZE = (PROGRAM_GROUP_KEYS + 1023) / 1024;
+	const uint32_t k0 = min(threadIdx.x * CHUNK_SIZE, PROGRAM_GROUP_KEYS);
+	const uint32_t k1 = min(k0 + CHUNK_SIZE, PROGRAM_GROUP_KEYS);
+
+	uint32_t sum = 0;
+	for (uint32_t k = k0; k < k1; ++k)
+		sum += offsets[k];
+
+	chunk_sums[threadIdx.x] = sum;
+	__syncthreads();
+
+	for (uint32_t d = 1; d < 1024; d <<= 1)
+	{
+		const uint32_t t = (threadIdx.x >= d) ? chunk_sums[threadIdx.x - d] : 0;
+		__syncthreads();
+		chunk_sums[threadIdx.x] += t;
+		__syncthreads();
+	}
+
+	sum = chunk_sums[threadIdx.x] - sum;
+	for (uint32_t k = k0; k < k1; ++k)
+	{
+		const uint32_t count = offsets[k];
+		offsets[k] = sum;
+		sum += count;
+	}
+
+	__syncthreads();
+
+	// Order inside a group doesn't matter, so hashes are scattered with atomics
+	for (uint32_t i = threadIdx.x; i < num_hashes; i += blockDim.x)
+	{
+		const uint32_t hash_index = in_list ? in_list[1 + i] : i;
+		out_list[1 + atomicAdd(offsets + program_group_key(vm_states, hash_index), 1U)] = hash_index;
+	}
+
+	if (threadIdx.x == 0)
+		out_list[0] = num_hashes / 2;
+
+	__syncthreads();
+
+	for (uint32_t i = threadIdx.x * hashes_per_warp; i < num_hashes; i += blockDim.x * hashes_per_warp)
+	{
+		const uint32_t count = min(hashes_per_warp, num_hashes - i);
+
+		uint32_t program_steps;
+		const uint32_t steps_before = warp_program_steps(vm_states, in_list, i, count, program_steps);
+		const uint32_t steps_after = warp_program_steps(vm_states, out_list, i, count, program_steps);
+
+		atomicAdd(steps + 0, static_cast<unsigned long long int>(program_steps));
+		atomicAdd(steps + 1, static_cast<unsigned long long int>(steps_before));
+		atomicAdd(steps + 2, static_cast<unsigned long long int>(steps_after));
+	}
+
+	__syncthreads();
+
+	if (threadIdx.x < 3)
+		atomicAdd((unsigned long long int*)(stats + threadIdx.x), steps[threadIdx.x]);
+}
+
+template<typename T, size_t N>
+__device__ void load_buffer(T (&dst_buf)[N], const void* src_buf, uint32_t block_index)
+{
+	uint32_t i = threadIdx.x * sizeof(T);
+	const uint32_t step = blockDim.x * sizeof(T);
+	const uint8_t* src = ((const uint8_t*) src_buf) + block_index * sizeof(T) * N + i;
+	uint8_t* dst = ((uint8_t*) dst_buf) + i;
+	while (i < sizeof(T) * N)
+	{
+		*(T*)(dst) = *(T*)(src);
+		src += step;
+		dst += step;
+		i += step;
+	}
+}
+
+template<typename T, size_t N>
+__device__ void load_buffer(T (&dst_buf)[N], const void* src_buf)
+{
+	load_buffer(dst_buf, src_buf, blockIdx.x);
+}
+
+// Body of execute_vm opcode OPCODE (0 also runs opcode 1, they only differ in the immediate), both dispatchers of execute_instruction expand it
+template<uint32_t OPCODE, int FPRC>
+__device__ __forceinline__ void execute_opcode(uint32_t inst, uint32_t opcode, uint32_t location, uint64_t& dst, uint64_t src, uint2 imm, bool is_fp, int32_t sub, uint64_t xexponentMask, uint32_t fp_workers_mask, int32_t num_insts, int32_t& ip, bool& ip_changed, bool& sync_needed, uint32_t& fprc, bool& fprc_changed)
+{
+	const uint32_t rounding_mode = (FPRC >= 0) ? FPRC : fprc;
+
+	if (OPCODE == 0)
+	{
+		if (inst & (1 << NEGATIVE_SRC_OFFSET)) src = static_cast<uint64_t>(-static_cast<int64_t>(src));
+		if (opcode == 0) dst += static_cast<int32_t>(imm.x);
+		const uint32_t shift = (inst >> SHIFT_OFFSET) & 3;
+		dst += src << shift;
+	}
+	else if (OPCODE == 12)
+	{
+		if (location) src = bit_cast<uint64_t>(fp_from_int(static_cast<int32_t>(src >> ((sub & 1) * 32))));
+		if (inst & (1 << NEGATIVE_SRC_OFFSET)) src ^= 0x8000000000000000ULL;
+		dst = bit_cast<uint64_t>(fp_add(__longlong_as_double(dst), __longlong_as_double(src), rounding_mode));
+	}
+	else if (OPCODE == 2)
+	{
+		if (inst & (1 << SRC_IS_IMM64_OFFSET)) src = *((uint64_t*)&imm);
+		dst *= src;
+	}
+	else if (OPCODE == 6)
+	{
+		dst ^= is_fp ? 0x81F0000000000000ULL : src;
+	}
+	else if (OPCODE == 13)
+	{
+		dst = bit_cast<uint64_t>(fp_mul(__longlong_as_double(dst), __longlong_as_double(src), rounding_mode));
+	}
+	else if (OPCODE == 9)
+	{
+		dst += static_cast<int32_t>(imm.x);
+		if ((static_cast<uint32_t>(dst) & (randomx::ConditionMask << (imm.y & 31))) == 0)
+		{
+			ip = (static_cast<int32_t>(imm.y) >> 5);
+			ip -= num_insts;
+			ip_changed = true;
+			sync_needed = true;
+		}
+	}
+	else if (OPCODE == 7)
+	{
+		const uint32_t shift = src & 63;
+		dst = (dst >> shift) | (dst << (64 - shift));
+	}
+	else if (OPCODE == 11)
+	{
+		dst = __shfl_xor_sync(fp_workers_mask, dst, 1, 8);
+	}
+	else if (OPCODE == 14)
+	{
+		dst = bit_cast<uint64_t>(fp_sqrt(__longlong_as_double(dst), rounding_mode));
+	}
+	else if (OPCODE == 3)
+	{
+		dst = __umul64hi(dst, src);
+	}
+	else if (OPCODE == 4)
+	{
+		dst = static_cast<uint64_t>(__mul64hi(static_cast<int64_t>(dst), static_cast<int64_t>(src)));
+	}
+	else if (OPCODE == 8)
+	{
+		dst = src;
+	}
+	else if (OPCODE == 15)
+	{
+		src = bit_cast<uint64_t>(fp_from_int(static_cast<int32_t>(src >> ((sub & 1) * 32))));
+		src &= randomx::dynamicMantissaMask;
+		src |= xexponentMask;
+		dst = bit_cast<uint64_t>(fp_div(__longlong_as_double(dst), __longlong_as_double(src), rounding_mode));
+	}
+	else if (OPCODE == 5)
+	{
+		dst = static_cast<uint64_t>(-static_cast<int64_t>(dst));
+	}
+	else if (OPCODE == 16)
+	{
+		const uint32_t imm_offset = (inst >> IMM_OFFSET) & 255;
+		const uint32_t new_fprc = ((src >> imm_offset) | (src << (64 - imm_offset))) & 3;
+		fprc_changed = new_fprc != fprc;
+		sync_needed |= fprc_changed;
+		fprc = new_fprc;
+	}
+}
+
+// Executes one instruction (any opcode except ISTORE) on dst and src and returns the new dst value
+// ISWAP only returns the new dst value, the caller must write the old one to the src register
+// FP instructions use rounding mode FPRC if it's known at compile time (FPRC >= 0) and fprc otherwise
+template<int FPRC>
+__device__ uint64_t execute_instruction(uint32_t inst, uint32_t opcode, uint32_t location, uint64_t dst, uint64_t src, uint2 imm, bool is_fp, int32_t sub, uint64_t xexponentMask, uint32_t fp_workers_mask, int32_t num_insts, int32_t& ip, bool& ip_changed, bool& sync_needed, uint32_t& fprc, bool& fprc_changed)
+{
+	if (inst & (1 << SRC_IS_IMM32_OFFSET)) src = static_cast<uint64_t>(static_cast<int64_t>(static_cast<int32_t>(imm.x)));
+
+	// The dispatchers only differ in how they get to execute_opcode
+#define EXECUTE_OPCODE(OPCODE) execute_opcode<OPCODE, FPRC>(inst, opcode, location, dst, src, imm, is_fp, sub, xexponentMask, fp_workers_mask, num_insts, ip, ip_changed, sync_needed, fprc, fprc_changed)
+
+#if EXECUTE_VM_SWITCH_DISPATCH
+	// Jump straight to the opcode handler through a table
+	switch (opcode)
+	{
+	case 0:
+	case 1:  EXECUTE_OPCODE(0); break;
+	case 2:  EXECUTE_OPCODE(2); break;
+	case 3:  EXECUTE_OPCODE(3); break;
+	case 4:  EXECUTE_OPCODE(4); break;
+	case 5:  EXECUTE_OPCODE(5); break;
+	case 6:  EXECUTE_OPCODE(6); break;
+	case 7:  EXECUTE_OPCODE(7); break;
+	case 8:  EXECUTE_OPCODE(8); break;
+	case 9:  EXECUTE_OPCODE(9); break;
+	case 11: EXECUTE_OPCODE(11); break;
+	case 12: EXECUTE_OPCODE(12); break;
+	case 13: EXECUTE_OPCODE(13); break;
+	case 14: EXECUTE_OPCODE(14); break;
+	case 15: EXECUTE_OPCODE(15); break;
+	case 16: EXECUTE_OPCODE(16); break;
+	}
+#else
+	// Check instruction opcodes (most frequent instructions come first)
+	if      (opcode < 2)   EXECUTE_OPCODE(0);
+	else if (opcode == 12) EXECUTE_OPCODE(12);
+	else if (opcode == 2)  EXECUTE_OPCODE(2);
+	else if (opcode == 6)  EXECUTE_OPCODE(6);
+	else if (opcode == 13) EXECUTE_OPCODE(13);
+	else if (opcode == 9)  EXECUTE_OPCODE(9);
+	else if (opcode == 7)  EXECUTE_OPCODE(7);
+	else if (opcode == 11) EXECUTE_OPCODE(11);
+	else if (opcode == 14) EXECUTE_OPCODE(14);
+	else if (opcode == 3)  EXECUTE_OPCODE(3);
+	else if (opcode == 4)  EXECUTE_OPCODE(4);
+	else if (opcode == 8)  EXECUTE_OPCODE(8);
+	else if (opcode == 15) EXECUTE_OPCODE(15);
+	else if (opcode == 5)  EXECUTE_OPCODE(5);
+	else if (opcode == 16) EXECUTE_OPCODE(16);
+#endif
+
+#undef EXECUTE_OPCODE
+
+	return dst;
+}
+
+// Reads the header of the instruction group at ip and picks the instruction of lane sub (FP instructions come first and take 2 lanes each)
+// Returns false if the lane has no instruction in this group, num_insts and sync_group are set in any case
+template<int WORKERS_PER_HASH>
+__device__ __forceinline__ bool fetch_instruction(const uint32_t* compiled_program, int32_t ip, int32_t sub, uint32_t& inst, int32_t& num_insts, bool& sync_group, bool& is_fp)
+{
+	inst = compiled_program[ip];
+	const int32_t num_workers = (inst >> NUM_INSTS_OFFSET) & (WORKERS_PER_HASH - 1);
+	const int32_t num_fp_insts = (inst >> NUM_FP_INSTS_OFFSET) & (WORKERS_PER_HASH - 1);
+	num_insts = num_workers - num_fp_insts;
+	sync_group = !EXECUTE_VM_CONDITIONAL_SYNC || (inst & (1 << SYNC_GROUP_OFFSET));
+
+	if (sub > num_workers)
+		return false;
+
+	const int32_t inst_offset = sub - num_fp_insts;
+	is_fp = inst_offset < num_fp_insts;
+	inst = compiled_program[ip + (is_fp ? (sub >> 1) : inst_offset)];
+	return true;
+}
+
+// Finds the operands of an instruction in the register file R and reads them and its immediate values
+__device__ __forceinline__ void decode_operands(uint32_t inst, bool is_fp, uint64_t* R, const uint32_t* imm_buf, uint32_t fp_reg_offset, uint32_t fp_reg_group_A_offset, uint64_t*& dst_ptr, uint64_t*& src_ptr, uint64_t& dst, uint64_t& src, uint2& imm)
+{
+	const uint32_t location = (inst >> LOC_OFFSET) & 3;
+
+	const uint32_t reg_size_shift = is_fp ? 4 : 3;
+	const uint32_t reg_base_offset = is_fp ? fp_reg_offset : 0;
+	const uint32_t reg_base_src_offset = is_fp ? fp_reg_group_A_offset : 0;
+
+	uint32_t dst_offset = (inst >> DST_OFFSET) & 7;
+	dst_offset = reg_base_offset + (dst_offset << reg_size_shift);
+#if COMPILE_PROGRAM_RENAME_SWAPS
+	// Halves of the FP dst register are swapped by a removed FSWAP_R
+	if (is_fp)
+		dst_offset ^= ((inst >> SHIFT_OFFSET) & 1) * sizeof(double);
+#endif
+
+	uint32_t src_offset = (inst >> SRC_OFFSET) & 7;
+	src_offset = (src_offset << 3) + (location ? 0 : reg_base_src_offset);
+
+	dst_ptr = (uint64_t*)((uint8_t*)(R) + dst_offset);
+	src_ptr = (uint64_t*)((uint8_t*)(R) + src_offset);
+
+	const uint32_t imm_offset = (inst >> IMM_OFFSET) & 255;
+	const uint32_t* imm_ptr = imm_buf + imm_offset;
+
+	dst = *dst_ptr;
+	src = *src_ptr;
+	imm.x = imm_ptr[0];
+	imm.y = imm_ptr[1];
+}
+
+// Memory operand of an instruction in the hash's scratchpad (64-byte lines of all hashes are interleaved, batch_size lines apart)
+// reg is the address register (src of a read, dst of ISTORE), imm is imm32 with the operand's location in bits 21-25, reads from L3 only use imm
+// Returns the pointer and sets addr to the address in the scratchpad
+template<typename VARIANT>
+__device__ __forceinline__ uint64_t* scratchpad_operand(uint8_t* scratchpad, uint32_t reg, uint32_t imm, bool is_read, uint32_t batch_size, uint32_t& addr)
+{
+	uint32_t loc_shift;
+	asm("bfe.u32 %0, %1, 21, 5;" : "=r"(loc_shift) : "r"(imm));
+	const uint32_t mask = 0xFFFFFFFFU >> loc_shift;
+
+	addr = (is_read && (loc_shift == VARIANT::LOC_L3)) ? 0 : reg;
+	addr += static_cast<int32_t>(imm);
+	addr &= mask;
+
+	uint64_t offset;
+	asm("mad.wide.u32 %0,%1,%2,%3;" : "=l"(offset) : "r"(addr & 0xFFFFFFC0U), "r"(batch_size), "l"(static_cast<uint64_t>(addr & 0x38)));
+
+	return (uint64_t*)(scratchpad + offset);
+}
+
+// Reads the memory operand of an instruction into src, or writes src to the scratchpad for ISTORE (opcode 10)
+// If L1_SHARED is true, addresses in the L1 window go to l1 (see execute_vm_iterations)
+template<typename VARIANT, bool L1_SHARED>
+__device__ __forceinline__ void access_scratchpad(uint32_t opcode, uint2 imm, uint64_t& src, uint64_t dst, uint8_t* scratchpad, uint64_t* l1, uint32_t batch_size)
+{
+	const bool is_read = (opcode != 10);
+
+	uint32_t addr;
+	uint64_t* ptr = scratchpad_operand<VARIANT>(scratchpad, static_cast<uint32_t>(is_read ? src : dst), imm.x, is_read, batch_size, addr);
+	if (L1_SHARED && (addr < VARIANT::SCRATCHPAD_L1_SIZE))
+		ptr = l1 + addr / sizeof(uint64_t);
+
+	if (is_read)
+		src = *ptr;
+	else
+		*ptr = src;
+}
+
+// Executes a decoded instruction (any opcode except ISTORE) and writes its results to the register file
+template<int FPRC>
+__device__ __forceinline__ void execute_decoded_instruction(uint32_t inst, uint32_t opcode, uint32_t location, uint64_t* dst_ptr, uint64_t* src_ptr, uint64_t dst, uint64_t src, uint2 imm, bool is_fp, int32_t sub, uint64_t xexponentMask, uint32_t fp_workers_mask, int32_t num_insts, int32_t& ip, bool& ip_changed, bool& sync_needed, uint32_t& fprc, bool& fprc_changed)
+{
+	const uint64_t result = execute_instruction<FPRC>(inst, opcode, location, dst, src, imm, is_fp, sub, xexponentMask, fp_workers_mask, num_insts, ip, ip_changed, sync_needed, fprc, fprc_changed);
+
+	if (opcode == 8)
+		*src_ptr = dst;
+
+	if (opcode != 16)
+		*dst_ptr = result;
+}
+
+// End of an instruction group: all workers take ip and rounding mode from the lane which changed them (CBRANCH or CFROUND)
+// Groups which can't change them only wait for the register writes of other lanes in shared memory,
+// REGISTER_BARRIER is false if registers are exchanged with shuffles (execute_vm_resident), then they don't wait at all
+template<bool REGISTER_BARRIER = true>
+__device__ __forceinline__ void sync_instruction_group(bool sync_group, bool sync_needed, bool ip_changed, bool fprc_changed, uint32_t workers_mask, int32_t& ip, uint32_t& fprc)
+{
+	if (!sync_group)
+	{
+		if (REGISTER_BARRIER)
+			__syncwarp(workers_mask);
+	}
+	else if (__ballot_sync(workers_mask, sync_needed))
+	{
+		int mask = __ballot_sync(workers_mask, ip_changed);
+		if (mask)
+		{
+			int lane;
+			asm("bfind.u32 %0, %1;" : "=r"(lane) : "r"(mask));
+			ip = __shfl_sync(workers_mask, ip, lane, 16);
+		}
+
+		mask = __ballot_sync(workers_mask, fprc_changed);
+		if (mask)
+		{
+			int lane;
+			asm("bfind.u32 %0, %1;" : "=r"(lane) : "r"(mask));
+			fprc = __shfl_sync(workers_mask, fprc, lane, 16);
+		}
+	}
+}
+
+// One hash's part of execute_vm_iterations and execute_vm_iterations_interleaved, unpacked from its VM state in shared memory by load_vm_hash_state
+struct VMHashState
+{
+	uint64_t* R;
+	uint32_t ma;
+	uint32_t mx;
+	uint32_t fprc;
+	uint32_t num_imm;
+	const uint64_t* readReg0;
+	const uint64_t* readReg1;
+	const uint32_t* readReg2;
+	const uint32_t* readReg3;
+	const uint8_t* dataset;
+	uint64_t orMask1;
+	uint64_t orMask2;
+	uint64_t xexponentMask;
+	int32_t program_length;
+	uint32_t spAddr0;
+	uint32_t spAddr1;
+	uint8_t* scratchpad;
+	const uint32_t* imm_buf;
+	const uint32_t* compiled_program;
+	double* fe;
+	double* f;
+	double* e;
+#if COMPILE_PROGRAM_RENAME_SWAPS
+	// Where the program leaves this lane's registers after renaming (end_map in compile_program)
+	const uint64_t* r_end;
+	const double* f_end;
+	const double* e_end;
+#endif
+	uint64_t* p0;
+	uint64_t* p1;
+};
+
+// R is the VM state copied to shared memory, hash_index selects the scratchpad
+// A hash which is not valid gets an empty program, so it skips all memory accesses
+__device__ __forceinline__ void load_vm_hash_state(VMHashState& s, uint64_t* R, uint32_t hash_index, bool valid, const void* dataset_ptr, void* scratchpads, int32_t sub, bool first)
+{
+	const bool f_group = (sub < 4);
+
+	double* F = (double*)(R + 8);
+	double* E = (double*)(R + 16);
+
+	s.R = R;
+	s.ma = ((uint32_t*)(R + 16))[0];
+	s.mx = ((uint32_t*)(R + 16))[1];
+	s.fprc = ((uint32_t*)(R + 16))[2];
+	s.num_imm = ((uint32_t*)(R + 16))[3];
+
+	const uint32_t addressRegisters = ((uint32_t*)(R + 22))[0];
+	s.readReg0 = (uint64_t*)(((uint8_t*) R) + (addressRegisters & 0xff));
+	s.readReg1 = (uint64_t*)(((uint8_t*) R) + ((addressRegisters >> 8) & 0xff));
+	s.readReg2 = (uint32_t*)(((uint8_t*) R) + ((addressRegisters >> 16) & 0xff));
+	s.readReg3 = (uint32_t*)(((uint8_t*) R) + (addressRegisters >> 24));
+
+	const uint32_t datasetOffset = ((uint32_t*)(R + 22))[1];
+	s.dataset = ((const uint8_t*) dataset_ptr) + datasetOffset;
+
+	const ulonglong2 eMask = ((ulonglong2*)(R + 18))[0];
+	s.orMask1 = f_group ? 0 : eMask.x;
+	s.orMask2 = f_group ? 0 : eMask.y;
+	s.xexponentMask = (sub & 1) ? eMask.y : eMask.x;
+
+	s.program_length = valid ? ((int32_t*)(R + 20))[0] : 0;
+
+	s.spAddr0 = first ? s.mx : 0;
+	s.spAddr1 = first ? s.ma : 0;
+
+	s.scratchpad = ((uint8_t*) scratchpads) + hash_index * 64;
+
+	s.imm_buf = (const uint32_t*)(R + REGISTERS_SIZE / sizeof(uint64_t));
+	s.compiled_program = s.imm_buf + s.num_imm;
+
+	s.fe = f_group ? (F + sub * 2) : (E + (sub - 4) * 2);
+	s.f = F + sub;
+	s.e = E + sub;
+
+#if COMPILE_PROGRAM_RENAME_SWAPS
+	const int32_t sub2 = sub >> 1;
+	const uint32_t end_map = ((uint32_t*)(R + 21))[1];
+	s.r_end = R + ((end_map >> (sub * 3)) & 7);
+	s.f_end = F + (sub ^ ((end_map >> (24 + sub2)) & 1));
+	s.e_end = E + (sub ^ ((end_map >> (28 + sub2)) & 1));
+#endif
+}
+
+// Start of an iteration: spAddr0 and spAddr1 are mixed with the address registers, which belong to other lanes
+template<typename VARIANT>
+__device__ __forceinline__ void mix_scratchpad_addresses(VMHashState& s)
+{
+	const uint64_t spMix = *s.readReg0 ^ *s.readReg1;
+	s.spAddr0 ^= ((const uint32_t*) &spMix)[0];
+	s.spAddr1 ^= ((const uint32_t*) &spMix)[1];
+	s.spAddr0 &= VARIANT::ScratchpadL3Mask64;
+	s.spAddr1 &= VARIANT::ScratchpadL3Mask64;
+}
+
+// Reads the scratchpad lines of the iteration: the lane's integer register is XORed with line spAddr0, its F or E register halves are loaded from line spAddr1
+// If L1_SHARED is true, lines in the L1 window are taken from l1 (see execute_vm_iterations)
+template<typename VARIANT, bool L1_SHARED>
+__device__ __forceinline__ void read_scratchpad_lines(VMHashState& s, uint64_t* l1, int32_t sub, uint32_t batch_size, uint64_t andMask)
+{
+	uint64_t offset1, offset2;
+	asm("mad.wide.u32 %0,%2,%4,%5;\n\tmad.wide.u32 %1,%3,%4,%5;" : "=l"(offset1), "=l"(offset2) : "r"(s.spAddr0), "r"(s.spAddr1), "r"(batch_size), "l"(static_cast<uint64_t>(sub * 8)));
+
+	s.p0 = (uint64_t*)(s.scratchpad + offset1);
+	s.p1 = (uint64_t*)(s.scratchpad + offset2);
+
+	if (L1_SHARED)
+	{
+		if (s.spAddr0 < VARIANT::SCRATCHPAD_L1_SIZE) s.p0 = l1 + s.spAddr0 / sizeof(uint64_t) + sub;
+		if (s.spAddr1 < VARIANT::SCRATCHPAD_L1_SIZE) s.p1 = l1 + s.spAddr1 / sizeof(uint64_t) + sub;
+	}
+
+	s.R[sub] ^= *s.p0;
+
+	uint64_t global_mem_data = *s.p1;
+	int32_t* q = (int32_t*) &global_mem_data;
+
+	s.fe[0] = load_F_E_groups(q[0], andMask, s.orMask1);
+	s.fe[1] = load_F_E_groups(q[1], andMask, s.orMask2);
+}
+
+// Updates mx with the address registers after the program
+template<typename VARIANT>
+__device__ __forceinline__ void mix_dataset_address(VMHashState& s)
+{
+	s.mx ^= *s.readReg2 ^ *s.readReg3;
+	s.mx &= VARIANT::CacheLineAlignMask;
+}
+
+__device__ __forceinline__ uint64_t read_dataset_item(const VMHashState& s, int32_t sub)
+{
+	return *(const uint64_t*)(s.dataset + s.ma + sub * 8);
+}
+
+// Same as read_dataset_item, but through the read-only cache, for the start of the iteration (ma doesn't change until the end of it)
+__device__ __forceinline__ uint64_t prefetch_dataset_item(const VMHashState& s, int32_t sub)
+{
+	return __ldg((const uint64_t*)(s.dataset + s.ma + sub * 8));
+}
+
+// End of an iteration: r_value (the lane's integer register after the program) is XORed with dataset_data (the dataset item at ma),
+// registers are written back to the scratchpad lines and ma, mx are swapped
+__device__ __forceinline__ void write_scratchpad_lines(VMHashState& s, int32_t sub, uint64_t r_value, uint64_t dataset_data)
+{
+	const uint64_t next_r = r_value ^ dataset_data;
+	s.R[sub] = next_r;
+
+	uint32_t tmp = s.ma;
+	s.ma = s.mx;
+	s.mx = tmp;
+
+	*s.p1 = next_r;
+	*s.p0 = bit_cast<uint64_t>(s.f[0]) ^ bit_cast<uint64_t>(s.e[0]);
+
+	s.spAddr0 = 0;
+	s.spAddr1 = 0;
+}
+
+// Saves the registers to the VM state p in global memory
+// If last is true, the program is done: F ^ E and E are saved for the register hash and fprc for the next program goes over the first immediate value
+// Otherwise ma, mx and fprc are saved, so the next chunk can resume
+__device__ __forceinline__ void store_vm_hash_state(uint64_t* p, const VMHashState& s, int32_t sub, bool last)
+{
+	const double* F = (const double*)(s.R + 8);
+	const double* E = (const double*)(s.R + 16);
+
+	p[sub] = s.R[sub];
+
+	if (last)
+	{
+		p[sub +  8] = bit_cast<uint64_t>(F[sub]) ^ bit_cast<uint64_t>(E[sub]);
+		p[sub + 16] = bit_cast<uint64_t>(E[sub]);
+
+		if (sub == 0)
+			((uint32_t*)(p + REGISTERS_SIZE / sizeof(uint64_t)))[0] = s.fprc;
+	}
+	else if (sub == 0)
+	{
+		*(uint4*)(p + 16) = make_uint4(s.ma, s.mx, s.fprc, s.num_imm);
+	}
+}
+
+// Runs the current program from ip for 1 hash, returns when the program ends or when CFROUND changes the rounding mode away from FPRC
+// FPRC is the rounding mode this instance is compiled for, or -1 to read it from fprc for every FP instruction
+// Returns the ip to continue from
+template<typename VARIANT, int WORKERS_PER_HASH, int FPRC, bool L1_SHARED>
+__device__ int32_t execute_program(int32_t ip, uint32_t& fprc, const uint32_t* compiled_program, const uint32_t* imm_buf, int32_t program_length, uint64_t* R, uint32_t fp_reg_offset, uint32_t fp_reg_group_A_offset, uint8_t* scratchpad, uint64_t* l1, uint32_t batch_size, int32_t sub, uint64_t xexponentMask, uint32_t workers_mask, uint32_t fp_workers_mask)
+{
+	#pragma unroll(1)
+	while (ip < program_length)
+	{
+		uint32_t inst;
+		int32_t num_insts;
+		bool sync_group;
+		bool is_fp;
+
+		bool sync_needed = false;
+		bool ip_changed = false;
+		bool fprc_changed = false;
+
+		if (fetch_instruction<WORKERS_PER_HASH>(compiled_program, ip, sub, inst, num_insts, sync_group, is_fp))
+		{
+			asm("// INSTRUCTION DECODING BEGIN");
+
+			const uint32_t opcode = (inst >> OPCODE_OFFSET) & 31;
+			const uint32_t location = (inst >> LOC_OFFSET) & 3;
+
+			uint64_t* dst_ptr;
+			uint64_t* src_ptr;
+			uint64_t dst;
+			uint64_t src;
+			uint2 imm;
+			decode_operands(inst, is_fp, R, imm_buf, fp_reg_offset, fp_reg_group_A_offset, dst_ptr, src_ptr, dst, src, imm);
+
+			asm("// INSTRUCTION DECODING END");
+
+			if (location)
+			{
+				asm("// SCRATCHPAD ACCESS BEGIN");
+				access_scratchpad<VARIANT, L1_SHARED>(opcode, imm, src, dst, scratchpad, l1, batch_size);
+				asm("// SCRATCHPAD ACCESS END");
+			}
+
+			if (opcode != 10)
+			{
+				asm("// EXECUTION BEGIN");
+				execute_decoded_instruction<FPRC>(inst, opcode, location, dst_ptr, src_ptr, dst, src, imm, is_fp, sub, xexponentMask, fp_workers_mask, num_insts, ip, ip_changed, sync_needed, fprc, fprc_changed);
+				asm("// EXECUTION END");
+			}
+		}
+
+		asm("// SYNCHRONIZATION OF INSTRUCTION POINTER AND ROUNDING MODE BEGIN");
+		sync_instruction_group(sync_group, sync_needed, ip_changed, fprc_changed, workers_mask, ip, fprc);
+		asm("// SYNCHRONIZATION OF INSTRUCTION POINTER AND ROUNDING MODE END");
 
-		// Generate opcodes for execute_vm
-		int32_t branch_target_slot = -1;
-		int32_t k = -1;
-		for (int32_t i = 0; i <= last_used_slot; ++i)
+		ip += num_insts + 1;
+
+		// Let the caller switch to the instance for the new rounding mode
+		if ((FPRC >= 0) && (fprc != FPRC))
+			break;
+	}
+
+	return ip;
+}
+
+// Runs the whole current program with runner.run<FPRC>(ip), which returns the ip to continue from (see execute_program)
+// With EXECUTE_VM_FPRC_SPECIALIZATION every rounding mode has its own instance of the interpreter, it only returns early when CFROUND changes fprc
+// Otherwise a single instance (FPRC = -1) reads fprc for every FP instruction
+template<typename RUNNER>
+__device__ __forceinline__ void run_program(const RUNNER& runner, int32_t program_length, const uint32_t& fprc)
+{
+#if EXECUTE_VM_FPRC_SPECIALIZATION
+	#pragma unroll(1)
+	for (int32_t ip = 0; ip < program_length;)
+	{
+		switch (fprc)
 		{
-			if (!(execution_plan[i] || (i == first_instruction_slot) || ((i == first_instruction_slot + 1) && first_instruction_fp)))
-				continue;
+		case 0:  ip = runner.template run<0>(ip); break;
+		case 1:  ip = runner.template run<1>(ip); break;
+		case 2:  ip = runner.template run<2>(ip); break;
+		default: ip = runner.template run<3>(ip); break;
+		}
+	}
+#else
+	runner.template run<-1>(0);
+#endif
+}
 
-			uint32_t num_workers = 1;
-			uint32_t num_fp_insts = 0;
-			while ((i + num_workers <= last_used_slot) && ((i + num_workers) % WORKERS_PER_HASH) && (execution_plan[i + num_workers] || (i + num_workers == first_instruction_slot) || ((i + num_workers == first_instruction_slot + 1) && first_instruction_fp)))
-			{
-				if ((num_workers & 1) && ((src_program[execution_plan[i + num_workers]].x & (0x20 << 8)) != 0))
-					++num_fp_insts;
-				++num_workers;
-			}
+// execute_program of one lane in execute_vm_iterations, for run_program
+template<typename VARIANT, int WORKERS_PER_HASH, bool L1_SHARED>
+struct ProgramRunner
+{
+	VMHashState& vm;
+	uint64_t* l1;
+	uint32_t batch_size;
+	int32_t sub;
+	uint32_t fp_reg_offset;
+	uint32_t fp_reg_group_A_offset;
+	uint32_t workers_mask;
+	uint32_t fp_workers_mask;
+
+	template<int FPRC>
+	__device__ __forceinline__ int32_t run(int32_t ip) const
+	{
+		return execute_program<VARIANT, WORKERS_PER_HASH, FPRC, L1_SHARED>(ip, vm.fprc, vm.compiled_program, vm.imm_buf, vm.program_length, vm.R, fp_reg_offset, fp_reg_group_A_offset, vm.scratchpad, l1, batch_size, sub, vm.xexponentMask, workers_mask, fp_workers_mask);
+	}
+};
+
+// Runs up to num_iterations of the current program for 2 hashes, 16 threads must call it: lanes 0-7 and 8-15 pass their hash's index in hash_index
+// vm_states_local (2 * VM_STATE_SHARED_STRIDE bytes) and l1_local (32 KB) point to the pair's part of shared memory, the pair must be aligned to 16 lanes in the warp
+// If YIELD is true, execution stops after the first iteration which ends past the deadline (clock64), so at least 1 iteration is always done
+// VM state is saved to vm_states in a resumable form unless this is the last chunk of the program and it was executed to the end
+// If L1_SHARED is true, the first VARIANT::SCRATCHPAD_L1_SIZE bytes of both scratchpads are kept in l1_local for the whole chunk
+// Every scratchpad access (L1, L2, L3 and spAddr0/spAddr1) which falls into this window goes to l1_local, so they stay coherent
+// Returns the number of iterations done
+template<typename VARIANT, int WORKERS_PER_HASH, bool YIELD, bool L1_SHARED>
+__device__ uint32_t execute_vm_iterations(uint64_t* vm_states_local, uint64_t* l1_local, uint32_t hash_index, void* vm_states, void* scratchpads, const void* dataset_ptr, uint32_t batch_size, uint32_t num_iterations, bool first, bool last, long long int deadline)
+{
+	const uint32_t pair_lane = threadIdx.x % 16;
+	const int32_t idx = hash_index;
+	const int32_t sub = pair_lane % 8;
 
-			//if (global_index == 0)
-			//	printf("i = %d, num_workers = %u, num_fp_insts = %u\n", i, num_workers, num_fp_insts);
+	uint64_t* R = vm_states_local + (pair_lane / 8) * VM_STATE_SHARED_STRIDE / sizeof(uint64_t);
 
-			num_workers = ((num_workers - 1) << NUM_INSTS_OFFSET) | (num_fp_insts << NUM_FP_INSTS_OFFSET);
+	copy_vm_state(R, ((const uint64_t*) vm_states) + idx * (VM_STATE_SIZE / sizeof(uint64_t)), sub);
 
-			const uint2 src_inst = src_program[execution_plan[i]];
-			uint2 inst = src_inst;
+	__syncwarp();
 
-			uint32_t opcode = inst.x & 0xff;
-			const uint32_t dst = (inst.x >> 8) & 7;
-			const uint32_t src = (inst.x >> 16) & 7;
-			const uint32_t mod = (inst.x >> 24);
+	VMHashState vm;
+	load_vm_hash_state(vm, R, hash_index, true, dataset_ptr, scratchpads, sub, first);
 
-			const bool is_fp = (src_inst.x & (0x20 << 8)) != 0;
-			if (is_fp && ((i & 1) == 0))
-				++i;
+	uint64_t* l1 = L1_SHARED ? (l1_local + (pair_lane / 8) * (VARIANT::SCRATCHPAD_L1_SIZE / sizeof(uint64_t))) : nullptr;
+	if (L1_SHARED)
+	{
+		for (uint32_t i = 0; i < VARIANT::SCRATCHPAD_L1_SIZE / 64; ++i)
+			l1[i * 8 + sub] = *(const uint64_t*)(vm.scratchpad + static_cast<size_t>(i * 64) * batch_size + sub * 8);
 
-			const bool is_branch_target = (src_inst.x & (0x40 << 8)) != 0;
-			if (is_branch_target && (branch_target_slot < 0))
-				branch_target_slot = k;
+		__syncwarp();
+	}
 
-			++k;
+	const uint32_t fp_reg_offset = 64 + ((sub & 1) << 3);
+	const uint32_t fp_reg_group_A_offset = 192 + ((sub & 1) << 3);
+	const uint64_t andMask = (sub < 4) ? uint64_t(-1) : randomx::dynamicMantissaMask;
 
-			inst.x = INST_NOP;
+	const uint32_t workers_mask = ((1 << WORKERS_PER_HASH) - 1) << (((threadIdx.x % 32) / 8) * 8);
+	const uint32_t fp_workers_mask = 3 << (((sub >> 1) << 1) + ((threadIdx.x % 32) / 8) * 8);
 
-			if (opcode < RANDOMX_FREQ_IADD_RS)
-			{
-				const uint32_t shift = (mod >> 2) % 4;
+	uint32_t ic = 0;
 
-				inst.x = (dst << DST_OFFSET) | (src << SRC_OFFSET) | (shift << SHIFT_OFFSET);
+	#pragma unroll(1)
+	while (ic < num_iterations)
+	{
+#if EXECUTE_VM_DATASET_PREFETCH
+		const uint64_t dataset_data = prefetch_dataset_item(vm, sub);
+#endif
 
-				if (dst != randomx::RegisterNeedsDisplacement)
-				{
-					// Encode regular ADD (opcode 1)
-					inst.x |= (1 << OPCODE_OFFSET);
-				}
-				else
-				{
-					// Encode ADD with src and imm32 (opcode 0)
-					inst.x |= imm_index << IMM_OFFSET;
-					imm_buf[imm_index++] = inst.y;
-				}
+		mix_scratchpad_addresses<VARIANT>(vm);
+		read_scratchpad_lines<VARIANT, L1_SHARED>(vm, l1, sub, batch_size, andMask);
 
-				*(compiled_program++) = inst.x | num_workers;
-				continue;
-			}
-			opcode -= RANDOMX_FREQ_IADD_RS;
+		__syncwarp();
 
-			if (opcode < RANDOMX_FREQ_IADD_M)
-			{
-				const uint32_t location = (src == dst) ? 3 : ((mod % 4) ? 1 : 2);
-				inst.x = (dst << DST_OFFSET) | (src << SRC_OFFSET) | (location << LOC_OFFSET) | (1 << OPCODE_OFFSET);
-				inst.x |= imm_index << IMM_OFFSET;
-				imm_buf[imm_index++] = (inst.y & 0xFC1FFFFFU) | (((location == 1) ? LOC_L1 : ((location == 2) ? LOC_L2 : LOC_L3)) << 21);
+		if ((WORKERS_PER_HASH == 8) || (sub < WORKERS_PER_HASH))
+		{
+			const ProgramRunner<VARIANT, WORKERS_PER_HASH, L1_SHARED> runner = { vm, l1, batch_size, sub, fp_reg_offset, fp_reg_group_A_offset, workers_mask, fp_workers_mask };
+			run_program(runner, vm.program_length, vm.fprc);
+		}
 
-				*(compiled_program++) = inst.x | num_workers;
-				continue;
-			}
-			opcode -= RANDOMX_FREQ_IADD_M;
+		mix_dataset_address<VARIANT>(vm);
 
-			if (opcode < RANDOMX_FREQ_ISUB_R)
-			{
-				inst.x = (dst << DST_OFFSET) | (src << SRC_OFFSET) | (1 << OPCODE_OFFSET) | (1 << NEGATIVE_SRC_OFFSET);
-				if (src == dst)
-				{
-					inst.x |= (imm_index << IMM_OFFSET) | (1 << SRC_IS_IMM32_OFFSET);
-					imm_buf[imm_index++] = inst.y;
-				}
+#if COMPILE_PROGRAM_RENAME_SWAPS
+		// Undo register renaming, all lanes read their registers before any of them writes
+		const uint64_t r_value = *vm.r_end;
+		const double f_value = *vm.f_end;
+		const double e_value = *vm.e_end;
+		__syncwarp();
+		vm.f[0] = f_value;
+		vm.e[0] = e_value;
+#else
+		const uint64_t r_value = R[sub];
+#endif
+
+#if EXECUTE_VM_DATASET_PREFETCH
+		write_scratchpad_lines(vm, sub, r_value, dataset_data);
+#else
+		write_scratchpad_lines(vm, sub, r_value, read_dataset_item(vm, sub));
+#endif
+
+		++ic;
+
+		// Both hashes of the pair must stop at the same iteration, the first lane of the pair decides
+		if (YIELD && (ic < num_iterations) && __shfl_sync(0xFFFFU << (threadIdx.x & 16), clock64() >= deadline, 0, 16))
+		{
+			last = false;
+			break;
+		}
+	}
 
-				*(compiled_program++) = inst.x | num_workers;
-				continue;
-			}
-			opcode -= RANDOMX_FREQ_ISUB_R;
+	if (L1_SHARED)
+	{
+		__syncwarp();
 
-			if (opcode < RANDOMX_FREQ_ISUB_M)
-			{
-				const uint32_t location = (src == dst) ? 3 : ((mod % 4) ? 1 : 2);
-				inst.x = (dst << DST_OFFSET) | (src << SRC_OFFSET) | (location << LOC_OFFSET) | (1 << OPCODE_OFFSET) | (1 << NEGATIVE_SRC_OFFSET);
-				inst.x |= imm_index << IMM_OFFSET;
-				imm_buf[imm_index++] = (inst.y & 0xFC1FFFFFU) | (((location == 1) ? LOC_L1 : ((location == 2) ? LOC_L2 : LOC_L3)) << 21);
+		for (uint32_t i = 0; i < VARIANT::SCRATCHPAD_L1_SIZE / 64; ++i)
+			*(uint64_t*)(vm.scratchpad + static_cast<size_t>(i * 64) * batch_size + sub * 8) = l1[i * 8 + sub];
+	}
 
-				*(compiled_program++) = inst.x | num_workers;
-				continue;
-			}
-			opcode -= RANDOMX_FREQ_ISUB_M;
+	store_vm_hash_state(((uint64_t*) vm_states) + idx * (VM_STATE_SIZE / sizeof(uint64_t)), vm, sub, last);
+
+	return ic;
+}
+
+// Sets hash_index to the calling lane's hash in pair pair_index of hash_list (see hash_list_size), hashes 2 * pair_index and 2 * pair_index + 1 run if it's null
+// Grid slots past the end of the list exit right away, so the grid can always be sized for the whole batch
+__device__ bool map_hash_index(const uint32_t* hash_list, uint32_t pair_index, uint32_t& hash_index)
+{
+	hash_index = pair_index * 2 + (threadIdx.x % 16) / 8;
+	if (!hash_list)
+		return true;
+
+	if (pair_index >= hash_list[0])
+		return false;
+
+	hash_index = hash_list[1 + hash_index];
+	return true;
+}
+
+// HASHES_PER_BLOCK can be 2, 4 or 8: every 16 threads run a pair of hashes independently, larger blocks only reduce the number of blocks per SM
+// Launch bounds keep at least 256 threads per SM for any block size, so register allocation doesn't depend on HASHES_PER_BLOCK
+template<typename VARIANT, int WORKERS_PER_HASH, int HASHES_PER_BLOCK>
+__global__ void __launch_bounds__(HASHES_PER_BLOCK * 8, 32 / HASHES_PER_BLOCK) execute_vm(void* vm_states, void* scratchpads, const void* dataset_ptr, uint32_t batch_size, uint32_t num_iterations, bool first, bool last, const uint32_t* hash_list)
+{
+	SPECIALIZE_BATCH_SIZE(batch_size);
+	SPECIALIZE_NUM_ITERATIONS(num_iterations);
+
+	// 2 KB shared memory per hash for VM states (plus VM_STATE_SHARED_PADDING)
+	__shared__ uint64_t vm_states_local[(VM_STATE_SHARED_STRIDE * HASHES_PER_BLOCK) / sizeof(uint64_t)];
+
+	const uint32_t pair = threadIdx.x / 16;
+	uint32_t hash_index;
+	if (!map_hash_index(hash_list, blockIdx.x * (HASHES_PER_BLOCK / 2) + pair, hash_index))
+		return;
 
-			if (opcode < RANDOMX_FREQ_IMUL_R)
+	execute_vm_iterations<VARIANT, WORKERS_PER_HASH, false, false>(vm_states_local + pair * ((VM_STATE_SHARED_STRIDE * 2) / sizeof(uint64_t)), nullptr, hash_index, vm_states, scratchpads, dataset_ptr, batch_size, num_iterations, first, last, 0);
+}
+
+// Same as execute_vm, but L1 windows of both scratchpads are cached in shared memory for the whole chunk
+// It needs 18 KB shared memory per hash, so the number of hashes per SM is limited by the SM's shared memory size
+// Experimental (--l1-shared): whether the saved L1 loads make up for the lower occupancy hasn't been measured on a GPU yet
+// Shared memory is dynamic because 4 hashes per block already need more than 48 KB: the launch must pass execute_vm_l1_shared_size_per_hash<VARIANT>() * HASHES_PER_BLOCK
+// bytes and cudaFuncAttributeMaxDynamicSharedMemorySize must be set to at least that
+template<typename VARIANT, int WORKERS_PER_HASH, int HASHES_PER_BLOCK>
+__global__ void __launch_bounds__(HASHES_PER_BLOCK * 8) execute_vm_l1_shared(void* vm_states, void* scratchpads, const void* dataset_ptr, uint32_t batch_size, uint32_t num_iterations, bool first, bool last, const uint32_t* hash_list)
+{
+	SPECIALIZE_BATCH_SIZE(batch_size);
+	SPECIALIZE_NUM_ITERATIONS(num_iterations);
+
+	// VM states of all hashes in the block, followed by L1 windows of their scratchpads
+	extern __shared__ uint64_t shared_buf[];
+	uint64_t* vm_states_local = shared_buf;
+	uint64_t* l1_local = shared_buf + (VM_STATE_SHARED_STRIDE * HASHES_PER_BLOCK) / sizeof(uint64_t);
+
+	const uint32_t pair = threadIdx.x / 16;
+	uint32_t hash_index;
+	if (!map_hash_index(hash_list, blockIdx.x * (HASHES_PER_BLOCK / 2) + pair, hash_index))
+		return;
+
+	execute_vm_iterations<VARIANT, WORKERS_PER_HASH, false, true>(vm_states_local + pair * ((VM_STATE_SHARED_STRIDE * 2) / sizeof(uint64_t)), l1_local + pair * ((VARIANT::SCRATCHPAD_L1_SIZE * 2) / sizeof(uint64_t)), hash_index, vm_states, scratchpads, dataset_ptr, batch_size, num_iterations, first, last, 0);
+}
+
+// Number of instruction groups in the programs of measure_instruction_costs
+// Programs are short, so FP values stay in range until registers are reset, and 2 immediate values per instruction and the program fit in the VM state
+constexpr uint32_t INSTRUCTION_COST_GROUPS = 16;
+
+// Builds a program of INSTRUCTION_COST_GROUPS groups for measure_instruction_costs, encoded the same way as compile_program does it
+// cls is an instruction cost class: execute_vm opcodes use their most common operands, scratchpad reads (17, 18) are integer XOR from L1/L3
+// Every group has 1 instruction if full_groups is false, or as many as WORKERS_PER_HASH lanes can run in parallel
+// Immediate values come from seed, CBRANCH jumps to the next group when it's taken, CFROUND keeps the rounding mode (registers must be divisible by 4)
+// Returns the program length
+template<typename VARIANT, int WORKERS_PER_HASH>
+__device__ uint32_t build_cost_program(uint32_t cls, bool full_groups, uint64_t seed, uint32_t* imm_buf, uint32_t* compiled_program)
+{
+	const bool is_fp = (cls >= 11) && (cls <= 15);
+	const uint32_t n = full_groups ? (is_fp ? WORKERS_PER_HASH / 2 : WORKERS_PER_HASH) : 1;
+	const uint32_t num_workers = (is_fp ? n * 2 : n) - 1;
+	const bool sync_group = (cls == 9) || (cls == 16);
+
+	uint32_t program_length = 0;
+	for (uint32_t g = 0; g < INSTRUCTION_COST_GROUPS; ++g)
+	{
+		for (uint32_t l = 0; l < n; ++l)
+		{
+			seed = seed * 6364136223846793005ULL + 1442695040888963407ULL;
+			const uint32_t rnd = static_cast<uint32_t>(seed >> 32);
+
+			const uint32_t dst = l;
+			const uint32_t src = (l + 1) % 8;
+
+			// Every instruction has its own pair of immediate values
+			const uint32_t imm_index = (g * n + l) * 2;
+			imm_buf[imm_index] = rnd;
+			imm_buf[imm_index + 1] = rnd;
+
+			uint32_t inst = (dst << DST_OFFSET) | (src << SRC_OFFSET);
+			switch (cls)
 			{
-				inst.x = (dst << DST_OFFSET) | (src << SRC_OFFSET) | (2 << OPCODE_OFFSET);
-				if (src == dst)
+			case 0:
+				inst |= imm_index << IMM_OFFSET;
+				break;
+
+			case 9:
 				{
-					inst.x |= (imm_index << IMM_OFFSET) | (1 << SRC_IS_IMM32_OFFSET);
-					imm_buf[imm_index++] = inst.y;
+					const uint32_t cshift = (rnd >> 28) + randomx::ConditionOffset;
+					inst = (dst << DST_OFFSET) | (9 << OPCODE_OFFSET) | (imm_index << IMM_OFFSET);
+					imm_buf[imm_index] = (rnd | (1U << cshift)) & ~(1U << (cshift - 1));
+					imm_buf[imm_index + 1] = cshift | ((program_length - l + num_workers) << 5);
 				}
-
-				*(compiled_program++) = inst.x | num_workers;
-				continue;
+				break;
+
+			case 10:
+				inst |= (1 << LOC_OFFSET) | (10 << OPCODE_OFFSET) | (imm_index << IMM_OFFSET);
+				imm_buf[imm_index] = (rnd & 0xFC1FFFFFU) | (VARIANT::LOC_L1 << 21);
+				break;
+
+			case 11:
+			case 14:
+				inst = (((cls == 11) ? dst : (dst + randomx::RegisterCountFlt)) << DST_OFFSET) | (cls << OPCODE_OFFSET);
+				break;
+
+			case 12:
+			case 13:
+				inst = (((cls == 12) ? dst : (dst + randomx::RegisterCountFlt)) << DST_OFFSET) | (dst << (SRC_OFFSET + 1)) | (cls << OPCODE_OFFSET);
+				break;
+
+			case 15:
+				inst = ((dst + randomx::RegisterCountFlt) << DST_OFFSET) | (src << SRC_OFFSET) | (1 << LOC_OFFSET) | (15 << OPCODE_OFFSET) | (imm_index << IMM_OFFSET);
+				imm_buf[imm_index] = (rnd & 0xFC1FFFFFU) | (VARIANT::LOC_L1 << 21);
+				break;
+
+			case 16:
+				inst = (src << SRC_OFFSET) | (16 << OPCODE_OFFSET);
+				break;
+
+			case INSTRUCTION_COST_READ_L1_L2:
+				inst |= (1 << LOC_OFFSET) | (6 << OPCODE_OFFSET) | (imm_index << IMM_OFFSET);
+				imm_buf[imm_index] = (rnd & 0xFC1FFFFFU) | (VARIANT::LOC_L1 << 21);
+				break;
+
+			case INSTRUCTION_COST_READ_L3:
+				inst = (dst << DST_OFFSET) | (dst << SRC_OFFSET) | (3 << LOC_OFFSET) | (6 << OPCODE_OFFSET) | (imm_index << IMM_OFFSET);
+				imm_buf[imm_index] = (rnd & 0xFC1FFFC0U) | (VARIANT::LOC_L3 << 21);
+				break;
+
+			default:
+				inst |= cls << OPCODE_OFFSET;
+				break;
 			}
-			opcode -= RANDOMX_FREQ_IMUL_R;
 
-			if (opcode < RANDOMX_FREQ_IMUL_M)
-			{
-				const uint32_t location = (src == dst) ? 3 : ((mod % 4) ? 1 : 2);
-				inst.x = (dst << DST_OFFSET) | (src << SRC_OFFSET) | (location << LOC_OFFSET) | (2 << OPCODE_OFFSET);
-				inst.x |= imm_index << IMM_OFFSET;
-				imm_buf[imm_index++] = (inst.y & 0xFC1FFFFFU) | (((location == 1) ? LOC_L1 : ((location == 2) ? LOC_L2 : LOC_L3)) << 21);
+			if (l == 0)
+				inst |= (num_workers << NUM_INSTS_OFFSET) | ((is_fp ? n : 0) << NUM_FP_INSTS_OFFSET) | (sync_group ? (1U << SYNC_GROUP_OFFSET) : 0);
 
-				*(compiled_program++) = inst.x | num_workers;
-				continue;
-			}
-			opcode -= RANDOMX_FREQ_IMUL_M;
+			compiled_program[program_length++] = inst;
+		}
+	}
 
-			if (opcode < RANDOMX_FREQ_IMULH_R)
-			{
-				inst.x = (dst << DST_OFFSET) | (src << SRC_OFFSET) | (3 << OPCODE_OFFSET);
+	return program_length;
+}
 
-				*(compiled_program++) = inst.x | num_workers;
-				continue;
-			}
-			opcode -= RANDOMX_FREQ_IMULH_R;
+// Microbenchmark of instruction classes as execute_vm runs them, 16 threads (2 hashes) per block
+// Every pass resets registers, builds a new program with build_cost_program and runs it with execute_program, the same code execute_vm uses,
+// so the measured time includes decoding, scratchpad access and synchronization after every group
+// cycles[hash_index] receives the total number of clock cycles of all passes, scratchpads must have room for batch_size hashes
+template<typename VARIANT, int WORKERS_PER_HASH>
+__global__ void __launch_bounds__(16) measure_instruction_costs(void* scratchpads, uint32_t batch_size, uint32_t cls, bool full_groups, uint32_t num_passes, uint64_t* cycles)
+{
+	__shared__ uint64_t vm_states_local[(VM_STATE_SHARED_STRIDE * 2) / sizeof(uint64_t)];
+	static_assert(REGISTERS_SIZE + INSTRUCTION_COST_GROUPS * 8 * 3 * sizeof(uint32_t) <= VM_STATE_SIZE, "Immediate values and the program must fit in the VM state");
 
-			if (opcode < RANDOMX_FREQ_IMULH_M)
-			{
-				const uint32_t location = (src == dst) ? 3 : ((mod % 4) ? 1 : 2);
-				inst.x = (dst << DST_OFFSET) | (src << SRC_OFFSET) | (location << LOC_OFFSET) | (3 << OPCODE_OFFSET);
-				inst.x |= imm_index << IMM_OFFSET;
-				imm_buf[imm_index++] = (inst.y & 0xFC1FFFFFU) | (((location == 1) ? LOC_L1 : ((location == 2) ? LOC_L2 : LOC_L3)) << 21);
+	const uint32_t hash_index = blockIdx.x * 2 + threadIdx.x / 8;
+	const int32_t sub = threadIdx.x % 8;
 
-				*(compiled_program++) = inst.x | num_workers;
-				continue;
-			}
-			opcode -= RANDOMX_FREQ_IMULH_M;
+	uint64_t* R = vm_states_local + (threadIdx.x / 8) * (VM_STATE_SHARED_STRIDE / sizeof(uint64_t));
+	uint32_t* imm_buf = (uint32_t*)(R + REGISTERS_SIZE / sizeof(uint64_t));
+	uint32_t* compiled_program = imm_buf + INSTRUCTION_COST_GROUPS * 8 * 2;
+	double* F = (double*)(R + 8);
+	double* E = (double*)(R + 16);
+	double* A = (double*)(R + 24);
 
-			if (opcode < RANDOMX_FREQ_ISMULH_R)
-			{
-				inst.x = (dst << DST_OFFSET) | (src << SRC_OFFSET) | (4 << OPCODE_OFFSET);
+	uint8_t* scratchpad = ((uint8_t*) scratchpads) + hash_index * 64;
 
-				*(compiled_program++) = inst.x | num_workers;
-				continue;
-			}
-			opcode -= RANDOMX_FREQ_ISMULH_R;
+	const uint32_t fp_reg_offset = 64 + ((sub & 1) << 3);
+	const uint32_t fp_reg_group_A_offset = 192 + ((sub & 1) << 3);
 
-			if (opcode < RANDOMX_FREQ_ISMULH_M)
-			{
-				const uint32_t location = (src == dst) ? 3 : ((mod % 4) ? 1 : 2);
-				inst.x = (dst << DST_OFFSET) | (src << SRC_OFFSET) | (location << LOC_OFFSET) | (4 << OPCODE_OFFSET);
-				inst.x |= imm_index << IMM_OFFSET;
-				imm_buf[imm_index++] = (inst.y & 0xFC1FFFFFU) | (((location == 1) ? LOC_L1 : ((location == 2) ? LOC_L2 : LOC_L3)) << 21);
+	// FDIV_M divisors are in [1, 2)
+	const uint64_t xexponentMask = 0x3FF0000000000000ULL;
+
+	const uint32_t workers_mask = ((1 << WORKERS_PER_HASH) - 1) << (((threadIdx.x % 32) / 8) * 8);
+	const uint32_t fp_workers_mask = 3 << (((sub >> 1) << 1) + ((threadIdx.x % 32) / 8) * 8);
+
+	long long int total = 0;
+
+	for (uint32_t pass = 0; pass < num_passes; ++pass)
+	{
+		const uint64_t seed = (static_cast<uint64_t>(hash_index) * num_passes + pass + 1) * 0x9E3779B97F4A7C15ULL;
+
+		// Integer registers are random multiples of 4, FP registers are close to 1, so no value under- or overflows within one pass
+		R[sub] = ((seed + sub) * 0xBF58476D1CE4E5B9ULL) & ~3ULL;
+		F[sub] = 1.0 + sub / 16.0;
+		E[sub] = 1.5 + sub / 16.0;
+		A[sub] = 1.0 + sub / 1024.0;
+
+		const uint32_t program_length = build_cost_program<VARIANT, WORKERS_PER_HASH>(cls, full_groups, seed, imm_buf, compiled_program);
 
-				*(compiled_program++) = inst.x | num_workers;
+		__syncwarp();
+
+		const long long int t0 = clock64();
+
+		uint32_t fprc = 0;
+		if ((WORKERS_PER_HASH == 8) || (sub < WORKERS_PER_HASH))
+			execute_program<VARIANT, WORKERS_PER_HASH, 0, false>(0, fprc, compiled_program, imm_buf, program_length, R, fp_reg_offset, fp_reg_group_A_offset, scratchpad, nullptr, batch_size, sub, xexponentMask, workers_mask, fp_workers_mask);
+
+		__syncwarp();
+
+		total += clock64() - t0;
+	}
+
+	if (sub == 0)
+		cycles[hash_index] = total;
+}
+
+// Runs the current programs of 2 hashes in the same lanes, one instruction group of each hash per step
+// Both groups are decoded and their scratchpad reads are issued before either of them executes,
+// so the memory latency of one hash overlaps with the other hash's work instead of stalling the warp
+// The 2 hashes can use different rounding modes, so FP instructions read it from vm[h].fprc (no FPRC specialization)
+template<typename VARIANT, int WORKERS_PER_HASH>
+__device__ void execute_program_interleaved(VMHashState (&vm)[2], uint32_t fp_reg_offset, uint32_t fp_reg_group_A_offset, uint32_t batch_size, int32_t sub, uint32_t workers_mask, uint32_t fp_workers_mask)
+{
+	int32_t ip[2] = { 0, 0 };
+
+	#pragma unroll(1)
+	while ((ip[0] < vm[0].program_length) || (ip[1] < vm[1].program_length))
+	{
+		bool running[2];
+		bool active[2];
+		bool sync_group[2];
+		int32_t num_insts[2];
+
+		bool is_fp[2];
+		uint32_t inst[2];
+		uint32_t opcode[2];
+		uint32_t location[2];
+		uint64_t* dst_ptr[2];
+		uint64_t* src_ptr[2];
+		uint64_t dst[2];
+		uint64_t src[2];
+		uint2 imm[2];
+
+		asm("// INSTRUCTION DECODING BEGIN");
+
+		#pragma unroll
+		for (int h = 0; h < 2; ++h)
+		{
+			running[h] = (ip[h] < vm[h].program_length);
+			active[h] = running[h] && fetch_instruction<WORKERS_PER_HASH>(vm[h].compiled_program, ip[h], sub, inst[h], num_insts[h], sync_group[h], is_fp[h]);
+			if (!active[h])
 				continue;
-			}
-			opcode -= RANDOMX_FREQ_ISMULH_M;
 
-			if (opcode < RANDOMX_FREQ_IMUL_RCP)
-			{
-				const uint64_t r = imul_rcp_value(inst.y);
-				if (r == 1)
-				{
-					*(compiled_program++) = INST_NOP | num_workers;
-					continue;
-				}
+			opcode[h] = (inst[h] >> OPCODE_OFFSET) & 31;
+			location[h] = (inst[h] >> LOC_OFFSET) & 3;
+
+			decode_operands(inst[h], is_fp[h], vm[h].R, vm[h].imm_buf, fp_reg_offset, fp_reg_group_A_offset, dst_ptr[h], src_ptr[h], dst[h], src[h], imm[h]);
 
-				inst.x = (dst << DST_OFFSET) | (src << SRC_OFFSET) | (2 << OPCODE_OFFSET);
-				inst.x |= (imm_index << IMM_OFFSET) | (1 << SRC_IS_IMM64_OFFSET);
+			if (location[h])
+				access_scratchpad<VARIANT, false>(opcode[h], imm[h], src[h], dst[h], vm[h].scratchpad, nullptr, batch_size);
+		}
 
-				imm_buf[imm_index] = ((const uint32_t*) &r)[0];
-				imm_buf[imm_index + 1] = ((const uint32_t*) &r)[1];
-				imm_index += 2;
+		asm("// INSTRUCTION DECODING END");
 
-				*(compiled_program++) = inst.x | num_workers;
+		#pragma unroll
+		for (int h = 0; h < 2; ++h)
+		{
+			if (!running[h])
 				continue;
-			}
-			opcode -= RANDOMX_FREQ_IMUL_RCP;
 
-			if (opcode < RANDOMX_FREQ_INEG_R)
+			bool sync_needed = false;
+			bool ip_changed = false;
+			bool fprc_changed = false;
+
+			if (active[h] && (opcode[h] != 10))
 			{
-				inst.x = (dst << DST_OFFSET) | (5 << OPCODE_OFFSET);
+				asm("// EXECUTION BEGIN");
+				execute_decoded_instruction<-1>(inst[h], opcode[h], location[h], dst_ptr[h], src_ptr[h], dst[h], src[h], imm[h], is_fp[h], sub, vm[h].xexponentMask, fp_workers_mask, num_insts[h], ip[h], ip_changed, sync_needed, vm[h].fprc, fprc_changed);
+				asm("// EXECUTION END");
+			}
 
-				*(compiled_program++) = inst.x | num_workers;
-				continue;
+			asm("// SYNCHRONIZATION OF INSTRUCTION POINTER AND ROUNDING MODE BEGIN");
+			sync_instruction_group(sync_group[h], sync_needed, ip_changed, fprc_changed, workers_mask, ip[h], vm[h].fprc);
+			asm("// SYNCHRONIZATION OF INSTRUCTION POINTER AND ROUNDING MODE END");
+
+			ip[h] += num_insts[h] + 1;
+		}
+	}
+}
+
+// Runs num_iterations of the current program for 4 hashes, 16 threads must call it
+// Lanes 0-7 run hash_index[0] and hash_index[1] with execute_program_interleaved, lanes 8-15 run their own 2 hashes the same way
+// valid[1] is false if there is no second hash (the end of hash_list), valid[0] must be true
+// vm_states_local (4 * VM_STATE_SHARED_STRIDE bytes) points to the part of shared memory for the 16 threads, they must be aligned to 16 lanes in the warp
+template<typename VARIANT, int WORKERS_PER_HASH>
+__device__ void execute_vm_iterations_interleaved(uint64_t* vm_states_local, const uint32_t (&hash_index)[2], const bool (&valid)[2], void* vm_states, void* scratchpads, const void* dataset_ptr, uint32_t batch_size, uint32_t num_iterations, bool first, bool last)
+{
+	const uint32_t pair_lane = threadIdx.x % 16;
+	const int32_t sub = pair_lane % 8;
+
+	uint64_t* R[2];
+
+	#pragma unroll
+	for (int h = 0; h < 2; ++h)
+	{
+		R[h] = vm_states_local + (h * 2 + pair_lane / 8) * VM_STATE_SHARED_STRIDE / sizeof(uint64_t);
+		if (valid[h])
+			copy_vm_state(R[h], ((const uint64_t*) vm_states) + hash_index[h] * (VM_STATE_SIZE / sizeof(uint64_t)), sub);
+	}
+
+	__syncwarp();
+
+	VMHashState vm[2];
+
+	#pragma unroll
+	for (int h = 0; h < 2; ++h)
+		load_vm_hash_state(vm[h], R[h], hash_index[h], valid[h], dataset_ptr, scratchpads, sub, first);
+
+	const uint32_t fp_reg_offset = 64 + ((sub & 1) << 3);
+	const uint32_t fp_reg_group_A_offset = 192 + ((sub & 1) << 3);
+	const uint64_t andMask = (sub < 4) ? uint64_t(-1) : randomx::dynamicMantissaMask;
+
+	const uint32_t workers_mask = ((1 << WORKERS_PER_HASH) - 1) << (((threadIdx.x % 32) / 8) * 8);
+	const uint32_t fp_workers_mask = 3 << (((sub >> 1) << 1) + ((threadIdx.x % 32) / 8) * 8);
+
+	#pragma unroll(1)
+	for (uint32_t ic = 0; ic < num_iterations; ++ic)
+	{
+#if EXECUTE_VM_DATASET_PREFETCH
+		uint64_t dataset_data[2];
+
+		#pragma unroll
+		for (int h = 0; h < 2; ++h)
+			dataset_data[h] = valid[h] ? prefetch_dataset_item(vm[h], sub) : 0;
+#endif
+
+		// Registers of other lanes are read here, so they must all be written before and not changed until all lanes have read them
+		// A hash which is not valid has no VM state in shared memory, so its address registers can't be read
+		#pragma unroll
+		for (int h = 0; h < 2; ++h)
+		{
+			if (valid[h])
+				mix_scratchpad_addresses<VARIANT>(vm[h]);
+		}
+
+		__syncwarp();
+
+		#pragma unroll
+		for (int h = 0; h < 2; ++h)
+		{
+			if (valid[h])
+				read_scratchpad_lines<VARIANT, false>(vm[h], nullptr, sub, batch_size, andMask);
+		}
+
+		__syncwarp();
+
+		if ((WORKERS_PER_HASH == 8) || (sub < WORKERS_PER_HASH))
+			execute_program_interleaved<VARIANT, WORKERS_PER_HASH>(vm, fp_reg_offset, fp_reg_group_A_offset, batch_size, sub, workers_mask, fp_workers_mask);
+
+		// Lanes which don't run the program must wait for its results
+		__syncwarp();
+
+		#pragma unroll
+		for (int h = 0; h < 2; ++h)
+		{
+			if (valid[h])
+				mix_dataset_address<VARIANT>(vm[h]);
+		}
+
+		uint64_t r_value[2] = {};
+#if COMPILE_PROGRAM_RENAME_SWAPS
+		// Undo register renaming, all lanes read their registers before any of them writes
+		double f_value[2] = {}, e_value[2] = {};
+
+		#pragma unroll
+		for (int h = 0; h < 2; ++h)
+		{
+			if (valid[h])
+			{
+				r_value[h] = *vm[h].r_end;
+				f_value[h] = *vm[h].f_end;
+				e_value[h] = *vm[h].e_end;
 			}
-			opcode -= RANDOMX_FREQ_INEG_R;
+		}
+
+		__syncwarp();
 
-			if (opcode < RANDOMX_FREQ_IXOR_R)
+		#pragma unroll
+		for (int h = 0; h < 2; ++h)
+		{
+			if (valid[h])
 			{
-				inst.x = (dst << DST_OFFSET) | (src << SRC_OFFSET) | (6 << OPCODE_OFFSET);
-				if (src == dst)
-				{
-					inst.x |= (imm_index << IMM_OFFSET) | (1 << SRC_IS_IMM32_OFFSET);
-					imm_buf[imm_index++] = inst.y;
-				}
+				vm[h].f[0] = f_value[h];
+				vm[h].e[0] = e_value[h];
+			}
+		}
+#else
+		#pragma unroll
+		for (int h = 0; h < 2; ++h)
+		{
+			if (valid[h])
+				r_value[h] = R[h][sub];
+		}
+#endif
 
-				*(compiled_program++) = inst.x | num_workers;
-				continue;
+		#pragma unroll
+		for (int h = 0; h < 2; ++h)
+		{
+			if (valid[h])
+			{
+#if EXECUTE_VM_DATASET_PREFETCH
+				write_scratchpad_lines(vm[h], sub, r_value[h], dataset_data[h]);
+#else
+				write_scratchpad_lines(vm[h], sub, r_value[h], read_dataset_item(vm[h], sub));
+#endif
 			}
-			opcode -= RANDOMX_FREQ_IXOR_R;
+		}
+
+		__syncwarp();
+	}
+
+	#pragma unroll
+	for (int h = 0; h < 2; ++h)
+	{
+		if (valid[h])
+			store_vm_hash_state(((uint64_t*) vm_states) + hash_index[h] * (VM_STATE_SIZE / sizeof(uint64_t)), vm[h], sub, last);
+	}
+}
+
+// Variant of execute_vm where every 8 threads run 2 hashes with interleaved instruction groups (see execute_program_interleaved)
+// It's meant for 2 and 4 workers per hash, where a single program leaves most cycles waiting on dependent loads
+// Every 16 threads run 2 pairs of hash_list (or 4 consecutive hashes if it's null), so the grid is half the size of execute_vm's grid
+// Experimental (--interleaved): use RandomX_CUDA.exe --benchmark-engines to compare it with execute_vm on a GPU
+template<typename VARIANT, int WORKERS_PER_HASH, int HASHES_PER_BLOCK>
+__global__ void __launch_bounds__(HASHES_PER_BLOCK * 8, 32 / HASHES_PER_BLOCK) execute_vm_interleaved(void* vm_states, void* scratchpads, const void* dataset_ptr, uint32_t batch_size, uint32_t num_iterations, bool first, bool last, const uint32_t* hash_list)
+{
+	SPECIALIZE_BATCH_SIZE(batch_size);
+	SPECIALIZE_NUM_ITERATIONS(num_iterations);
+
+	// 2 VM states for every 8 threads
+	__shared__ uint64_t vm_states_local[(VM_STATE_SHARED_STRIDE * HASHES_PER_BLOCK * 2) / sizeof(uint64_t)];
+
+	const uint32_t pair = threadIdx.x / 16;
+	const uint32_t first_pair = (blockIdx.x * (HASHES_PER_BLOCK / 2) + pair) * 2;
+
+	uint32_t hash_index[2];
+	bool valid[2];
+	valid[0] = map_hash_index(hash_list, first_pair, hash_index[0]);
+	valid[1] = map_hash_index(hash_list, first_pair + 1, hash_index[1]);
+	if (!valid[0])
+		return;
+
+	execute_vm_iterations_interleaved<VARIANT, WORKERS_PER_HASH>(vm_states_local + pair * ((VM_STATE_SHARED_STRIDE * 4) / sizeof(uint64_t)), hash_index, valid, vm_states, scratchpads, dataset_ptr, batch_size, num_iterations, first, last);
+}
+
+// Returns the lanes (out of lanes) whose 5-bit register code is equal to code, bits[i] is the ballot of bit i of the register codes
+__device__ uint32_t lanes_with_code(uint32_t lanes, const uint32_t (&bits)[5], uint32_t code)
+{
+	#pragma unroll
+	for (int i = 0; i < 5; ++i)
+		lanes &= ((code >> i) & 1) ? bits[i] : ~bits[i];
+
+	return lanes;
+}
+
+// Takes the value from the first lane in writers if there is one, all lanes in mask must call it
+__device__ uint64_t take_written_value(uint32_t mask, uint32_t writers, uint64_t value, uint64_t written_value)
+{
+	const int32_t lane = __ffs(writers) - 1;
+	const uint64_t result = __shfl_sync(mask, written_value, (lane >= 0) ? lane : (threadIdx.x % 32));
+	return (lane >= 0) ? result : value;
+}
+
+// Variant of execute_vm which keeps VM registers in hardware registers instead of shared memory
+// Lane "sub" of a hash owns r[sub], a[sub] (as 64-bit halves, same layout as in VM state) and f[sub], e[sub] (halves of F and E registers)
+// Operands are read from their owners with __shfl_sync and results are sent back to the owners at the end of every instruction slot
+// Only immediates and the compiled program stay in shared memory
+// HASHES_PER_BLOCK can be 2, 4 or 8, same as in execute_vm
+template<typename VARIANT, int WORKERS_PER_HASH, int HASHES_PER_BLOCK>
+__global__ void __launch_bounds__(HASHES_PER_BLOCK * 8, 32 / HASHES_PER_BLOCK) execute_vm_resident(void* vm_states, void* scratchpads, const void* dataset_ptr, uint32_t batch_size, uint32_t num_iterations, bool first, bool last, const uint32_t* hash_list)
+{
+	SPECIALIZE_BATCH_SIZE(batch_size);
+	SPECIALIZE_NUM_ITERATIONS(num_iterations);
+
+	// 1.75 KB shared memory per hash for immediates and programs
+	__shared__ uint32_t programs_local[((VM_STATE_SHARED_STRIDE - REGISTERS_SIZE) * HASHES_PER_BLOCK) / sizeof(uint32_t)];
+
+	uint32_t hash_index;
+	if (!map_hash_index(hash_list, blockIdx.x * (HASHES_PER_BLOCK / 2) + threadIdx.x / 16, hash_index))
+		return;
+
+	const int32_t idx = hash_index;
+	const int32_t sub = threadIdx.x % 8;
+	const int32_t sub2 = sub >> 1;
+	const uint32_t fp_half = sub & 1;
+
+	uint64_t* p = ((uint64_t*) vm_states) + idx * (VM_STATE_SIZE / sizeof(uint64_t));
+
+	uint32_t ma = ((uint32_t*)(p + 16))[0];
+	uint32_t mx = ((uint32_t*)(p + 16))[1];
+	uint32_t fprc = ((uint32_t*)(p + 16))[2];
+	const uint32_t num_imm = ((uint32_t*)(p + 16))[3];
+
+	const uint32_t program_length = ((uint32_t*)(p + 20))[0];
+
+	uint32_t* imm_buf = programs_local + (threadIdx.x / 8) * ((VM_STATE_SHARED_STRIDE - REGISTERS_SIZE) / sizeof(uint32_t));
+	uint32_t* compiled_program = imm_buf + num_imm;
+
+	// Only immediate values and the program are copied, see vm_state_used_size
+	{
+		const uint4* src = (const uint4*)(p + REGISTERS_SIZE / sizeof(uint64_t));
+		for (uint32_t i = sub, n = (num_imm + program_length + 3) / 4; i < n; i += 8)
+			((uint4*) imm_buf)[i] = src[i];
+	}
+
+	uint64_t r = p[sub];
+	const uint64_t a = p[sub + 24];
+	uint64_t f, e;
+
+	const uint32_t addressRegisters = ((uint32_t*)(p + 22))[0];
+	const uint32_t readReg0 = (addressRegisters & 0xff) / sizeof(uint64_t);
+	const uint32_t readReg1 = ((addressRegisters >> 8) & 0xff) / sizeof(uint64_t);
+	const uint32_t readReg2 = ((addressRegisters >> 16) & 0xff) / sizeof(uint64_t);
+	const uint32_t readReg3 = (addressRegisters >> 24) / sizeof(uint64_t);
+
+	const uint32_t datasetOffset = ((uint32_t*)(p + 22))[1];
+	const uint8_t* dataset = ((const uint8_t*) dataset_ptr) + datasetOffset;
+
+	const ulonglong2 eMask = ((ulonglong2*)(p + 18))[0];
+
+#if COMPILE_PROGRAM_RENAME_SWAPS
+	// Lanes which hold this lane's registers at the end of the program (end_map in compile_program)
+	const uint32_t end_map = ((uint32_t*)(p + 21))[1];
+	const uint32_t r_end_lane = (end_map >> (sub * 3)) & 7;
+	const uint32_t f_end_lane = sub ^ ((end_map >> (24 + sub2)) & 1);
+	const uint32_t e_end_lane = sub ^ ((end_map >> (28 + sub2)) & 1);
+#endif
+
+	uint32_t spAddr0 = first ? mx : 0;
+	uint32_t spAddr1 = first ? ma : 0;
 
-			if (opcode < RANDOMX_FREQ_IXOR_M)
-			{
-				const uint32_t location = (src == dst) ? 3 : ((mod % 4) ? 1 : 2);
-				inst.x = (dst << DST_OFFSET) | (src << SRC_OFFSET) | (location << LOC_OFFSET) | (6 << OPCODE_OFFSET);
-				inst.x |= imm_index << IMM_OFFSET;
-				imm_buf[imm_index++] = (inst.y & 0xFC1FFFFFU) | (((location == 1) ? LOC_L1 : ((location == 2) ? LOC_L2 : LOC_L3)) << 21);
+	uint8_t* scratchpad = ((uint8_t*) scratchpads) + idx * 64;
 
-				*(compiled_program++) = inst.x | num_workers;
-				continue;
-			}
-			opcode -= RANDOMX_FREQ_IXOR_M;
+	const bool f_group = (sub < 4);
 
-			if (opcode < RANDOMX_FREQ_IROR_R)
-			{
-				inst.x = (dst << DST_OFFSET) | (src << SRC_OFFSET) | (7 << OPCODE_OFFSET);
-				if (src == dst)
-				{
-					inst.x |= (imm_index << IMM_OFFSET) | (1 << SRC_IS_IMM32_OFFSET);
-					imm_buf[imm_index++] = inst.y;
-				}
+	const uint64_t andMask = f_group ? uint64_t(-1) : randomx::dynamicMantissaMask;
+	const uint64_t orMask1 = f_group ? 0 : eMask.x;
+	const uint64_t orMask2 = f_group ? 0 : eMask.y;
+	const uint64_t xexponentMask = (sub & 1) ? eMask.y : eMask.x;
 
-				*(compiled_program++) = inst.x | num_workers;
-				continue;
-			}
-			opcode -= RANDOMX_FREQ_IROR_R;
+	// All 8 lanes of a hash own registers, so all of them go through the program even if only WORKERS_PER_HASH lanes execute instructions
+	const uint32_t hash_mask = 0xFFU << (((threadIdx.x % 32) / 8) * 8);
+	const uint32_t fp_workers_mask = 3 << (((sub >> 1) << 1) + ((threadIdx.x % 32) / 8) * 8);
 
-			if (opcode < RANDOMX_FREQ_ISWAP_R)
-			{
-				inst.x = (dst << DST_OFFSET) | (src << SRC_OFFSET) | (8 << OPCODE_OFFSET);
+	__syncwarp();
 
-				*(compiled_program++) = ((src != dst) ? inst.x : INST_NOP) | num_workers;
-				continue;
-			}
-			opcode -= RANDOMX_FREQ_ISWAP_R;
+	#pragma unroll(1)
+	for (int ic = 0; ic < num_iterations; ++ic)
+	{
+#if EXECUTE_VM_DATASET_PREFETCH
+		// ma doesn't change until the end of the iteration
+		const uint64_t dataset_data = __ldg((const uint64_t*)(dataset + ma + sub * 8));
+#endif
 
-			if (opcode < RANDOMX_FREQ_FSWAP_R)
-			{
-				inst.x = (dst << DST_OFFSET) | (11 << OPCODE_OFFSET);
+		const uint64_t spMix = __shfl_sync(hash_mask, r, readReg0, 8) ^ __shfl_sync(hash_mask, r, readReg1, 8);
+		spAddr0 ^= ((const uint32_t*) &spMix)[0];
+		spAddr1 ^= ((const uint32_t*) &spMix)[1];
+		spAddr0 &= VARIANT::ScratchpadL3Mask64;
+		spAddr1 &= VARIANT::ScratchpadL3Mask64;
 
-				*(compiled_program++) = inst.x | num_workers;
-				continue;
-			}
-			opcode -= RANDOMX_FREQ_FSWAP_R;
+		uint64_t offset1, offset2;
+		asm("mad.wide.u32 %0,%2,%4,%5;\n\tmad.wide.u32 %1,%3,%4,%5;" : "=l"(offset1), "=l"(offset2) : "r"(spAddr0), "r"(spAddr1), "r"(batch_size), "l"(static_cast<uint64_t>(sub * 8)));
 
-			if (opcode < RANDOMX_FREQ_FADD_R)
-			{
-				inst.x = ((dst % randomx::RegisterCountFlt) << DST_OFFSET) | ((src % randomx::RegisterCountFlt) << (SRC_OFFSET + 1)) | (12 << OPCODE_OFFSET);
+		uint64_t* p0 = (uint64_t*)(scratchpad + offset1);
+		uint64_t* p1 = (uint64_t*)(scratchpad + offset2);
 
-				*(compiled_program++) = inst.x | num_workers;
-				continue;
-			}
-			opcode -= RANDOMX_FREQ_FADD_R;
+		r ^= *p0;
 
-			if (opcode < RANDOMX_FREQ_FADD_M)
-			{
-				const uint32_t location = (mod % 4) ? 1 : 2;
-				inst.x = ((dst % randomx::RegisterCountFlt) << DST_OFFSET) | (src << SRC_OFFSET) | (location << LOC_OFFSET) | (12 << OPCODE_OFFSET);
-				inst.x |= imm_index << IMM_OFFSET;
-				imm_buf[imm_index++] = (inst.y & 0xFC1FFFFFU) | (((location == 1) ? LOC_L1 : ((location == 2) ? LOC_L2 : LOC_L3)) << 21);
+		uint64_t global_mem_data = *p1;
+		int32_t* q = (int32_t*) &global_mem_data;
 
-				*(compiled_program++) = inst.x | num_workers;
-				continue;
-			}
-			opcode -= RANDOMX_FREQ_FADD_M;
+		// Lanes 0-3 load F registers and lanes 4-7 load E registers (2 halves each), then every lane takes its own half
+		{
+			const uint64_t fe0 = bit_cast<uint64_t>(load_F_E_groups(q[0], andMask, orMask1));
+			const uint64_t fe1 = bit_cast<uint64_t>(load_F_E_groups(q[1], andMask, orMask2));
 
-			if (opcode < RANDOMX_FREQ_FSUB_R)
-			{
-				inst.x = ((dst % randomx::RegisterCountFlt) << DST_OFFSET) | ((src % randomx::RegisterCountFlt) << (SRC_OFFSET + 1)) | (12 << OPCODE_OFFSET) | (1 << NEGATIVE_SRC_OFFSET);
+			const uint64_t f0 = __shfl_sync(hash_mask, fe0, sub2, 8);
+			const uint64_t f1 = __shfl_sync(hash_mask, fe1, sub2, 8);
+			const uint64_t e0 = __shfl_sync(hash_mask, fe0, sub2 + 4, 8);
+			const uint64_t e1 = __shfl_sync(hash_mask, fe1, sub2 + 4, 8);
 
-				*(compiled_program++) = inst.x | num_workers;
-				continue;
-			}
-			opcode -= RANDOMX_FREQ_FSUB_R;
+			f = fp_half ? f1 : f0;
+			e = fp_half ? e1 : e0;
+		}
 
-			if (opcode < RANDOMX_FREQ_FSUB_M)
+		#pragma unroll(1)
+		for (int32_t ip = 0; ip < program_length;)
+		{
+			uint32_t inst = compiled_program[ip];
+			const int32_t num_workers = (inst >> NUM_INSTS_OFFSET) & (WORKERS_PER_HASH - 1);
+			const int32_t num_fp_insts = (inst >> NUM_FP_INSTS_OFFSET) & (WORKERS_PER_HASH - 1);
+			const int32_t num_insts = num_workers - num_fp_insts;
+			const bool sync_group = !EXECUTE_VM_CONDITIONAL_SYNC || (inst & (1 << SYNC_GROUP_OFFSET));
+
+			bool sync_needed = false;
+			bool ip_changed = false;
+			bool fprc_changed = false;
+
+			const bool active = (sub <= num_workers);
+			const int32_t inst_offset = sub - num_fp_insts;
+			const bool is_fp = inst_offset < num_fp_insts;
+			if (active)
+				inst = compiled_program[ip + (is_fp ? sub2 : inst_offset)];
+
+			const uint32_t opcode = (inst >> OPCODE_OFFSET) & 31;
+			const uint32_t location = (inst >> LOC_OFFSET) & 3;
+			const uint32_t dst_index = (inst >> DST_OFFSET) & 7;
+			const uint32_t src_index = (inst >> SRC_OFFSET) & 7;
+
+			// FP instructions work on halves 2 * dst + fp_half of F/E registers and 2 * (src / 2) + fp_half of A registers
+#if COMPILE_PROGRAM_RENAME_SWAPS
+			// The other half if halves of the dst register are swapped by a removed FSWAP_R
+			const uint32_t fp_dst_half = fp_half ^ ((inst >> SHIFT_OFFSET) & 1);
+#else
+			const uint32_t fp_dst_half = fp_half;
+#endif
+			const uint32_t fp_dst_lane = (dst_index * 2 + fp_dst_half) & 7;
+
+			uint64_t dst = __shfl_sync(hash_mask, r, dst_index, 8);
+			uint64_t src = __shfl_sync(hash_mask, r, src_index, 8);
+
+			if (num_fp_insts > 0)
 			{
-				const uint32_t location = (mod % 4) ? 1 : 2;
-				inst.x = ((dst % randomx::RegisterCountFlt) << DST_OFFSET) | (src << SRC_OFFSET) | (location << LOC_OFFSET) | (12 << OPCODE_OFFSET) | (1 << NEGATIVE_SRC_OFFSET);
-				inst.x |= imm_index << IMM_OFFSET;
-				imm_buf[imm_index++] = (inst.y & 0xFC1FFFFFU) | (((location == 1) ? LOC_L1 : ((location == 2) ? LOC_L2 : LOC_L3)) << 21);
+				const uint64_t f_dst = __shfl_sync(hash_mask, f, fp_dst_lane, 8);
+				const uint64_t e_dst = __shfl_sync(hash_mask, e, fp_dst_lane, 8);
+				const uint64_t a_src = __shfl_sync(hash_mask, a, (src_index + fp_half) & 7, 8);
 
-				*(compiled_program++) = inst.x | num_workers;
-				continue;
+				if (is_fp)
+				{
+					dst = (dst_index < 4) ? f_dst : e_dst;
+					if (!location)
+						src = a_src;
+				}
 			}
-			opcode -= RANDOMX_FREQ_FSUB_M;
 
-			if (opcode < RANDOMX_FREQ_FSCAL_R)
+			const uint64_t prev_dst = dst;
+
+			if (active)
 			{
-				inst.x = ((dst % randomx::RegisterCountFlt) << DST_OFFSET) | (6 << OPCODE_OFFSET);
+				const uint32_t imm_offset = (inst >> IMM_OFFSET) & 255;
+				uint2 imm;
+				imm.x = imm_buf[imm_offset];
+				imm.y = imm_buf[imm_offset + 1];
 
-				*(compiled_program++) = inst.x | num_workers;
-				continue;
+				if (location)
+					access_scratchpad<VARIANT, false>(opcode, imm, src, dst, scratchpad, nullptr, batch_size);
+
+				if (opcode != 10)
+					dst = execute_instruction<-1>(inst, opcode, location, dst, src, imm, is_fp, sub, xexponentMask, fp_workers_mask, num_insts, ip, ip_changed, sync_needed, fprc, fprc_changed);
 			}
-			opcode -= RANDOMX_FREQ_FSCAL_R;
 
-			if (opcode < RANDOMX_FREQ_FMUL_R)
 			{
-				inst.x = (((dst % randomx::RegisterCountFlt) + randomx::RegisterCountFlt) << DST_OFFSET) | ((src % randomx::RegisterCountFlt) << (SRC_OFFSET + 1)) | (13 << OPCODE_OFFSET);
+				// Register codes: 0-7 for r0-r7, 8-15 for F halves and 16-23 for E halves
+				const bool is_nop = (opcode == 8) && (dst_index == src_index);
+				const bool writes_dst = active && (opcode != 10) && (opcode != 16) && !is_nop;
+				const uint32_t code = is_fp ? (8 + dst_index * 2 + fp_dst_half) : dst_index;
 
-				*(compiled_program++) = inst.x | num_workers;
-				continue;
-			}
-			opcode -= RANDOMX_FREQ_FMUL_R;
+				const uint32_t writers = __ballot_sync(hash_mask, writes_dst);
+				if (writers)
+				{
+					uint32_t bits[5];
+					#pragma unroll
+					for (int i = 0; i < 5; ++i)
+						bits[i] = __ballot_sync(hash_mask, (code >> i) & 1);
 
-			if (opcode < RANDOMX_FREQ_FDIV_M)
-			{
-				const uint32_t location = (mod % 4) ? 1 : 2;
-				inst.x = (((dst % randomx::RegisterCountFlt) + randomx::RegisterCountFlt) << DST_OFFSET) | (src << SRC_OFFSET) | (location << LOC_OFFSET) | (15 << OPCODE_OFFSET);
-				inst.x |= imm_index << IMM_OFFSET;
-				imm_buf[imm_index++] = (inst.y & 0xFC1FFFFFU) | (((location == 1) ? LOC_L1 : ((location == 2) ? LOC_L2 : LOC_L3)) << 21);
+					const uint32_t fp_writers = writers & (bits[3] | bits[4]);
 
-				*(compiled_program++) = inst.x | num_workers;
-				continue;
-			}
-			opcode -= RANDOMX_FREQ_FDIV_M;
+					if (writers & ~fp_writers)
+						r = take_written_value(hash_mask, lanes_with_code(writers, bits, sub), r, dst);
 
-			if (opcode < RANDOMX_FREQ_FSQRT_R)
-			{
-				inst.x = (((dst % randomx::RegisterCountFlt) + randomx::RegisterCountFlt) << DST_OFFSET) | (14 << OPCODE_OFFSET);
+					if (fp_writers)
+					{
+						f = take_written_value(hash_mask, lanes_with_code(writers, bits, 8 + sub), f, dst);
+						e = take_written_value(hash_mask, lanes_with_code(writers, bits, 16 + sub), e, dst);
+					}
+				}
 
-				*(compiled_program++) = inst.x | num_workers;
-				continue;
+				// ISWAP also writes the old dst value to the src register
+				const uint32_t swappers = __ballot_sync(hash_mask, writes_dst && (opcode == 8));
+				if (swappers)
+				{
+					uint32_t bits[5] = { __ballot_sync(hash_mask, src_index & 1), __ballot_sync(hash_mask, src_index & 2), __ballot_sync(hash_mask, src_index & 4), 0, 0 };
+					r = take_written_value(hash_mask, lanes_with_code(swappers, bits, sub), r, prev_dst);
+				}
 			}
-			opcode -= RANDOMX_FREQ_FSQRT_R;
 
-			if (opcode < RANDOMX_FREQ_CBRANCH)
-			{
-				inst.x = (dst << DST_OFFSET) | (9 << OPCODE_OFFSET);
-				inst.x |= (imm_index << IMM_OFFSET);
+			asm("// SYNCHRONIZATION OF INSTRUCTION POINTER AND ROUNDING MODE BEGIN");
+			// Registers are exchanged with shuffles above, so groups without CBRANCH or CFROUND need no barrier here
+			sync_instruction_group<false>(sync_group, sync_needed, ip_changed, fprc_changed, hash_mask, ip, fprc);
+			asm("// SYNCHRONIZATION OF INSTRUCTION POINTER AND ROUNDING MODE END");
 
-				const uint32_t cshift = (mod >> 4) + randomx::ConditionOffset;
+			ip += num_insts + 1;
+		}
 
-				uint32_t imm = inst.y | (1U << cshift);
-				if (cshift > 0)
-					imm &= ~(1U << (cshift - 1));
+		mx ^= static_cast<uint32_t>(__shfl_sync(hash_mask, r, readReg2, 8) ^ __shfl_sync(hash_mask, r, readReg3, 8));
+		mx &= VARIANT::CacheLineAlignMask;
 
-				imm_buf[imm_index] = imm;
-				imm_buf[imm_index + 1] = cshift | (static_cast<uint32_t>(branch_target_slot) << 5);
-				imm_index += 2;
+#if COMPILE_PROGRAM_RENAME_SWAPS
+		// Undo register renaming
+		r = __shfl_sync(hash_mask, r, r_end_lane, 8);
+		f = __shfl_sync(hash_mask, f, f_end_lane, 8);
+		e = __shfl_sync(hash_mask, e, e_end_lane, 8);
+#endif
 
-				branch_target_slot = -1;
+#if EXECUTE_VM_DATASET_PREFETCH
+		const uint64_t next_r = r ^ dataset_data;
+#else
+		const uint64_t next_r = r ^ *(const uint64_t*)(dataset + ma + sub * 8);
+#endif
+		r = next_r;
 
-				*(compiled_program++) = inst.x | num_workers;
-				continue;
-			}
-			opcode -= RANDOMX_FREQ_CBRANCH;
+		uint32_t tmp = ma;
+		ma = mx;
+		mx = tmp;
 
-			if (opcode < RANDOMX_FREQ_CFROUND)
-			{
-				inst.x = (src << SRC_OFFSET) | (16 << OPCODE_OFFSET) | ((inst.y & 63) << IMM_OFFSET);
+		*p1 = next_r;
+		*p0 = f ^ e;
 
-				*(compiled_program++) = inst.x | num_workers;
-				continue;
-			}
-			opcode -= RANDOMX_FREQ_CFROUND;
+		spAddr0 = 0;
+		spAddr1 = 0;
+	}
 
-			if (opcode < RANDOMX_FREQ_ISTORE)
-			{
-				const uint32_t location = ((mod >> 4) >= randomx::StoreL3Condition) ? 3 : ((mod % 4) ? 1 : 2);
-				inst.x = (dst << DST_OFFSET) | (src << SRC_OFFSET) | (location << LOC_OFFSET) | (10 << OPCODE_OFFSET);
-				inst.x |= imm_index << IMM_OFFSET;
-				imm_buf[imm_index++] = (inst.y & 0xFC1FFFFFU) | (((location == 1) ? LOC_L1 : ((location == 2) ? LOC_L2 : LOC_L3)) << 21);
-				*(compiled_program++) = inst.x | num_workers;
-				continue;
-			}
-			opcode -= RANDOMX_FREQ_ISTORE;
+	p[sub] = r;
 
-			*(compiled_program++) = inst.x | num_workers;
-		}
+	if (last)
+	{
+		p[sub +  8] = f ^ e;
+		p[sub + 16] = e;
 
-		((uint32_t*)(R + 20))[0] = static_cast<uint32_t>(compiled_program - (uint32_t*)(R + (REGISTERS_SIZE + IMM_BUF_SIZE) / sizeof(uint64_t)));
+		if (sub == 0)
+			((uint32_t*)(p + REGISTERS_SIZE / sizeof(uint64_t)))[0] = fprc;
 	}
-}
-
-template<typename T, size_t N>
-__device__ void load_buffer(T (&dst_buf)[N], const void* src_buf)
-{
-	uint32_t i = threadIdx.x * sizeof(T);
-	const uint32_t step = blockDim.x * sizeof(T);
-	const uint8_t* src = ((const uint8_t*) src_buf) + blockIdx.x * sizeof(T) * N + i;
-	uint8_t* dst = ((uint8_t*) dst_buf) + i;
-	while (i < sizeof(T) * N)
+	else if (sub == 0)
 	{
-		*(T*)(dst) = *(T*)(src);
-		src += step;
-		dst += step;
-		i += step;
+		*(uint4*)(p + 16) = make_uint4(ma, mx, fprc, num_imm);
 	}
 }
 
-template<int WORKERS_PER_HASH>
-__global__ void __launch_bounds__(16, 16) execute_vm(void* vm_states, void* rounding, void* scratchpads, const void* dataset_ptr, uint32_t batch_size, uint32_t num_iterations, bool first, bool last)
+// Persistent version of execute_vm: the grid is sized to fill the GPU once and each block takes hash pairs from a global work counter
+// work_items[0] is the work counter and must be set to 0 before every launch
+// work_items[1] is the number of finished pairs and work_items[2 + i] is the number of iterations done for pair i, both must be set to 0 before the first launch for a program
+// Blocks stop taking new pairs when *stop_flag (host mapped memory) is set or when time_budget clock cycles have passed (0 means no limit),
+// so the host must relaunch until work_items[1] reaches batch_size / 2. Unfinished pairs are resumed where they stopped.
+// hash_list pairs hashes the same way as in execute_vm, it must hold the whole batch if it's not null
+template<typename VARIANT, int WORKERS_PER_HASH>
+__global__ void __launch_bounds__(16, 16) execute_vm_persistent(void* vm_states, void* scratchpads, const void* dataset_ptr, uint32_t batch_size, uint32_t* work_items, const volatile uint32_t* stop_flag, long long int time_budget, const uint32_t* hash_list)
 {
-	// 2 hashes per warp, 4 KB shared memory for VM states
-	__shared__ uint64_t vm_states_local[(VM_STATE_SIZE * 2) / sizeof(uint64_t)];
-
-	load_buffer(vm_states_local, vm_states);
-
-	__syncwarp();
-
-	uint64_t* R = vm_states_local + (threadIdx.x / 8) * VM_STATE_SIZE / sizeof(uint64_t);
-	double* F = (double*)(R + 8);
-	double* E = (double*)(R + 16);
-
-	const uint32_t global_index = blockIdx.x * blockDim.x + threadIdx.x;
-	const int32_t idx = global_index / 8;
-	const int32_t sub = global_index % 8;
-	const int32_t sub2 = sub >> 1;
+	SPECIALIZE_BATCH_SIZE(batch_size);
 
-	uint32_t ma = ((uint32_t*)(R + 16))[0];
-	uint32_t mx = ((uint32_t*)(R + 16))[1];
-
-	const uint32_t addressRegisters = ((uint32_t*)(R + 16))[2];
-	const uint64_t* readReg0 = (uint64_t*)(((uint8_t*) R) + (addressRegisters & 0xff));
-	const uint64_t* readReg1 = (uint64_t*)(((uint8_t*) R) + ((addressRegisters >> 8) & 0xff));
-	const uint32_t* readReg2 = (uint32_t*)(((uint8_t*) R) + ((addressRegisters >> 16) & 0xff));
-	const uint32_t* readReg3 = (uint32_t*)(((uint8_t*) R) + (addressRegisters >> 24));
+	// 2 hashes per warp, 4 KB shared memory for VM states
+	__shared__ uint64_t vm_states_local[(VM_STATE_SHARED_STRIDE * 2) / sizeof(uint64_t)];
 
-	const uint32_t datasetOffset = ((uint32_t*)(R + 16))[3];
-	const uint8_t* dataset = ((const uint8_t*) dataset_ptr) + datasetOffset;
+	const uint32_t num_pairs = batch_size / 2;
+	const long long int deadline = time_budget ? (clock64() + time_budget) : LLONG_MAX;
 
-	const uint32_t fp_reg_offset = 64 + ((global_index & 1) << 3);
-	const uint32_t fp_reg_group_A_offset = 192 + ((global_index & 1) << 3);
+	for (;;)
+	{
+		uint32_t pair = num_pairs;
+		if ((threadIdx.x == 0) && !*stop_flag && (clock64() < deadline))
+			pair = atomicAdd(work_items, 1);
 
-	ulonglong2 eMask = ((ulonglong2*)(R + 18))[0];
+		pair = __shfl_sync(0xFFFF, pair, 0);
+		if (pair >= num_pairs)
+			break;
 
-	const uint32_t program_length = ((uint32_t*)(R + 20))[0];
-	uint32_t fprc = ((uint32_t*) rounding)[idx];
+		uint32_t* progress = work_items + 2 + pair;
+		const uint32_t iterations_done = *progress;
+		if (iterations_done >= VARIANT::PROGRAM_ITERATIONS)
+			continue;
 
-	uint32_t spAddr0 = first ? mx : 0;
-	uint32_t spAddr1 = first ? ma : 0;
+		uint32_t hash_index;
+		map_hash_index(hash_list, pair, hash_index);
 
-	uint8_t* scratchpad = ((uint8_t*) scratchpads) + idx * 64;
+		const uint32_t n = execute_vm_iterations<VARIANT, WORKERS_PER_HASH, true, false>(vm_states_local, nullptr, hash_index, vm_states, scratchpads, dataset_ptr, batch_size, VARIANT::PROGRAM_ITERATIONS - iterations_done, iterations_done == 0, true, deadline);
 
-	const bool f_group = (sub < 4);
+		// All lanes must read progress and finish with the shared VM states before the next pair
+		__syncwarp();
 
-	double* fe = f_group ? (F + sub * 2) : (E + (sub - 4) * 2);
-	double* f = F + sub;
-	double* e = E + sub;
+		if (threadIdx.x == 0)
+		{
+			*progress = iterations_done + n;
+			if (iterations_done + n == VARIANT::PROGRAM_ITERATIONS)
+				atomicAdd(work_items + 1, 1);
+		}
+	}
+}
 
-	const uint64_t andMask = f_group ? uint64_t(-1) : randomx::dynamicMantissaMask;
-	const uint64_t orMask1 = f_group ? 0 : eMask.x;
-	const uint64_t orMask2 = f_group ? 0 : eMask.y;
-	const uint64_t xexponentMask = (sub & 1) ? eMask.y : eMask.x;
+// Threads per block of execute_vm_thread, batch sizes are always a multiple of it
+constexpr uint32_t EXECUTE_VM_THREAD_BLOCK_SIZE = 32;
 
-	uint32_t* imm_buf = (uint32_t*)(R + REGISTERS_SIZE / sizeof(uint64_t));
-	uint32_t* compiled_program = (uint32_t*)(R + (REGISTERS_SIZE + IMM_BUF_SIZE) / sizeof(uint64_t));
+// Register file of execute_vm_thread is indexed with values only known at run time, so every access compares the index
+// with all registers: the array then stays in thread registers instead of going to local memory
+template<typename T, size_t N>
+__device__ __forceinline__ T read_reg(const T (&regs)[N], uint32_t index)
+{
+	T value = regs[0];
+	#pragma unroll
+	for (size_t i = 1; i < N; ++i)
+		if (index == i) value = regs[i];
+	return value;
+}
 
-	const uint32_t workers_mask = ((1 << WORKERS_PER_HASH) - 1) << ((threadIdx.x / 8) * 8);
-	const uint32_t fp_workers_mask = 3 << (((sub >> 1) << 1) + (threadIdx.x / 8) * 8);
+template<typename T, size_t N>
+__device__ __forceinline__ void write_reg(T (&regs)[N], uint32_t index, T value)
+{
+	#pragma unroll
+	for (size_t i = 0; i < N; ++i)
+		if (index == i) regs[i] = value;
+}
 
+// Runs the current program from ip for 1 hash in 1 thread, it's execute_program with all lanes of a group done one after another
+// Lanes of a group read their registers before any of them writes, so integer registers are read from a copy made at the start of the group
+// (FP instructions only read their own dst register, and CFROUND comes after FP instructions of its group, so they need nothing like that)
+// r are the integer registers, fe are the halves of F and E registers (F0.lo, F0.hi, ... E3.hi), a are the halves of A registers
+// Returns the ip to continue from, it returns early when CFROUND changes the rounding mode away from FPRC (see execute_program)
+template<typename VARIANT, int FPRC>
+__device__ __forceinline__ int32_t execute_program_thread(int32_t ip, uint32_t& fprc, const uint32_t* compiled_program, const uint32_t* imm_buf, int32_t program_length, uint64_t (&r)[8], uint64_t (&fe)[16], const uint64_t (&a)[8], uint8_t* scratchpad, uint32_t batch_size, ulonglong2 eMask)
+{
 	#pragma unroll(1)
-	for (int ic = 0; ic < num_iterations; ++ic)
+	while (ip < program_length)
 	{
-		const uint64_t spMix = *readReg0 ^ *readReg1;
-		spAddr0 ^= ((const uint32_t*) &spMix)[0];
-		spAddr1 ^= ((const uint32_t*) &spMix)[1];
-		spAddr0 &= ScratchpadL3Mask64;
-		spAddr1 &= ScratchpadL3Mask64;
+		const uint32_t group = __ldg(compiled_program + ip);
+		const int32_t num_fp_insts = (group >> NUM_FP_INSTS_OFFSET) & 7;
+		const int32_t num_insts = ((group >> NUM_INSTS_OFFSET) & 7) - num_fp_insts;
 
-		uint64_t offset1, offset2;
-		asm("mad.wide.u32 %0,%2,%4,%5;\n\tmad.wide.u32 %1,%3,%4,%5;" : "=l"(offset1), "=l"(offset2) : "r"(spAddr0), "r"(spAddr1), "r"(batch_size), "l"(static_cast<uint64_t>(sub * 8)));
+		int32_t next_ip = ip + num_insts + 1;
 
-		uint64_t* p0 = (uint64_t*)(scratchpad + offset1);
-		uint64_t* p1 = (uint64_t*)(scratchpad + offset2);
+		uint64_t r_in[8];
+		#pragma unroll
+		for (int i = 0; i < 8; ++i)
+			r_in[i] = r[i];
 
-		uint64_t* r = R + sub;
-		*r ^= *p0;
+		// A group has at most 1 ISTORE and memory reads can share its group only when they come after it in the original program,
+		// but they can be in any slot, so the store is done first
+		#pragma unroll(1)
+		for (int32_t k = num_fp_insts; k <= num_insts; ++k)
+		{
+			const uint32_t inst = __ldg(compiled_program + ip + k);
+			if (((inst >> OPCODE_OFFSET) & 31) != 10)
+				continue;
 
-		uint64_t global_mem_data = *p1;
-		int32_t* q = (int32_t*) &global_mem_data;
+			const uint32_t* imm_ptr = imm_buf + ((inst >> IMM_OFFSET) & 255);
+			const uint32_t imm = __ldg(imm_ptr);
 
-		fe[0] = load_F_E_groups(q[0], andMask, orMask1);
-		fe[1] = load_F_E_groups(q[1], andMask, orMask2);
+			uint32_t addr;
+			*scratchpad_operand<VARIANT>(scratchpad, static_cast<uint32_t>(read_reg(r_in, (inst >> DST_OFFSET) & 7)), imm, false, batch_size, addr) = read_reg(r_in, (inst >> SRC_OFFSET) & 7);
+			break;
+		}
 
-		__syncwarp();
+		#pragma unroll(1)
+		for (int32_t k = 0; k <= num_insts; ++k)
+		{
+			const uint32_t inst = __ldg(compiled_program + ip + k);
+			const bool is_fp = k < num_fp_insts;
 
-		//if ((global_index == 0) && (ic == 0))
-		//{
-		//	printf("ic = %d (before)\n", ic);
-		//	for (int i = 0; i < 8; ++i)
-		//		printf("f%d = %016llx\n", i, bit_cast<uint64_t>(F[i]));
-		//	for (int i = 0; i < 8; ++i)
-		//		printf("e%d = %016llx\n", i, bit_cast<uint64_t>(E[i]));
-		//	printf("\n");
-		//}
+			const uint32_t opcode = (inst >> OPCODE_OFFSET) & 31;
+			if (opcode == 10)
+				continue;
+			const uint32_t location = (inst >> LOC_OFFSET) & 3;
+			const uint32_t dst_index = (inst >> DST_OFFSET) & 7;
+			const uint32_t src_index = (inst >> SRC_OFFSET) & 7;
 
-		if ((WORKERS_PER_HASH == 8) || (sub < WORKERS_PER_HASH))
-		{
-			#pragma unroll(1)
-			for (int32_t ip = 0; ip < program_length;)
+			const uint32_t* imm_ptr = imm_buf + ((inst >> IMM_OFFSET) & 255);
+			uint2 imm;
+			imm.x = __ldg(imm_ptr);
+			imm.y = __ldg(imm_ptr + 1);
+
+			// Memory operands are integer registers for both integer and FP instructions
+			uint64_t src = read_reg(r_in, src_index);
+			const uint64_t dst = is_fp ? 0 : read_reg(r_in, dst_index);
+
+			if (location)
 			{
-				uint32_t inst = compiled_program[ip];
-				const int32_t num_workers = (inst >> NUM_INSTS_OFFSET) & (WORKERS_PER_HASH - 1);
-				const int32_t num_fp_insts = (inst >> NUM_FP_INSTS_OFFSET) & (WORKERS_PER_HASH - 1);
-				const int32_t num_insts = num_workers - num_fp_insts;
+				uint32_t addr;
+				src = *scratchpad_operand<VARIANT>(scratchpad, static_cast<uint32_t>(src), imm.x, true, batch_size, addr);
+			}
 
-				bool sync_needed = false;
-				bool ip_changed = false;
-				bool fprc_changed = false;
+			int32_t ip_branch = ip;
+			bool ip_changed = false;
+			bool sync_needed = false;
+			bool fprc_changed = false;
 
-				if (sub <= num_workers)
+			if (is_fp)
+			{
+#if COMPILE_PROGRAM_RENAME_SWAPS
+				// Halves of the FP dst register are swapped by a removed FSWAP_R
+				const uint32_t swapped = (inst >> SHIFT_OFFSET) & 1;
+#else
+				const uint32_t swapped = 0;
+#endif
+				const uint32_t lo_index = dst_index * 2 + swapped;
+				const uint32_t hi_index = lo_index ^ 1;
+				const uint64_t lo = read_reg(fe, lo_index);
+				const uint64_t hi = read_reg(fe, hi_index);
+
+				if (opcode == 11)
 				{
-					const int32_t inst_offset = sub - num_fp_insts;
-					const bool is_fp = inst_offset < num_fp_insts;
-					inst = compiled_program[ip + (is_fp ? sub2 : inst_offset)];
-					//if ((idx == 0) && (ic == 0))
-					//{
-					//	printf("num_fp_insts = %u, sub = %u, ip = %u, inst = %08x\n", num_fp_insts, sub, ip + ((sub < num_fp_insts * 2) ? (sub / 2) : (sub - num_fp_insts)), inst);
-					//}
-
-					asm("// INSTRUCTION DECODING BEGIN");
+					// FSWAP_R which wasn't removed by renaming (inside of a CBRANCH loop)
+					write_reg(fe, lo_index, hi);
+					write_reg(fe, hi_index, lo);
+				}
+				else
+				{
+					const uint64_t src_lo = location ? src : read_reg(a, src_index);
+					const uint64_t src_hi = location ? src : read_reg(a, src_index + 1);
+					write_reg(fe, lo_index, execute_instruction<FPRC>(inst, opcode, location, lo, src_lo, imm, true, 0, eMask.x, 0, num_insts, ip_branch, ip_changed, sync_needed, fprc, fprc_changed));
+					write_reg(fe, hi_index, execute_instruction<FPRC>(inst, opcode, location, hi, src_hi, imm, true, 1, eMask.y, 0, num_insts, ip_branch, ip_changed, sync_needed, fprc, fprc_changed));
+				}
+			}
+			else
+			{
+				const uint64_t result = execute_instruction<FPRC>(inst, opcode, location, dst, src, imm, false, 0, 0, 0, num_insts, ip_branch, ip_changed, sync_needed, fprc, fprc_changed);
 
-					const uint32_t opcode = (inst >> OPCODE_OFFSET) & 31;
-					const uint32_t location = (inst >> LOC_OFFSET) & 3;
+				if (opcode == 8)
+					write_reg(r, src_index, dst);
 
-					const uint32_t reg_size_shift = is_fp ? 4 : 3;
-					const uint32_t reg_base_offset = is_fp ? fp_reg_offset : 0;
-					const uint32_t reg_base_src_offset = is_fp ? fp_reg_group_A_offset : 0;
+				if (opcode != 16)
+					write_reg(r, dst_index, result);
 
-					uint32_t dst_offset = (inst >> DST_OFFSET) & 7;
-					dst_offset = reg_base_offset + (dst_offset << reg_size_shift);
+				if (ip_changed)
+					next_ip = ip_branch + num_insts + 1;
+			}
+		}
 
-					uint32_t src_offset = (inst >> SRC_OFFSET) & 7;
-					src_offset = (src_offset << 3) + (location ? 0 : reg_base_src_offset);
+		ip = next_ip;
 
-					uint64_t* dst_ptr = (uint64_t*)((uint8_t*)(R) + dst_offset);
-					uint64_t* src_ptr = (uint64_t*)((uint8_t*)(R) + src_offset);
+		if ((FPRC >= 0) && (fprc != FPRC))
+			break;
+	}
 
-					const uint32_t imm_offset = (inst >> IMM_OFFSET) & 255;
-					uint32_t* imm_ptr = imm_buf + imm_offset;
+	return ip;
+}
 
-					uint64_t dst = *dst_ptr;
-					uint64_t src = *src_ptr;
-					uint2 imm;
-					imm.x = imm_ptr[0];
-					imm.y = imm_ptr[1];
+// execute_program_thread of execute_vm_thread, for run_program
+template<typename VARIANT>
+struct ThreadProgramRunner
+{
+	uint32_t& fprc;
+	const uint32_t* compiled_program;
+	const uint32_t* imm_buf;
+	int32_t program_length;
+	uint64_t (&r)[8];
+	uint64_t (&fe)[16];
+	const uint64_t (&a)[8];
+	uint8_t* scratchpad;
+	uint32_t batch_size;
+	ulonglong2 eMask;
+
+	template<int FPRC>
+	__device__ __forceinline__ int32_t run(int32_t ip) const
+	{
+		return execute_program_thread<VARIANT, FPRC>(ip, fprc, compiled_program, imm_buf, program_length, r, fe, a, scratchpad, batch_size, eMask);
+	}
+};
+
+// Hash-per-thread engine: every thread runs one hash with the VM state and compiled program of execute_vm (any WORKERS_PER_HASH)
+// All registers stay in thread registers and there are no shuffles or warp syncs, but lanes of a warp run different programs,
+// so every instruction is executed by a warp as many times as there are different instructions in it
+// Experimental (--thread): use RandomX_CUDA.exe --benchmark-engines to compare it with execute_vm on a GPU
+// Launch with EXECUTE_VM_THREAD_BLOCK_SIZE threads per block, hash_list works like in execute_vm (whole pairs are run)
+template<typename VARIANT>
+__global__ void __launch_bounds__(EXECUTE_VM_THREAD_BLOCK_SIZE) execute_vm_thread(void* vm_states, void* scratchpads, const void* dataset_ptr, uint32_t batch_size, uint32_t num_iterations, bool first, bool last, const uint32_t* hash_list)
+{
+	SPECIALIZE_BATCH_SIZE(batch_size);
+	SPECIALIZE_NUM_ITERATIONS(num_iterations);
 
-					asm("// INSTRUCTION DECODING END");
+	uint32_t idx = blockIdx.x * blockDim.x + threadIdx.x;
+	if (hash_list)
+	{
+		if (idx >= hash_list[0] * 2)
+			return;
+		idx = hash_list[1 + idx];
+	}
 
-					if (location)
-					{
-						asm("// SCRATCHPAD ACCESS BEGIN");
+	uint64_t* p = ((uint64_t*) vm_states) + idx * (VM_STATE_SIZE / sizeof(uint64_t));
+	const uint32_t* header = (const uint32_t*)(p + 16);
+
+	uint32_t ma = header[0];
+	uint32_t mx = header[1];
+	uint32_t fprc = header[2];
+	const uint32_t num_imm = header[3];
+	const ulonglong2 eMask = *(const ulonglong2*)(p + 18);
+	const uint32_t program_length = header[8];
+#if COMPILE_PROGRAM_RENAME_SWAPS
+	const uint32_t end_map = header[11];
+#endif
+	const uint32_t addressRegisters = header[12];
+	const uint8_t* dataset = ((const uint8_t*) dataset_ptr) + header[13];
+
+	const uint32_t readReg0 = (addressRegisters & 0xff) / sizeof(uint64_t);
+	const uint32_t readReg1 = ((addressRegisters >> 8) & 0xff) / sizeof(uint64_t);
+	const uint32_t readReg2 = ((addressRegisters >> 16) & 0xff) / sizeof(uint64_t);
+	const uint32_t readReg3 = (addressRegisters >> 24) / sizeof(uint64_t);
+
+	uint64_t r[8];
+	uint64_t fe[16];
+	uint64_t a[8];
 
-						uint32_t loc_shift;
-						asm("bfe.u32 %0, %1, 21, 5;" : "=r"(loc_shift) : "r"(imm.x));
-						const uint32_t mask = 0xFFFFFFFFU >> loc_shift;
+	#pragma unroll
+	for (int i = 0; i < 8; ++i)
+	{
+		r[i] = p[i];
+		a[i] = p[24 + i];
+	}
 
-						const bool is_read = (opcode != 10);
-						uint32_t addr = is_read ? ((loc_shift == LOC_L3) ? 0 : static_cast<uint32_t>(src)) : static_cast<uint32_t>(dst);
-						addr += static_cast<int32_t>(imm.x);
-						addr &= mask;
+	const uint32_t* imm_buf = (const uint32_t*)(p + REGISTERS_SIZE / sizeof(uint64_t));
+	const uint32_t* compiled_program = imm_buf + num_imm;
 
-						uint64_t offset;
-						asm("mad.wide.u32 %0,%1,%2,%3;" : "=l"(offset) : "r"(addr & 0xFFFFFFC0U), "r"(batch_size), "l"(static_cast<uint64_t>(addr & 0x38)));
+	uint32_t spAddr0 = first ? mx : 0;
+	uint32_t spAddr1 = first ? ma : 0;
 
-						uint64_t* ptr = (uint64_t*)(scratchpad + offset);
+	uint8_t* scratchpad = ((uint8_t*) scratchpads) + idx * 64;
 
-						if (is_read)
-							src = *ptr;
-						else
-							*ptr = src;
+	#pragma unroll(1)
+	for (uint32_t ic = 0; ic < num_iterations; ++ic)
+	{
+#if EXECUTE_VM_DATASET_PREFETCH
+		// ma doesn't change until the end of the iteration
+		ulonglong2 dataset_data[4];
+		#pragma unroll
+		for (int i = 0; i < 4; ++i)
+			dataset_data[i] = __ldg((const ulonglong2*)(dataset + ma) + i);
+#endif
+
+		const uint64_t spMix = read_reg(r, readReg0) ^ read_reg(r, readReg1);
+		spAddr0 ^= static_cast<uint32_t>(spMix);
+		spAddr1 ^= static_cast<uint32_t>(spMix >> 32);
+		spAddr0 &= VARIANT::ScratchpadL3Mask64;
+		spAddr1 &= VARIANT::ScratchpadL3Mask64;
+
+		ulonglong2* p0 = (ulonglong2*)(scratchpad + static_cast<uint64_t>(spAddr0) * batch_size);
+		ulonglong2* p1 = (ulonglong2*)(scratchpad + static_cast<uint64_t>(spAddr1) * batch_size);
+
+		#pragma unroll
+		for (int i = 0; i < 4; ++i)
+		{
+			const ulonglong2 x = p0[i];
+			r[i * 2] ^= x.x;
+			r[i * 2 + 1] ^= x.y;
+		}
 
-						asm("// SCRATCHPAD ACCESS END");
-					}
+		#pragma unroll
+		for (int i = 0; i < 4; ++i)
+		{
+			const ulonglong2 x = p1[i];
+			const uint64_t andMask = (i < 2) ? uint64_t(-1) : randomx::dynamicMantissaMask;
+			const uint64_t orMask1 = (i < 2) ? 0 : eMask.x;
+			const uint64_t orMask2 = (i < 2) ? 0 : eMask.y;
+			fe[i * 4 + 0] = bit_cast<uint64_t>(load_F_E_groups(static_cast<int32_t>(x.x), andMask, orMask1));
+			fe[i * 4 + 1] = bit_cast<uint64_t>(load_F_E_groups(static_cast<int32_t>(x.x >> 32), andMask, orMask2));
+			fe[i * 4 + 2] = bit_cast<uint64_t>(load_F_E_groups(static_cast<int32_t>(x.y), andMask, orMask1));
+			fe[i * 4 + 3] = bit_cast<uint64_t>(load_F_E_groups(static_cast<int32_t>(x.y >> 32), andMask, orMask2));
+		}
 
-					if (opcode != 10)
-					{
-						asm("// EXECUTION BEGIN");
-
-						if (inst & (1 << SRC_IS_IMM32_OFFSET)) src = static_cast<uint64_t>(static_cast<int64_t>(static_cast<int32_t>(imm.x)));
-
-						// Check instruction opcodes (most frequent instructions come first)
-						if (opcode < 2)
-						{
-							if (inst & (1 << NEGATIVE_SRC_OFFSET)) src = static_cast<uint64_t>(-static_cast<int64_t>(src));
-							if (opcode == 0) dst += static_cast<int32_t>(imm.x);
-							const uint32_t shift = (inst >> SHIFT_OFFSET) & 3;
-							dst += src << shift;
-						}
-						else if (opcode == 12)
-						{
-							if (location) src = bit_cast<uint64_t>(__int2double_rn(static_cast<int32_t>(src >> ((sub & 1) * 32))));
-							if (inst & (1 << NEGATIVE_SRC_OFFSET)) src ^= 0x8000000000000000ULL;
-
-							const double a = __longlong_as_double(dst);
-							const double b = __longlong_as_double(src);
-
-							double result;
-							if (fprc == 0)
-								result = __dadd_rn(a, b);
-							else if (fprc == 1)
-								result = __dadd_rd(a, b);
-							else if (fprc == 2)
-								result = __dadd_ru(a, b);
-							else
-								result = __dadd_rz(a, b);
-
-							dst = bit_cast<uint64_t>(result);
-						}
-						else if (opcode == 2)
-						{
-							if (inst & (1 << SRC_IS_IMM64_OFFSET)) src = *((uint64_t*)&imm);
-							dst *= src;
-						}
-						else if (opcode == 6)
-						{
-							dst ^= is_fp ? 0x81F0000000000000ULL : src;
-						}
-						else if (opcode == 13)
-						{
-							const double a = __longlong_as_double(dst);
-							const double b = __longlong_as_double(src);
-
-							double result;
-							if (fprc == 0)
-								result = __dmul_rn(a, b);
-							else if (fprc == 1)
-								result = __dmul_rd(a, b);
-							else if (fprc == 2)
-								result = __dmul_ru(a, b);
-							else
-								result = __dmul_rz(a, b);
-
-							dst = bit_cast<uint64_t>(result);
-						}
-						else if (opcode == 9)
-						{
-							dst += static_cast<int32_t>(imm.x);
-							if ((static_cast<uint32_t>(dst) & (randomx::ConditionMask << (imm.y & 31))) == 0)
-							{
-								ip = (static_cast<int32_t>(imm.y) >> 5);
-								ip -= num_insts;
-								ip_changed = true;
-								sync_needed = true;
-							}
-						}
-						else if (opcode == 7)
-						{
-							const uint32_t shift = src & 63;
-							dst = (dst >> shift) | (dst << (64 - shift));
-						}
-						else if (opcode == 11)
-						{
-							dst = __shfl_xor_sync(fp_workers_mask, dst, 1, 8);
-						}
-						else if (opcode == 14)
-						{
-							const double a = __longlong_as_double(dst);
-
-							double result;
-							if (fprc == 0)
-								result = __dsqrt_rn(a);
-							else if (fprc == 1)
-								result = __dsqrt_rd(a);
-							else if (fprc == 2)
-								result = __dsqrt_ru(a);
-							else
-								result = __dsqrt_rz(a);
-
-							dst = bit_cast<uint64_t>(result);
-						}
-						else if (opcode == 3)
-						{
-							dst = __umul64hi(dst, src);
-						}
-						else if (opcode == 4)
-						{
-							dst = static_cast<uint64_t>(__mul64hi(static_cast<int64_t>(dst), static_cast<int64_t>(src)));
-						}
-						else if (opcode == 8)
-						{
-							*src_ptr = dst;
-							dst = src;
-						}
-						else if (opcode == 15)
-						{
-							src = bit_cast<uint64_t>(__int2double_rn(static_cast<int32_t>(src >> ((sub & 1) * 32))));
-							src &= randomx::dynamicMantissaMask;
-							src |= xexponentMask;
-
-							const double a = __longlong_as_double(dst);
-							const double b = __longlong_as_double(src);
-
-							double result;
-							if (fprc == 0)
-								result = __ddiv_rn(a, b);
-							else if (fprc == 1)
-								result = __ddiv_rd(a, b);
-							else if (fprc == 2)
-								result = __ddiv_ru(a, b);
-							else
-								result = __ddiv_rz(a, b);
-
-							dst = bit_cast<uint64_t>(result);
-						}
-						else if (opcode == 5)
-						{
-							dst = static_cast<uint64_t>(-static_cast<int64_t>(dst));
-						}
-						else if (opcode == 16)
-						{
-							const uint32_t new_fprc = ((src >> imm_offset) | (src << (64 - imm_offset))) & 3;
-							fprc_changed = new_fprc != fprc;
-							sync_needed |= fprc_changed;
-							fprc = new_fprc;
-						}
-
-						if (opcode != 16)
-							*dst_ptr = dst;
-
-						asm("// EXECUTION END");
-					}
-				}
+		const ThreadProgramRunner<VARIANT> runner = { fprc, compiled_program, imm_buf, static_cast<int32_t>(program_length), r, fe, a, scratchpad, batch_size, eMask };
+		run_program(runner, program_length, fprc);
 
-				{
-					asm("// SYNCHRONIZATION OF INSTRUCTION POINTER AND ROUNDING MODE BEGIN");
+		mx ^= static_cast<uint32_t>(read_reg(r, readReg2) ^ read_reg(r, readReg3));
+		mx &= VARIANT::CacheLineAlignMask;
 
-					if (__ballot_sync(workers_mask, sync_needed))
-					{
-						int mask = __ballot_sync(workers_mask, ip_changed);
-						if (mask)
-						{
-							int lane;
-							asm("bfind.u32 %0, %1;" : "=r"(lane) : "r"(mask));
-							ip = __shfl_sync(workers_mask, ip, lane, 16);
-						}
-
-						mask = __ballot_sync(workers_mask, fprc_changed);
-						if (mask)
-						{
-							int lane;
-							asm("bfind.u32 %0, %1;" : "=r"(lane) : "r"(mask));
-							fprc = __shfl_sync(workers_mask, fprc, lane, 16);
-						}
-					}
+#if COMPILE_PROGRAM_RENAME_SWAPS
+		// Undo register renaming (see end_map in compile_program)
+		{
+			uint64_t r_end[8];
+			uint64_t fe_end[16];
 
-					asm("// SYNCHRONIZATION OF INSTRUCTION POINTER AND ROUNDING MODE END");
+			#pragma unroll
+			for (int i = 0; i < 8; ++i)
+			{
+				r_end[i] = read_reg(r, (end_map >> (i * 3)) & 7);
+				fe_end[i] = fe[i ^ ((end_map >> (24 + i / 2)) & 1)];
+				fe_end[i + 8] = fe[(i ^ ((end_map >> (28 + i / 2)) & 1)) + 8];
+			}
 
-					ip += num_insts + 1;
-				}
+			#pragma unroll
+			for (int i = 0; i < 8; ++i)
+			{
+				r[i] = r_end[i];
+				fe[i] = fe_end[i];
+				fe[i + 8] = fe_end[i + 8];
 			}
 		}
+#endif
 
-		//if ((global_index == 0) && (ic == RANDOMX_PROGRAM_ITERATIONS - 1))
-		//{
-		//	printf("ic = %d (after)\n", ic);
-		//	for (int i = 0; i < 8; ++i)
-		//		printf("r%d = %016llx\n", i, R[i]);
-		//	for (int i = 0; i < 8; ++i)
-		//		printf("f%d = %016llx\n", i, bit_cast<uint64_t>(F[i]));
-		//	for (int i = 0; i < 8; ++i)
-		//		printf("e%d = %016llx\n", i, bit_cast<uint64_t>(E[i]));
-		//	printf("\n");
-		//}
-
-		mx ^= *readReg2 ^ *readReg3;
-		mx &= CacheLineAlignMask;
+#if !EXECUTE_VM_DATASET_PREFETCH
+		ulonglong2 dataset_data[4];
+		#pragma unroll
+		for (int i = 0; i < 4; ++i)
+			dataset_data[i] = *((const ulonglong2*)(dataset + ma) + i);
+#endif
 
-		const uint64_t next_r = *r ^ *(const uint64_t*)(dataset + ma + sub * 8);
-		*r = next_r;
+		#pragma unroll
+		for (int i = 0; i < 4; ++i)
+		{
+			r[i * 2] ^= dataset_data[i].x;
+			r[i * 2 + 1] ^= dataset_data[i].y;
+		}
 
 		uint32_t tmp = ma;
 		ma = mx;
 		mx = tmp;
 
-		*p1 = next_r;
-		*p0 = bit_cast<uint64_t>(f[0]) ^ bit_cast<uint64_t>(e[0]);
+		#pragma unroll
+		for (int i = 0; i < 4; ++i)
+			p1[i] = make_ulonglong2(r[i * 2], r[i * 2 + 1]);
+
+		#pragma unroll
+		for (int i = 0; i < 4; ++i)
+			p0[i] = make_ulonglong2(fe[i * 2] ^ fe[i * 2 + 8], fe[i * 2 + 1] ^ fe[i * 2 + 9]);
 
 		spAddr0 = 0;
 		spAddr1 = 0;
 	}
 
-	//if (global_index == 0)
-	//{
-	//	for (int i = 0; i < 8; ++i)
-	//		printf("r%d = %016llx\n", i, R[i]);
-	//	for (int i = 0; i < 8; ++i)
-	//		printf("fe%d = %016llx\n", i, bit_cast<uint64_t>(F[i]) ^ bit_cast<uint64_t>(E[i]));
-	//	printf("\n");
-	//}
-
-	uint64_t* p = ((uint64_t*) vm_states) + idx * (VM_STATE_SIZE / sizeof(uint64_t));
-	p[sub] = R[sub];
+	#pragma unroll
+	for (int i = 0; i < 8; ++i)
+		p[i] = r[i];
 
-	if (sub == 0)
+	if (last)
 	{
-		((uint32_t*) rounding)[idx] = fprc;
-	}
+		#pragma unroll
+		for (int i = 0; i < 8; ++i)
+		{
+			p[i + 8] = fe[i] ^ fe[i + 8];
+			p[i + 16] = fe[i + 8];
+		}
 
-	if (last)
+		// The program is done, so fprc for the next program goes over the first immediate value
+		((uint32_t*)(p + REGISTERS_SIZE / sizeof(uint64_t)))[0] = fprc;
+	}
+	else
 	{
-		p[sub +  8] = bit_cast<uint64_t>(F[sub]) ^ bit_cast<uint64_t>(E[sub]);
-		p[sub + 16] = bit_cast<uint64_t>(E[sub]);
+		*(uint4*)(p + 16) = make_uint4(ma, mx, fprc, num_imm);
 	}
-	else if (sub == 0)
+}
+
+// Final stage of the last program in one launch: hashAes1Rx4 of the scratchpad, final BLAKE2b of the register file and target check
+// Only hashes at or below the target are written to hashes (at their index in the batch), their indices are appended to results
+// A target of uint64_t(-1) writes every hash
+// results[0] is the number of results found, it must be set to 0 before the launch
+// ENGINE is one of the AES engines from aes_cuda.hpp (AES_ENGINE_TTABLE, ...)
+template<typename VARIANT, uint32_t ENGINE = AES_ENGINE_TTABLE>
+__global__ void __launch_bounds__(128) finalize_hashes(const void* scratchpads, const void* vm_states, void* hashes, uint32_t* results, uint64_t target, uint32_t batch_size)
+{
+	SPECIALIZE_BATCH_SIZE(batch_size);
+
+	// 32 hashes per block, 4 lanes per hash for AES and 1 lane per hash for BLAKE2b
+	__shared__ uint32_t T[AESEngine<ENGINE>::TABLE_SIZE];
+	__shared__ uint64_t registers_local[(REGISTERS_SIZE * 32) / sizeof(uint64_t)];
+
+	const uint32_t global_index = blockIdx.x * blockDim.x + threadIdx.x;
+	const uint32_t idx = global_index / 4;
+	const uint32_t sub = global_index % 4;
+
+	AESEngine<ENGINE>::load_table(T, false);
+
+	// Copy the first 192 bytes of the register file, AES hash of the scratchpad goes to the last 64 bytes
+	uint4* R = (uint4*)(registers_local + (threadIdx.x / 4) * (REGISTERS_SIZE / sizeof(uint64_t)));
+	const uint4* p = ((const uint4*) vm_states) + idx * (VM_STATE_SIZE / sizeof(uint4));
+	for (uint32_t i = sub; i < 192 / sizeof(uint4); i += 4)
+		R[i] = p[i];
+
+	__syncthreads();
+
+	uint32_t x[4];
+	hashAes1Rx4_lanes<VARIANT::SCRATCHPAD_SIZE, ENGINE>(T, scratchpads, idx, sub, batch_size, x);
+	R[192 / sizeof(uint4) + sub] = *(uint4*)(x);
+
+	__syncthreads();
+
+	if (threadIdx.x < 32)
 	{
-		((uint32_t*)(p + 16))[0] = ma;
-		((uint32_t*)(p + 16))[1] = mx;
+		const uint32_t hash_index = blockIdx.x * 32 + threadIdx.x;
+		const uint64_t* r = registers_local + threadIdx.x * (REGISTERS_SIZE / sizeof(uint64_t));
+
+		uint64_t m[16] = { r[0], r[1], r[2], r[3], r[4], r[5], r[6], r[7], r[8], r[9], r[10], r[11], r[12], r[13], r[14], r[15] };
+		uint64_t h[4];
+		blake2b_512_process_double_block<REGISTERS_SIZE, 32>(h, m, r);
+
+		if (h[3] <= target)
+		{
+			ulonglong2* out = ((ulonglong2*) hashes) + hash_index * 2;
+			out[0] = make_ulonglong2(h[0], h[1]);
+			out[1] = make_ulonglong2(h[2], h[3]);
+
+			const uint32_t k = atomicAdd(results, 1);
+			results[k + 1] = hash_index;
+		}
 	}
 }
@@ -0,0 +1,475 @@
+#pragma once
+
+/*
+Copyright (c) 2019 SChernykh
+
+This file is part of RandomX CUDA.
+
+RandomX CUDA is free software: you can redistribute it and/or modify
+it under the terms of the GNU General Public License as published by
+the Free Software Foundation, either version 3 of the License, or
+(at your option) any later version.
+
+RandomX CUDA is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+GNU General Public License for more details.
+
+You should have received a copy of the GNU General Public License
+along with RandomX CUDA.  If not, see<http://www.gnu.org/licenses/>.
+*/
+
+// IEEE-754 double precision arithmetic done with integer and FP32 instructions, for GPUs with slow FP64 units
+// Values are passed as raw bits, rounding mode has the same encoding as fprc: 0 = nearest even, 1 = down, 2 = up, 3 = toward zero
+// Results are bit-exact with native FP64 instructions, including subnormals, infinities and signed zeros
+// All NaN results are the canonical NaN, the same as native FP64 instructions on the GPU return
+
+constexpr uint64_t SOFT_FP64_NAN = 0x7FFFFFFFFFFFFFFFULL;
+constexpr uint64_t SOFT_FP64_FRAC_MASK = 0x000FFFFFFFFFFFFFULL;
+constexpr uint64_t SOFT_FP64_HIDDEN_BIT = 0x0010000000000000ULL;
+
+// Mantissa is added, so its bit 52 (if set) increments the exponent
+__device__ uint64_t soft_fp64_pack(uint64_t sign, int32_t exp, uint64_t sig)
+{
+	return (sign << 63) + (static_cast<uint64_t>(exp) << 52) + sig;
+}
+
+// Shifts right and sets the lowest bit if any 1 bits were shifted out
+__device__ uint64_t soft_fp64_shift_right_jam(uint64_t a, uint32_t dist)
+{
+	return (dist < 64) ? ((a >> dist) | ((a & ((1ULL << dist) - 1)) != 0)) : (a != 0);
+}
+
+// Normalizes a subnormal mantissa so that bit 52 is set
+__device__ void soft_fp64_normalize_subnormal(int32_t& exp, uint64_t& sig)
+{
+	const int32_t shift = __clzll(sig) - 11;
+	exp = 1 - shift;
+	sig <<= shift;
+}
+
+// sig has the integer bit at bit 62 (or bit 61 and lower if the result can be subnormal), the result's exponent is exp + 1
+// The lowest 10 bits of sig are rounding bits
+__device__ uint64_t soft_fp64_round_pack(uint64_t sign, int32_t exp, uint64_t sig, uint32_t mode)
+{
+	uint32_t round_increment = 0x200;
+	if (mode != 0)
+		round_increment = (mode == (sign ? 1U : 2U)) ? 0x3FF : 0;
+
+	uint32_t round_bits = sig & 0x3FF;
+
+	if (static_cast<uint32_t>(exp) >= 0x7FD)
+	{
+		if (exp < 0)
+		{
+			sig = soft_fp64_shift_right_jam(sig, static_cast<uint32_t>(-exp));
+			exp = 0;
+			round_bits = sig & 0x3FF;
+		}
+		else if ((exp > 0x7FD) || (sig + round_increment >= 0x8000000000000000ULL))
+		{
+			// Infinity if rounding goes away from zero, the largest finite number otherwise
+			return soft_fp64_pack(sign, 0x7FF, 0) - (round_increment ? 0 : 1);
+		}
+	}
+
+	sig = (sig + round_increment) >> 10;
+	if ((mode == 0) && (round_bits == 0x200))
+		sig &= ~1ULL;
+
+	if (sig == 0)
+		exp = 0;
+
+	return soft_fp64_pack(sign, exp, sig);
+}
+
+// Same as soft_fp64_round_pack, but sig doesn't have to be normalized
+__device__ uint64_t soft_fp64_norm_round_pack(uint64_t sign, int32_t exp, uint64_t sig, uint32_t mode)
+{
+	const int32_t shift = __clzll(sig) - 1;
+	exp -= shift;
+
+	if ((shift >= 10) && (static_cast<uint32_t>(exp) < 0x7FD))
+		return soft_fp64_pack(sign, sig ? exp : 0, sig << (shift - 10));
+
+	return soft_fp64_round_pack(sign, exp, sig << shift, mode);
+}
+
+// |a| + |b| with the sign of the result given
+__device__ uint64_t soft_fp64_add_mags(uint64_t a, uint64_t b, uint64_t sign, uint32_t mode)
+{
+	const int32_t exp_a = (a >> 52) & 0x7FF;
+	const int32_t exp_b = (b >> 52) & 0x7FF;
+	uint64_t sig_a = a & SOFT_FP64_FRAC_MASK;
+	uint64_t sig_b = b & SOFT_FP64_FRAC_MASK;
+
+	const int32_t exp_diff = exp_a - exp_b;
+
+	int32_t exp_z;
+	uint64_t sig_z;
+
+	if (exp_diff == 0)
+	{
+		// Both are subnormal (or zero), the sum can carry into the exponent
+		if (exp_a == 0)
+			return a + sig_b;
+
+		if (exp_a == 0x7FF)
+			return (sig_a | sig_b) ? SOFT_FP64_NAN : a;
+
+		exp_z = exp_a;
+		sig_z = (SOFT_FP64_HIDDEN_BIT * 2 + sig_a + sig_b) << 9;
+	}
+	else
+	{
+		sig_a <<= 9;
+		sig_b <<= 9;
+
+		if (exp_diff < 0)
+		{
+			if (exp_b == 0x7FF)
+				return sig_b ? SOFT_FP64_NAN : soft_fp64_pack(sign, 0x7FF, 0);
+
+			exp_z = exp_b;
+			sig_a = exp_a ? (sig_a + 0x2000000000000000ULL) : (sig_a << 1);
+			sig_a = soft_fp64_shift_right_jam(sig_a, static_cast<uint32_t>(-exp_diff));
+		}
+		else
+		{
+			if (exp_a == 0x7FF)
+				return sig_a ? SOFT_FP64_NAN : a;
+
+			exp_z = exp_a;
+			sig_b = exp_b ? (sig_b + 0x2000000000000000ULL) : (sig_b << 1);
+			sig_b = soft_fp64_shift_right_jam(sig_b, static_cast<uint32_t>(exp_diff));
+		}
+
+		sig_z = 0x2000000000000000ULL + sig_a + sig_b;
+		if (sig_z < 0x4000000000000000ULL)
+		{
+			--exp_z;
+			sig_z <<= 1;
+		}
+	}
+
+	return soft_fp64_round_pack(sign, exp_z, sig_z, mode);
+}
+
+// |a| - |b| with the sign of a given
+__device__ uint64_t soft_fp64_sub_mags(uint64_t a, uint64_t b, uint64_t sign, uint32_t mode)
+{
+	int32_t exp_a = (a >> 52) & 0x7FF;
+	const int32_t exp_b = (b >> 52) & 0x7FF;
+	uint64_t sig_a = a & SOFT_FP64_FRAC_MASK;
+	uint64_t sig_b = b & SOFT_FP64_FRAC_MASK;
+
+	const int32_t exp_diff = exp_a - exp_b;
+
+	if (exp_diff == 0)
+	{
+		if (exp_a == 0x7FF)
+			return SOFT_FP64_NAN;
+
+		int64_t sig_diff = static_cast<int64_t>(sig_a - sig_b);
+
+		// Exact zero is negative only when rounding down
+		if (sig_diff == 0)
+			return soft_fp64_pack((mode == 1) ? 1 : 0, 0, 0);
+
+		if (exp_a)
+			--exp_a;
+
+		if (sig_diff < 0)
+		{
+			sign ^= 1;
+			sig_diff = -sig_diff;
+		}
+
+		int32_t shift = __clzll(sig_diff) - 11;
+		int32_t exp_z = exp_a - shift;
+		if (exp_z < 0)
+		{
+			shift = exp_a;
+			exp_z = 0;
+		}
+
+		return soft_fp64_pack(sign, exp_z, static_cast<uint64_t>(sig_diff) << shift);
+	}
+
+	sig_a <<= 10;
+	sig_b <<= 10;
+
+	int32_t exp_z;
+	uint64_t sig_z;
+
+	if (exp_diff < 0)
+	{
+		sign ^= 1;
+
+		if (exp_b == 0x7FF)
+			return sig_b ? SOFT_FP64_NAN : soft_fp64_pack(sign, 0x7FF, 0);
+
+		sig_a += exp_a ? 0x4000000000000000ULL : sig_a;
+		sig_a = soft_fp64_shift_right_jam(sig_a, static_cast<uint32_t>(-exp_diff));
+		sig_b |= 0x4000000000000000ULL;
+		exp_z = exp_b;
+		sig_z = sig_b - sig_a;
+	}
+	else
+	{
+		if (exp_a == 0x7FF)
+			return sig_a ? SOFT_FP64_NAN : a;
+
+		sig_b += exp_b ? 0x4000000000000000ULL : sig_b;
+		sig_b = soft_fp64_shift_right_jam(sig_b, static_cast<uint32_t>(exp_diff));
+		sig_a |= 0x4000000000000000ULL;
+		exp_z = exp_a;
+		sig_z = sig_a - sig_b;
+	}
+
+	return soft_fp64_norm_round_pack(sign, exp_z - 1, sig_z, mode);
+}
+
+__device__ uint64_t soft_fp64_add(uint64_t a, uint64_t b, uint32_t mode)
+{
+	const uint64_t sign_a = a >> 63;
+	const uint64_t sign_b = b >> 63;
+
+	if (sign_a == sign_b)
+		return soft_fp64_add_mags(a, b, sign_a, mode);
+	else
+		return soft_fp64_sub_mags(a, b, sign_a, mode);
+}
+
+__device__ uint64_t soft_fp64_mul(uint64_t a, uint64_t b, uint32_t mode)
+{
+	int32_t exp_a = (a >> 52) & 0x7FF;
+	int32_t exp_b = (b >> 52) & 0x7FF;
+	uint64_t sig_a = a & SOFT_FP64_FRAC_MASK;
+	uint64_t sig_b = b & SOFT_FP64_FRAC_MASK;
+	const uint64_t sign = (a ^ b) >> 63;
+
+	if (exp_a == 0x7FF)
+	{
+		if (sig_a || ((exp_b == 0x7FF) && sig_b))
+			return SOFT_FP64_NAN;
+
+		// Infinity * 0 is NaN
+		return (exp_b | sig_b) ? soft_fp64_pack(sign, 0x7FF, 0) : SOFT_FP64_NAN;
+	}
+
+	if (exp_b == 0x7FF)
+	{
+		if (sig_b)
+			return SOFT_FP64_NAN;
+
+		return (exp_a | sig_a) ? soft_fp64_pack(sign, 0x7FF, 0) : SOFT_FP64_NAN;
+	}
+
+	if (exp_a == 0)
+	{
+		if (sig_a == 0)
+			return soft_fp64_pack(sign, 0, 0);
+
+		soft_fp64_normalize_subnormal(exp_a, sig_a);
+	}
+
+	if (exp_b == 0)
+	{
+		if (sig_b == 0)
+			return soft_fp64_pack(sign, 0, 0);
+
+		soft_fp64_normalize_subnormal(exp_b, sig_b);
+	}
+
+	int32_t exp_z = exp_a + exp_b - 0x3FF;
+	sig_a = (sig_a | SOFT_FP64_HIDDEN_BIT) << 10;
+	sig_b = (sig_b | SOFT_FP64_HIDDEN_BIT) << 11;
+
+	// Upper 64 bits of the 128-bit product, lower 64 bits only matter for rounding
+	uint64_t sig_z = __umul64hi(sig_a, sig_b) | ((sig_a * sig_b) != 0);
+	if (sig_z < 0x4000000000000000ULL)
+	{
+		--exp_z;
+		sig_z <<= 1;
+	}
+
+	return soft_fp64_round_pack(sign, exp_z, sig_z, mode);
+}
+
+__device__ uint64_t soft_fp64_div(uint64_t a, uint64_t b, uint32_t mode)
+{
+	int32_t exp_a = (a >> 52) & 0x7FF;
+	int32_t exp_b = (b >> 52) & 0x7FF;
+	uint64_t sig_a = a & SOFT_FP64_FRAC_MASK;
+	uint64_t sig_b = b & SOFT_FP64_FRAC_MASK;
+	const uint64_t sign = (a ^ b) >> 63;
+
+	if (exp_a == 0x7FF)
+	{
+		if (sig_a || (exp_b == 0x7FF))
+			return SOFT_FP64_NAN;
+
+		return soft_fp64_pack(sign, 0x7FF, 0);
+	}
+
+	if (exp_b == 0x7FF)
+		return sig_b ? SOFT_FP64_NAN : soft_fp64_pack(sign, 0, 0);
+
+	if (exp_b == 0)
+	{
+		// x / 0 is infinity, 0 / 0 is NaN
+		if (sig_b == 0)
+			return (exp_a | sig_a) ? soft_fp64_pack(sign, 0x7FF, 0) : SOFT_FP64_NAN;
+
+		soft_fp64_normalize_subnormal(exp_b, sig_b);
+	}
+
+	if (exp_a == 0)
+	{
+		if (sig_a == 0)
+			return soft_fp64_pack(sign, 0, 0);
+
+		soft_fp64_normalize_subnormal(exp_a, sig_a);
+	}
+
+	int32_t exp_z = exp_a - exp_b + 0x3FD;
+	sig_a |= SOFT_FP64_HIDDEN_BIT;
+	sig_b |= SOFT_FP64_HIDDEN_BIT;
+
+	// Long division with 9-bit digits: every digit is estimated with FP32 (it's off by 1 at most) and then corrected with the exact remainder
+	// The result is q = floor(sig_a * 2^63 / sig_b) and the final remainder r
+	const float rcp = __frcp_rn(__ull2float_rn(sig_b));
+
+	uint64_t q = 0;
+	uint64_t r = sig_a;
+	if (r >= sig_b)
+	{
+		q = 1;
+		r -= sig_b;
+	}
+
+	#pragma unroll
+	for (int i = 0; i < 7; ++i)
+	{
+		r <<= 9;
+
+		int64_t d = __float2ll_rz(__fmul_rz(__ull2float_rn(r), rcp));
+		int64_t rem = static_cast<int64_t>(r) - d * static_cast<int64_t>(sig_b);
+
+		if (rem < 0)
+		{
+			--d;
+			rem += sig_b;
+		}
+		else if (rem >= static_cast<int64_t>(sig_b))
+		{
+			++d;
+			rem -= sig_b;
+		}
+
+		q = (q << 9) + static_cast<uint64_t>(d);
+		r = static_cast<uint64_t>(rem);
+	}
+
+	// sig_a >= sig_b, so the integer bit is at bit 63
+	if (q >= 0x8000000000000000ULL)
+	{
+		q = (q >> 1) | (q & 1);
+		++exp_z;
+	}
+
+	return soft_fp64_round_pack(sign, exp_z, q | (r != 0), mode);
+}
+
+__device__ uint64_t soft_fp64_sqrt(uint64_t a, uint32_t mode)
+{
+	int32_t exp_a = (a >> 52) & 0x7FF;
+	uint64_t sig_a = a & SOFT_FP64_FRAC_MASK;
+
+	if (exp_a == 0x7FF)
+		return (sig_a || (a >> 63)) ? SOFT_FP64_NAN : a;
+
+	// sqrt(-0) is -0
+	if (a >> 63)
+		return (exp_a | sig_a) ? SOFT_FP64_NAN : a;
+
+	if (exp_a == 0)
+	{
+		if (sig_a == 0)
+			return a;
+
+		soft_fp64_normalize_subnormal(exp_a, sig_a);
+	}
+
+	// a = m * 2^e, e is made even so that sqrt(a) = sqrt(m) * 2^(e / 2)
+	int32_t e = exp_a - 1075;
+	uint64_t m = sig_a | SOFT_FP64_HIDDEN_BIT;
+	if (e & 1)
+	{
+		m <<= 1;
+		--e;
+	}
+
+	// s = floor(sqrt(n * 2^64)) is in [2^62, 2^63)
+	const uint64_t n = m << 8;
+
+	// 24-bit estimate from FP32, then 2 Newton steps which use the exact residual n * 2^64 - s^2 (its high part fits in 64 bits)
+	uint64_t s = __float2ull_rz(__fsqrt_rn(__ull2float_rn(n)) * 4294967296.0f);
+
+	#pragma unroll
+	for (int i = 0; i < 2; ++i)
+	{
+		const uint64_t sq_lo = s * s;
+		const int64_t res_hi = static_cast<int64_t>(n - __umul64hi(s, s)) - ((sq_lo != 0) ? 1 : 0);
+		const uint64_t res_lo = 0 - sq_lo;
+
+		const float res = __ll2float_rn(res_hi) * 18446744073709551616.0f + __ull2float_rn(res_lo);
+		s += static_cast<uint64_t>(__float2ll_rn(res * (__frcp_rn(__ull2float_rn(s)) * 0.5f)));
+	}
+
+	// s is off by 1 at most now, make it exact: s^2 <= n * 2^64 < (s + 1)^2
+	while ((__umul64hi(s, s) > n) || ((__umul64hi(s, s) == n) && (s * s != 0)))
+		--s;
+
+	while ((__umul64hi(s + 1, s + 1) < n) || ((__umul64hi(s + 1, s + 1) == n) && ((s + 1) * (s + 1) == 0)))
+		++s;
+
+	const bool inexact = (__umul64hi(s, s) != n) || (s * s != 0);
+
+	return soft_fp64_round_pack(0, e / 2 + 1048, s | (inexact ? 1 : 0), mode);
+}
+
+// Conversion is always exact
+__device__ uint64_t soft_fp64_from_int32(int32_t value)
+{
+	if (value == 0)
+		return 0;
+
+	const uint64_t sign = static_cast<uint32_t>(value) >> 31;
+	const uint32_t mag = sign ? (0U - static_cast<uint32_t>(value)) : static_cast<uint32_t>(value);
+	const int32_t shift = __clz(mag);
+
+	return soft_fp64_pack(sign, 1023 + 30 - shift, static_cast<uint64_t>(mag) << (21 + shift));
+}
+
+// Test kernel: for every pair (inputs[i * 2], inputs[i * 2 + 1]) and every rounding mode, it writes a + b, a * b, a / b, sqrt(a) and (double)(int32_t)b
+__global__ void soft_fp64_test(const uint64_t* inputs, uint64_t* results, uint32_t count)
+{
+	const uint32_t i = blockIdx.x * blockDim.x + threadIdx.x;
+	if (i >= count)
+		return;
+
+	const uint64_t a = inputs[i * 2];
+	const uint64_t b = inputs[i * 2 + 1];
+
+	uint64_t* r = results + i * 20;
+	for (uint32_t mode = 0; mode < 4; ++mode, r += 5)
+	{
+		r[0] = soft_fp64_add(a, b, mode);
+		r[1] = soft_fp64_mul(a, b, mode);
+		r[2] = soft_fp64_div(a, b, mode);
+		r[3] = soft_fp64_sqrt(a, mode);
+		r[4] = soft_fp64_from_int32(static_cast<int32_t>(b));
+	}
+}